@@ -0,0 +1,87 @@
+// Times `NinjaGenerator::generate` on synthesized packages and reports the
+// peak memory of the process. Build with `-DQOBS_BENCH=ON`, then run e.g.
+// `./ninja_gen_bench` (10k, 100k and 1M files) or `./ninja_gen_bench 50000`.
+#include "generators/ninja/ninja_gen.hpp"
+#include "manifest.hpp"
+#include "utils.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fmt/core.h>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <vector>
+
+#ifndef QOBS_IS_WINDOWS
+#include <sys/resource.h>
+#endif
+
+// Peak resident set size of the process so far in MiB, nothing where that
+// isn't available.
+static std::optional<double> peak_rss_mib() {
+#ifdef QOBS_IS_WINDOWS
+    return std::nullopt;
+#else
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return std::nullopt;
+#ifdef __APPLE__
+    return static_cast<double>(usage.ru_maxrss) / (1024 * 1024); // bytes
+#else
+    return static_cast<double>(usage.ru_maxrss) / 1024; // KiB
+#endif
+#endif
+}
+
+static std::string format_rss(std::optional<double> rss) {
+    return rss ? fmt::format("{:.1f} MiB", *rss) : "n/a";
+}
+
+// `count` sources spread over directories of 100 files, like a large
+// package. The paths don't have to exist.
+static std::vector<BuildFile>
+synthesize_files(const std::filesystem::path& root, size_t count) {
+    std::vector<BuildFile> files;
+    files.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+        files.emplace_back(root / fmt::format("src/module{}/file{}.cpp",
+                                              i / 100, i));
+    return files;
+}
+
+int main(int argc, char** argv) {
+    spdlog::set_level(spdlog::level::warn);
+
+    // ascending, so the peak after each run is that run's own peak
+    std::vector<size_t> counts{10'000, 100'000, 1'000'000};
+    if (argc > 1) {
+        counts.clear();
+        for (int i = 1; i < argc; ++i)
+            counts.push_back(std::strtoull(argv[i], nullptr, 10));
+    }
+
+    auto root = std::filesystem::absolute("qobs-bench-package");
+    Manifest manifest(root);
+    fmt::print("{:>10}  {:>10}  {:>12}  {:>12}  {:>12}\n", "files", "time",
+               "output", "peak before", "peak after");
+    for (auto count : counts) {
+        auto files = synthesize_files(root, count);
+        auto before = peak_rss_mib();
+
+        NinjaGenerator gen;
+        auto start = std::chrono::steady_clock::now();
+        gen.generate(manifest, files, {}, "bench", "g++");
+        auto elapsed = std::chrono::duration<double, std::milli>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+
+        size_t output = 0;
+        for (auto& file : gen.files())
+            output += file.code.size();
+        fmt::print("{:>10}  {:>8.1f}ms  {:>8.1f} MiB  {:>12}  {:>12}\n", count,
+                   elapsed, static_cast<double>(output) / (1024 * 1024),
+                   format_rss(before), format_rss(peak_rss_mib()));
+    }
+    return 0;
+}
@@ -0,0 +1,455 @@
+#include "archive.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <vector>
+
+using namespace spdlog;
+
+// Join an archive entry name onto `dest`, refusing anything that would escape
+// it (absolute paths, `..`).
+static std::filesystem::path safe_join(const std::filesystem::path& dest,
+                                       std::string_view name) {
+    std::filesystem::path rel;
+    size_t start = 0;
+    while (start <= name.size()) {
+        auto end = name.find_first_of("/\\", start);
+        if (end == std::string_view::npos)
+            end = name.size();
+        auto part = name.substr(start, end - start);
+        start = end + 1;
+
+        if (part.empty() || part == ".")
+            continue;
+        if (part == ".." || part.find(':') != std::string_view::npos)
+            throw std::runtime_error(
+                fmt::format("refusing to extract unsafe path `{}`", name));
+        rel /= std::filesystem::path(part);
+    }
+    if (rel.empty())
+        throw std::runtime_error(
+            fmt::format("refusing to extract empty path `{}`", name));
+    return dest / rel;
+}
+
+// Copy `size` bytes from `in` into a new file at `path`.
+static void write_file(ByteStream& in, const std::filesystem::path& path,
+                       std::optional<uint64_t> size) {
+    std::filesystem::create_directories(path.parent_path());
+    std::ofstream file(path, std::ios::out | std::ios::trunc |
+                                 std::ios::binary);
+    if (!file)
+        throw std::runtime_error(
+            fmt::format("couldn't create `{}`", path.string()));
+
+    char buf[64 * 1024];
+    uint64_t left = size.value_or(UINT64_MAX);
+    while (left) {
+        auto n = in.read(buf, static_cast<size_t>(
+                                  std::min<uint64_t>(left, sizeof(buf))));
+        if (n == 0) {
+            if (size)
+                throw std::runtime_error("unexpected end of archive");
+            break;
+        }
+        file.write(buf, static_cast<std::streamsize>(n));
+        left -= n;
+    }
+    if (!file)
+        throw std::runtime_error(
+            fmt::format("couldn't write `{}`", path.string()));
+}
+
+static void set_executable(const std::filesystem::path& path, uint32_t mode) {
+#ifndef QOBS_IS_WINDOWS
+    if (mode & 0111) {
+        std::error_code ec;
+        std::filesystem::permissions(
+            path,
+            std::filesystem::perms::owner_exec |
+                std::filesystem::perms::group_exec |
+                std::filesystem::perms::others_exec,
+            std::filesystem::perm_options::add, ec);
+    }
+#endif
+}
+
+static uint16_t read_le16(const unsigned char* p) {
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static uint32_t read_le32(const unsigned char* p) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) |
+           (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint64_t read_le64(const unsigned char* p) {
+    return read_le32(p) | (static_cast<uint64_t>(read_le32(p + 4)) << 32);
+}
+
+// Parse a (NUL or space terminated) octal tar field, or a base-256 one.
+static uint64_t parse_tar_number(const char* field, size_t len) {
+    auto bytes = reinterpret_cast<const unsigned char*>(field);
+    if (bytes[0] & 0x80) {
+        uint64_t value = bytes[0] & 0x7f;
+        for (size_t i = 1; i < len; ++i)
+            value = (value << 8) | bytes[i];
+        return value;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (field[i] == ' ' && value == 0)
+            continue;
+        if (field[i] < '0' || field[i] > '7')
+            break;
+        value = value * 8 + static_cast<uint64_t>(field[i] - '0');
+    }
+    return value;
+}
+
+static std::string tar_string(const char* field, size_t len) {
+    return std::string(field, strnlen(field, len));
+}
+
+// Refuse anything below a symlink in `dest`: it could lead anywhere, even if
+// the link itself looks harmless (`a -> .` followed by `a/b -> ..`).
+static void check_real_parent(const std::filesystem::path& dest,
+                              const std::filesystem::path& path) {
+    auto current = dest;
+    for (auto& part : path.parent_path().lexically_relative(dest)) {
+        if (part == ".")
+            continue;
+        current /= part;
+        std::error_code ec;
+        if (std::filesystem::is_symlink(
+                std::filesystem::symlink_status(current, ec)))
+            throw std::runtime_error(fmt::format(
+                "refusing to extract `{}` through symlink `{}`",
+                path.string(), current.string()));
+    }
+}
+
+// Refuse symlinks that obviously point outside of the extraction directory.
+// Chains of links are only caught once they exist, see `create_symlinks`.
+static void check_symlink(const std::filesystem::path& dest,
+                          const std::filesystem::path& link,
+                          const std::string& target) {
+    std::filesystem::path target_path(target);
+    auto resolved = (link.parent_path() / target_path).lexically_normal();
+    auto rel = resolved.lexically_relative(dest.lexically_normal());
+    if (target_path.is_absolute() || rel.empty() ||
+        *rel.begin() == std::filesystem::path(".."))
+        throw std::runtime_error(fmt::format(
+            "refusing to extract symlink `{}` pointing outside of the "
+            "archive",
+            target));
+}
+
+// A symlink entry, created after every other entry.
+struct PendingSymlink {
+    std::filesystem::path path;
+    std::string target;
+};
+
+// Create the symlinks of an archive once nothing else is written anymore, so
+// that no entry is ever written through one. Throws if one resolves to
+// something outside of `dest`.
+static void create_symlinks(const std::filesystem::path& dest,
+                            const std::vector<PendingSymlink>& links) {
+    std::vector<std::filesystem::path> created;
+    for (auto& link : links) {
+        check_real_parent(dest, link.path);
+        std::filesystem::create_directories(link.path.parent_path());
+        std::filesystem::remove(link.path);
+        try {
+            std::filesystem::create_symlink(link.target, link.path);
+            created.push_back(link.path);
+        } catch (const std::exception& err) {
+            // e.g. Windows without developer mode
+            warn("couldn't create symlink `{}`: {}", link.path.string(),
+                 err.what());
+        }
+    }
+
+    // only now can chains (`a -> .`, `b -> a/..`) be resolved
+    auto real_dest = std::filesystem::weakly_canonical(dest);
+    for (auto& path : created) {
+        std::error_code ec;
+        auto real = std::filesystem::weakly_canonical(path, ec);
+        auto rel = real.lexically_relative(real_dest);
+        if (ec || rel.empty() || *rel.begin() == std::filesystem::path("..")) {
+            std::filesystem::remove(path, ec);
+            throw std::runtime_error(fmt::format(
+                "refusing to extract symlink `{}` pointing outside of the "
+                "archive",
+                path.string()));
+        }
+    }
+}
+
+static void extract_tar(ByteStream& in, const std::filesystem::path& dest) {
+    std::vector<PendingSymlink> symlinks;
+    // overrides for the next entry from pax/GNU extension headers
+    std::optional<std::string> next_path, next_link;
+    std::optional<uint64_t> next_size;
+    size_t zero_blocks = 0;
+
+    char header[512];
+    for (;;) {
+        // some tar writers omit the end-of-archive blocks
+        auto n = in.read(header, sizeof(header));
+        if (n == 0)
+            break;
+        if (n < sizeof(header))
+            in.read_exact(header + n, sizeof(header) - n);
+
+        if (std::all_of(header, header + sizeof(header),
+                        [](char c) { return c == 0; })) {
+            if (++zero_blocks == 2)
+                break;
+            continue;
+        }
+        zero_blocks = 0;
+
+        auto size = parse_tar_number(header + 124, 12);
+        auto mode = static_cast<uint32_t>(parse_tar_number(header + 100, 8));
+        auto type = header[156];
+        std::string name = tar_string(header, 100);
+        if (std::memcmp(header + 257, "ustar", 5) == 0) {
+            auto prefix = tar_string(header + 345, 155);
+            if (!prefix.empty())
+                name = prefix + "/" + name;
+        }
+        std::string link = tar_string(header + 157, 100);
+        auto padding = (512 - size % 512) % 512;
+
+        switch (type) {
+        case 'x': {
+            // pax extended header: `<len> <key>=<value>\n` records
+            std::string records(size, '\0');
+            in.read_exact(records.data(), size);
+            in.skip(padding);
+            size_t pos = 0;
+            while (pos < records.size()) {
+                auto space = records.find(' ', pos);
+                if (space == std::string::npos)
+                    break;
+                auto len = std::stoull(records.substr(pos, space - pos));
+                if (len == 0 || pos + len > records.size())
+                    break;
+                auto record = std::string_view(records).substr(
+                    space + 1, pos + len - space - 2);
+                auto eq = record.find('=');
+                if (eq != std::string_view::npos) {
+                    auto key = record.substr(0, eq);
+                    auto value = std::string(record.substr(eq + 1));
+                    if (key == "path")
+                        next_path = value;
+                    else if (key == "linkpath")
+                        next_link = value;
+                    else if (key == "size")
+                        next_size = std::stoull(value);
+                }
+                pos += len;
+            }
+            continue;
+        }
+        case 'L':
+        case 'K': {
+            // GNU long name/link name
+            std::string value(size, '\0');
+            in.read_exact(value.data(), size);
+            in.skip(padding);
+            value.resize(strnlen(value.data(), value.size()));
+            (type == 'L' ? next_path : next_link) = value;
+            continue;
+        }
+        case 'g':
+            // pax global header, nothing we care about
+            in.skip(size + padding);
+            continue;
+        default:
+            break;
+        }
+
+        if (next_path)
+            name = *std::exchange(next_path, std::nullopt);
+        if (next_link)
+            link = *std::exchange(next_link, std::nullopt);
+        if (next_size) {
+            size = *std::exchange(next_size, std::nullopt);
+            padding = (512 - size % 512) % 512;
+        }
+
+        // `pax_global_header`-style metadata entries have no useful name
+        if (name.empty() || name == "." || name == "./") {
+            in.skip(size + padding);
+            continue;
+        }
+
+        auto path = safe_join(dest, name);
+        check_real_parent(dest, path);
+        switch (type) {
+        case '0':
+        case '\0':
+        case '7':
+            trace("extracting {}", name);
+            write_file(in, path, size);
+            set_executable(path, mode);
+            break;
+        case '5':
+            std::filesystem::create_directories(path);
+            in.skip(size);
+            break;
+        case '2':
+            check_symlink(dest, path, link);
+            symlinks.push_back(PendingSymlink{.path = path, .target = link});
+            in.skip(size);
+            break;
+        case '1': {
+            // no symlinks exist yet, a regular file is all this can copy
+            auto target = safe_join(dest, link);
+            check_real_parent(dest, target);
+            if (!std::filesystem::is_regular_file(
+                    std::filesystem::symlink_status(target)))
+                throw std::runtime_error(fmt::format(
+                    "refusing to extract hardlink `{}` to `{}`", name, link));
+            std::filesystem::create_directories(path.parent_path());
+            std::filesystem::copy_file(
+                target, path,
+                std::filesystem::copy_options::overwrite_existing);
+            in.skip(size);
+            break;
+        }
+        default:
+            // devices, fifos, ...
+            debug("skipping tar entry `{}` of type `{}`", name, type);
+            in.skip(size);
+            break;
+        }
+        in.skip(padding);
+    }
+    create_symlinks(dest, symlinks);
+}
+
+static void extract_zip(BufferedStream& in, const std::filesystem::path& dest) {
+    constexpr uint32_t LOCAL_HEADER_SIG = 0x04034b50;
+    constexpr uint32_t DATA_DESCRIPTOR_SIG = 0x08074b50;
+    constexpr uint16_t FLAG_ENCRYPTED = 1 << 0;
+    constexpr uint16_t FLAG_DATA_DESCRIPTOR = 1 << 3;
+    constexpr uint16_t METHOD_STORE = 0, METHOD_DEFLATE = 8;
+
+    for (;;) {
+        // entries are followed by the central directory, which only repeats
+        // what the local headers already told us
+        if (in.peek(4) < 4 ||
+            read_le32(reinterpret_cast<const unsigned char*>(in.data())) !=
+                LOCAL_HEADER_SIG)
+            break;
+
+        unsigned char header[30];
+        in.read_exact(reinterpret_cast<char*>(header), sizeof(header));
+        auto flags = read_le16(header + 6);
+        auto method = read_le16(header + 8);
+        uint64_t compressed_size = read_le32(header + 18);
+        auto name_len = read_le16(header + 26);
+        auto extra_len = read_le16(header + 28);
+
+        std::string name(name_len, '\0');
+        in.read_exact(name.data(), name_len);
+        std::string extra(extra_len, '\0');
+        in.read_exact(extra.data(), extra_len);
+
+        // zip64: real sizes are in an extra field
+        bool zip64 = false;
+        for (size_t pos = 0; pos + 4 <= extra.size();) {
+            auto p = reinterpret_cast<const unsigned char*>(extra.data()) + pos;
+            auto id = read_le16(p);
+            auto len = read_le16(p + 2);
+            if (id == 0x0001) {
+                zip64 = true;
+                // uncompressed size first, then compressed size (each only if
+                // the header value is 0xffffffff)
+                size_t off = 4;
+                if (read_le32(header + 22) == 0xffffffff && off + 8 <= 4u + len)
+                    off += 8;
+                if (compressed_size == 0xffffffff && off + 8 <= 4u + len)
+                    compressed_size = read_le64(p + off);
+            }
+            pos += 4 + len;
+        }
+
+        if (flags & FLAG_ENCRYPTED)
+            throw std::runtime_error(
+                fmt::format("encrypted zip entry `{}` is not supported", name));
+
+        bool is_dir = name.ends_with('/') || name.ends_with('\\');
+        auto path = safe_join(dest, name);
+        bool has_descriptor = flags & FLAG_DATA_DESCRIPTOR;
+
+        if (method == METHOD_DEFLATE) {
+            InflateStream inflate(in, InflateStream::Format::raw);
+            if (is_dir) {
+                std::filesystem::create_directories(path);
+                inflate.drain();
+            } else {
+                trace("extracting {}", name);
+                write_file(inflate, path, std::nullopt);
+            }
+        } else if (method == METHOD_STORE) {
+            if (has_descriptor)
+                throw std::runtime_error(fmt::format(
+                    "stored zip entry `{}` without a size can't be streamed",
+                    name));
+            if (is_dir) {
+                std::filesystem::create_directories(path);
+                in.skip(compressed_size);
+            } else {
+                trace("extracting {}", name);
+                write_file(in, path, compressed_size);
+            }
+        } else {
+            throw std::runtime_error(
+                fmt::format("zip entry `{}` uses unsupported compression "
+                            "method {}",
+                            name, method));
+        }
+
+        if (has_descriptor) {
+            // optional signature, CRC-32, compressed and uncompressed size
+            if (in.peek(4) >= 4 &&
+                read_le32(reinterpret_cast<const unsigned char*>(in.data())) ==
+                    DATA_DESCRIPTOR_SIG)
+                in.skip(4);
+            in.skip(zip64 ? 20 : 12);
+        }
+    }
+}
+
+void extract_archive(BufferedStream& stream,
+                     const std::filesystem::path& dest) {
+    auto n = stream.peek(4);
+    auto magic = reinterpret_cast<const unsigned char*>(stream.data());
+
+    if (n >= 4 && magic[0] == 'P' && magic[1] == 'K' && magic[2] == 3 &&
+        magic[3] == 4) {
+        debug("extracting zip archive into `{}`", dest.string());
+        extract_zip(stream, dest);
+    } else if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        debug("extracting tar.gz archive into `{}`", dest.string());
+        InflateStream inflate(stream, InflateStream::Format::gzip);
+        extract_tar(inflate, dest);
+        inflate.drain();
+    } else if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+               magic[2] == 0x2f && magic[3] == 0xfd) {
+        debug("extracting tar.zst archive into `{}`", dest.string());
+        ZstdStream zstd(stream);
+        extract_tar(zstd, dest);
+        zstd.drain();
+    } else {
+        debug("extracting tar archive into `{}`", dest.string());
+        extract_tar(stream, dest);
+    }
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include "stream.hpp"
+#include <filesystem>
+
+// Extract a zip, tar, tar.gz or tar.zst archive (detected from its first
+// bytes) from `stream` into the existing directory `dest`, in a single pass
+// and without buffering whole entries in memory. Entries that would end up
+// outside of `dest`, directly or through a symlink, are rejected. Symlinks are
+// created after everything else. Throws on corrupt or unsupported archives.
+//
+// Only the archive itself is consumed, the caller should drain `stream` if it
+// needs all of the bytes (e.g. for hashing).
+void extract_archive(BufferedStream& stream, const std::filesystem::path& dest);
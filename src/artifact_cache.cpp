@@ -0,0 +1,141 @@
+#include "artifact_cache.hpp"
+#include "cache_limit.hpp"
+#include "hash.hpp"
+#include "remote_cache.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <random>
+
+using namespace spdlog;
+
+// bump when the way libraries are built changes, so that old entries are
+// never picked up
+constexpr std::string_view ARTIFACT_FORMAT = "qobs-artifact-2";
+
+ArtifactCache::ArtifactCache(const Toolchain& toolchain,
+                             std::string_view archiver) {
+    Sha256 sha;
+    sha.update_field(ARTIFACT_FORMAT)
+        .update_field(toolchain.compiler)
+        .update_field(toolchain.version)
+        .update_field(toolchain.target)
+        .update_field(archiver);
+    m_toolchain = sha.hex_digest();
+    trace("toolchain `{}` ({}, {}): {}", toolchain.compiler, toolchain.target,
+          archiver, m_toolchain);
+    m_remote = RemoteCache::from_env();
+}
+
+ArtifactCache::ArtifactCache() : m_remote(RemoteCache::from_env()) {}
+
+std::string
+ArtifactCache::key(const DependencyNode& node, const BuildLibrary& lib,
+                   const std::vector<std::string>& dependency_keys) const {
+    if (!enabled() || node.dependency.digest().empty())
+        return "";
+    for (auto& dep_key : dependency_keys)
+        if (dep_key.empty())
+            return "";
+
+    Sha256 sha;
+    sha.update_field(m_toolchain)
+        .update_field(lib.name)
+        .update_field(node.dependency.digest())
+        .update_field(lib.cflags);
+
+    // the sources are picked with globs, which may differ between qobs
+    // versions for packages without a Qobs.toml
+    std::vector<std::string> sources;
+    for (auto& file : lib.files)
+        sources.push_back(
+            std::filesystem::relative(file.path(), lib.root).generic_string());
+    std::sort(sources.begin(), sources.end());
+    for (auto& source : sources)
+        sha.update_field(source);
+
+    // headers of dependencies end up in the objects too
+    sha.update_field("deps");
+    for (auto& dep_key : dependency_keys)
+        sha.update_field(dep_key);
+    return sha.hex_digest();
+}
+
+std::filesystem::path ArtifactCache::entry_path(std::string_view name,
+                                                const std::string& key) {
+    return utils::cache_dir() / "artifacts" /
+           fmt::format("{}-{}", name, key.substr(0, 32));
+}
+
+bool ArtifactCache::contains(std::string_view name, const std::string& key,
+                             const std::filesystem::path& file_name) {
+    std::error_code ec;
+    return std::filesystem::is_regular_file(entry_path(name, key) / file_name,
+                                            ec);
+}
+
+std::optional<std::filesystem::path>
+ArtifactCache::find(std::string_view name, const std::string& key,
+                    const std::filesystem::path& file_name) const {
+    if (key.empty())
+        return std::nullopt;
+    auto path = entry_path(name, key) / file_name;
+    std::error_code ec;
+    if (std::filesystem::is_regular_file(path, ec)) {
+        // not the archive itself, build files depend on its mtime
+        mark_entry_used(path.parent_path());
+        return path;
+    }
+
+    // the record is the digest of the archive
+    if (!m_remote)
+        return std::nullopt;
+    auto digest = m_remote->get_record("artifact-" + key);
+    if (!digest)
+        return std::nullopt;
+    utils::trim_in_place(*digest);
+    auto archive = m_remote->get_blob(*digest);
+    if (!archive)
+        return std::nullopt;
+    if (Sha256::hex(*archive) != *digest) {
+        debug("remote cache: corrupt archive for `{}`", name);
+        return std::nullopt;
+    }
+    try {
+        utils::write_file_atomically(path, *archive);
+        mark_entry_used(path.parent_path());
+    } catch (const std::exception& err) {
+        debug("couldn't store `{}` from the remote cache: {}", name,
+              err.what());
+        return std::nullopt;
+    }
+    return path;
+}
+
+void ArtifactCache::store(std::string_view name, const std::string& key,
+                          const std::filesystem::path& archive) const {
+    auto dir = entry_path(name, key);
+    auto dest = dir / archive.filename();
+    if (!std::filesystem::exists(dest)) {
+        // copy next to the destination and rename, which is atomic
+        std::filesystem::create_directories(dir);
+        mark_entry_used(dir);
+        auto tmp =
+            dir / fmt::format(".{}.{:x}.tmp", archive.filename().string(),
+                              std::random_device{}());
+        try {
+            std::filesystem::copy_file(archive, tmp);
+            std::filesystem::rename(tmp, dest);
+        } catch (...) {
+            std::error_code ec;
+            std::filesystem::remove(tmp, ec);
+            throw;
+        }
+    }
+
+    // uploaded from the cache entry, which never changes
+    if (m_remote) {
+        auto digest = Sha256::hex_file(dest);
+        m_remote->put_blob(digest, dest);
+        m_remote->put_record("artifact-" + key, digest);
+    }
+}
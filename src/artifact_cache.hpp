@@ -0,0 +1,65 @@
+#pragma once
+#include "dependency_graph.hpp"
+#include "generators/generator.hpp"
+#include "toolchain.hpp"
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Prebuilt dependency libraries in the per-user cache
+// (`<cache dir>/artifacts/<name>-<key>/`), shared by every project and build
+// directory on the machine. A library is keyed on the contents of the
+// dependency (its resolved tree or archive digest), the identity and version
+// of the compiler, the flags it's built with and the keys of everything it
+// depends on, so the same fmt commit built with the same compiler and flags is
+// only ever compiled once. With a `RemoteCache`, libraries are shared between
+// machines too.
+class RemoteCache;
+
+class ArtifactCache {
+public:
+    // Libraries built with `toolchain` (see `probe_toolchain`) and archived
+    // with `archiver`.
+    ArtifactCache(const Toolchain& toolchain, std::string_view archiver);
+    // Without a toolchain, e.g. when there's no telling what the compiler
+    // would produce: can't compute keys, only `store` libraries under keys
+    // computed by an earlier build.
+    ArtifactCache();
+
+    inline bool enabled() const {
+        return !m_toolchain.empty();
+    }
+
+    // Key of `lib`, built from `node`. `dependency_keys` are the keys of the
+    // node's dependencies, in the same order. Returns an empty string if the
+    // library can't be cached: path dependencies have no fixed contents, and
+    // neither does anything that depends on them.
+    std::string key(const DependencyNode& node, const BuildLibrary& lib,
+                    const std::vector<std::string>& dependency_keys) const;
+
+    // Cached archive `file_name` for `key`, if there is one. Downloaded from
+    // the remote cache if it's only there.
+    std::optional<std::filesystem::path>
+    find(std::string_view name, const std::string& key,
+         const std::filesystem::path& file_name) const;
+
+    // Whether archive `file_name` for `key` is in the local cache.
+    static bool contains(std::string_view name, const std::string& key,
+                         const std::filesystem::path& file_name);
+
+    // Copy a freshly built `archive` into the cache. Entries appear
+    // atomically, so concurrent builds never see a half-written archive.
+    // Throws on failure.
+    void store(std::string_view name, const std::string& key,
+               const std::filesystem::path& archive) const;
+
+private:
+    static std::filesystem::path entry_path(std::string_view name,
+                                            const std::string& key);
+
+    // Digest of the toolchain and archiver. Empty if disabled.
+    std::string m_toolchain;
+    std::shared_ptr<RemoteCache> m_remote;
+};
@@ -0,0 +1,170 @@
+#include "build_stamp.hpp"
+#include "hash.hpp"
+#include <fstream>
+#include <spdlog/spdlog.h>
+#include <sstream>
+
+using namespace spdlog;
+
+// bump this if the format or what is recorded changes
+constexpr std::string_view BUILD_STAMP_HEADER = "qobs-build-stamp 2";
+
+static std::string file_digest(const std::filesystem::path& path) {
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(path, ec))
+        return "";
+    try {
+        return Sha256::hex_file(path);
+    } catch (const std::exception&) {
+        return "";
+    }
+}
+
+void BuildStamp::add_file(const std::filesystem::path& path) {
+    m_files.push_back(File{path, file_digest(path)});
+}
+
+void BuildStamp::add_value(std::string_view name, std::string_view value) {
+    m_values.push_back(Value{std::string(name), Sha256::hex(value)});
+}
+
+void BuildStamp::add_dir(const WalkedDir& dir) {
+    m_dirs.push_back(dir);
+}
+
+std::vector<std::filesystem::path> BuildStamp::inputs() const {
+    std::vector<std::filesystem::path> paths;
+    for (auto& file : m_files)
+        if (!file.digest.empty())
+            paths.push_back(file.path);
+    for (auto& dir : m_dirs)
+        paths.push_back(dir.path);
+    return paths;
+}
+
+bool BuildStamp::is_current(const BuildStamp& current) const {
+    if (m_values.size() != current.m_values.size())
+        return false;
+    for (size_t i = 0; i < m_values.size(); ++i) {
+        if (m_values[i].name != current.m_values[i].name ||
+            m_values[i].digest != current.m_values[i].digest) {
+            debug("build files are out of date: `{}` changed",
+                  m_values[i].name);
+            return false;
+        }
+    }
+
+    // directories first, they only need a `stat`
+    for (auto& dir : m_dirs) {
+        auto stamp = dir_stamp(dir.path);
+        if (!stamp || *stamp != dir.stamp) {
+            debug("build files are out of date: `{}` changed",
+                  dir.path.string());
+            return false;
+        }
+    }
+    for (auto& file : m_files) {
+        if (file_digest(file.path) != file.digest) {
+            debug("build files are out of date: `{}` changed",
+                  file.path.string());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BuildStamp::is_reliable() const {
+    if (!m_reliable)
+        return false;
+    for (auto& dir : m_dirs)
+        if (is_racy(dir.stamp))
+            return false;
+    return true;
+}
+
+void BuildStamp::save(const std::filesystem::path& path) const {
+    std::ostringstream out;
+    out << BUILD_STAMP_HEADER << '\n';
+    out << "build_file " << build_file.string() << '\n';
+    out << "output " << output.string() << '\n';
+    for (auto& value : m_values)
+        out << "value " << value.digest << ' ' << value.name << '\n';
+    for (auto& file : m_files)
+        out << "file " << (file.digest.empty() ? "-" : file.digest) << ' '
+            << file.path.string() << '\n';
+    for (auto& dir : m_dirs)
+        out << "dir " << dir.stamp.mtime << ' ' << dir.stamp.inode << ' '
+            << dir.path.string() << '\n';
+    for (auto& artifact : artifacts)
+        out << "artifact " << artifact.key << ' ' << artifact.name << ' '
+            << artifact.archive.string() << '\n';
+
+    // write next to it and rename, a half-written stamp must never be
+    // mistaken for a valid one
+    auto tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::out | std::ios::trunc);
+        file << out.str();
+        if (!file)
+            throw std::runtime_error(
+                fmt::format("couldn't write `{}`", tmp.string()));
+    }
+    std::filesystem::rename(tmp, path);
+}
+
+std::optional<BuildStamp> BuildStamp::load(const std::filesystem::path& path) {
+    std::ifstream file(path);
+    std::string line;
+    if (!file || !std::getline(file, line) || line != BUILD_STAMP_HEADER)
+        return std::nullopt;
+
+    // the rest of the line, after what was already read from it
+    auto rest = [](std::istringstream& in) {
+        std::string str;
+        in.get(); // the space
+        std::getline(in, str);
+        return str;
+    };
+
+    BuildStamp stamp;
+    while (std::getline(file, line)) {
+        std::istringstream in(line);
+        std::string kind;
+        in >> kind;
+        if (kind == "build_file") {
+            stamp.build_file = rest(in);
+        } else if (kind == "output") {
+            stamp.output = rest(in);
+        } else if (kind == "value") {
+            Value value;
+            in >> value.digest;
+            value.name = rest(in);
+            stamp.m_values.push_back(std::move(value));
+        } else if (kind == "file") {
+            File entry;
+            in >> entry.digest;
+            if (entry.digest == "-")
+                entry.digest.clear();
+            entry.path = rest(in);
+            stamp.m_files.push_back(std::move(entry));
+        } else if (kind == "dir") {
+            WalkedDir dir;
+            in >> dir.stamp.mtime >> dir.stamp.inode;
+            dir.path = rest(in);
+            stamp.m_dirs.push_back(std::move(dir));
+        } else if (kind == "artifact") {
+            Artifact artifact;
+            in >> artifact.key >> artifact.name;
+            artifact.archive = rest(in);
+            stamp.artifacts.push_back(std::move(artifact));
+        } else {
+            return std::nullopt;
+        }
+        if (in.fail())
+            return std::nullopt;
+    }
+    if (stamp.build_file.empty() || stamp.output.empty())
+        return std::nullopt;
+    return stamp;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include "source_walker.hpp"
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+constexpr auto& BUILD_STAMP_NAME = "build.stamp";
+
+// Every input that went into generating the build files: files (by content),
+// environment variables and options (by value) and the scanned directories (by
+// stamp). If none of them changed, the build files are still up to date and a
+// build can go straight to the build tool, without parsing the manifest,
+// probing the compiler or scanning sources.
+class BuildStamp {
+public:
+    BuildStamp() {}
+
+    // A file whose contents matter, may not exist.
+    void add_file(const std::filesystem::path& path);
+
+    // A named value, e.g. an environment variable or the `-cc` override.
+    void add_value(std::string_view name, std::string_view value);
+
+    void add_dir(const WalkedDir& dir);
+
+    // Some input can't be tracked, e.g. sources outside of the package.
+    inline void set_unreliable() {
+        m_reliable = false;
+    }
+
+    // Where the build file and the final output are. Recorded so that the
+    // fast path knows them without generating anything.
+    std::filesystem::path build_file;
+    std::filesystem::path output;
+
+    // A dependency library that goes into the `ArtifactCache` once it's
+    // built. Not an input: recorded so that a build that only invokes the
+    // build tool can cache what it built, like a full build would.
+    struct Artifact {
+        std::string name;
+        std::string key;
+        std::filesystem::path archive;
+    };
+    std::vector<Artifact> artifacts;
+
+    // Existing files and all directories, e.g. for the build tool to watch.
+    std::vector<std::filesystem::path> inputs() const;
+
+    // Whether every recorded input is still the same: the values must be the
+    // same as in `current` (a stamp with just the current values), files are
+    // re-read and directories re-`stat`ed.
+    bool is_current(const BuildStamp& current) const;
+
+    // Whether the stamp can be trusted later: not if an input can't be
+    // tracked, or if a directory stamp is racy (see `is_racy`).
+    bool is_reliable() const;
+
+    // Throws if the file can't be written.
+    void save(const std::filesystem::path& path) const;
+
+    // Nothing if there is no (valid) stamp at `path`.
+    static std::optional<BuildStamp> load(const std::filesystem::path& path);
+
+private:
+    struct Value {
+        std::string name;
+        // SHA-256 of the value
+        std::string digest;
+    };
+    struct File {
+        std::filesystem::path path;
+        // SHA-256 of the contents, empty if the file doesn't exist
+        std::string digest;
+    };
+
+    std::vector<Value> m_values;
+    std::vector<File> m_files;
+    std::vector<WalkedDir> m_dirs;
+    bool m_reliable{true};
+};
@@ -1,14 +1,16 @@
 #include "builder.hpp"
+#include "artifact_cache.hpp"
+#include "build_stamp.hpp"
+#include "cache_limit.hpp"
+#include "object_cache.hpp"
+#include "source_walker.hpp"
 #include "utils.hpp"
-#include <glob/glob.h>
+#include <algorithm>
 #include <spdlog/spdlog.h>
 
 using namespace spdlog;
 
-std::filesystem::path Builder::build(std::shared_ptr<Generator> gen,
-                                     std::string_view build_dir,
-                                     std::optional<std::string> compiler) {
-    // create build directory
+std::filesystem::path Builder::create_build_dir(std::string_view build_dir) {
     try {
         std::filesystem::create_directory(m_manifest.package_root() /
                                           build_dir);
@@ -16,14 +18,102 @@ std::filesystem::path Builder::build(std::shared_ptr<Generator> gen,
         throw std::runtime_error(
             fmt::format("couldn't create build directory: {}", err.what()));
     }
+    return m_manifest.package_root() / build_dir;
+}
 
-    auto build_dir_path = m_manifest.package_root() / build_dir;
+// Everything generation depends on that isn't a file or a directory.
+static void stamp_environment(BuildStamp& stamp, const Generator& gen,
+                              const std::optional<std::string>& compiler) {
+    for (auto name : {"CC", "CXX", "AR", "PATH", "QOBS_NO_OBJECT_CACHE"}) {
+        auto value = std::getenv(name);
+        stamp.add_value(name, value ? value : "");
+    }
+    // prebuilt libraries are referenced from there
+    stamp.add_value("cache_dir", utils::cache_dir().string());
+    stamp.add_value("-cc", compiler.value_or(""));
+    stamp.add_value("generator", gen.name());
+}
 
-    // find all package sources (this will glob `target.sources` wildcards)
-    scan_files();
+// Upload what `qobs cc` compiled and trim the local caches, after building.
+static void finish_caches() {
+    ObjectCache().upload_deferred();
+    trim_local_cache();
+}
 
-    // fetch & add dependencies
+// Put the libraries that were just built into the artifact cache, unless
+// they're there already.
+static void
+store_artifacts(const ArtifactCache& cache,
+                const std::vector<BuildStamp::Artifact>& artifacts) {
+    for (auto& artifact : artifacts) {
+        if (ArtifactCache::contains(artifact.name, artifact.key,
+                                    artifact.archive.filename()))
+            continue;
+        // not being able to cache something doesn't fail the build
+        try {
+            cache.store(artifact.name, artifact.key, artifact.archive);
+            debug("cached `{}`", artifact.name);
+        } catch (const std::exception& err) {
+            warn("couldn't cache `{}`: {}", artifact.name, err.what());
+        }
+    }
+}
+
+std::optional<std::filesystem::path>
+Builder::build_if_unchanged(std::shared_ptr<Generator> gen,
+                            const std::filesystem::path& package_root,
+                            std::string_view build_dir,
+                            std::optional<std::string> compiler, bool invoke) {
+    auto stamp = BuildStamp::load(package_root / build_dir / BUILD_STAMP_NAME);
+    if (!stamp)
+        return std::nullopt;
+
+    BuildStamp current;
+    stamp_environment(current, *gen, compiler);
+    if (!stamp->is_current(current))
+        return std::nullopt;
+
+    debug("build files are up to date");
+    if (!invoke)
+        return stamp->output;
+    gen->invoke(stamp->build_file);
+
+    // the build that wrote the stamp may have failed before its libraries
+    // could be cached, or they may have been built by the build tool alone
+    auto uncached = [](const BuildStamp::Artifact& artifact) {
+        return !ArtifactCache::contains(artifact.name, artifact.key,
+                                        artifact.archive.filename());
+    };
+    if (std::any_of(stamp->artifacts.begin(), stamp->artifacts.end(),
+                    uncached))
+        store_artifacts(ArtifactCache(), stamp->artifacts);
+    finish_caches();
+    return stamp->output;
+}
+
+std::filesystem::path Builder::build(std::shared_ptr<Generator> gen,
+                                     std::string_view build_dir,
+                                     std::optional<std::string> compiler,
+                                     bool invoke) {
+    auto build_dir_path = create_build_dir(build_dir);
+
+    // the build files are about to change, the old stamp must not survive a
+    // failed generation
+    auto stamp_path = build_dir_path / BUILD_STAMP_NAME;
+    std::error_code ec;
+    std::filesystem::remove(stamp_path, ec);
+    m_stamp = BuildStamp();
+    stamp_environment(m_stamp, *gen, compiler);
+    m_stamp.add_file(m_manifest.package_root() / MANIFEST_NAME);
+
+    // fetch & add dependencies. This goes first since it may write Qobs.lock,
+    // which would change the stamp of the package directory
     handle_deps(build_dir_path);
+    m_stamp.add_file(m_manifest.package_root() / LOCKFILE_NAME);
+
+    // find all package sources (this will glob `target.sources` wildcards)
+    scan_files(build_dir_path);
+    collect_libraries();
 
     // generate project files
     debug("generating project files...");
@@ -36,59 +126,275 @@ std::filesystem::path Builder::build(std::shared_ptr<Generator> gen,
 #endif
 
     // find cc, prefer cxx if compiling C++ package
-    auto cc = compiler ? compiler.value()
-                       : utils::find_compiler(m_manifest.m_target.m_cxx);
+    std::string cc;
+    std::optional<Toolchain> toolchain;
+    if (compiler)
+        cc = *compiler;
+    else
+        std::tie(cc, toolchain) =
+            utils::find_compiler(m_manifest.m_target.m_cxx);
     if (cc.empty())
         throw std::runtime_error(
             "couldn't find suitable C/C++ compiler, either re-run with `-cc`, "
             "set the `CC` or `CXX` environment variable or add your compiler "
             "to PATH");
 
-    gen->generate(m_manifest, m_files, exe_name, cc);
-    trace("build.ninja:\n{}", gen->code());
+    // link libraries that were already built with the same compiler and flags
+    // instead of compiling them again. There's no telling what a compiler
+    // that can't be probed produces, its libraries aren't cached. A compiler
+    // found in PATH was already probed
+    if (!toolchain)
+        toolchain = probe_toolchain(cc);
+    auto cache = toolchain ? ArtifactCache(*toolchain, utils::find_archiver(cc))
+                           : ArtifactCache();
+    use_artifact_cache(cache, *gen);
+    // keep the cache from trimming what the build files are about to use
+    std::vector<std::filesystem::path> entries;
+    for (auto& lib : m_libraries)
+        if (lib.prebuilt)
+            entries.push_back(lib.prebuilt->parent_path());
+    pin_cache_entries(build_dir_path, entries);
+
+    // commands run with their output captured, keep the colors
+    if (toolchain && toolchain->supports(COLOR_DIAGNOSTICS_FLAG))
+        gen->set_toolchain_flags({COLOR_DIAGNOSTICS_FLAG});
+    for (auto& lib : m_libraries)
+        if (!lib.files.empty() && !lib.prebuilt && !lib.cache_key.empty())
+            m_stamp.artifacts.push_back(BuildStamp::Artifact{
+                .name = lib.name,
+                .key = lib.cache_key,
+                .archive = build_dir_path / gen->library_path(lib),
+            });
+
+    // let the build tool rerun us when the manifest or sources change, so it
+    // can be used on its own
+    if (auto qobs = utils::current_exe(); !qobs.empty()) {
+        std::vector<std::string> command{qobs.string(),
+                                         "build",
+                                         m_manifest.package_root().string(),
+                                         "--build-dir",
+                                         std::string(build_dir),
+                                         "--generator",
+                                         std::string(gen->name()),
+                                         "--generate-only"};
+        if (compiler) {
+            command.push_back("-cc");
+            command.push_back(*compiler);
+        }
+        gen->set_regeneration(Regeneration{
+            .command = std::move(command),
+            .inputs = m_stamp.inputs(),
+        });
+        if (ObjectCache::enabled_by_env())
+            gen->set_compile_launcher({qobs.string(), "cc"});
+    }
+
+    gen->generate(m_manifest, m_files, m_libraries, exe_name, cc);
+
+    // write project files. Unchanged files are left alone, so that the build
+    // tool doesn't reload them
+    for (auto& file : gen->files()) {
+        trace("{}:\n{}", file.path.string(), file.code);
+        if (utils::write_if_changed(build_dir_path / file.path, file.code))
+            debug("wrote `{}`", file.path.string());
+    }
+    auto build_file_path = build_dir_path / gen->files().front().path;
 
-    // write project files
-    auto build_file_path = build_dir_path / "build.ninja";
-    std::fstream file(build_file_path, std::ios::out);
-    file << gen->code();
-    file.close();
+    // the next build can skip everything above if nothing changes. Written
+    // before building, so that failing builds (e.g. while editing) take the
+    // fast path too
+    m_stamp.build_file = build_file_path;
+    m_stamp.output = build_dir_path / exe_name;
+    if (m_stamp.is_reliable()) {
+        try {
+            m_stamp.save(stamp_path);
+        } catch (const std::exception& err) {
+            debug("couldn't save build stamp: {}", err.what());
+        }
+    }
 
     // invoke generator
+    if (!invoke)
+        return build_dir_path / exe_name;
     gen->invoke(build_file_path);
+    store_artifacts(cache, m_stamp.artifacts);
+    finish_caches();
 
     // return path to built file
     return build_dir_path / exe_name;
 }
 
-void Builder::scan_files() {
+// Directories of the package and what they contained on the last build, so
+// that unchanged directories don't need to be listed again.
+constexpr auto& SCAN_INDEX_NAME = "scan.idx";
+
+// Find the source files of `target` in the package at `root`, never looking
+// inside of `build_dir`. With a `build_dir`, the scan index is kept there.
+// Directories that were looked into go into `stamp`.
+static std::vector<BuildFile>
+scan_sources(const Target& target, const std::filesystem::path& root,
+             BuildStamp& stamp, const std::filesystem::path& build_dir = {}) {
+    // since `qobs build` can be used with a path (e.g. `qobs build
+    // package-dir`) the patterns are matched relative to the package root.
+    // All patterns are matched in a single walk of the package
+    SourceWalker walker(target.sources(), target.exclude(),
+                        target.glob_recurse());
+    if (!build_dir.empty()) {
+        walker.prune(build_dir);
+        walker.cache_in(build_dir / SCAN_INDEX_NAME);
+    }
+
+    std::vector<WalkedDir> walked;
+    std::vector<BuildFile> files;
+    for (auto& path : walker.walk(root, &walked))
+        files.push_back(BuildFile(path));
+
+    for (auto& dir : walked)
+        stamp.add_dir(dir);
+    if (!walker.tracks_everything())
+        stamp.set_unreliable();
+    return files;
+}
+
+void Builder::scan_files(const std::filesystem::path& build_dir_path) {
     debug("scanning files...");
-    for (auto& query : m_manifest.target().sources()) {
-        // since `qobs build` can be used with a path (e.g. `qobs build
-        // package-dir`) we need to make the query relative to the path qobs is
-        // being run from
-        auto relative_query = m_manifest.package_root().string();
-        relative_query.push_back(std::filesystem::path::preferred_separator);
-        relative_query.append(query);
-
-        // recursively glob the query
-        trace("globbing relative query: {}", relative_query);
-        auto files = m_manifest.target().glob_recurse()
-                         ? glob::rglob(relative_query)
-                         : glob::glob(relative_query);
-
-        for (auto& p : files) {
-            trace("found source file: {}", p.string());
-            BuildFile file(p);
-            m_files.push_back(file);
+    m_files = scan_sources(m_manifest.target(), m_manifest.package_root(),
+                           m_stamp, build_dir_path);
+    debug("queued {} file(s) for building", m_files.size());
+}
+
+void Builder::collect_libraries() {
+    m_libraries.clear();
+    auto& nodes = m_deps.nodes();
+    for (auto& node : nodes) {
+        // dependencies without a Qobs.toml are built with the defaults
+        Target target;
+        if (node.manifest)
+            target = node.manifest->target();
+        m_stamp.add_file(node.path / MANIFEST_NAME);
+
+        BuildLibrary lib{
+            .name = node.dependency.name(),
+            .root = node.path,
+            .files = scan_sources(target, node.path, m_stamp),
+            .cflags = target.cflags(),
+            .ldflags = target.ldflags(),
+        };
+        for (auto& dir : target.include_dirs()) {
+            auto path = node.path / dir;
+            if (std::filesystem::is_directory(path))
+                lib.public_include_dirs.push_back(path);
         }
+        // header-only libraries without an `include` directory usually have
+        // their headers at the top level
+        if (lib.public_include_dirs.empty() && !node.manifest)
+            lib.public_include_dirs.push_back(node.path);
+
+        // nodes are sorted so that dependencies come first
+        lib.include_dirs = lib.public_include_dirs;
+        for (auto index : node.dependencies) {
+            for (auto& dir : m_libraries[index].include_dirs) {
+                if (std::find(lib.include_dirs.begin(), lib.include_dirs.end(),
+                              dir) == lib.include_dirs.end())
+                    lib.include_dirs.push_back(dir);
+            }
+        }
+
+        debug("dependency `{}`: {} source file(s), {} include dir(s)",
+              lib.name, lib.files.size(), lib.include_dirs.size());
+        m_libraries.push_back(std::move(lib));
     }
-    debug("queued {} file(s) for building", m_files.size());
 }
 
-void Builder::handle_deps(const std::filesystem::path& build_dir_path) {
-    auto deps_path = build_dir_path / "_deps";
-    for (auto& dep : m_manifest.m_dependencies.m_list) {
-        dep.fetch_and_get_path(deps_path);
-        
+void Builder::use_artifact_cache(const ArtifactCache& cache,
+                                 const Generator& gen) {
+    auto& nodes = m_deps.nodes();
+    size_t hits = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        auto& lib = m_libraries[i];
+        std::vector<std::string> dependency_keys;
+        for (auto index : nodes[i].dependencies)
+            dependency_keys.push_back(m_libraries[index].cache_key);
+        lib.cache_key = cache.key(nodes[i], lib, dependency_keys);
+        if (lib.files.empty())
+            continue;
+
+        lib.prebuilt = cache.find(lib.name, lib.cache_key,
+                                  gen.library_path(lib).filename());
+        if (lib.prebuilt) {
+            debug("using prebuilt `{}` from `{}`", lib.name,
+                  lib.prebuilt->string());
+            ++hits;
+
+            // the build files point into the cache, regenerate them if the
+            // entry goes away
+            auto entry = lib.prebuilt->parent_path();
+            if (auto stamp = dir_stamp(entry))
+                m_stamp.add_dir(WalkedDir{entry, *stamp});
+            else
+                m_stamp.set_unreliable();
+        }
+    }
+    if (hits)
+        info("using {} prebuilt dependenc{}", hits, hits == 1 ? "y" : "ies");
+}
+
+void Builder::update(std::string_view build_dir,
+                     const std::vector<std::string>& names) {
+    // transitive dependencies aren't in the manifest, but they are locked
+    Lockfile lockfile;
+    try {
+        lockfile.load(m_manifest.package_root() / LOCKFILE_NAME);
+    } catch (const std::exception&) {
+    }
+    for (auto& name : names) {
+        if (std::none_of(
+                m_manifest.m_dependencies.m_list.begin(),
+                m_manifest.m_dependencies.m_list.end(),
+                [&](const Dependency& dep) { return dep.name() == name; }) &&
+            !lockfile.find(name))
+            throw std::runtime_error(
+                fmt::format("package has no dependency named `{}`", name));
+    }
+
+    auto build_dir_path = create_build_dir(build_dir);
+    handle_deps(build_dir_path, names, names.empty());
+}
+
+void Builder::handle_deps(const std::filesystem::path& build_dir_path,
+                          const std::vector<std::string>& update,
+                          bool update_all) {
+    auto lock_path = m_manifest.package_root() / LOCKFILE_NAME;
+    Lockfile lockfile;
+    try {
+        lockfile.load(lock_path);
+    } catch (const std::exception& err) {
+        warn("ignoring `{}`: {}", lock_path.string(), err.what());
+    }
+
+    // fetches are mostly waiting on the network, so independent dependencies
+    // are fetched at the same time: the whole thing should take about as long
+    // as the slowest chain of dependencies
+    m_deps.resolve(m_manifest, build_dir_path / "_deps", lockfile, update,
+                   update_all);
+
+    // record what everything resolved to, so that the next build doesn't need
+    // to ask the remotes again. Dependencies that are no longer needed are
+    // dropped
+    std::vector<std::string> names;
+    for (auto& node : m_deps.nodes())
+        names.push_back(node.dependency.name());
+    lockfile.retain(names);
+    for (auto& node : m_deps.nodes()) {
+        if (auto entry = node.dependency.lock_entry())
+            lockfile.set(std::move(*entry));
+    }
+
+    if (m_deps.empty() && !std::filesystem::exists(lock_path))
+        return;
+    try {
+        lockfile.save(lock_path);
+    } catch (const std::exception& err) {
+        warn("couldn't update `{}`: {}", lock_path.string(), err.what());
     }
 }
@@ -1,26 +1,78 @@
 #pragma once
+#include "build_stamp.hpp"
+#include "dependency_graph.hpp"
 #include "generators/generator.hpp"
 #include "manifest.hpp"
 
+class ArtifactCache;
+
 class Builder {
 public:
     Builder(Manifest manifest) : m_manifest(manifest) {}
 
-    // returns path to the built executable/library
+    // If nothing that the build files were generated from changed since the
+    // last build, just invoke the build tool and return the path to the built
+    // executable/library. Dependency libraries that aren't in the artifact
+    // cache yet are stored after a successful build. Doesn't parse the
+    // manifest. Returns nothing if the build files need to be generated again.
+    static std::optional<std::filesystem::path>
+    build_if_unchanged(std::shared_ptr<Generator> gen,
+                       const std::filesystem::path& package_root,
+                       std::string_view build_dir,
+                       std::optional<std::string> compiler, bool invoke = true);
+
+    // returns path to the built executable/library. Only generates the build
+    // files without building if `invoke` is false.
     std::filesystem::path build(std::shared_ptr<Generator> gen,
                                 std::string_view build_dir,
-                                std::optional<std::string> compiler);
+                                std::optional<std::string> compiler,
+                                bool invoke = true);
+    // Re-resolve the given dependencies (or all of them, if `names` is empty),
+    // ignoring what Qobs.lock says, fetch them and update Qobs.lock.
+    void update(std::string_view build_dir,
+                const std::vector<std::string>& names);
+
     inline const Manifest& manifest() {
         return m_manifest;
     }
     inline const std::vector<BuildFile>& files() const {
         return m_files;
     }
+    // All (transitive) dependencies, available after they're fetched.
+    inline const DependencyGraph& dependencies() const {
+        return m_deps;
+    }
+    // Inputs of the last `build`, even if they weren't saved because the
+    // stamp isn't reliable.
+    inline const BuildStamp& stamp() const {
+        return m_stamp;
+    }
 
 private:
-    void scan_files();
-    void handle_deps(const std::filesystem::path& build_dir_path);
+    std::filesystem::path create_build_dir(std::string_view build_dir);
+    void scan_files(const std::filesystem::path& build_dir_path);
+
+    // Turn the fetched dependencies into static libraries to build. Must be
+    // called after `handle_deps`.
+    void collect_libraries();
+
+    // Compute the artifact cache keys of `m_libraries` and use the cached
+    // archives that exist. Must be called after `collect_libraries`.
+    void use_artifact_cache(const ArtifactCache& cache, const Generator& gen);
+
+    // Fetch all (transitive) dependencies, resolving them through Qobs.lock (except for those
+    // in `update`, or all of them if `update_all` is set) and update it.
+    void handle_deps(const std::filesystem::path& build_dir_path,
+                     const std::vector<std::string>& update = {},
+                     bool update_all = false);
 
     Manifest m_manifest;
     std::vector<BuildFile> m_files;
+    DependencyGraph m_deps;
+
+    // One for every node in `m_deps`, in the same order.
+    std::vector<BuildLibrary> m_libraries;
+
+    // Inputs of the current build, see `build_if_unchanged`.
+    BuildStamp m_stamp;
 };
@@ -0,0 +1,255 @@
+#include "cache_limit.hpp"
+#include "hash.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+using namespace spdlog;
+
+// Keep this much of the limit after trimming, in percent.
+constexpr uintmax_t TRIM_TARGET = 90;
+
+// Pins of an entry: a file per build directory, holding its path.
+constexpr auto& USERS_DIR = ".users";
+
+// The entries a build directory pins, one per line.
+constexpr auto& PINS_NAME = ".qobs_cache_pins";
+
+static std::filesystem::path normalized(const std::filesystem::path& path) {
+    std::error_code ec;
+    auto absolute = std::filesystem::absolute(path, ec);
+    return (ec ? path : absolute).lexically_normal();
+}
+
+static std::vector<std::string> read_lines(const std::filesystem::path& path) {
+    std::vector<std::string> lines;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+        if (!line.empty())
+            lines.push_back(line);
+    return lines;
+}
+
+std::optional<uintmax_t> parse_size(std::string_view text) {
+    uintmax_t value = 0;
+    auto [end, ec] =
+        std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec != std::errc() || end == text.data())
+        return std::nullopt;
+
+    std::string_view suffix(end, text.data() + text.size() - end);
+    if (suffix.empty())
+        return value;
+    constexpr std::string_view units = "KMGT";
+    auto unit = units.find(static_cast<char>(
+        std::toupper(static_cast<unsigned char>(suffix.front()))));
+    // `20G`, `20GB` and `20GiB` all mean the same
+    suffix.remove_prefix(1);
+    if (unit == std::string_view::npos ||
+        (!suffix.empty() && suffix != "B" && suffix != "iB"))
+        return std::nullopt;
+    for (size_t i = 0; i <= unit; ++i) {
+        if (value > UINTMAX_MAX / 1024)
+            return std::nullopt;
+        value *= 1024;
+    }
+    return value;
+}
+
+std::optional<uintmax_t> cache_max_size() {
+    auto value = std::getenv("QOBS_CACHE_MAX_SIZE");
+    if (!value || !*value)
+        return std::nullopt;
+    auto size = parse_size(value);
+    if (!size) {
+        static std::once_flag warned;
+        std::call_once(warned, [&] {
+            warn("ignoring QOBS_CACHE_MAX_SIZE=`{}`, expected a size like "
+                 "`20G`",
+                 value);
+        });
+    }
+    return size;
+}
+
+void touch_cache_file(const std::filesystem::path& path) {
+    std::error_code ec;
+    std::filesystem::last_write_time(
+        path, std::filesystem::file_time_type::clock::now(), ec);
+}
+
+void mark_entry_used(const std::filesystem::path& dir) {
+    auto marker = dir / USED_MARKER;
+    std::error_code ec;
+    std::filesystem::last_write_time(
+        marker, std::filesystem::file_time_type::clock::now(), ec);
+    if (ec)
+        std::ofstream(marker, std::ios::out | std::ios::app);
+}
+
+void pin_cache_entries(const std::filesystem::path& build_dir,
+                       const std::vector<std::filesystem::path>& entries) {
+    auto dir = normalized(build_dir);
+    auto user = Sha256::hex(dir.string()).substr(0, 32);
+    std::vector<std::string> pinned;
+    for (auto& entry : entries)
+        pinned.push_back(normalized(entry).string());
+
+    // pins are added before the list names them, and the list stops naming
+    // them before they're removed, so an entry in use is always pinned
+    std::error_code ec;
+    for (auto& entry : pinned) {
+        auto users = std::filesystem::path(entry) / USERS_DIR;
+        std::filesystem::create_directories(users, ec);
+        try {
+            utils::write_if_changed(users / user, dir.string() + '\n');
+        } catch (const std::exception& err) {
+            debug("couldn't pin `{}`: {}", entry, err.what());
+        }
+    }
+    auto previous = read_lines(dir / PINS_NAME);
+    std::string list;
+    for (auto& entry : pinned)
+        list += entry + '\n';
+    try {
+        utils::write_if_changed(dir / PINS_NAME, list);
+    } catch (const std::exception& err) {
+        debug("couldn't record cache pins: {}", err.what());
+        return;
+    }
+    for (auto& entry : previous)
+        if (std::find(pinned.begin(), pinned.end(), entry) == pinned.end())
+            std::filesystem::remove(
+                std::filesystem::path(entry) / USERS_DIR / user, ec);
+}
+
+static uintmax_t dir_size(const std::filesystem::path& dir) {
+    uintmax_t size = 0;
+    std::error_code ec;
+    std::filesystem::recursive_directory_iterator it(dir, ec);
+    for (; !ec && it != std::filesystem::recursive_directory_iterator();
+         it.increment(ec)) {
+        std::error_code entry_ec;
+        if (it->is_regular_file(entry_ec))
+            size += it->file_size(entry_ec);
+    }
+    return size;
+}
+
+// Whether a build directory still points into `entry`. Pins of build
+// directories that are gone or moved on are removed.
+static bool is_pinned(const std::filesystem::path& entry) {
+    auto self = normalized(entry).string();
+    bool pinned = false;
+    std::error_code ec;
+    std::filesystem::directory_iterator it(entry / USERS_DIR, ec);
+    for (; !ec && it != std::filesystem::directory_iterator();
+         it.increment(ec)) {
+        auto lines = read_lines(it->path());
+        auto pins = lines.empty()
+                        ? std::vector<std::string>()
+                        : read_lines(std::filesystem::path(lines.front()) /
+                                     PINS_NAME);
+        if (std::find(pins.begin(), pins.end(), self) != pins.end()) {
+            pinned = true;
+        } else {
+            std::error_code remove_ec;
+            std::filesystem::remove(it->path(), remove_ec);
+        }
+    }
+    return pinned;
+}
+
+void trim_cache(const std::vector<std::filesystem::path>& dirs,
+                uintmax_t max_size) {
+    struct Entry {
+        std::filesystem::path path;
+        std::filesystem::file_time_type mtime;
+        uintmax_t size;
+        // a whole directory (see `USED_MARKER`)
+        bool is_dir;
+    };
+    std::vector<Entry> entries;
+    uintmax_t total = 0;
+    for (auto& dir : dirs) {
+        std::error_code ec;
+        std::filesystem::recursive_directory_iterator it(
+            dir, std::filesystem::directory_options::skip_permission_denied,
+            ec);
+        for (; !ec && it != std::filesystem::recursive_directory_iterator();
+             it.increment(ec)) {
+            std::error_code entry_ec;
+            auto marker = it->path() / USED_MARKER;
+            if (it->is_directory(entry_ec) &&
+                std::filesystem::exists(marker, entry_ec)) {
+                it.disable_recursion_pending();
+                Entry entry{it->path(),
+                            std::filesystem::last_write_time(marker, entry_ec),
+                            dir_size(it->path()), true};
+                total += entry.size;
+                entries.push_back(std::move(entry));
+                continue;
+            }
+            if (!it->is_regular_file(entry_ec))
+                continue;
+            Entry entry{it->path(), it->last_write_time(entry_ec),
+                        it->file_size(entry_ec), false};
+            if (entry_ec)
+                continue; // deleted meanwhile
+            total += entry.size;
+            entries.push_back(std::move(entry));
+        }
+    }
+    if (total <= max_size)
+        return;
+
+    auto target = max_size / 100 * TRIM_TARGET;
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+    size_t removed = 0;
+    uintmax_t freed = 0;
+    for (auto& entry : entries) {
+        if (total - freed <= target)
+            break;
+        std::error_code ec;
+        if (entry.is_dir) {
+            if (is_pinned(entry.path) ||
+                std::filesystem::remove_all(entry.path, ec) == 0 || ec)
+                continue;
+        } else if (!std::filesystem::remove(entry.path, ec) || ec) {
+            continue;
+        }
+        ++removed;
+        freed += entry.size;
+        // e.g. the entry directory of a library, fails unless it's empty
+        auto parent = entry.path.parent_path();
+        if (std::find(dirs.begin(), dirs.end(), parent) == dirs.end())
+            std::filesystem::remove(parent, ec);
+    }
+    debug("trimmed the cache: removed {} entries, {} of {} bytes", removed,
+          freed, total);
+}
+
+void trim_local_cache() {
+    auto max_size = cache_max_size();
+    if (!max_size)
+        return;
+
+    // the marker's mtime is when any process last trimmed
+    auto dir = utils::cache_dir();
+    auto marker = dir / "trimmed";
+    std::error_code ec;
+    auto last = std::filesystem::last_write_time(marker, ec);
+    if (!ec &&
+        std::filesystem::file_time_type::clock::now() - last < TRIM_INTERVAL)
+        return;
+    std::filesystem::create_directories(dir, ec);
+    std::ofstream(marker, std::ios::out | std::ios::trunc);
+
+    trim_cache({dir / "objects", dir / "artifacts"}, *max_size);
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// A cache isn't trimmed again within this long of the last time, finding the
+// least recently used files means listing all of them.
+constexpr std::chrono::minutes TRIM_INTERVAL{1};
+
+// A size in bytes, e.g. `500M` or `20G` (`K`, `M`, `G` and `T` are powers of
+// 1024). Nothing if `text` isn't one.
+std::optional<uintmax_t> parse_size(std::string_view text);
+
+// `QOBS_CACHE_MAX_SIZE`, nothing if it isn't set (or invalid, which is warned
+// about).
+std::optional<uintmax_t> cache_max_size();
+
+// A directory with this file in it is a single cache entry, e.g. a prebuilt
+// library: it's trimmed as a whole, by the mtime of the marker. Build files
+// point at the files in such entries, which therefore must keep their mtime.
+constexpr auto& USED_MARKER = ".used";
+
+// Mark a cache file as just used. Caches do this on every hit, since access
+// times often aren't updated.
+void touch_cache_file(const std::filesystem::path& path);
+
+// Mark the entry `dir` (see `USED_MARKER`) as just used.
+void mark_entry_used(const std::filesystem::path& dir);
+
+// Record that the build files in `build_dir` point into the cache entries
+// `entries`, and no longer into any others. Entries aren't trimmed while a
+// build directory pointing into them exists. Never throws.
+void pin_cache_entries(const std::filesystem::path& build_dir,
+                       const std::vector<std::filesystem::path>& entries);
+
+// Delete the least recently used files and entries (by modification time,
+// see `touch_cache_file` and `mark_entry_used`) in `dirs` while all of them
+// together are bigger than 90% of `max_size`, so that the next store doesn't
+// trim again right away. Pinned entries are left alone, directories left
+// empty are removed. Never throws.
+void trim_cache(const std::vector<std::filesystem::path>& dirs,
+                uintmax_t max_size);
+
+// Trim the local caches (compiled objects and dependency libraries) to
+// `QOBS_CACHE_MAX_SIZE`, if it's set. At most once every `TRIM_INTERVAL`
+// across all processes. Call after storing something.
+void trim_local_cache();
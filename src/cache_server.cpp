@@ -0,0 +1,390 @@
+#include "cache_server.hpp"
+#include "cache_limit.hpp"
+#include "socket.hpp"
+#include "stream.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+
+using namespace spdlog;
+
+// Blobs bigger than this are refused, they are objects and archives. They
+// are streamed to disk, everything else is read into memory and has to fit
+// into `MAX_MESSAGE_SIZE` (records, lists of digests).
+constexpr size_t MAX_BLOB_SIZE = size_t(1) << 30;
+constexpr size_t MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+constexpr size_t MAX_HEADER_SIZE = 64 * 1024;
+
+struct Request {
+    std::string method;
+    std::string path;
+    size_t content_length{0};
+    // The start of the body, received along with the head.
+    std::string received;
+};
+
+// The body of a request as it arrives: what was received along with the head,
+// then the rest from the socket. Throws if the connection ends early.
+class BodyStream : public ByteStream {
+public:
+    BodyStream(Socket& sock, const Request& request)
+        : m_sock(sock), m_received(request.received),
+          m_left(request.content_length) {}
+
+    size_t read(char* buf, size_t size) override {
+        size = std::min(size, m_left);
+        if (!size)
+            return 0;
+        size_t n;
+        if (m_pos < m_received.size()) {
+            n = std::min(size, m_received.size() - m_pos);
+            m_received.copy(buf, n, m_pos);
+            m_pos += n;
+        } else {
+            n = m_sock.recv_some(buf, size);
+            if (!n)
+                throw std::runtime_error("the connection closed early");
+        }
+        m_left -= n;
+        return n;
+    }
+
+private:
+    Socket& m_sock;
+    std::string_view m_received;
+    size_t m_pos{0};
+    size_t m_left;
+};
+
+// Passes everything through while writing it to a file.
+class CopyingStream : public ByteStream {
+public:
+    CopyingStream(ByteStream& inner, std::ofstream& out)
+        : m_inner(inner), m_out(out) {}
+
+    size_t read(char* buf, size_t size) override {
+        auto n = m_inner.read(buf, size);
+        m_out.write(buf, static_cast<std::streamsize>(n));
+        return n;
+    }
+
+private:
+    ByteStream& m_inner;
+    std::ofstream& m_out;
+};
+
+struct Response {
+    int status{200};
+    std::string body;
+};
+
+static std::string_view reason(int status) {
+    switch (status) {
+    case 100:
+        return "Continue";
+    case 200:
+        return "OK";
+    case 201:
+        return "Created";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 411:
+        return "Length Required";
+    case 413:
+        return "Payload Too Large";
+    default:
+        return "Internal Server Error";
+    }
+}
+
+static bool send_response(Socket& sock, const Response& response) {
+    auto head = fmt::format("HTTP/1.1 {} {}\r\n"
+                            "Content-Length: {}\r\n"
+                            "Connection: close\r\n\r\n",
+                            response.status, reason(response.status),
+                            response.body.size());
+    return sock.send_all(head) && sock.send_all(response.body);
+}
+
+// Read a request, answering `Expect: 100-continue` (which curl sends for
+// bigger uploads). Nothing if the connection is broken or the request is
+// malformed, in which case an error may already have been sent.
+static std::optional<Request> read_request(Socket& sock) {
+    std::string data;
+    char buf[16 * 1024];
+    size_t header_end;
+    while ((header_end = data.find("\r\n\r\n")) == std::string::npos) {
+        if (data.size() > MAX_HEADER_SIZE)
+            return std::nullopt;
+        auto n = sock.recv_some(buf, sizeof(buf));
+        if (!n)
+            return std::nullopt;
+        data.append(buf, n);
+    }
+
+    Request request;
+    std::istringstream head(data.substr(0, header_end));
+    std::string line;
+    std::getline(head, line);
+    std::istringstream request_line(line);
+    request_line >> request.method >> request.path;
+    if (request.method.empty() || request.path.empty())
+        return std::nullopt;
+
+    size_t content_length = 0;
+    bool expect_continue = false;
+    while (std::getline(head, line)) {
+        auto colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        auto name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), [](char c) {
+            return static_cast<char>(
+                std::tolower(static_cast<unsigned char>(c)));
+        });
+        auto value = line.substr(colon + 1);
+        utils::trim_in_place(value);
+        if (name == "content-length") {
+            try {
+                content_length = std::stoull(value);
+            } catch (const std::exception&) {
+                return std::nullopt;
+            }
+        } else if (name == "expect") {
+            expect_continue = value == "100-continue";
+        } else if (name == "transfer-encoding") {
+            send_response(sock, {411, "chunked uploads aren't supported\n"});
+            return std::nullopt;
+        }
+    }
+    // only blobs are streamed to disk
+    bool blob = request.method == "PUT" && request.path.starts_with("/cas/");
+    if (content_length > (blob ? MAX_BLOB_SIZE : MAX_MESSAGE_SIZE)) {
+        send_response(sock, {413, ""});
+        return std::nullopt;
+    }
+
+    if (expect_continue && !sock.send_all("HTTP/1.1 100 Continue\r\n\r\n"))
+        return std::nullopt;
+    request.content_length = content_length;
+    request.received = data.substr(header_end + 4);
+    return request;
+}
+
+// Digests and keys are lowercase hex, optionally with a `kind-` prefix. Never
+// anything that could escape the storage directory.
+static bool is_valid_name(std::string_view name) {
+    return !name.empty() && name.size() <= 128 &&
+           std::all_of(name.begin(), name.end(), [](char c) {
+               return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                      c == '-';
+           });
+}
+
+static std::filesystem::path entry_path(const std::filesystem::path& dir,
+                                        std::string_view ns,
+                                        std::string_view name) {
+    return dir / ns / name.substr(name.size() - 2) / name;
+}
+
+// Stream `body` into the blob `file` if it's what the blob `name` must
+// contain: the digest of the body, or for `zstd-<digest>` (compressed objects)
+// of what it decompresses to. Returns whether it was.
+static bool store_blob(const std::filesystem::path& file, std::string_view name,
+                       ByteStream& body) {
+    constexpr std::string_view ZSTD_PREFIX = "zstd-";
+    std::filesystem::create_directories(file.parent_path());
+    auto tmp = file.parent_path() / fmt::format(".{}.{:x}.tmp",
+                                                file.filename().string(),
+                                                std::random_device{}());
+    bool matches = false;
+    try {
+        {
+            std::ofstream out(tmp, std::ios::out | std::ios::trunc |
+                                       std::ios::binary);
+            CopyingStream copy(body, out);
+            if (!name.starts_with(ZSTD_PREFIX)) {
+                HashingStream hashing(copy);
+                hashing.drain();
+                matches = hashing.hex_digest() == name;
+            } else {
+                BufferedStream buffered(copy);
+                try {
+                    ZstdStream zstd(buffered);
+                    HashingStream hashing(zstd);
+                    hashing.drain();
+                    matches = hashing.hex_digest() ==
+                              name.substr(ZSTD_PREFIX.size());
+                } catch (const std::exception&) {
+                    // not zstd, or the connection broke
+                }
+                // what follows the compressed data is part of the blob
+                if (matches)
+                    buffered.drain();
+            }
+            if (!out)
+                throw std::runtime_error(
+                    fmt::format("couldn't write `{}`", tmp.string()));
+        }
+        if (matches)
+            std::filesystem::rename(tmp, file);
+        else
+            std::filesystem::remove(tmp);
+    } catch (...) {
+        std::error_code ec;
+        std::filesystem::remove(tmp, ec);
+        throw;
+    }
+    return matches;
+}
+
+// All of `body`, which `read_request` limited to `MAX_MESSAGE_SIZE`.
+static std::string read_message(ByteStream& body) {
+    std::string contents;
+    char buf[16 * 1024];
+    while (auto n = body.read(buf, sizeof(buf)))
+        contents.append(buf, n);
+    return contents;
+}
+
+static Response handle(const std::filesystem::path& dir,
+                       const Request& request, ByteStream& body) {
+    if (request.method == "POST" && request.path == "/cas/exists") {
+        Response response;
+        std::istringstream in(read_message(body));
+        std::string digest;
+        std::error_code ec;
+        while (std::getline(in, digest)) {
+            utils::trim_in_place(digest);
+            if (!is_valid_name(digest))
+                continue;
+            // the client won't upload it again, it's as good as used
+            auto file = entry_path(dir, "cas", digest);
+            if (std::filesystem::is_regular_file(file, ec)) {
+                touch_cache_file(file);
+                response.body += digest + '\n';
+            }
+        }
+        return response;
+    }
+
+    // `/cas/<digest>` or `/ac/<key>`
+    std::string_view path(request.path);
+    std::string_view ns;
+    for (std::string_view prefix : {"cas", "ac"}) {
+        if (path.size() > prefix.size() + 2 && path[0] == '/' &&
+            path.substr(1, prefix.size()) == prefix &&
+            path[prefix.size() + 1] == '/')
+            ns = prefix;
+    }
+    if (ns.empty())
+        return {404, "not found\n"};
+    auto name = path.substr(ns.size() + 2);
+    if (!is_valid_name(name) || name.size() < 2)
+        return {400, "invalid name\n"};
+    auto file = entry_path(dir, ns, name);
+
+    if (request.method == "GET") {
+        std::ifstream in(file, std::ios::in | std::ios::binary);
+        if (!in)
+            return {404, "not found\n"};
+        touch_cache_file(file);
+        return {200, std::string((std::istreambuf_iterator<char>(in)),
+                                 std::istreambuf_iterator<char>())};
+    }
+    if (request.method == "PUT") {
+        // a blob stored under the wrong name would be served to every client
+        // asking for it
+        if (ns == "cas") {
+            if (!store_blob(file, name, body))
+                return {400, "body doesn't match its digest\n"};
+        } else {
+            utils::write_file_atomically(file, read_message(body));
+        }
+        return {201, ""};
+    }
+    return {405, "method not allowed\n"};
+}
+
+// Trims the storage directory after uploads, at most every `TRIM_INTERVAL`
+// and in one thread at a time.
+class Trimmer {
+public:
+    Trimmer(std::filesystem::path dir, std::optional<uintmax_t> max_size)
+        : m_dir(std::move(dir)), m_max_size(max_size) {}
+
+    void after_upload() {
+        if (!m_max_size)
+            return;
+        std::unique_lock lock(m_mutex, std::try_to_lock);
+        auto now = std::chrono::steady_clock::now();
+        if (!lock.owns_lock() || (m_last && now - *m_last < TRIM_INTERVAL))
+            return;
+        m_last = now;
+        trim_cache({m_dir / "cas", m_dir / "ac"}, *m_max_size);
+    }
+
+private:
+    std::filesystem::path m_dir;
+    std::optional<uintmax_t> m_max_size;
+    std::mutex m_mutex;
+    std::optional<std::chrono::steady_clock::time_point> m_last;
+};
+
+static void serve_connection(const std::filesystem::path& dir,
+                             Trimmer& trimmer, Socket sock) {
+    // don't let a stuck client hold a worker forever
+    sock.set_timeout(std::chrono::seconds(30));
+
+    if (auto request = read_request(sock)) {
+        BodyStream body(sock, *request);
+        Response response;
+        try {
+            response = handle(dir, *request, body);
+        } catch (const std::exception& err) {
+            warn("{} {}: {}", request->method, request->path, err.what());
+            response = {500, std::string(err.what()) + '\n'};
+        }
+        debug("{} {} -> {} ({} bytes)", request->method, request->path,
+              response.status, response.body.size());
+        send_response(sock, response);
+        if (response.status == 201)
+            trimmer.after_upload();
+    }
+}
+
+void serve_cache(const std::filesystem::path& dir, const std::string& host,
+                 uint16_t port, std::optional<uintmax_t> max_size) {
+    std::filesystem::create_directories(dir);
+    // IPv6 literals need brackets
+    auto address = host.find(':') == std::string::npos
+                       ? fmt::format("{}:{}", host, port)
+                       : fmt::format("[{}]:{}", host, port);
+    auto listener = Socket::listen_on(address);
+
+    info("serving the cache in `{}` on http://{}:{}", dir.string(), host,
+         port);
+    Trimmer trimmer(dir, max_size);
+    ThreadPool pool;
+    for (;;) {
+        auto sock = listener.accept();
+        if (!sock.valid())
+            continue;
+        // `std::function` needs a copyable job
+        auto shared = std::make_shared<Socket>(std::move(sock));
+        pool.submit([&dir, &trimmer, shared] {
+            serve_connection(dir, trimmer, std::move(*shared));
+        });
+    }
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+
+// Reference server for `RemoteCache`, storing everything in `dir`. Minimal
+// HTTP/1.1: one request per connection, no TLS (put it behind a reverse
+// proxy to expose it beyond a trusted network). With a `max_size`, the least
+// recently used entries are removed after uploads (see `trim_cache`). Blocks
+// forever, throws if it can't listen.
+void serve_cache(const std::filesystem::path& dir, const std::string& host,
+                 uint16_t port, std::optional<uintmax_t> max_size);
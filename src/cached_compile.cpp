@@ -0,0 +1,83 @@
+#include "cached_compile.hpp"
+#include "cache_limit.hpp"
+#include "generators/native/build_graph.hpp"
+#include "object_cache.hpp"
+#include "utils.hpp"
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+using namespace spdlog;
+
+// Escape a path for a Makefile-style depfile, as ninja reads them.
+static std::string escape_depfile_path(std::string_view path) {
+    std::string out;
+    for (char c : path) {
+        if (c == ' ' || c == '#' || c == '\\')
+            out += '\\';
+        else if (c == '$')
+            out += '$';
+        out += c;
+    }
+    return out;
+}
+
+int cached_compile(const std::vector<std::string>& command,
+                   const std::string& input, const std::string& output,
+                   const std::string& depfile) {
+    if (command.empty())
+        throw std::runtime_error("no command to run");
+
+    // many of these run at once and exit right away, uploads are left to
+    // the `qobs build` that runs ninja
+    ObjectCache cache(true);
+
+    // keyed like the native generator: on the command with the paths of this
+    // edge left out, and on the contents of the source
+    std::string key;
+    if (cache.enabled()) {
+        std::vector<std::string> args;
+        for (auto& arg : command) {
+            if (arg == input)
+                args.push_back("$in");
+            else if (arg == output)
+                args.push_back("$out");
+            else if (arg == depfile)
+                args.push_back("$depfile");
+            else
+                args.push_back(escape_arg(arg));
+        }
+        key = cache.key(args, command, {std::filesystem::absolute(input)});
+    }
+
+    if (!key.empty()) {
+        if (auto deps = cache.restore(key, output)) {
+            std::string contents = escape_depfile_path(output) + ":";
+            for (auto& dep : *deps)
+                contents += " \\\n  " + escape_depfile_path(dep);
+            utils::write_file_atomically(depfile, contents + '\n');
+            return 0;
+        }
+    }
+
+    auto [code, compiler_output] = utils::run_captured(command);
+    std::fwrite(compiler_output.data(), 1, compiler_output.size(), stdout);
+    std::fflush(stdout);
+    if (code != 0 || key.empty())
+        return code;
+
+    // not being able to cache something doesn't fail the build
+    try {
+        std::ifstream file(depfile);
+        std::string contents((std::istreambuf_iterator<char>(file)),
+                             std::istreambuf_iterator<char>());
+        std::vector<std::string> deps;
+        for (auto& dep : parse_depfile(contents))
+            deps.push_back(std::filesystem::absolute(dep).string());
+        cache.store(key, output, deps);
+    } catch (const std::exception& err) {
+        debug("couldn't cache `{}`: {}", output, err.what());
+    }
+    trim_local_cache();
+    return 0;
+}
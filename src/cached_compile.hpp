@@ -0,0 +1,14 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// `qobs cc`: run `command`, the compile command of a ninja `cc` edge, through
+// the `ObjectCache` like the native generator does. `input`, `output` and
+// `depfile` are the source, object and depfile as they appear in `command`
+// (which must be GCC-style and write the depfile). On a hit, the object and a
+// depfile listing the headers it was compiled with are written instead of
+// running the compiler, so ninja keeps tracking the headers. Returns the exit
+// code of the compiler.
+int cached_compile(const std::vector<std::string>& command,
+                   const std::string& input, const std::string& output,
+                   const std::string& depfile);
@@ -0,0 +1,289 @@
+#include "compile_farm.hpp"
+#include "socket.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <iterator>
+#include <thread>
+
+using namespace spdlog;
+
+// A worker that doesn't accept a connection this fast is treated as down.
+constexpr std::chrono::seconds CONNECT_TIMEOUT{2};
+constexpr std::chrono::seconds INFO_TIMEOUT{5};
+// Time to wait for a compile to finish. A compile that takes longer is
+// compiled locally instead.
+constexpr std::chrono::minutes COMPILE_TIMEOUT{10};
+
+std::string compiler_identity(const std::filesystem::path& compiler) {
+    auto [code, version] =
+        utils::run_captured({compiler.string(), "--version"});
+    if (code != 0)
+        return "";
+    version.resize(std::min(version.size(), version.find('\n')));
+    utils::trim_in_place(version);
+    auto [machine_code, machine] =
+        utils::run_captured({compiler.string(), "-dumpmachine"});
+    if (machine_code != 0 || version.empty())
+        return "";
+    utils::trim_in_place(machine);
+    return version + '\n' + machine;
+}
+
+// Whether `value` is made of plain words, e.g. `c++20`, `x86-64-v3` or
+// `address,undefined`, so that it can't name a file.
+static bool is_plain_value(std::string_view value, std::string_view extra) {
+    return !value.empty() &&
+           std::all_of(value.begin(), value.end(), [&](char c) {
+               return std::isalnum(static_cast<unsigned char>(c)) ||
+                      extra.find(c) != std::string_view::npos;
+           }) &&
+           value.find("..") == std::string_view::npos;
+}
+
+// Whether `arg` is `prefix` followed by one of `names`.
+template <size_t N>
+static bool is_one_of(std::string_view arg, std::string_view prefix,
+                      const std::string_view (&names)[N]) {
+    return arg.starts_with(prefix) &&
+           std::find(std::begin(names), std::end(names),
+                     arg.substr(prefix.size())) != std::end(names);
+}
+
+bool is_remote_safe_arg(std::string_view arg) {
+    constexpr std::string_view exact[] = {
+        "-O", "-O0", "-O1", "-O2", "-O3", "-Os", "-Oz", "-Ofast", "-Og", "-g",
+        "-g0", "-g1", "-g2", "-g3", "-ggdb", "-gdwarf", "-gdwarf-4",
+        "-gdwarf-5", "-gline-tables-only", "-w", "-pedantic",
+        "-pedantic-errors", "-ansi", "-pthread", "-m32", "-m64", "-mthumb",
+        "-marm", "-fcolor-diagnostics", "-fno-color-diagnostics"};
+    if (std::find(std::begin(exact), std::end(exact), arg) != std::end(exact))
+        return true;
+
+    // options with a plain value
+    constexpr std::string_view valued[] = {
+        "-std=", "--target=", "-march=", "-mtune=", "-mcpu=", "-mfpu=",
+        "-mfloat-abi=", "-mabi=", "-mcmodel=", "-fvisibility=", "-fsanitize=",
+        "-fno-sanitize=", "-flto=", "-ftemplate-depth=", "-fconstexpr-depth=",
+        "-fconstexpr-steps=", "-fmessage-length=", "-fdiagnostics-color=",
+        "-fcf-protection="};
+    for (auto prefix : valued)
+        if (arg.starts_with(prefix))
+            return is_plain_value(arg.substr(prefix.size()), "-_+.,");
+
+    // warnings, e.g. `-Wno-unused` or `-Wformat=2`. A comma would pass
+    // options on to other tools (`-Wl,`), no warning takes a path
+    if (arg.starts_with("-W"))
+        return is_plain_value(arg.substr(2), "-_+=");
+
+    // code generation, also as `-fno-<name>`
+    constexpr std::string_view codegen[] = {
+        "pic", "PIC", "pie", "PIE", "exceptions", "cxx-exceptions", "rtti",
+        "strict-aliasing", "strict-overflow", "omit-frame-pointer",
+        "stack-protector", "stack-protector-strong", "stack-protector-all",
+        "stack-clash-protection", "inline", "inline-functions", "unroll-loops",
+        "fast-math", "finite-math-only", "math-errno", "lto", "common",
+        "visibility-inlines-hidden", "signed-char", "unsigned-char",
+        "short-enums", "data-sections", "function-sections", "wrapv", "trapv",
+        "char8_t", "coroutines", "permissive", "ms-extensions", "openmp",
+        "threadsafe-statics", "asynchronous-unwind-tables", "unwind-tables",
+        "builtin", "plt", "semantic-interposition",
+        "delete-null-pointer-checks", "diagnostics-show-option", "show-column",
+        "elide-constructors", "access-control", "operator-names",
+        "gnu89-inline", "asm", "gnu-keywords", "implicit-templates",
+        "strict-enums", "zero-initialized-in-bss", "merge-constants",
+        "tree-vectorize", "vectorize", "slp-vectorize", "split-stack",
+        "non-call-exceptions"};
+    // instruction set extensions, also as `-mno-<name>`
+    constexpr std::string_view extensions[] = {
+        "sse", "sse2", "sse3", "ssse3", "sse4", "sse4.1", "sse4.2", "avx",
+        "avx2", "avx512f", "fma", "bmi", "bmi2", "popcnt", "aes", "pclmul",
+        "lzcnt", "f16c", "red-zone"};
+    return is_one_of(arg, "-f", codegen) || is_one_of(arg, "-fno-", codegen) ||
+           is_one_of(arg, "-m", extensions) ||
+           is_one_of(arg, "-mno-", extensions);
+}
+
+// Send `request` to `address` and return the fields of an `ok` response.
+// Throws if the worker can't be talked to or responds with an error.
+static std::vector<std::string>
+request(const std::string& address,
+        const std::vector<std::string_view>& request,
+        std::chrono::milliseconds timeout) {
+    auto sock = Socket::connect_to(address, CONNECT_TIMEOUT);
+    sock.set_timeout(timeout);
+    if (!sock.send_message(request))
+        throw std::runtime_error("connection lost while sending");
+    auto response = sock.recv_message(MAX_WORKER_MESSAGE_SIZE);
+    if (!response || response->empty())
+        throw std::runtime_error("connection lost while receiving");
+    if (response->front() == "error" && response->size() == 2)
+        throw std::runtime_error(response->at(1));
+    if (response->front() != "ok")
+        throw std::runtime_error("invalid response");
+    response->erase(response->begin());
+    return std::move(*response);
+}
+
+static std::optional<int> parse_int(std::string_view text) {
+    int value = 0;
+    auto [end, ec] =
+        std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec != std::errc() || end != text.data() + text.size())
+        return std::nullopt;
+    return value;
+}
+
+std::shared_ptr<CompileFarm>
+CompileFarm::from_env(const std::vector<std::string>& compilers) {
+    auto value = std::getenv("QOBS_WORKERS");
+    if (!value || !*value)
+        return nullptr;
+
+    std::vector<std::string> addresses;
+    std::string_view list(value);
+    while (!list.empty()) {
+        auto comma = list.find(',');
+        std::string address(list.substr(0, comma));
+        utils::trim_in_place(address);
+        if (!address.empty())
+            addresses.push_back(std::move(address));
+        list.remove_prefix(comma == std::string_view::npos ? list.size()
+                                                           : comma + 1);
+    }
+
+    auto farm = std::make_shared<CompileFarm>(addresses, compilers);
+    if (!farm->capacity()) {
+        warn("none of the workers in QOBS_WORKERS are available, compiling "
+             "locally");
+        return nullptr;
+    }
+    return farm;
+}
+
+CompileFarm::CompileFarm(const std::vector<std::string>& addresses,
+                         const std::vector<std::string>& compilers) {
+    // a compiler that can't tell what it is never leaves this machine
+    std::vector<std::string> identities;
+    for (auto& compiler : compilers) {
+        identities.push_back(compiler_identity(compiler));
+        if (identities.back().empty())
+            debug("`{}` can't be identified, compiling it locally", compiler);
+    }
+
+    m_workers.resize(addresses.size());
+    // a worker that's down costs the connect timeout, don't pay it once per
+    // worker
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < addresses.size(); ++i) {
+        m_workers[i].address = addresses[i];
+        threads.emplace_back([&, i] {
+            auto& worker = m_workers[i];
+            try {
+                std::vector<std::string_view> fields{WORKER_PROTOCOL, "info"};
+                fields.insert(fields.end(), compilers.begin(),
+                              compilers.end());
+                auto response = request(worker.address, fields, INFO_TIMEOUT);
+                auto jobs = response.size() == compilers.size() + 1
+                                ? parse_int(response.front())
+                                : std::nullopt;
+                if (!jobs || *jobs <= 0)
+                    throw std::runtime_error("invalid response");
+                worker.jobs = static_cast<size_t>(*jobs);
+
+                for (size_t j = 0; j < compilers.size(); ++j) {
+                    if (identities[j].empty())
+                        continue;
+                    if (response[j + 1] == identities[j]) {
+                        worker.compilers.push_back(compilers[j]);
+                        continue;
+                    }
+                    warn("worker `{}` doesn't have the same `{}`, compiling "
+                         "with it locally",
+                         worker.address, compilers[j]);
+                }
+            } catch (const std::exception& err) {
+                warn("worker `{}` is unavailable: {}", worker.address,
+                     err.what());
+                worker.down = true;
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    for (auto& worker : m_workers) {
+        if (worker.down || worker.compilers.empty())
+            continue;
+        debug("worker `{}` runs {} job(s) with {}", worker.address,
+              worker.jobs, fmt::join(worker.compilers, ", "));
+        m_capacity += worker.jobs;
+    }
+}
+
+std::optional<CompileFarm::Lease>
+CompileFarm::acquire(std::string_view compiler) {
+    std::lock_guard lock(m_mutex);
+    std::optional<size_t> best;
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        auto& worker = m_workers[i];
+        if (worker.down || worker.running >= worker.jobs ||
+            std::find(worker.compilers.begin(), worker.compilers.end(),
+                      compiler) == worker.compilers.end())
+            continue;
+        // least loaded relative to its capacity: running / jobs, compared
+        // without dividing
+        if (!best || worker.running * m_workers[*best].jobs <
+                         m_workers[*best].running * worker.jobs)
+            best = i;
+    }
+    if (!best)
+        return std::nullopt;
+    ++m_workers[*best].running;
+    return Lease(*this, *best);
+}
+
+void CompileFarm::mark_down(size_t worker, std::string_view reason) {
+    std::lock_guard lock(m_mutex);
+    if (m_workers[worker].down)
+        return;
+    m_workers[worker].down = true;
+    warn("worker `{}` failed, not using it anymore: {}",
+         m_workers[worker].address, reason);
+}
+
+CompileFarm::Lease::~Lease() {
+    if (!m_farm)
+        return;
+    std::lock_guard lock(m_farm->m_mutex);
+    --m_farm->m_workers[m_worker].running;
+}
+
+CompileFarm::Lease::Lease(Lease&& other) noexcept
+    : m_farm(std::exchange(other.m_farm, nullptr)), m_worker(other.m_worker) {}
+
+const std::string& CompileFarm::Lease::address() const {
+    // never changes after construction
+    return m_farm->m_workers[m_worker].address;
+}
+
+std::optional<CompileFarm::Result>
+CompileFarm::Lease::compile(std::string_view compiler,
+                            std::string_view language, std::string_view source,
+                            const std::vector<std::string>& args) {
+    std::vector<std::string_view> fields{WORKER_PROTOCOL, "compile", compiler,
+                                         language, source};
+    fields.insert(fields.end(), args.begin(), args.end());
+    try {
+        auto response = request(address(), fields, COMPILE_TIMEOUT);
+        auto code = response.size() == 3 ? parse_int(response[0])
+                                         : std::nullopt;
+        if (!code)
+            throw std::runtime_error("invalid response");
+        return Result{*code, std::move(response[1]), std::move(response[2])};
+    } catch (const std::exception& err) {
+        m_farm->mark_down(m_worker, err.what());
+        return std::nullopt;
+    }
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Version of the protocol between `CompileFarm` and `qobs worker`, the first
+// field of every request. Workers refuse requests of other versions.
+constexpr std::string_view WORKER_PROTOCOL = "qobs-worker 2";
+
+// Messages bigger than this are refused, they carry preprocessed sources and
+// objects.
+constexpr size_t MAX_WORKER_MESSAGE_SIZE = size_t(1) << 30;
+
+// What `compiler` is: the first line of its `--version` and its
+// `-dumpmachine`. An object compiled elsewhere is only as good as a local one
+// if this is the same on both machines. Empty if the compiler doesn't run.
+std::string compiler_identity(const std::filesystem::path& compiler);
+
+// Whether `arg` may be passed to the compiler of a worker. Only a fixed list of
+// options that affect code generation and diagnostics without naming a file
+// is: `-O*`, `-g*`, `-std=`, `-W<warning>` (without a comma, which would pass
+// options on to other tools), known `-f`/`-m` options and those taking a
+// plain value (e.g. `-march=`). Anything else (e.g. `-fplugin=`, `-B` or
+// `@file`) is refused.
+bool is_remote_safe_arg(std::string_view arg);
+
+// Compiles preprocessed sources on `qobs worker` daemons, set with
+// `QOBS_WORKERS=<address>,<address>,...` (`host:port` or `unix:<path>`). The
+// protocol is a single request per connection, every message a list of byte
+// strings (see `Socket::send_message`):
+//
+// - `[version, "info", compilers...]`: responds with
+//   `["ok", <jobs>, identities...]`, the number of compiles the worker runs at
+//   once and the `compiler_identity` of each compiler (looked up by name),
+//   empty for those it doesn't have.
+// - `[version, "compile", compiler, language, source, args...]`: compiles
+//   `source` (preprocessed `c` or `c++`) with `args`, responds with
+//   `["ok", <exit code>, output, object]`. Refused if an argument isn't
+//   `is_remote_safe_arg`.
+//
+// Any request can also be answered with `["error", message]`.
+//
+// A worker only gets jobs for the compilers that have the same identity there
+// as locally, so its objects can be cached like local ones. Jobs go to the
+// worker with the lowest share of its capacity in use. A worker that can't be
+// reached is left out for the rest of the build, the caller compiles locally
+// instead. Thread-safe.
+class CompileFarm {
+public:
+    struct Result {
+        int code;
+        std::string output;
+        std::string object;
+    };
+
+    // A reserved compile slot on a worker, released when destroyed.
+    class Lease {
+    public:
+        Lease(CompileFarm& farm, size_t worker)
+            : m_farm(&farm), m_worker(worker) {}
+        ~Lease();
+
+        Lease(Lease&& other) noexcept;
+        Lease& operator=(Lease&&) = delete;
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        // Address of the worker.
+        const std::string& address() const;
+
+        // Nothing if the worker couldn't be talked to.
+        std::optional<Result> compile(std::string_view compiler,
+                                      std::string_view language,
+                                      std::string_view source,
+                                      const std::vector<std::string>& args);
+
+    private:
+        CompileFarm* m_farm;
+        size_t m_worker;
+    };
+
+    // Nothing if `QOBS_WORKERS` isn't set or none of its workers respond.
+    // `compilers` are those the build will compile with.
+    static std::shared_ptr<CompileFarm>
+    from_env(const std::vector<std::string>& compilers);
+
+    // Asks every worker for its capacity and which of `compilers` it has
+    // the same as this machine, leaving out those that don't respond.
+    CompileFarm(const std::vector<std::string>& addresses,
+                const std::vector<std::string>& compilers);
+
+    // Compiles that can run at once on all workers.
+    inline size_t capacity() const {
+        return m_capacity;
+    }
+
+    // A slot on a worker that has `compiler`. Nothing if every such worker
+    // is busy or down, or there is none.
+    std::optional<Lease> acquire(std::string_view compiler);
+
+private:
+    struct Worker {
+        std::string address;
+        size_t jobs{0};
+        size_t running{0};
+        bool down{false};
+        // The compilers it has the same as this machine.
+        std::vector<std::string> compilers;
+    };
+
+    // Leave a worker out from now on, warning once.
+    void mark_down(size_t worker, std::string_view reason);
+
+    std::mutex m_mutex;
+    std::vector<Worker> m_workers;
+    size_t m_capacity{0};
+};
@@ -0,0 +1,240 @@
+#include "daemon.hpp"
+#include "hash.hpp"
+#include "loaded_package.hpp"
+#include "socket.hpp"
+#include "utils.hpp"
+#include <charconv>
+
+#ifdef __linux__
+#include <csignal>
+#include <unistd.h>
+#endif
+
+using namespace spdlog;
+
+constexpr std::string_view DAEMON_PROTOCOL = "qobs-daemon 1";
+
+// Requests are a handful of paths and environment variables.
+constexpr size_t MAX_DAEMON_MESSAGE_SIZE = 1024 * 1024;
+
+// A build only goes through the daemon if these are the same for the caller,
+// since they change what's built or how.
+constexpr const char* DAEMON_ENVIRONMENT[] = {
+    "CC",
+    "CXX",
+    "AR",
+    "PATH",
+    "QOBS_CACHE_DIR",
+    "QOBS_NO_OBJECT_CACHE",
+    "QOBS_REMOTE_CACHE",
+    "QOBS_WORKERS",
+};
+
+// `unix:<path>` of the daemon for a package and build directory. In the cache
+// directory rather than the build directory, Unix socket paths are short.
+static std::string socket_address(const PackageOptions& options) {
+    auto build_dir = options.package_root / options.build_dir;
+    auto name =
+        Sha256::hex(build_dir.lexically_normal().string()).substr(0, 16);
+    auto path = utils::cache_dir() / "daemon" / (name + ".sock");
+    return "unix:" + path.string();
+}
+
+// Fields of a build request after the version and the command.
+static std::vector<std::string> request_fields(const PackageOptions& options,
+                                               bool invoke) {
+    std::vector<std::string> fields{
+        options.package_root.string(),
+        options.build_dir,
+        options.compiler.value_or(""),
+        options.generator.value_or(""),
+        invoke ? "1" : "0",
+        std::to_string(static_cast<int>(get_level())),
+    };
+    for (auto name : DAEMON_ENVIRONMENT) {
+        auto value = std::getenv(name);
+        fields.push_back(value ? value : "");
+    }
+    return fields;
+}
+
+#ifdef __linux__
+
+class Daemon {
+public:
+    Daemon(PackageOptions options,
+           std::function<std::shared_ptr<Generator>()> make_generator)
+        : m_environment(request_fields(options, true)),
+          m_package(std::move(options), std::move(make_generator)) {}
+
+    // Respond to a request on `sock`.
+    void serve(Socket sock);
+
+private:
+    // Request fields (other than `invoke` and the log level) that can be
+    // served.
+    std::vector<std::string> m_environment;
+    LoadedPackage m_package;
+};
+
+// Indices of request fields that don't have to match `m_environment`.
+constexpr size_t INVOKE_FIELD = 4;
+constexpr size_t LEVEL_FIELD = 5;
+
+// The log level of a request, nothing if it isn't one.
+static std::optional<level::level_enum> parse_level(std::string_view text) {
+    int value = 0;
+    auto [end, ec] =
+        std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec != std::errc() || end != text.data() + text.size() ||
+        value < level::trace || value > level::off)
+        return std::nullopt;
+    return static_cast<level::level_enum>(value);
+}
+
+void Daemon::serve(Socket sock) {
+    auto request = sock.recv_message(MAX_DAEMON_MESSAGE_SIZE);
+    if (!request)
+        return;
+    if (request->size() != m_environment.size() + 2 ||
+        request->at(0) != DAEMON_PROTOCOL || request->at(1) != "build") {
+        sock.send_message({"error", "invalid request"});
+        return;
+    }
+    request->erase(request->begin(), request->begin() + 2);
+    for (size_t i = 0; i < m_environment.size(); ++i) {
+        if (i != INVOKE_FIELD && i != LEVEL_FIELD &&
+            request->at(i) != m_environment[i]) {
+            debug("not serving a build with different options or environment");
+            sock.send_message({"mismatch"});
+            return;
+        }
+    }
+    auto& invoke = request->at(INVOKE_FIELD);
+    auto level = parse_level(request->at(LEVEL_FIELD));
+    if ((invoke != "0" && invoke != "1") || !level) {
+        sock.send_message({"error", "invalid request"});
+        return;
+    }
+
+    // output goes to the caller's stdout and stderr, build tools inherit them
+    sock.send_message({"ok"});
+    auto fds = sock.recv_fds(2);
+    if (!fds)
+        return;
+    std::fflush(stdout);
+    std::fflush(stderr);
+    int saved_stdout = dup(STDOUT_FILENO), saved_stderr = dup(STDERR_FILENO);
+    dup2(fds->at(0), STDOUT_FILENO);
+    dup2(fds->at(1), STDERR_FILENO);
+    close(fds->at(0));
+    close(fds->at(1));
+    auto saved_level = get_level();
+    set_level(*level);
+
+    std::vector<std::string> response;
+    try {
+        auto output = m_package.build(invoke == "1");
+        response = {"done", "1", output.string()};
+    } catch (const std::exception& err) {
+        error("failed to build package: {}", err.what());
+        response = {"done", "0", ""};
+    }
+
+    std::fflush(stdout);
+    std::fflush(stderr);
+    set_level(saved_level);
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stdout);
+    close(saved_stderr);
+    sock.send_message({response.begin(), response.end()});
+}
+
+void serve_daemon(const PackageOptions& options,
+                  std::function<std::shared_ptr<Generator>()> make_generator) {
+    auto address = socket_address(options);
+    bool running = false;
+    try {
+        Socket::connect_to(address, std::chrono::seconds(1));
+        running = true;
+    } catch (const std::exception&) {
+    }
+    if (running)
+        throw std::runtime_error(fmt::format(
+            "a daemon is already running for `{}`",
+            (options.package_root / options.build_dir).string()));
+
+    std::filesystem::create_directories(utils::cache_dir() / "daemon");
+    auto listener = Socket::listen_on(address);
+    // a caller going away mid-build must not take the daemon with it
+    std::signal(SIGPIPE, SIG_IGN);
+    // builds are served one at a time, a build tool regenerating its build
+    // files (`qobs build --generate-only`) must not wait for the daemon
+    setenv("QOBS_NO_DAEMON", "1", 1);
+
+    Daemon daemon(options, std::move(make_generator));
+    info("serving builds of `{}` on `{}`",
+         (options.package_root / options.build_dir).string(), address);
+    // one build at a time, like a build tool would
+    for (;;) {
+        auto sock = listener.accept();
+        if (!sock.valid())
+            continue;
+        // a bad request must not take the daemon down
+        try {
+            daemon.serve(std::move(sock));
+        } catch (const std::exception& err) {
+            warn("couldn't serve a request: {}", err.what());
+        }
+    }
+}
+
+std::optional<DaemonBuild> build_with_daemon(const PackageOptions& options,
+                                             bool invoke) {
+    if (auto value = std::getenv("QOBS_NO_DAEMON"); value && *value)
+        return std::nullopt;
+    Socket sock;
+    try {
+        sock = Socket::connect_to(socket_address(options),
+                                  std::chrono::seconds(1));
+    } catch (const std::exception&) {
+        return std::nullopt; // not running, or a stale socket
+    }
+
+    std::vector<std::string> fields{std::string(DAEMON_PROTOCOL), "build"};
+    auto rest = request_fields(options, invoke);
+    fields.insert(fields.end(), rest.begin(), rest.end());
+    if (!sock.send_message({fields.begin(), fields.end()}))
+        return std::nullopt;
+    auto response = sock.recv_message(MAX_DAEMON_MESSAGE_SIZE);
+    if (!response || response->empty() || response->front() != "ok") {
+        debug("not building through the daemon");
+        return std::nullopt;
+    }
+
+    debug("building through the daemon");
+    std::fflush(stdout);
+    std::fflush(stderr);
+    if (!sock.send_fds({STDOUT_FILENO, STDERR_FILENO}))
+        return std::nullopt;
+    // the build runs from here, it can take a while
+    response = sock.recv_message(MAX_DAEMON_MESSAGE_SIZE);
+    if (!response || response->size() != 3 || response->front() != "done")
+        throw std::runtime_error("lost the connection to the daemon");
+    return DaemonBuild{.ok = response->at(1) == "1",
+                       .output = response->at(2)};
+}
+
+#else
+
+void serve_daemon(const PackageOptions&,
+                  std::function<std::shared_ptr<Generator>()>) {
+    throw std::runtime_error("the daemon is only supported on Linux");
+}
+
+std::optional<DaemonBuild> build_with_daemon(const PackageOptions&, bool) {
+    return std::nullopt;
+}
+
+#endif
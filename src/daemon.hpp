@@ -0,0 +1,27 @@
+#pragma once
+#include "loaded_package.hpp"
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+
+struct DaemonBuild {
+    bool ok;
+    // The built executable/library.
+    std::filesystem::path output;
+};
+
+// `qobs daemon`: keeps a package loaded (see `LoadedPackage`). Builds of the
+// same package and build directory are handed to it over a Unix socket in the
+// per-user cache directory, along with the caller's stdout and stderr, so
+// output goes where it would have gone anyway. `make_generator` creates the
+// generator. Linux only. Blocks forever, throws if it can't start.
+void serve_daemon(const PackageOptions& options,
+                  std::function<std::shared_ptr<Generator>()> make_generator);
+
+// Build through the daemon serving `options`, if there is one running with the
+// same environment and `QOBS_NO_DAEMON` isn't set. Nothing if the build has to
+// be done in this process.
+std::optional<DaemonBuild> build_with_daemon(const PackageOptions& options,
+                                             bool invoke);
@@ -1,15 +1,17 @@
 #include "dependency.hpp"
+#include "archive.hpp"
+#include "git_cache.hpp"
 #include "utils.hpp"
-#include <deque>
+#include <algorithm>
+#include <cctype>
 #include <filesystem>
 #include <fmt/core.h>
-#include <git2.h>
-#include <indicators/dynamic_progress.hpp>
-#include <indicators/progress_bar.hpp>
+#include <fstream>
 #include <map>
+#include <optional>
+#include <sstream>
 
 using namespace spdlog;
-using namespace indicators;
 
 static const std::map<std::string, std::string> SHORTCUTS{
     {"gh:", "https://github.com/"},    {"gl:", "https://gitlab.com/"},
@@ -100,146 +102,348 @@ Dependency::Dependency(std::string name, toml::table dep,
             m_value = p.string();
             m_expanded = m_value;
             m_type = DependencyType::path;
+        } else if (key == "url") {
+            if (!v.is_string())
+                throw std::runtime_error(
+                    fmt::format("`url` is of type `{}`, expected `string`",
+                                utils::toml_type_to_str(v.type())));
+
+            m_value = v.as_string()->get();
+            m_expanded = m_value;
+            while (!m_expanded.empty() && m_expanded.back() == '/')
+                m_expanded.pop_back();
+            m_type = DependencyType::url;
+        } else if (key == "sha256") {
+            if (!v.is_string())
+                throw std::runtime_error(
+                    fmt::format("`sha256` is of type `{}`, expected `string`",
+                                utils::toml_type_to_str(v.type())));
+
+            m_sha256 = v.as_string()->get();
+            if (m_sha256.size() != 64 ||
+                m_sha256.find_first_not_of("0123456789abcdefABCDEF") !=
+                    std::string::npos)
+                throw std::runtime_error(fmt::format(
+                    "`sha256` must be 64 hex characters, got `{}`", m_sha256));
+            std::transform(m_sha256.begin(), m_sha256.end(), m_sha256.begin(),
+                           [](unsigned char c) { return std::tolower(c); });
         } else {
             throw std::runtime_error(fmt::format("unrecognized key `{}`", key));
         }
     }
+
+    if (dep.contains("path") && dep.contains("url"))
+        throw std::runtime_error("`path` and `url` can't be used together");
+    if (m_expanded.empty())
+        throw std::runtime_error("either `path` or `url` is required");
+    if (!m_sha256.empty() && m_type != DependencyType::url)
+        throw std::runtime_error("`sha256` only applies to `url` dependencies");
 }
 
-// Kinda like DynamicProgress from the `indicators` library, but doesn't hog
-// performance when running in Windows cmd. Handles sequencing of multiple
-// progressbars, update granularity and forces Windows to process ANSI escape
-// codes.
-class SequentialProgress {
-public:
-    SequentialProgress() {}
-
-    // Sequence a progressbar. It will only start once all progressbars before
-    // it have completed, and after that `update_progress` will update this
-    // sequenced progressbar.
-    void add_bar(std::unique_ptr<ProgressBar> bar) {
-#ifdef QOBS_IS_WINDOWS
-        // see https://github.com/p-ranav/indicators/issues/131
-        utils::ensure_virtual_terminal_processing();
-#endif
-        m_bars.push_back(std::move(bar));
+std::string Dependency::revspec(VersionType type, const std::string& version) {
+    switch (type) {
+    case VersionType::none:
+        return "refs/qobs/HEAD";
+    case VersionType::commit_hash:
+        return version;
+    case VersionType::tag:
+        return "refs/tags/" + version;
     }
+    return "refs/qobs/HEAD"; // unreachable
+}
 
-    // Update progress of the current progressbar in the sequence. Does nothing
-    // if the sequence is empty/becomes empty.
-    void update_progress(double progress) {
-        if (m_bars.empty())
-            return;
-        auto bar = m_bars[0].get();
-        if (bar->is_completed() && progress != 1.L) {
-            m_bars.pop_front();
-            if (m_bars.empty())
-                return;
-            bar = m_bars[0].get();
-        }
+// Whether `version` is a full (not abbreviated) SHA-1 commit hash.
+static bool is_full_commit_hash(std::string_view version) {
+    return version.size() == GIT_OID_SHA1_HEXSIZE &&
+           version.find_first_not_of("0123456789abcdefABCDEF") ==
+               std::string_view::npos;
+}
 
-        auto progress_i = static_cast<size_t>(progress * 100.L);
-        if (bar->current() != progress_i)
-            bar->set_progress(progress_i);
+git_oid Dependency::fetch_version(GitMirror& mirror, VersionType type,
+                                  const std::string& version,
+                                  MultiProgress::Bar& bar) {
+    // everything the remote has, with full history. This is the fallback for
+    // when the server refuses narrower fetches
+    const std::vector<std::string> ALL_REFS = {"+refs/heads/*:refs/heads/*",
+                                               "+refs/tags/*:refs/tags/*"};
+
+    // only fetch the one requested ref, at depth 1
+    std::vector<std::string> refspecs;
+    switch (type) {
+    case VersionType::none:
+        refspecs = {"+HEAD:refs/qobs/HEAD"};
+        break;
+    case VersionType::tag:
+        refspecs = {fmt::format("+refs/tags/{0}:refs/tags/{0}", version)};
+        break;
+    case VersionType::commit_hash:
+        // servers can't be asked for an abbreviated hash
+        if (is_full_commit_hash(version))
+            refspecs = {fmt::format("+{0}:refs/qobs/{0}", version)};
+        break;
     }
 
-private:
-    std::deque<std::unique_ptr<ProgressBar>> m_bars{};
-};
+    if (!refspecs.empty()) {
+        try {
+            mirror.fetch(refspecs, 1, bar);
+            if (auto commit = mirror.try_resolve(revspec(type, version)))
+                return *commit;
+        } catch (const std::exception& err) {
+            debug("{}: shallow fetch failed, fetching full history: {}",
+                  m_name, err.what());
+        }
+    }
+
+    if (type == VersionType::none)
+        mirror.fetch(refspecs, 0, bar);
+    else
+        mirror.fetch(ALL_REFS, 0, bar);
+    return mirror.resolve(revspec(type, version));
+}
 
-static int sideband_progress(const char* str, int len, void* payload) {
-    (void)payload; // unused
-    printf("  remote: %.*s", len, str);
-    std::flush(std::cout);
-    return 0;
+// Written into `<checkout>/.git/` after a successful checkout, records what the
+// checkout was made from: `<commit> <tree> <digest> <url> <revspec>`
+static const char* CHECKOUT_STAMP = "qobs-checkout";
+
+// Read the first line of a (small) text file, empty if it can't be read.
+static std::string read_first_line(const std::filesystem::path& path) {
+    std::ifstream file(path);
+    std::string line;
+    if (file)
+        std::getline(file, line);
+    utils::trim_in_place(line);
+    return line;
 }
 
-static int fetch_progress(const git_indexer_progress* stats, void* payload) {
-    auto sp = static_cast<SequentialProgress*>(payload);
-    auto progress = static_cast<double>(stats->received_objects) /
-                    static_cast<double>(stats->total_objects);
-    sp->update_progress(progress);
-    return 0;
+bool Dependency::is_checkout_current(const std::filesystem::path& dep_path,
+                                     const LockedDependency* locked,
+                                     bool update) {
+    // a detached HEAD is just the commit id: no need to open the repository
+    auto head = read_first_line(dep_path / ".git" / "HEAD");
+    if (head.size() != GIT_OID_SHA1_HEXSIZE)
+        return false;
+
+    std::istringstream stamp(read_first_line(dep_path / ".git" /
+                                             CHECKOUT_STAMP));
+    std::string commit, tree, digest, url, spec;
+    if (!(stamp >> commit >> tree >> digest >> url >> spec))
+        return false;
+    if (commit != head || url != m_expanded || spec != revspec())
+        return false;
+
+    if (locked) {
+        // the lockfile decides which commit we want
+        if (head != locked->commit)
+            return false;
+    } else if (m_version_type == VersionType::commit_hash) {
+        if (!head.starts_with(m_version))
+            return false;
+    } else if (update) {
+        // tags and unversioned dependencies must be re-resolved on update.
+        // Otherwise, they are only re-resolved when the checkout is missing
+        return false;
+    }
+
+    m_commit = std::move(commit);
+    m_tree = std::move(tree);
+    m_digest = std::move(digest);
+    return true;
 }
 
-void checkout_progress(const char* path, size_t cur, size_t tot,
-                       void* payload) {
-    auto sp = static_cast<SequentialProgress*>(payload);
-    auto progress = static_cast<double>(cur) / static_cast<double>(tot);
+void Dependency::clone_git_repo(const std::filesystem::path& dep_path,
+                                MultiProgress::Bar& bar,
+                                const LockedDependency* locked, bool update) {
+    // no-op fast path: a couple of small file reads, no libgit2 or network
+    if (is_checkout_current(dep_path, locked, update)) {
+        debug("{}: checkout is up to date", m_name);
+        bar.finish("up to date");
+        return;
+    }
 
-    // technically this should only run after `fetch_progress` is done, so this
-    // will update the second progressbar
-    sp->update_progress(progress);
+    // a locked dependency is just a pinned commit
+    auto type = locked ? VersionType::commit_hash : m_version_type;
+    auto version = locked ? locked->commit : m_version;
+
+    // commits and tags don't move, so if the mirror already has them we can
+    // skip the fetch. Otherwise update the shared mirror (only missing
+    // objects are transferred), then check out the requested version from it
+    GitMirror mirror(m_expanded);
+    std::optional<git_oid> commit;
+    if (type == VersionType::commit_hash ||
+        (type == VersionType::tag && !update))
+        commit = mirror.try_resolve(revspec(type, version));
+    if (!commit)
+        commit = fetch_version(mirror, type, version, bar);
+    std::string commit_str = git_oid_tostr_s(&*commit);
+    debug("{}: resolved `{}` to {}", m_name, revspec(type, version),
+          commit_str);
+
+    auto [tree, digest] = mirror.tree_digest(*commit);
+    if (locked && !locked->tree.empty() && locked->tree != tree)
+        throw std::runtime_error(fmt::format(
+            "commit {} has tree {}, but {} expects {}. Run `qobs update` if "
+            "this is intended",
+            commit_str, tree, LOCKFILE_NAME, locked->tree));
+
+    // an existing checkout is moved forward in place. Drop the stamp first so
+    // that an interrupted checkout is never considered up to date
+    auto stamp_path = dep_path / ".git" / CHECKOUT_STAMP;
+    std::filesystem::remove(stamp_path);
+    mirror.checkout(dep_path, *commit, bar);
+
+    std::ofstream stamp(stamp_path, std::ios::out | std::ios::trunc);
+    stamp << fmt::format("{} {} {} {} {}", commit_str, tree, digest,
+                         m_expanded, revspec())
+          << '\n';
+    stamp.close();
+
+    m_commit = std::move(commit_str);
+    m_tree = std::move(tree);
+    m_digest = std::move(digest);
+    bar.finish("checked out");
 }
 
-void Dependency::clone_git_repo(const std::filesystem::path& dep_path) {
-    // setup progressbars
-    auto fetch_bar = std::make_unique<ProgressBar>(
-        option::BarWidth{50}, option::PrefixText{"  fetching "},
-        option::ForegroundColor{Color::green}, option::ShowElapsedTime{true},
-        option::ShowRemainingTime{true},
-        option::FontStyles{std::vector<FontStyle>{FontStyle::bold}});
-    auto checkout_bar = std::make_unique<ProgressBar>(
-        option::BarWidth{50}, option::PrefixText{"  checkout "},
-        option::ForegroundColor{Color::yellow}, option::ShowElapsedTime{true},
-        option::ShowRemainingTime{true},
-        option::FontStyles{std::vector<FontStyle>{FontStyle::bold}});
-
-    // sequence 2 progressbars:
-    SequentialProgress sp;
-    sp.add_bar(std::move(fetch_bar));
-    sp.add_bar(std::move(checkout_bar));
-
-    git_repository* cloned_repo = nullptr;
-    git_clone_options clone_opts = GIT_CLONE_OPTIONS_INIT;
-    git_checkout_options checkout_opts = GIT_CHECKOUT_OPTIONS_INIT;
-
-    auto url = m_expanded.c_str();
-    auto path_str = dep_path.string();
-
-    // set up options
-    checkout_opts.checkout_strategy = GIT_CHECKOUT_SAFE;
-    checkout_opts.progress_cb = checkout_progress;
-    checkout_opts.progress_payload = &sp;
-    clone_opts.checkout_opts = checkout_opts;
-    clone_opts.fetch_opts.callbacks.sideband_progress = sideband_progress;
-    clone_opts.fetch_opts.callbacks.transfer_progress = &fetch_progress;
-    // TODO: clone_opts.fetch_opts.callbacks.credentials = cred_acquire_cb;
-    clone_opts.fetch_opts.callbacks.payload = &sp;
-
-    // do the clone
-    utils::git_init_once(); // make sure libgit2 is initialized
-    info("cloning {}", m_expanded);
-    int error = git_clone(&cloned_repo, url, path_str.c_str(), &clone_opts);
-    if (error != 0) {
-        const git_error* err = git_error_last();
-        if (err)
-            throw std::runtime_error(
-                fmt::format("error {}: {}", err->klass, err->message));
-        else
-            throw std::runtime_error(
-                fmt::format("error {}: no detailed info", error));
-    } else if (cloned_repo)
-        git_repository_free(cloned_repo);
+// Written next to an extracted url dependency (`<name>-src.stamp`), records
+// what it was extracted from: `<digest> <url>`
+static std::filesystem::path
+url_stamp_path(const std::filesystem::path& dep_path) {
+    auto path = dep_path;
+    path += ".stamp";
+    return path;
 }
 
-void Dependency::fetch_url(const std::filesystem::path& download_path) {
-    assert(false && "unimplemented");
+// If `dir` only contains a single directory (`pkg-1.0/` in most source
+// tarballs), return it, so that its contents become the dependency root.
+static std::filesystem::path
+strip_top_level_dir(const std::filesystem::path& dir) {
+    std::filesystem::path only;
+    for (auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (!only.empty() || !entry.is_directory())
+            return dir;
+        only = entry.path();
+    }
+    return only.empty() ? dir : only;
+}
+
+void Dependency::fetch_url(const std::filesystem::path& dep_path,
+                           MultiProgress::Bar& bar,
+                           const LockedDependency* locked, bool update) {
+    // the manifest hash always wins, the lockfile pins whatever was
+    // downloaded the first time
+    std::string expected;
+    if (!m_sha256.empty())
+        expected = "sha256:" + m_sha256;
+    else if (locked && !update)
+        expected = locked->digest;
+
+    // no-op fast path: the same archive was already extracted
+    auto stamp_path = url_stamp_path(dep_path);
+    {
+        std::istringstream stamp(read_first_line(stamp_path));
+        std::string digest, url;
+        if (stamp >> digest >> url && url == m_expanded &&
+            (expected.empty() ? !update : digest == expected) &&
+            std::filesystem::is_directory(dep_path)) {
+            debug("{}: archive is up to date", m_name);
+            m_digest = std::move(digest);
+            bar.finish("up to date");
+            return;
+        }
+    }
+
+    // extract into a temporary directory and only move it into place once
+    // the hash is verified, so that a failed or tampered download never
+    // leaves a half-extracted dependency behind
+    auto tmp_path = dep_path;
+    tmp_path += ".tmp";
+    std::filesystem::remove_all(tmp_path);
+    std::filesystem::create_directories(tmp_path);
+
+    // download -> hash -> decompress -> untar, all in one pass in constant
+    // memory: nothing is buffered whole and the archive never touches the
+    // disk
+    bar.update("downloading", 0.0);
+    std::string digest;
+    try {
+        auto source = open_url(m_expanded);
+        HashingStream hashing(*source);
+        BufferedStream buffered(hashing);
+        extract_archive(buffered, tmp_path);
+        buffered.drain(); // hash trailing bytes too
+        digest = "sha256:" + hashing.hex_digest();
+    } catch (...) {
+        std::error_code ec;
+        std::filesystem::remove_all(tmp_path, ec);
+        throw;
+    }
+
+    if (!expected.empty() && digest != expected) {
+        std::filesystem::remove_all(tmp_path);
+        throw std::runtime_error(fmt::format(
+            "hash mismatch for `{}`: expected {}, got {}{}", m_expanded,
+            expected, digest,
+            m_sha256.empty() ? fmt::format(". Run `qobs update {}` if this "
+                                           "is intended",
+                                           m_name)
+                             : ""));
+    }
+    if (m_sha256.empty() && !locked)
+        warn("{}: no `sha256` given for `{}`, pinning {} in {}", m_name,
+             m_expanded, digest, LOCKFILE_NAME);
+
+    std::filesystem::remove(stamp_path);
+    std::filesystem::remove_all(dep_path);
+    auto root = strip_top_level_dir(tmp_path);
+    std::filesystem::rename(root, dep_path);
+    if (root != tmp_path)
+        std::filesystem::remove_all(tmp_path);
+
+    std::ofstream stamp(stamp_path, std::ios::out | std::ios::trunc);
+    stamp << fmt::format("{} {}", digest, m_expanded) << '\n';
+    stamp.close();
+
+    m_digest = std::move(digest);
+    bar.finish("downloaded");
+}
+
+std::optional<LockedDependency> Dependency::lock_entry() const {
+    if (m_type == DependencyType::path || m_digest.empty())
+        return std::nullopt;
+    return LockedDependency{
+        .name = m_name,
+        .source = m_expanded,
+        .version = m_version,
+        .commit = m_commit,
+        .tree = m_tree,
+        .digest = m_digest,
+    };
 }
 
 std::filesystem::path
-Dependency::fetch_and_get_path(const std::filesystem::path& deps_dir) {
+Dependency::fetch_and_get_path(const std::filesystem::path& deps_dir,
+                               MultiProgress::Bar& bar,
+                               const LockedDependency* locked, bool update) {
     auto download_path = deps_dir / (m_name + "-src");
 
+    // the lock only applies if the dependency is still requested the same way
+    if (locked &&
+        (locked->source != m_expanded || locked->version != m_version)) {
+        debug("{}: {} entry is outdated, re-resolving", m_name,
+              LOCKFILE_NAME);
+        locked = nullptr;
+    }
+
     switch (m_type) {
     case DependencyType::git:
-        clone_git_repo(download_path);
+        clone_git_repo(download_path, bar, locked, update);
         return download_path;
     case DependencyType::url:
-        fetch_url(download_path);
+        fetch_url(download_path, bar, locked, update);
         return download_path;
     case DependencyType::path:
         // we don't need to copy or fetch anything, path is already given
+        bar.finish("local path");
         return m_value;
     }
+    return download_path; // unreachable
 }
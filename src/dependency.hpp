@@ -1,7 +1,14 @@
 #pragma once
+#include "lockfile.hpp"
+#include "progress.hpp"
+#include <filesystem>
+#include <optional>
 #include <string>
 #include <toml++/toml.hpp>
 
+class GitMirror;
+struct git_oid;
+
 enum class DependencyType {
     // supports git remotes:
     // `gh:nlohmann/json`
@@ -14,6 +21,10 @@ enum class DependencyType {
     // `sr:` for sourcehut, `cb:` for Codeberg.
     git,
     // `https://example.com/my-package.zip`
+    // `dep = { url = "https://example.com/pkg.tar.gz", sha256 = "..." }`
+    //
+    // zip, tar, tar.gz and tar.zst archives are supported, `file://` URLs
+    // are read directly.
     url,
     // `dep = { path = "/path/to/dep" }`
     path,
@@ -37,9 +48,22 @@ public:
     Dependency(std::string name, toml::table dep,
                const std::filesystem::path& package_root);
 
-    // throws!
+    // throws! `bar` is updated with the fetch progress and finished on
+    // success. Safe to call for different dependencies from multiple threads.
+    //
+    // If `locked` is given (and still matches this dependency), the locked
+    // commit is checked out instead of resolving the version again, which
+    // doesn't need the network if the commit is already cached. `update`
+    // forces floating versions (tags, unversioned) to be re-resolved.
     std::filesystem::path
-    fetch_and_get_path(const std::filesystem::path& deps_dir);
+    fetch_and_get_path(const std::filesystem::path& deps_dir,
+                       MultiProgress::Bar& bar,
+                       const LockedDependency* locked = nullptr,
+                       bool update = false);
+
+    // What to record in the lockfile after `fetch_and_get_path`. Nothing for
+    // path dependencies.
+    std::optional<LockedDependency> lock_entry() const;
 
     // `dep` in `dep = "gh:nlohmann/json"`
     inline std::string name() const {
@@ -72,10 +96,51 @@ public:
         return m_version;
     }
 
+    // Expected SHA-256 of a url dependency's archive (hex), may be empty.
+    inline const std::string& sha256() const {
+        return m_sha256;
+    }
+
+    // Resolved commit, its tree and the content digest, available after
+    // `fetch_and_get_path`. Empty where not applicable.
+    inline const std::string& commit() const {
+        return m_commit;
+    }
+    inline const std::string& tree() const {
+        return m_tree;
+    }
+    inline const std::string& digest() const {
+        return m_digest;
+    }
+
 private:
-    // throws!
-    void clone_git_repo(const std::filesystem::path& dep_path);
-    void fetch_url(const std::filesystem::path& download_path);
+    // What to look up in the git mirror for a version, e.g. `refs/tags/v1.0`.
+    static std::string revspec(VersionType type, const std::string& version);
+    inline std::string revspec() const {
+        return revspec(m_version_type, m_version);
+    }
+
+    // Whether `dep_path` already has the wanted version checked out, in which
+    // case the resolved commit, tree and digest are read from the checkout
+    // stamp. Only reads a couple of files.
+    bool is_checkout_current(const std::filesystem::path& dep_path,
+                             const LockedDependency* locked, bool update);
+
+    // Fetch a version into the mirror as cheaply as possible and return the
+    // commit it resolves to. Throws!
+    git_oid fetch_version(GitMirror& mirror, VersionType type,
+                          const std::string& version, MultiProgress::Bar& bar);
+
+    // throws! Finishes `bar`.
+    void clone_git_repo(const std::filesystem::path& dep_path,
+                        MultiProgress::Bar& bar,
+                        const LockedDependency* locked, bool update);
+
+    // throws! Downloads, hashes and extracts the archive in a single pass,
+    // then moves it into `dep_path`. Finishes `bar`.
+    void fetch_url(const std::filesystem::path& dep_path,
+                   MultiProgress::Bar& bar, const LockedDependency* locked,
+                   bool update);
 
     // `dep` in `dep = "gh:nlohmann/json"`
     std::string m_name;
@@ -95,4 +160,12 @@ private:
 
     // Version string or commit hash.
     std::string m_version;
+
+    // Expected SHA-256 of the archive for url dependencies.
+    std::string m_sha256;
+
+    // What m_version resolved to, see `commit()`, `tree()` and `digest()`.
+    std::string m_commit;
+    std::string m_tree;
+    std::string m_digest;
 };
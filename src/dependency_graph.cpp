@@ -0,0 +1,321 @@
+#include "dependency_graph.hpp"
+#include "progress.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <spdlog/spdlog.h>
+
+using namespace spdlog;
+
+// upper bound on the number of dependencies that are fetched at the same time
+constexpr size_t MAX_CONCURRENT_FETCHES = 8;
+
+// Whether two requests for a dependency ask for exactly the same thing.
+static bool same_request(const Dependency& a, const Dependency& b) {
+    return a.type() == b.type() && a.expanded() == b.expanded() &&
+           a.version() == b.version() && a.sha256() == b.sha256();
+}
+
+// `pkg` for warnings, empty is the root package.
+static std::string describe_package(const std::string& pkg) {
+    return pkg.empty() ? "the root package" : fmt::format("`{}`", pkg);
+}
+
+// Parse `<path>/Qobs.toml`, if there is one.
+static std::optional<Manifest>
+load_manifest(const std::filesystem::path& path) {
+    auto manifest_path = path / MANIFEST_NAME;
+    if (!std::filesystem::exists(manifest_path))
+        return std::nullopt;
+
+    Manifest manifest{path};
+    try {
+        manifest.parse_file(manifest_path.string());
+    } catch (const std::exception& err) {
+        throw std::runtime_error(fmt::format("couldn't parse `{}`: {}",
+                                             manifest_path.string(),
+                                             err.what()));
+    }
+    return manifest;
+}
+
+namespace {
+
+// State shared between the fetch jobs of `DependencyGraph::resolve`.
+class Resolver {
+public:
+    Resolver(const std::filesystem::path& deps_dir, const Lockfile& lockfile,
+             const std::vector<std::string>& update, bool update_all)
+        : m_deps_dir(deps_dir), m_lockfile(lockfile), m_update(update),
+          m_update_all(update_all) {}
+
+    // `requested_by` (at `depth`) depends on `dep`. Schedules a fetch if this
+    // is the first or the best request for it so far.
+    void request(const Dependency& dep, size_t depth,
+                 const std::string& requested_by);
+
+    // Wait for all fetches, including the ones they schedule. Failed ones
+    // have an `error`, reported by `resolve` only if it's still needed.
+    void wait();
+
+    struct Entry {
+        Dependency dependency;
+
+        // Of the request that won.
+        size_t depth;
+        std::string requested_by;
+
+        MultiProgress::Bar bar;
+
+        enum class State { queued, fetching, done } state{State::queued};
+
+        // Bumped whenever a better request replaces `dependency`, so that a
+        // fetch that was already running knows it has to start over.
+        size_t generation{0};
+
+        std::filesystem::path path;
+        std::optional<Manifest> manifest;
+
+        // Why the last fetch failed, empty if it didn't.
+        std::string error;
+    };
+
+    // Only valid after `wait`.
+    inline const std::map<std::string, Entry, std::less<>>& entries() const {
+        return m_entries;
+    }
+
+private:
+    // `request` with `m_mutex` held.
+    void request_locked(const Dependency& dep, size_t depth,
+                        const std::string& requested_by);
+    void fetch(const std::string& name);
+
+    const std::filesystem::path& m_deps_dir;
+    const Lockfile& m_lockfile;
+    const std::vector<std::string>& m_update;
+    bool m_update_all;
+
+    std::mutex m_mutex;
+    MultiProgress m_progress;
+    std::map<std::string, Entry, std::less<>> m_entries;
+
+    // Printed after the progressbars are done, so they don't garble them.
+    std::vector<std::string> m_warnings;
+
+    // destroyed (joined) first, jobs use everything above
+    ThreadPool m_pool{MAX_CONCURRENT_FETCHES};
+};
+
+void Resolver::request(const Dependency& dep, size_t depth,
+                       const std::string& requested_by) {
+    std::lock_guard lock(m_mutex);
+    request_locked(dep, depth, requested_by);
+}
+
+void Resolver::request_locked(const Dependency& dep, size_t depth,
+                              const std::string& requested_by) {
+    auto it = m_entries.find(dep.name());
+    if (it == m_entries.end()) {
+        m_entries.emplace(dep.name(),
+                          Entry{.dependency = dep,
+                                .depth = depth,
+                                .requested_by = requested_by,
+                                .bar = m_progress.add_bar(dep.name())});
+        m_pool.submit([this, name = dep.name()] { fetch(name); });
+        return;
+    }
+
+    // closest to the root package wins, ties are broken by the name of the
+    // requesting package so that the outcome doesn't depend on which fetch
+    // finished first
+    auto& entry = it->second;
+    bool wins = depth < entry.depth ||
+                (depth == entry.depth && requested_by < entry.requested_by);
+    if (same_request(entry.dependency, dep)) {
+        if (!wins)
+            return;
+        entry.depth = depth;
+        entry.requested_by = requested_by;
+        // its dependencies move closer to the root too. A fetch that isn't
+        // done yet requests them with the new depth by itself
+        if (entry.state == Entry::State::done && entry.manifest) {
+            auto children = entry.manifest->m_dependencies.m_list;
+            for (auto& child : children)
+                request_locked(child, depth + 1, dep.name());
+        }
+        return;
+    }
+
+    auto& winner = wins ? dep : entry.dependency;
+    auto& loser = wins ? entry.dependency : dep;
+    m_warnings.push_back(fmt::format(
+        "`{}` is requested as `{}` by {} and as `{}` by {}, using `{}`",
+        dep.name(), winner.value(),
+        describe_package(wins ? requested_by : entry.requested_by),
+        loser.value(),
+        describe_package(wins ? entry.requested_by : requested_by),
+        winner.value()));
+    if (!wins)
+        return;
+
+    entry.dependency = dep;
+    entry.depth = depth;
+    entry.requested_by = requested_by;
+    ++entry.generation;
+    switch (entry.state) {
+    case Entry::State::queued:
+        break; // the queued fetch picks up the new request
+    case Entry::State::fetching:
+        break; // the running fetch notices the new generation and restarts
+    case Entry::State::done:
+        entry.state = Entry::State::queued;
+        entry.bar = m_progress.add_bar(dep.name());
+        m_pool.submit([this, name = dep.name()] { fetch(name); });
+        break;
+    }
+}
+
+void Resolver::fetch(const std::string& name) {
+    bool should_update =
+        m_update_all ||
+        std::find(m_update.begin(), m_update.end(), name) != m_update.end();
+    auto locked = should_update ? nullptr : m_lockfile.find(name);
+
+    std::unique_lock lock(m_mutex);
+    auto& entry = m_entries.at(name); // map nodes don't move
+    for (;;) {
+        auto dep = entry.dependency;
+        auto generation = entry.generation;
+        auto bar = entry.bar;
+        entry.state = Entry::State::fetching;
+        lock.unlock();
+
+        std::filesystem::path path;
+        std::optional<Manifest> manifest;
+        std::string error;
+        try {
+            path = dep.fetch_and_get_path(m_deps_dir, bar, locked,
+                                          should_update);
+            manifest = load_manifest(path);
+        } catch (const std::exception& err) {
+            error = err.what();
+            bar.finish(fmt::format("failed: {}", error));
+        }
+
+        lock.lock();
+        if (entry.generation != generation) {
+            // a request closer to the root came in while we were busy
+            entry.bar = m_progress.add_bar(name);
+            continue;
+        }
+        entry.state = Entry::State::done;
+        entry.error = error;
+        if (!error.empty())
+            return;
+        entry.dependency = std::move(dep); // now knows its commit and digest
+        entry.path = std::move(path);
+        entry.manifest = std::move(manifest);
+        break;
+    }
+
+    // fetch the dependencies of this dependency right away, instead of
+    // waiting for the rest of its level
+    if (!entry.manifest)
+        return;
+    auto depth = entry.depth;
+    auto children = entry.manifest->m_dependencies.m_list;
+    lock.unlock();
+    for (auto& child : children)
+        request(child, depth + 1, name);
+}
+
+void Resolver::wait() {
+    m_pool.wait();
+    m_progress.done();
+    for (auto& warning : m_warnings)
+        warn("{}", warning);
+}
+
+} // namespace
+
+void DependencyGraph::resolve(const Manifest& root,
+                              const std::filesystem::path& deps_dir,
+                              const Lockfile& lockfile,
+                              const std::vector<std::string>& update,
+                              bool update_all) {
+    m_nodes.clear();
+    m_roots.clear();
+
+    auto& root_deps = root.m_dependencies.m_list;
+    if (root_deps.empty())
+        return;
+
+    info("fetching dependencies");
+    utils::git_init_once();
+    Resolver resolver(deps_dir, lockfile, update, update_all);
+    for (auto& dep : root_deps)
+        resolver.request(dep, 1, "");
+    resolver.wait();
+
+    // only keep what's reachable with the versions that won (a replaced
+    // request may have pulled in things nobody needs anymore), sorted so that
+    // every dependency comes before its dependents
+    auto& entries = resolver.entries();
+    std::map<std::string, size_t, std::less<>> indices;
+    std::vector<std::string> stack;
+    // fetches of requests that lost, or of dependencies only they needed,
+    // may fail without breaking the build
+    std::vector<std::string> failed;
+    std::function<size_t(const std::string&)> visit =
+        [&](const std::string& name) -> size_t {
+        if (auto it = indices.find(name); it != indices.end())
+            return it->second;
+
+        if (std::find(stack.begin(), stack.end(), name) != stack.end()) {
+            stack.push_back(name);
+            throw std::runtime_error(fmt::format("dependency cycle: {}",
+                                                 fmt::join(stack, " -> ")));
+        }
+        stack.push_back(name);
+
+        auto& entry = entries.at(name);
+        if (!entry.error.empty())
+            failed.push_back(name);
+        std::vector<size_t> dependencies;
+        if (entry.manifest) {
+            for (auto& child : entry.manifest->m_dependencies.m_list)
+                dependencies.push_back(visit(child.name()));
+        }
+        stack.pop_back();
+
+        m_nodes.push_back(DependencyNode{
+            .dependency = entry.dependency,
+            .path = entry.path,
+            .manifest = entry.manifest,
+            .dependencies = std::move(dependencies),
+            .depth = entry.depth,
+        });
+        indices.emplace(name, m_nodes.size() - 1);
+        return m_nodes.size() - 1;
+    };
+    for (auto& dep : root_deps)
+        m_roots.push_back(visit(dep.name()));
+    if (!failed.empty())
+        throw std::runtime_error(fmt::format(
+            "couldn't fetch {} dependenc{}: {}", failed.size(),
+            failed.size() == 1 ? "y" : "ies", fmt::join(failed, ", ")));
+
+    debug("resolved {} dependenc{} ({} direct)", m_nodes.size(),
+          m_nodes.size() == 1 ? "y" : "ies", m_roots.size());
+}
+
+const DependencyNode* DependencyGraph::find(std::string_view name) const {
+    for (auto& node : m_nodes)
+        if (node.dependency.name() == name)
+            return &node;
+    return nullptr;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "lockfile.hpp"
+#include "manifest.hpp"
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+// A fetched dependency.
+struct DependencyNode {
+    // How the dependency was requested (the request that won, if several
+    // packages asked for it).
+    Dependency dependency;
+
+    // Where the sources are.
+    std::filesystem::path path;
+
+    // The dependency's own Qobs.toml, if it has one.
+    std::optional<Manifest> manifest;
+
+    // Indices of the direct dependencies in `DependencyGraph::nodes()`.
+    std::vector<size_t> dependencies;
+
+    // Distance from the root package (direct dependencies are 1).
+    size_t depth{0};
+};
+
+// All (transitive) dependencies of a package. Dependencies are identified by
+// name: if two packages ask for different versions of the same dependency,
+// the request closest to the root package wins (the root package always
+// wins), so that every dependency is only fetched and built once.
+class DependencyGraph {
+public:
+    // Fetch all dependencies of `root` into `deps_dir`, following the
+    // manifests of fetched dependencies. A dependency is fetched as soon as
+    // the package that requests it is, so independent branches don't wait on
+    // each other. Dependencies are resolved through `lockfile`, except for
+    // those in `update` (or all of them if `update_all` is set).
+    //
+    // throws! Also if the graph has a cycle.
+    void resolve(const Manifest& root, const std::filesystem::path& deps_dir,
+                 const Lockfile& lockfile,
+                 const std::vector<std::string>& update = {},
+                 bool update_all = false);
+
+    // Every node comes after all of its dependencies.
+    inline const std::vector<DependencyNode>& nodes() const {
+        return m_nodes;
+    }
+
+    // Indices of the root package's direct dependencies.
+    inline const std::vector<size_t>& roots() const {
+        return m_roots;
+    }
+
+    inline bool empty() const {
+        return m_nodes.empty();
+    }
+
+    const DependencyNode* find(std::string_view name) const;
+
+private:
+    std::vector<DependencyNode> m_nodes;
+    std::vector<size_t> m_roots;
+};
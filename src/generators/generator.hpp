@@ -1,5 +1,7 @@
 #pragma once
 #include "../manifest.hpp"
+#include <cstdint>
+#include <optional>
 #include <string>
 
 class BuildFile {
@@ -15,16 +17,116 @@ private:
     std::filesystem::path m_path;
 };
 
+// A dependency, built as a static library.
+struct BuildLibrary {
+    // Dependency name, also used for the library and object directory names.
+    std::string name;
+
+    // Package root, sources are relative to it.
+    std::filesystem::path root;
+
+    // No files means the library is header-only and nothing gets built.
+    std::vector<BuildFile> files;
+
+    // Include directories for compiling the library: its own public ones,
+    // followed by those of all of its (transitive) dependencies.
+    std::vector<std::filesystem::path> include_dirs;
+
+    // Public include directories only, for packages depending on this one.
+    std::vector<std::filesystem::path> public_include_dirs;
+
+    // From the dependency's `[target]`, if it has a Qobs.toml.
+    std::string cflags;
+    std::string ldflags;
+
+    // Key in the artifact cache, empty if the library can't be cached.
+    std::string cache_key;
+
+    // A cached archive to link instead of compiling `files`.
+    std::optional<std::filesystem::path> prebuilt;
+};
+
+// A generated build file.
+struct GeneratedFile {
+    // Relative to the build directory.
+    std::filesystem::path path;
+    std::string code;
+};
+
+// When an edge of the last build ran, in milliseconds since the build started.
+struct EdgeTiming {
+    // As in the build file: relative to the build directory unless absolute.
+    std::filesystem::path output;
+    int64_t start_ms{0};
+    int64_t end_ms{0};
+    // Edges of the same build this one depended on, as indices into the
+    // timings. Inputs that were already up to date aren't in there.
+    std::vector<size_t> inputs;
+};
+
+// How the build files can regenerate themselves when their inputs change.
+struct Regeneration {
+    // Regenerates the build files without building anything.
+    std::vector<std::string> command;
+
+    // Existing files and directories the build files were generated from.
+    std::vector<std::filesystem::path> inputs;
+};
+
 class Generator {
 public:
     virtual ~Generator() = default;
 
+    // Short name, e.g. `ninja`. Build files of another generator must not be
+    // reused.
+    virtual std::string_view name() const = 0;
+
+    // Call before `generate` to make the build files regenerate themselves,
+    // for generators that support it.
+    inline void set_regeneration(Regeneration regeneration) {
+        m_regeneration = std::move(regeneration);
+    }
+
+    // Call before `generate`: flags that go first in every GCC-style compile
+    // command, e.g. those the toolchain was found to support.
+    inline void set_toolchain_flags(std::vector<std::string> flags) {
+        m_toolchain_flags = std::move(flags);
+    }
+
+    // Call before `generate`: a command that GCC-style compile commands are
+    // run through to cache their objects, `qobs cc` (see `cached_compile`).
+    // Generators that cache objects themselves ignore it.
+    inline void set_compile_launcher(std::vector<std::string> launcher) {
+        m_compile_launcher = std::move(launcher);
+    }
+
+    // `libraries` are in dependency order: every library comes after all of
+    // the libraries it depends on.
     virtual void generate(const Manifest& manifest,
                           const std::vector<BuildFile>& files,
+                          const std::vector<BuildLibrary>& libraries,
                           std::string_view exe_name,
                           std::string_view compiler) = 0;
+    // Throws if the build failed.
     virtual void invoke(std::filesystem::path path){
         // nop
     };
-    virtual std::string& code() = 0;
+    // When the edges of the last successful `invoke` in `build_dir` ran.
+    // Empty if nothing was built or the generator can't tell.
+    virtual std::vector<EdgeTiming>
+    timings(const std::filesystem::path& build_dir) const {
+        return {};
+    }
+    // Where the archive of a library that isn't prebuilt ends up, relative to
+    // the build directory.
+    virtual std::filesystem::path
+    library_path(const BuildLibrary& lib) const = 0;
+    // Files to write after `generate`. The first one is the main build file
+    // that `invoke` is called with.
+    virtual const std::vector<GeneratedFile>& files() const = 0;
+
+protected:
+    std::optional<Regeneration> m_regeneration;
+    std::vector<std::string> m_toolchain_flags;
+    std::vector<std::string> m_compile_launcher;
 };
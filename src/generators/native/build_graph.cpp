@@ -0,0 +1,165 @@
+#include "build_graph.hpp"
+#include "../../utils.hpp"
+#include <fstream>
+#include <sstream>
+
+// bump this if the format changes
+constexpr std::string_view BUILD_GRAPH_HEADER = "qobs-build-graph 1";
+
+std::string BuildGraph::serialize() const {
+    std::string out;
+    out += BUILD_GRAPH_HEADER;
+    out += '\n';
+    for (auto& edge : edges) {
+        out += "edge\n";
+        out += "desc " + edge.description + '\n';
+        out += "out " + edge.output.string() + '\n';
+        for (auto& input : edge.inputs)
+            out += "in " + input.string() + '\n';
+        if (edge.deps == DepsStyle::gcc)
+            out += "deps gcc " + edge.depfile.string() + '\n';
+        else if (edge.deps == DepsStyle::msvc)
+            out += "deps msvc\n";
+        for (auto& arg : edge.args)
+            out += "arg " + arg + '\n';
+    }
+    return out;
+}
+
+std::optional<BuildGraph> BuildGraph::load(const std::filesystem::path& path) {
+    std::ifstream file(path);
+    std::string line;
+    if (!file || !std::getline(file, line) || line != BUILD_GRAPH_HEADER)
+        return std::nullopt;
+
+    BuildGraph graph;
+    while (std::getline(file, line)) {
+        auto space = line.find(' ');
+        std::string_view kind(line.data(),
+                              space == std::string::npos ? line.size() : space);
+        std::string rest =
+            space == std::string::npos ? "" : line.substr(space + 1);
+
+        if (kind == "edge") {
+            graph.edges.emplace_back();
+            continue;
+        }
+        if (graph.edges.empty())
+            return std::nullopt;
+        auto& edge = graph.edges.back();
+        if (kind == "desc") {
+            edge.description = std::move(rest);
+        } else if (kind == "out") {
+            edge.output = rest;
+        } else if (kind == "in") {
+            edge.inputs.push_back(rest);
+        } else if (kind == "deps") {
+            if (rest == "msvc") {
+                edge.deps = DepsStyle::msvc;
+            } else if (rest.starts_with("gcc ")) {
+                edge.deps = DepsStyle::gcc;
+                edge.depfile = rest.substr(4);
+            } else {
+                return std::nullopt;
+            }
+        } else if (kind == "arg") {
+            edge.args.push_back(std::move(rest));
+        } else {
+            return std::nullopt;
+        }
+    }
+    return graph;
+}
+
+std::string escape_arg(std::string_view arg) {
+    return utils::replace(std::string(arg), "$", "$$");
+}
+
+std::vector<std::string> split_args(std::string_view command) {
+    std::vector<std::string> args;
+    std::string arg;
+    bool in_arg = false;
+    char quote = 0;
+    for (size_t i = 0; i < command.size(); ++i) {
+        char c = command[i];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else if (quote == '"' && c == '\\' && i + 1 < command.size() &&
+                       (command[i + 1] == '"' || command[i + 1] == '\\')) {
+                arg += command[++i];
+            } else {
+                arg += c;
+            }
+        } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            if (in_arg)
+                args.push_back(std::move(arg));
+            arg.clear();
+            in_arg = false;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+            in_arg = true;
+        }
+#ifndef QOBS_IS_WINDOWS
+        // backslashes are path separators on Windows
+        else if (c == '\\' && i + 1 < command.size()) {
+            arg += command[++i];
+            in_arg = true;
+        }
+#endif
+        else {
+            arg += c;
+            in_arg = true;
+        }
+    }
+    if (in_arg)
+        args.push_back(std::move(arg));
+    return args;
+}
+
+std::vector<std::string> parse_depfile(std::string_view contents) {
+    // split into words. `\ ` is an escaped space, `$$` an escaped `$` and a
+    // backslash at the end of a line continues it
+    std::vector<std::string> words;
+    std::string word;
+    for (size_t i = 0; i < contents.size(); ++i) {
+        char c = contents[i];
+        char next = i + 1 < contents.size() ? contents[i + 1] : 0;
+        if (c == '\\' && (next == ' ' || next == '#')) {
+            word += next;
+            ++i;
+        } else if (c == '\\' && (next == '\n' || next == '\r')) {
+            ++i;
+            if (next == '\r' && i + 1 < contents.size() &&
+                contents[i + 1] == '\n')
+                ++i;
+            if (!word.empty())
+                words.push_back(std::move(word));
+            word.clear();
+        } else if (c == '$' && next == '$') {
+            word += '$';
+            ++i;
+        } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            if (!word.empty())
+                words.push_back(std::move(word));
+            word.clear();
+        } else {
+            word += c;
+        }
+    }
+    if (!word.empty())
+        words.push_back(std::move(word));
+
+    // everything after the targets (`out.o:`)
+    std::vector<std::string> deps;
+    bool seen_target = false;
+    for (auto& w : words) {
+        if (w.ends_with(':')) {
+            seen_target = true;
+            continue;
+        }
+        if (seen_target)
+            deps.push_back(std::move(w));
+    }
+    return deps;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// How a command reports the headers it read.
+enum class DepsStyle {
+    none,
+    // a Makefile-style depfile (`-MD -MF $depfile`)
+    gcc,
+    // `Note: including file:` lines in the output (`/showIncludes`)
+    msvc,
+};
+
+// A command producing one file from its inputs. Paths that aren't absolute
+// are relative to the build directory.
+struct BuildEdge {
+    // Arguments, with `$out`, `$depfile` and `$in` (a whole argument, expanded
+    // to every input) substituted when running. A literal `$` is `$$`.
+    std::vector<std::string> args;
+
+    // Shown while running, e.g. `CC QobsFiles/pkg.dir/src/main.cpp.obj`.
+    std::string description;
+
+    std::vector<std::filesystem::path> inputs;
+    std::filesystem::path output;
+
+    DepsStyle deps{DepsStyle::none};
+    // Only for `DepsStyle::gcc`.
+    std::filesystem::path depfile;
+};
+
+// Everything the native generator builds, in the order it was generated in.
+struct BuildGraph {
+    std::vector<BuildEdge> edges;
+
+    // Text form, see `BUILD_GRAPH_HEADER`.
+    std::string serialize() const;
+
+    // Nothing if the file doesn't exist or wasn't written by this version.
+    static std::optional<BuildGraph> load(const std::filesystem::path& path);
+};
+
+// Escape `$` in a literal argument.
+std::string escape_arg(std::string_view arg);
+
+// Split a command line (e.g. `cflags` from a manifest) into arguments like a
+// shell would: on whitespace, except in quotes.
+std::vector<std::string> split_args(std::string_view command);
+
+// Headers listed in a Makefile-style depfile, e.g. `out.o: a.c a.h \`.
+std::vector<std::string> parse_depfile(std::string_view contents);
@@ -0,0 +1,205 @@
+#include "build_log.hpp"
+#include "../../utils.hpp"
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <unordered_set>
+
+// bump this if the format changes
+constexpr std::string_view BUILD_LOG_MAGIC = "qobslog2";
+
+const BuildLog::Entry* BuildLog::find(const std::string& output) const {
+    auto it = m_entries.find(output);
+    return it == m_entries.end() ? nullptr : &it->second;
+}
+
+// Kinds of records, each followed by its fields.
+enum class Record : uint8_t {
+    // size, bytes: the next path index
+    path,
+    // output index, command hash, dep count, dep indices
+    entry,
+    // output index
+    erase,
+};
+
+template <typename T> static void put(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void BuildLog::put_entry(std::string& out, const std::string& output,
+                         const Entry& entry) {
+    auto intern = [&](const std::string& str) {
+        auto [it, inserted] =
+            m_ids.emplace(str, static_cast<uint32_t>(m_ids.size()));
+        if (inserted) {
+            put(out, Record::path);
+            put(out, static_cast<uint32_t>(str.size()));
+            out += str;
+        }
+        return it->second;
+    };
+
+    // paths first, the entry record references them
+    auto id = intern(output);
+    std::vector<uint32_t> deps;
+    deps.reserve(entry.deps.size());
+    for (auto& dep : entry.deps)
+        deps.push_back(intern(dep));
+
+    put(out, Record::entry);
+    put(out, id);
+    put(out, entry.command_hash);
+    put(out, static_cast<uint32_t>(deps.size()));
+    for (auto dep : deps)
+        put(out, dep);
+    ++m_records;
+}
+
+void BuildLog::append(std::string_view record) {
+    if (!m_file.is_open())
+        return;
+    // a failed write only costs rebuilding, the log is saved after the build
+    m_file.write(record.data(), static_cast<std::streamsize>(record.size()));
+    if (!m_file.flush())
+        m_file.close();
+}
+
+void BuildLog::set(const std::string& output, Entry entry) {
+    auto& stored = m_entries[output] = std::move(entry);
+    if (m_file.is_open()) {
+        std::string record;
+        put_entry(record, output, stored);
+        append(record);
+    }
+}
+
+void BuildLog::erase(const std::string& output) {
+    if (!m_entries.erase(output) || !m_file.is_open())
+        return;
+    auto it = m_ids.find(output);
+    if (it == m_ids.end())
+        return;
+    std::string record;
+    put(record, Record::erase);
+    put(record, it->second);
+    append(record);
+    ++m_records;
+}
+
+void BuildLog::retain(const std::vector<std::string>& outputs) {
+    std::unordered_set<std::string_view> keep(outputs.begin(), outputs.end());
+    if (std::erase_if(m_entries, [&](const auto& entry) {
+            return !keep.count(entry.first);
+        }))
+        m_stale = true;
+}
+
+void BuildLog::open(const std::filesystem::path& path) {
+    // after an interrupted build, entries may have been rebuilt many times
+    if (m_stale || m_records > m_entries.size())
+        save(path);
+    m_file.open(path, std::ios::binary | std::ios::app);
+    if (!m_file)
+        throw std::runtime_error(
+            fmt::format("couldn't open `{}`", path.string()));
+}
+
+void BuildLog::save(const std::filesystem::path& path) {
+    if (m_file.is_open())
+        m_file.close();
+    m_ids.clear();
+    m_records = 0;
+    std::string out(BUILD_LOG_MAGIC);
+    for (auto& [output, entry] : m_entries)
+        put_entry(out, output, entry);
+    utils::write_if_changed(path, out);
+    m_stale = false;
+}
+
+BuildLog BuildLog::load(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+    if (!data.starts_with(BUILD_LOG_MAGIC))
+        return {};
+
+    size_t pos = BUILD_LOG_MAGIC.size();
+    bool ok = true;
+    auto get = [&]<typename T>(T& value) {
+        if (!ok || data.size() - pos < sizeof(T)) {
+            ok = false;
+            return;
+        }
+        std::memcpy(&value, data.data() + pos, sizeof(T));
+        pos += sizeof(T);
+    };
+
+    BuildLog log;
+    std::vector<const std::string*> paths;
+    while (ok && pos < data.size()) {
+        Record kind{};
+        get(kind);
+        if (kind == Record::path) {
+            uint32_t size = 0;
+            get(size);
+            if (!ok || data.size() - pos < size)
+                break;
+            auto it = log.m_ids
+                          .emplace(std::string(data.data() + pos, size),
+                                   static_cast<uint32_t>(paths.size()))
+                          .first;
+            // a path stored twice would shift every later index
+            if (it->second != paths.size())
+                return {};
+            paths.push_back(&it->first);
+            pos += size;
+        } else if (kind == Record::entry) {
+            uint32_t output = 0, dep_count = 0;
+            Entry entry;
+            get(output);
+            get(entry.command_hash);
+            get(dep_count);
+            for (uint32_t j = 0; ok && j < dep_count; ++j) {
+                uint32_t dep = 0;
+                get(dep);
+                if (ok && dep >= paths.size())
+                    return {};
+                if (ok)
+                    entry.deps.push_back(*paths[dep]);
+            }
+            if (!ok)
+                break;
+            if (output >= paths.size())
+                return {};
+            log.m_entries[*paths[output]] = std::move(entry);
+            ++log.m_records;
+        } else if (kind == Record::erase) {
+            uint32_t output = 0;
+            get(output);
+            if (!ok)
+                break;
+            if (output >= paths.size())
+                return {};
+            log.m_entries.erase(*paths[output]);
+            ++log.m_records;
+        } else {
+            return {};
+        }
+    }
+    // a truncated record is cut off before appending again
+    log.m_stale = !ok;
+    return log;
+}
+
+uint64_t BuildLog::hash_command(const std::vector<std::string>& args) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (auto& arg : args) {
+        // include the terminator, so that `a b` and `ab` differ
+        for (size_t i = 0; i <= arg.size(); ++i) {
+            hash ^= static_cast<unsigned char>(arg.c_str()[i]);
+            hash *= 0x100000001b3;
+        }
+    }
+    return hash;
+}
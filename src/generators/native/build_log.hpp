@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// What the native executor knows about every output it built: a hash of the
+// command that built it, to rebuild outputs whose command changed, and the
+// headers it read (the deps database), since a depfile only exists right
+// after compiling.
+class BuildLog {
+public:
+    struct Entry {
+        uint64_t command_hash{0};
+        std::vector<std::string> deps;
+    };
+
+    // Entry for `output` (as in the build graph), if it was ever built.
+    const Entry* find(const std::string& output) const;
+
+    void set(const std::string& output, Entry entry);
+
+    // Drop the entry for `output`, e.g. because building it failed.
+    void erase(const std::string& output);
+
+    // Only keep entries for `outputs`, so that the log doesn't grow forever.
+    void retain(const std::vector<std::string>& outputs);
+
+    // Append every `set` and `erase` from now on to the log at `path` as it
+    // happens (like ninja), so that an interrupted build keeps what it
+    // finished. Compacts the file first if it has stale or truncated records.
+    // Throws on failure.
+    void open(const std::filesystem::path& path);
+
+    // Compact the log into `path`, one record per entry, and stop appending.
+    // Binary, in native byte order: it never leaves the build directory.
+    // Paths are stored once and referenced by index, most deps are shared
+    // between translation units. Throws on failure.
+    void save(const std::filesystem::path& path);
+
+    // An empty log if the file is missing or unreadable, everything is
+    // rebuilt then. A truncated last record (of an interrupted build) is
+    // ignored.
+    static BuildLog load(const std::filesystem::path& path);
+
+    // FNV-1a of every argument, stable across runs.
+    static uint64_t hash_command(const std::vector<std::string>& args);
+
+private:
+    // Append the records of `entry` to `out`, and those of the paths it
+    // introduces.
+    void put_entry(std::string& out, const std::string& output,
+                   const Entry& entry);
+
+    // Append `record` to the open file.
+    void append(std::string_view record);
+
+    std::unordered_map<std::string, Entry> m_entries;
+
+    // The file appended to while open, the index of each path stored in it
+    // and the number of entry records in it.
+    std::ofstream m_file;
+    std::unordered_map<std::string, uint32_t> m_ids;
+    size_t m_records{0};
+    // Whether the file has to be rewritten before appending to it.
+    bool m_stale{true};
+};
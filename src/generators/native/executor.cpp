@@ -0,0 +1,504 @@
+#include "executor.hpp"
+#include "../../thread_pool.hpp"
+#include "../../utils.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <spdlog/spdlog.h>
+
+using namespace spdlog;
+
+// Name of the build log in the build directory, see `BuildLog`.
+constexpr auto& BUILD_LOG_NAME = ".qobs_log";
+
+// How `/showIncludes` reports a header.
+constexpr std::string_view MSVC_INCLUDE_PREFIX = "Note: including file:";
+
+Executor::Executor(const BuildGraph& graph, std::filesystem::path build_dir)
+    : m_graph(graph), m_build_dir(std::move(build_dir)),
+      m_log(BuildLog::load(m_build_dir / BUILD_LOG_NAME)) {
+    auto& edges = m_graph.edges;
+    std::unordered_map<std::string, size_t> producers;
+    for (size_t i = 0; i < edges.size(); ++i) {
+        m_outputs.push_back(resolve(edges[i].output).string());
+        producers.emplace(m_outputs.back(), i);
+        m_args.push_back(expand(edges[i]));
+    }
+
+    m_producers.resize(edges.size());
+    for (size_t i = 0; i < edges.size(); ++i) {
+        for (auto& input : edges[i].inputs) {
+            auto it = producers.find(resolve(input).string());
+            if (it != producers.end())
+                m_producers[i].push_back(it->second);
+        }
+    }
+    m_states.resize(edges.size(), State::unknown);
+}
+
+std::filesystem::path
+Executor::resolve(const std::filesystem::path& path) const {
+    return path.is_absolute() ? path : m_build_dir / path;
+}
+
+std::vector<std::string> Executor::expand(const BuildEdge& edge) const {
+    auto out = resolve(edge.output).string();
+    auto depfile = edge.depfile.empty() ? "" : resolve(edge.depfile).string();
+
+    std::vector<std::string> args;
+    args.reserve(edge.args.size() + edge.inputs.size());
+    for (auto& arg : edge.args) {
+        if (arg == "$in") {
+            for (auto& input : edge.inputs)
+                args.push_back(resolve(input).string());
+            continue;
+        }
+
+        std::string expanded;
+        for (size_t i = 0; i < arg.size(); ++i) {
+            std::string_view rest(arg.data() + i, arg.size() - i);
+            if (rest.starts_with("$$")) {
+                expanded += '$';
+                i += 1;
+            } else if (rest.starts_with("$out")) {
+                expanded += out;
+                i += 3;
+            } else if (rest.starts_with("$depfile")) {
+                expanded += depfile;
+                i += 7;
+            } else {
+                expanded += arg[i];
+            }
+        }
+        args.push_back(std::move(expanded));
+    }
+    return args;
+}
+
+std::optional<int64_t> Executor::mtime(const std::string& path) {
+    auto it = m_mtimes.find(path);
+    if (it != m_mtimes.end())
+        return it->second;
+
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(path, ec);
+    std::optional<int64_t> result;
+    if (!ec)
+        result = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     time.time_since_epoch())
+                     .count();
+    m_mtimes.emplace(path, result);
+    return result;
+}
+
+bool Executor::is_dirty(size_t index) {
+    auto& state = m_states[index];
+    if (state == State::visiting)
+        throw std::runtime_error(fmt::format(
+            "dependency cycle involving `{}`", m_outputs[index]));
+    if (state != State::unknown)
+        return state == State::dirty;
+    state = State::visiting;
+
+    auto& edge = m_graph.edges[index];
+    auto dirty = [&](std::string_view reason) {
+        trace("`{}` is dirty: {}", m_outputs[index], reason);
+        m_states[index] = State::dirty;
+        return true;
+    };
+
+    // check every producer, so that cycles are always found
+    bool input_dirty = false;
+    for (auto producer : m_producers[index])
+        input_dirty |= is_dirty(producer);
+    if (input_dirty)
+        return dirty("an input is rebuilt");
+
+    auto output_time = mtime(m_outputs[index]);
+    if (!output_time)
+        return dirty("missing");
+    auto entry = m_log.find(edge.output.string());
+    if (!entry)
+        return dirty("not in the build log");
+    if (entry->command_hash != BuildLog::hash_command(m_args[index]))
+        return dirty("command changed");
+
+    for (auto& input : edge.inputs) {
+        auto time = mtime(resolve(input).string());
+        if (!time || *time > *output_time)
+            return dirty(fmt::format("`{}` changed", input.string()));
+    }
+    for (auto& dep : entry->deps) {
+        auto time = mtime(dep);
+        if (!time || *time > *output_time)
+            return dirty(fmt::format("`{}` changed", dep));
+    }
+
+    state = State::clean;
+    return false;
+}
+
+// Move `/showIncludes` lines from `output` into `deps`.
+static void take_msvc_includes(std::string& output,
+                               std::vector<std::string>& deps) {
+    std::string rest;
+    size_t pos = 0;
+    while (pos < output.size()) {
+        auto end = output.find('\n', pos);
+        if (end == std::string::npos)
+            end = output.size();
+        else
+            ++end;
+        std::string_view line(output.data() + pos, end - pos);
+        if (line.starts_with(MSVC_INCLUDE_PREFIX)) {
+            std::string dep(line.substr(MSVC_INCLUDE_PREFIX.size()));
+            utils::trim_in_place(dep);
+            deps.push_back(std::move(dep));
+        } else {
+            rest += line;
+        }
+        pos = end;
+    }
+    output = std::move(rest);
+}
+
+// `output` without ANSI escape sequences (the colors of
+// `COLOR_DIAGNOSTICS_FLAG`), for when it doesn't go to a terminal.
+static std::string strip_ansi(std::string_view output) {
+    std::string result;
+    result.reserve(output.size());
+    for (size_t i = 0; i < output.size(); ++i) {
+        if (output[i] != '\x1b' || i + 1 == output.size() ||
+            output[i + 1] != '[') {
+            result += output[i];
+            continue;
+        }
+        // parameters, then a final byte in `@`..`~`
+        i += 2;
+        while (i < output.size() && (output[i] < '@' || output[i] > '~'))
+            ++i;
+    }
+    return result;
+}
+
+// A compile command split for `CompileFarm`: preprocessing runs locally, the
+// preprocessed source is compiled on a worker.
+struct RemoteCompile {
+    // The command with `-c` replaced by `-E`, writing to `preprocessed`.
+    std::vector<std::string> preprocess;
+    // `c` or `c++`.
+    std::string language;
+    // Arguments that affect compiling a preprocessed source, without the
+    // input, output, depfile and preprocessor options.
+    std::vector<std::string> args;
+};
+
+// Language of a C/C++ source for `CompileFarm`, nothing for anything else.
+static std::optional<std::string>
+source_language(const std::filesystem::path& source) {
+    auto ext = source.extension().string();
+    if (ext == ".c")
+        return "c";
+    if (ext == ".cpp" || ext == ".cc" || ext == ".cxx" || ext == ".c++" ||
+        ext == ".C")
+        return "c++";
+    return std::nullopt;
+}
+
+// Nothing if `args` isn't a GCC-style `-c <input> -o <output>` command.
+static std::optional<RemoteCompile>
+split_compile(const std::vector<std::string>& args, const std::string& input,
+              const std::string& preprocessed) {
+    auto language = source_language(input);
+    if (!language || args.empty())
+        return std::nullopt;
+
+    // options of the preprocessor, with their value joined or in the next
+    // argument
+    constexpr std::string_view separate[] = {
+        "-MF", "-MT", "-MQ", "-include", "-imacros", "-I", "-D", "-U",
+        "-isystem", "-iquote", "-idirafter"};
+    constexpr std::string_view joined[] = {"-I", "-D", "-U", "-isystem",
+                                           "-iquote", "-idirafter"};
+
+    RemoteCompile result{.preprocess = {args.front()},
+                         .language = std::move(*language)};
+    bool compile = false, has_input = false, has_output = false;
+    for (size_t i = 1; i < args.size(); ++i) {
+        auto& arg = args[i];
+        if (arg == "-c") {
+            compile = true;
+            result.preprocess.push_back("-E");
+            continue;
+        }
+        if (arg == "-o" && i + 1 < args.size()) {
+            has_output = true;
+            result.preprocess.insert(result.preprocess.end(),
+                                     {"-o", preprocessed});
+            ++i;
+            continue;
+        }
+        result.preprocess.push_back(arg);
+        if (arg == input) {
+            has_input = true;
+        } else if (arg == "-MD" || arg == "-MMD" || arg == "-MP") {
+        } else if (std::find(std::begin(separate), std::end(separate), arg) !=
+                   std::end(separate)) {
+            if (i + 1 < args.size())
+                result.preprocess.push_back(args[++i]);
+        } else if (std::none_of(std::begin(joined), std::end(joined),
+                                [&](std::string_view prefix) {
+                                    return arg.starts_with(prefix);
+                                })) {
+            result.args.push_back(arg);
+        }
+    }
+    if (!compile || !has_input || !has_output)
+        return std::nullopt;
+    return result;
+}
+
+std::optional<std::pair<int, std::string>>
+Executor::compile_remotely(size_t index) {
+    auto& edge = m_graph.edges[index];
+    if (edge.deps != DepsStyle::gcc || edge.inputs.size() != 1)
+        return std::nullopt;
+    auto& output_path = m_outputs[index];
+    auto preprocessed = output_path + ".pp";
+    auto job = split_compile(m_args[index], resolve(edge.inputs[0]).string(),
+                             preprocessed);
+    if (!job || !std::all_of(job->args.begin(), job->args.end(),
+                             is_remote_safe_arg))
+        return std::nullopt;
+    auto lease = m_farm->acquire(job->preprocess.front());
+    if (!lease)
+        return std::nullopt;
+
+    // the depfile is written while preprocessing, a preprocessor error is a
+    // real one
+    auto [code, output] = utils::run_captured(job->preprocess);
+    std::error_code ec;
+    if (code != 0) {
+        std::filesystem::remove(preprocessed, ec);
+        return std::make_pair(code, std::move(output));
+    }
+    std::string source;
+    {
+        std::ifstream file(preprocessed, std::ios::in | std::ios::binary);
+        source.assign(std::istreambuf_iterator<char>(file),
+                      std::istreambuf_iterator<char>());
+    }
+    std::filesystem::remove(preprocessed, ec);
+
+    auto result = lease->compile(job->preprocess.front(), job->language,
+                                 source, job->args);
+    // retry errors locally: the worker may have a different compiler, and
+    // diagnostics should point at the real source instead of the
+    // preprocessed one
+    if (!result || result->code != 0) {
+        debug("`{}` failed on worker `{}`, compiling locally",
+              edge.output.string(), lease->address());
+        return std::nullopt;
+    }
+    utils::write_file_atomically(output_path, result->object);
+    trace("compiled `{}` on worker `{}`", edge.output.string(),
+          lease->address());
+    return std::make_pair(0, output + result->output);
+}
+
+bool Executor::run_edge(size_t index) {
+    auto& edge = m_graph.edges[index];
+    auto output_path = std::filesystem::path(m_outputs[index]);
+    auto depfile = edge.depfile.empty() ? std::filesystem::path()
+                                        : resolve(edge.depfile);
+
+    // start from scratch, e.g. archives would keep objects of deleted sources
+    std::error_code ec;
+    std::filesystem::create_directories(output_path.parent_path(), ec);
+    std::filesystem::remove(output_path, ec);
+    if (!depfile.empty())
+        std::filesystem::remove(depfile, ec);
+
+    BuildLog::Entry entry{.command_hash = BuildLog::hash_command(m_args[index])};
+
+    // compile commands report their headers, which is what makes them
+    // cacheable. The key uses the arguments before expansion, so that the
+    // build directory doesn't matter
+    std::string cache_key;
+    if (edge.deps != DepsStyle::none && !edge.args.empty()) {
+        std::vector<std::filesystem::path> inputs;
+        for (auto& input : edge.inputs)
+            inputs.push_back(resolve(input));
+        cache_key = m_cache.key(edge.args, m_args[index], inputs);
+    }
+    if (!cache_key.empty()) {
+        if (auto deps = m_cache.restore(cache_key, output_path)) {
+            entry.deps = std::move(*deps);
+            std::lock_guard lock(m_mutex);
+            fmt::print("[{}/{}] {} (cached)\n", ++m_finished, m_total,
+                       edge.description);
+            std::fflush(stdout);
+            m_log.set(edge.output.string(), std::move(entry));
+            return true;
+        }
+    }
+
+    std::optional<std::pair<int, std::string>> remote;
+    if (m_farm)
+        remote = compile_remotely(index);
+    auto [code, output] =
+        remote ? std::move(*remote) : utils::run_captured(m_args[index]);
+
+    if (code == 0 && edge.deps == DepsStyle::gcc) {
+        std::ifstream file(depfile);
+        std::string contents((std::istreambuf_iterator<char>(file)),
+                             std::istreambuf_iterator<char>());
+        for (auto& dep : parse_depfile(contents))
+            entry.deps.push_back(std::filesystem::absolute(dep).string());
+        file.close();
+        // the deps are in the log now
+        std::filesystem::remove(depfile, ec);
+    } else if (edge.deps == DepsStyle::msvc) {
+        take_msvc_includes(output, entry.deps);
+    }
+
+    // objects from workers too: they only get to compile with the same
+    // compiler as this machine (see `CompileFarm`)
+    if (code == 0 && !cache_key.empty()) {
+        // not being able to cache something doesn't fail the build
+        try {
+            m_cache.store(cache_key, output_path, entry.deps);
+        } catch (const std::exception& err) {
+            debug("couldn't cache `{}`: {}", edge.output.string(), err.what());
+        }
+    }
+
+    std::lock_guard lock(m_mutex);
+    fmt::print("[{}/{}] {}\n", ++m_finished, m_total, edge.description);
+    if (!output.empty())
+        fmt::print("{}", utils::is_stdout_tty() ? output : strip_ansi(output));
+    std::fflush(stdout);
+
+    if (code != 0) {
+        std::string command;
+        for (auto& arg : m_args[index])
+            command += (command.empty() ? "" : " ") + arg;
+        error("`{}` failed (exit code {}): {}", edge.output.string(), code,
+              command);
+        m_log.erase(edge.output.string());
+        std::filesystem::remove(output_path, ec);
+        if (!depfile.empty())
+            std::filesystem::remove(depfile, ec);
+        return false;
+    }
+    m_log.set(edge.output.string(), std::move(entry));
+    return true;
+}
+
+void Executor::run() {
+    auto& edges = m_graph.edges;
+    std::vector<size_t> pending(edges.size(), 0);
+    std::vector<std::vector<size_t>> dependents(edges.size());
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < edges.size(); ++i) {
+        if (!is_dirty(i))
+            continue;
+        ++m_total;
+        for (auto producer : m_producers[i]) {
+            if (m_states[producer] == State::dirty) {
+                ++pending[i];
+                dependents[producer].push_back(i);
+            }
+        }
+        if (!pending[i])
+            ready.push_back(i);
+    }
+    if (!m_total) {
+        debug("nothing to do in `{}`", m_build_dir.string());
+        return;
+    }
+
+    // workers add to the local cores: while they all are busy, this still
+    // runs as many local commands as there are cores
+    std::vector<std::string> compilers;
+    for (size_t i = 0; i < edges.size(); ++i)
+        if (m_states[i] == State::dirty && edges[i].deps == DepsStyle::gcc &&
+            std::find(compilers.begin(), compilers.end(), m_args[i].front()) ==
+                compilers.end())
+            compilers.push_back(m_args[i].front());
+    m_farm = CompileFarm::from_env(compilers);
+    size_t threads = ThreadPool::hardware_threads();
+    if (m_farm)
+        threads += m_farm->capacity();
+
+    m_log.retain([&] {
+        std::vector<std::string> outputs;
+        for (auto& edge : edges)
+            outputs.push_back(edge.output.string());
+        return outputs;
+    }());
+    try {
+        m_log.open(m_build_dir / BUILD_LOG_NAME);
+    } catch (const std::exception& err) {
+        warn("couldn't open the build log: {}", err.what());
+    }
+
+    // an edge is submitted once all of its inputs are built, the pool only
+    // ever has runnable commands queued
+    bool failed = false;
+    std::vector<size_t> timing_of(edges.size(), SIZE_MAX);
+    auto started = std::chrono::steady_clock::now();
+    auto elapsed_ms = [&] {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - started)
+            .count();
+    };
+    {
+        ThreadPool pool(threads);
+        std::function<void(size_t)> submit = [&](size_t index) {
+            pool.submit([&, index] {
+                auto start_ms = elapsed_ms();
+                bool ok = false;
+                try {
+                    ok = run_edge(index);
+                } catch (const std::exception& err) {
+                    error("`{}` failed: {}", edges[index].output.string(),
+                          err.what());
+                }
+
+                std::lock_guard lock(m_mutex);
+                timing_of[index] = m_timings.size();
+                m_timings.push_back(EdgeTiming{.output = edges[index].output,
+                                               .start_ms = start_ms,
+                                               .end_ms = elapsed_ms()});
+                if (!ok)
+                    failed = true;
+                if (failed)
+                    return;
+                for (auto dependent : dependents[index])
+                    if (--pending[dependent] == 0)
+                        submit(dependent);
+            });
+        };
+        for (auto index : ready)
+            submit(index);
+        pool.wait();
+    }
+    for (size_t i = 0; i < edges.size(); ++i) {
+        if (timing_of[i] == SIZE_MAX)
+            continue;
+        for (auto producer : m_producers[i])
+            if (timing_of[producer] != SIZE_MAX)
+                m_timings[timing_of[i]].inputs.push_back(timing_of[producer]);
+    }
+
+    try {
+        m_log.save(m_build_dir / BUILD_LOG_NAME);
+    } catch (const std::exception& err) {
+        warn("couldn't save the build log: {}", err.what());
+    }
+
+    if (failed)
+        throw std::runtime_error("build failed");
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include "../../compile_farm.hpp"
+#include "../../object_cache.hpp"
+#include "../generator.hpp"
+#include "build_graph.hpp"
+#include "build_log.hpp"
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Brings the outputs of a `BuildGraph` up to date, running independent
+// commands in parallel (like ninja, without being a separate process).
+//
+// An output is rebuilt if it's missing, if its command changed since it was
+// last built, if any of its inputs or the headers it read last time is newer
+// than it, or if one of its inputs is rebuilt. Objects are restored from the
+// `ObjectCache` instead of compiling them when possible. With a `CompileFarm`,
+// sources are preprocessed locally and compiled on its workers while they
+// have free slots.
+class Executor {
+public:
+    Executor(const BuildGraph& graph, std::filesystem::path build_dir);
+
+    // Throws if a command failed, after the running ones have finished.
+    // Nothing new is started after a failure.
+    void run();
+
+    // When the edges that ran in `run` started and finished.
+    inline const std::vector<EdgeTiming>& timings() const {
+        return m_timings;
+    }
+
+private:
+    // Absolute path of `path`, which may be relative to the build directory.
+    std::filesystem::path resolve(const std::filesystem::path& path) const;
+
+    // Substitute `$in`, `$out` and `$depfile` in the arguments of an edge.
+    std::vector<std::string> expand(const BuildEdge& edge) const;
+
+    // Modification time in nanoseconds, nothing if the file doesn't exist.
+    // Cached, only call before running anything.
+    std::optional<int64_t> mtime(const std::string& path);
+
+    bool is_dirty(size_t index);
+
+    // Run the command of an edge and record it in the log. Returns whether
+    // it succeeded.
+    bool run_edge(size_t index);
+
+    // Preprocess the source of a compile edge and compile it on a worker. The
+    // exit code and output, nothing if it has to be compiled locally instead.
+    std::optional<std::pair<int, std::string>> compile_remotely(size_t index);
+
+    const BuildGraph& m_graph;
+    std::filesystem::path m_build_dir;
+    BuildLog m_log;
+    ObjectCache m_cache;
+    std::shared_ptr<CompileFarm> m_farm;
+
+    // Per edge.
+    std::vector<std::vector<std::string>> m_args;
+    std::vector<std::string> m_outputs;
+    std::vector<std::vector<size_t>> m_producers;
+    enum class State { unknown, visiting, clean, dirty };
+    std::vector<State> m_states;
+
+    std::unordered_map<std::string, std::optional<int64_t>> m_mtimes;
+
+    // Guards the log and the status output while running.
+    std::mutex m_mutex;
+    size_t m_finished{0};
+    size_t m_total{0};
+    std::vector<EdgeTiming> m_timings;
+};
@@ -0,0 +1,198 @@
+#include "native_gen.hpp"
+#include "../../utils.hpp"
+#include "executor.hpp"
+#include <algorithm>
+#include <cctype>
+
+#include <spdlog/spdlog.h>
+using namespace spdlog;
+
+const std::filesystem::path QOBS_FILES_DIR = "QobsFiles";
+
+// Whether `compiler` takes MSVC-style arguments (`cl.exe`, `clang-cl`).
+static bool is_msvc(std::string_view compiler) {
+    auto stem = std::filesystem::path(compiler).stem().string();
+    std::transform(stem.begin(), stem.end(), stem.begin(), [](char c) {
+        return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    });
+    return stem == "cl" || stem == "clang-cl";
+}
+
+// Literal arguments of a command line from a manifest, e.g. `cflags`.
+static std::vector<std::string> literal_args(std::string_view command) {
+    auto args = split_args(command);
+    for (auto& arg : args)
+        arg = escape_arg(arg);
+    return args;
+}
+
+// Compiler arguments, before the ones of a specific source file.
+static std::vector<std::string>
+compile_flags(std::string_view cflags,
+              const std::vector<std::filesystem::path>& include_dirs) {
+    auto args = literal_args(cflags);
+    for (auto& dir : include_dirs)
+        args.push_back(escape_arg("-I" + dir.string()));
+    return args;
+}
+
+// Add a `cc` edge for every file and return the object paths, e.g.
+// src/main.cpp turns into QobsFiles/packagename.dir/src/main.cpp.obj
+static std::vector<std::filesystem::path>
+add_compile_edges(BuildGraph& graph, const std::vector<std::string>& cc,
+                  bool msvc, const std::vector<std::string>& toolchain_flags,
+                  const std::vector<std::string>& flags,
+                  const std::vector<BuildFile>& files,
+                  const std::filesystem::path& obj_dir,
+                  const std::filesystem::path& root) {
+    std::vector<std::filesystem::path> objs;
+    objs.reserve(files.size());
+    for (auto& file : files) {
+        auto obj = obj_dir / file.path().lexically_relative(root);
+        obj += ".obj";
+
+        BuildEdge edge{
+            .description = "CC " + obj.string(),
+            .inputs = {file.path()},
+            .output = obj,
+        };
+        edge.args = cc;
+        if (msvc) {
+            edge.args.insert(edge.args.end(), {"/nologo", "/showIncludes"});
+            edge.args.insert(edge.args.end(), flags.begin(), flags.end());
+            edge.args.insert(edge.args.end(), {"/c", "$in", "/Fo$out"});
+            edge.deps = DepsStyle::msvc;
+        } else {
+            edge.args.insert(edge.args.end(), {"-MD", "-MF", "$depfile"});
+            edge.args.insert(edge.args.end(), toolchain_flags.begin(),
+                             toolchain_flags.end());
+            edge.args.insert(edge.args.end(), flags.begin(), flags.end());
+            edge.args.insert(edge.args.end(), {"-c", "$in", "-o", "$out"});
+            edge.deps = DepsStyle::gcc;
+            edge.depfile = obj;
+            edge.depfile += ".d";
+        }
+        graph.edges.push_back(std::move(edge));
+        objs.push_back(std::move(obj));
+    }
+    return objs;
+}
+
+void NativeGenerator::generate(const Manifest& manifest,
+                               const std::vector<BuildFile>& files,
+                               const std::vector<BuildLibrary>& libraries,
+                               std::string_view exe_name,
+                               std::string_view compiler) {
+    m_graph = BuildGraph();
+
+    // the package sees its own public include directories and those of
+    // every dependency
+    std::vector<std::filesystem::path> include_dirs;
+    for (auto& dir : manifest.target().include_dirs()) {
+        auto path = manifest.package_root() / dir;
+        if (std::filesystem::is_directory(path))
+            include_dirs.push_back(path);
+    }
+    for (auto& lib : libraries)
+        for (auto& dir : lib.public_include_dirs)
+            if (std::find(include_dirs.begin(), include_dirs.end(), dir) ==
+                include_dirs.end())
+                include_dirs.push_back(dir);
+
+    // the compiler may come with arguments, e.g. `ccache gcc`
+    auto cc = literal_args(compiler);
+    auto msvc = is_msvc(cc.empty() ? compiler : cc.front());
+    std::vector<std::string> toolchain_flags;
+    for (auto& flag : m_toolchain_flags)
+        toolchain_flags.push_back(escape_arg(flag));
+
+    // every dependency is its own static library with its own object
+    // directory, all in the same graph so that everything is compiled in
+    // parallel and only what changed is relinked
+    std::vector<std::filesystem::path> archives;
+    for (auto& lib : libraries) {
+        if (lib.files.empty())
+            continue; // header-only
+        if (lib.prebuilt) {
+            // from the artifact cache, nothing to compile
+            archives.push_back(*lib.prebuilt);
+            continue;
+        }
+
+        auto lib_dir = QOBS_FILES_DIR / "deps" / (lib.name + ".dir");
+        auto objs = add_compile_edges(
+            m_graph, cc, msvc, toolchain_flags,
+            compile_flags(lib.cflags, lib.include_dirs), lib.files, lib_dir,
+            lib.root);
+
+        auto archive = library_path(lib);
+        m_graph.edges.push_back(BuildEdge{
+            .args = {escape_arg(utils::find_archiver(compiler)), "rcs", "$out",
+                     "$in"},
+            .description = "AR " + archive.string(),
+            .inputs = std::move(objs),
+            .output = archive,
+        });
+        archives.push_back(std::move(archive));
+    }
+
+    // compile
+    auto obj_dir = QOBS_FILES_DIR / (manifest.package().name() + ".dir");
+    auto objs = add_compile_edges(
+        m_graph, cc, msvc, toolchain_flags,
+        compile_flags(manifest.target().cflags(), include_dirs), files,
+        obj_dir, manifest.package_root());
+
+    // link. Static libraries are searched in order, so dependents must come
+    // before their dependencies
+    for (auto it = archives.rbegin(); it != archives.rend(); ++it)
+        objs.push_back(*it);
+    BuildEdge link{
+        .args = cc,
+        .description = fmt::format("LINK {}", exe_name),
+        .inputs = std::move(objs),
+        .output = std::string(exe_name),
+    };
+    // dependencies may need to link with something too (e.g. `-lpthread`)
+    auto ldflags = literal_args(manifest.target().ldflags());
+    for (auto it = libraries.rbegin(); it != libraries.rend(); ++it) {
+        auto args = literal_args(it->ldflags);
+        ldflags.insert(ldflags.end(), args.begin(), args.end());
+    }
+    link.args.insert(link.args.end(), ldflags.begin(), ldflags.end());
+    link.args.insert(link.args.end(), {"-o", "$out", "$in"});
+    m_graph.edges.push_back(std::move(link));
+
+    m_generated = true;
+    m_files = {GeneratedFile{
+        .path = "build.qobs",
+        .code = m_graph.serialize(),
+    }};
+}
+
+void NativeGenerator::invoke(std::filesystem::path path) {
+    if (!m_generated) {
+        auto graph = BuildGraph::load(path);
+        if (!graph)
+            throw std::runtime_error(
+                fmt::format("couldn't read build graph `{}`", path.string()));
+        m_graph = std::move(*graph);
+        m_generated = true;
+    }
+
+    trace("building `{}`", path.string());
+    Executor executor(m_graph, path.parent_path());
+    m_timings.clear();
+    executor.run();
+    m_timings = executor.timings();
+}
+
+std::filesystem::path
+NativeGenerator::library_path(const BuildLibrary& lib) const {
+    auto lib_dir = QOBS_FILES_DIR / "deps" / (lib.name + ".dir");
+#ifdef QOBS_IS_WINDOWS
+    return lib_dir / (lib.name + ".lib");
+#else
+    return lib_dir / ("lib" + lib.name + ".a");
+#endif
+}
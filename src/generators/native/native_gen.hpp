@@ -0,0 +1,37 @@
+#pragma once
+#include "../generator.hpp"
+#include "build_graph.hpp"
+
+// Builds without any external build tool: the build graph is kept in memory
+// and executed by qobs itself (see `Executor`). It's also written to
+// `build.qobs`, so that a later run can execute it without generating it
+// again. Doesn't support regeneration, since only qobs can run it anyway.
+class NativeGenerator : public Generator {
+public:
+    NativeGenerator(){};
+    std::string_view name() const override {
+        return "native";
+    }
+    void generate(const Manifest& manifest, const std::vector<BuildFile>& files,
+                  const std::vector<BuildLibrary>& libraries,
+                  std::string_view exe_name,
+                  std::string_view compiler) override;
+    void invoke(std::filesystem::path path) override;
+    std::vector<EdgeTiming>
+    timings(const std::filesystem::path&) const override {
+        return m_timings;
+    }
+    std::filesystem::path
+    library_path(const BuildLibrary& lib) const override;
+    const std::vector<GeneratedFile>& files() const override {
+        return m_files;
+    };
+
+private:
+    BuildGraph m_graph;
+    // Whether `m_graph` is what `generate` produced, `invoke` loads it
+    // otherwise.
+    bool m_generated{false};
+    std::vector<GeneratedFile> m_files;
+    std::vector<EdgeTiming> m_timings;
+};
@@ -1,5 +1,13 @@
 #include "ninja_gen.hpp"
+#include "../../source_walker.hpp"
 #include "../../utils.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 #include <stdlib.h>
 
 #include <spdlog/spdlog.h>
@@ -8,7 +16,7 @@ using namespace spdlog;
 const std::filesystem::path QOBS_FILES_DIR = "QobsFiles";
 
 void NinjaGenerator::write(std::string_view code) {
-    m_code += code;
+    out() += code;
 }
 
 void NinjaGenerator::writeln(std::string_view code) {
@@ -16,73 +24,477 @@ void NinjaGenerator::writeln(std::string_view code) {
     write("\n");
 }
 
-inline std::string escape_path(std::filesystem::path path) {
-    auto str = utils::replace(path.string(), ":", "$:");
-    utils::replace_in_place(str, " ", "$ ");
+// Append `path` to `out`, escaped for ninja, in a single pass.
+static void append_path(std::string& out, std::string_view path) {
+    for (char c : path) {
+        if (c == ':' || c == ' ' || c == '$')
+            out += '$';
+        out += c;
+    }
+}
+
+inline std::string escape_path(const std::filesystem::path& path) {
+    std::string str;
+    append_path(str, path.string());
     return str;
 }
 
+// `path` relative to `root`, where `root_prefix` is `root` followed by a
+// separator. Sources are found by walking their package root, so they
+// (almost) always start with it, and a prefix check is all that's needed.
+static std::string relative_to(const std::filesystem::path& path,
+                               const std::filesystem::path& root,
+                               std::string_view root_prefix) {
+    auto str = path.string();
+    if (str.starts_with(root_prefix))
+        return str.substr(root_prefix.size());
+    return std::filesystem::relative(path, root).string();
+}
+
+// Write a `cc` edge for every file into `out` and return the escaped object
+// paths, which are computed only once and reused for the link/archive edge.
+// e.g. src/main.cpp turns into QobsFiles/packagename.dir/src/main.cpp.obj
+static std::vector<std::string>
+write_compile_edges(std::string& out, const std::vector<BuildFile>& files,
+                    const std::filesystem::path& obj_dir,
+                    const std::filesystem::path& root) {
+    auto root_prefix = root.string();
+    if (!root_prefix.empty() &&
+        root_prefix.back() != std::filesystem::path::preferred_separator)
+        root_prefix.push_back(std::filesystem::path::preferred_separator);
+    auto obj_prefix = obj_dir.string();
+    obj_prefix.push_back(std::filesystem::path::preferred_separator);
+
+    // `build <obj>: cc <src>` with the object path about as long as the
+    // source path, plus a bit for escaping
+    size_t total = 0;
+    for (auto& file : files)
+        total += file.path().native().size();
+    out.reserve(out.size() + total * 2 +
+                files.size() * (obj_prefix.size() + 24));
+
+    std::vector<std::string> objs;
+    objs.reserve(files.size());
+    std::string obj;
+    for (auto& file : files) {
+        obj.assign(obj_prefix);
+        obj += relative_to(file.path(), root, root_prefix);
+        obj += ".obj";
+
+        auto& escaped = objs.emplace_back();
+        escaped.reserve(obj.size());
+        append_path(escaped, obj);
+
+        out += "build ";
+        out += escaped;
+        out += ": cc ";
+        append_path(out, file.path().string());
+        out += '\n';
+    }
+    return objs;
+}
+
+// Write ` <path>` for every path.
+static void append_paths(std::string& out,
+                         const std::vector<std::string>& paths) {
+    size_t total = 0;
+    for (auto& path : paths)
+        total += path.size() + 1;
+    out.reserve(out.size() + total + 1);
+    for (auto& path : paths) {
+        out += ' ';
+        out += path;
+    }
+}
+
+// Escape `$` in variable values.
+static std::string escape_value(std::string_view value) {
+    return utils::replace(std::string(value), "$", "$$");
+}
+
+// `-I` flags for `dirs`, quoted for the shell where needed.
+static std::string
+include_flags(const std::vector<std::filesystem::path>& dirs) {
+    std::string flags;
+    for (auto& dir : dirs) {
+        auto str = dir.string();
+        if (!flags.empty())
+            flags += ' ';
+        if (str.find(' ') != std::string::npos)
+            flags += fmt::format("-I\"{}\"", str);
+        else
+            flags += "-I" + str;
+    }
+    return flags;
+}
+
+// Join non-empty flag strings with spaces.
+template <typename... Args> static std::string join_flags(Args&&... args) {
+    std::string out;
+    for (std::string_view flags : {std::string_view(args)...}) {
+        if (flags.empty())
+            continue;
+        if (!out.empty())
+            out += ' ';
+        out += flags;
+    }
+    return out;
+}
+
+// Quote a command line argument for the shell ninja runs commands with.
+static std::string quote_arg(std::string_view arg) {
+    if (!arg.empty() && arg.find_first_of(" \t\"'\\&|;<>()$`") ==
+                            std::string_view::npos)
+        return std::string(arg);
+#ifdef QOBS_IS_WINDOWS
+    return fmt::format("\"{}\"", utils::replace(std::string(arg), "\"", "\\\""));
+#else
+    return fmt::format("'{}'", utils::replace(std::string(arg), "'", "'\\''"));
+#endif
+}
+
+// Whether `compiler` takes MSVC-style arguments (`cl.exe`, `clang-cl`).
+static bool is_msvc(std::string_view compiler) {
+    auto stem = std::filesystem::path(compiler).stem().string();
+    std::transform(stem.begin(), stem.end(), stem.begin(), [](char c) {
+        return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    });
+    return stem == "cl" || stem == "clang-cl";
+}
+
 void NinjaGenerator::generate(const Manifest& manifest,
                               const std::vector<BuildFile>& files,
+                              const std::vector<BuildLibrary>& libraries,
                               std::string_view exe_name,
                               std::string_view compiler) {
+    m_files = {GeneratedFile{.path = "build.ninja"}};
+    m_current = 0;
+
     writeln("# This file is automatically @generated by Qobs: DO NOT EDIT!");
-    writeln("ninja_required_version = 1.1");
+    writeln("ninja_required_version = 1.3");
+
+    // the package sees its own public include directories and those of
+    // every dependency
+    std::vector<std::filesystem::path> include_dirs;
+    for (auto& dir : manifest.target().include_dirs()) {
+        auto path = manifest.package_root() / dir;
+        if (std::filesystem::is_directory(path))
+            include_dirs.push_back(path);
+    }
+    for (auto& lib : libraries)
+        for (auto& dir : lib.public_include_dirs)
+            if (std::find(include_dirs.begin(), include_dirs.end(), dir) ==
+                include_dirs.end())
+                include_dirs.push_back(dir);
+
+    // dependencies may need to link with something too (e.g. `-lpthread`)
+    std::string ldflags = manifest.target().ldflags();
+    for (auto it = libraries.rbegin(); it != libraries.rend(); ++it)
+        ldflags = join_flags(ldflags, it->ldflags);
 
     // write variables
     write("cflags = ");
-    writeln(manifest.target().cflags());
+    writeln(escape_value(join_flags(manifest.target().cflags(),
+                                    include_flags(include_dirs))));
     write("ldflags = ");
-    writeln(manifest.target().ldflags());
+    writeln(escape_value(ldflags));
+    std::string toolchain_flags;
+    for (auto& flag : m_toolchain_flags)
+        toolchain_flags = join_flags(toolchain_flags, quote_arg(flag));
+    write("toolchain_flags = ");
+    writeln(escape_value(toolchain_flags));
     write("cc = ");
     writeln(compiler);
+    write("ar = ");
+    writeln(escape_value(utils::find_archiver(compiler)));
 
     // write rules
     writeln("\n# rules");
+    // let ninja know which headers every TU includes, so that editing a
+    // header rebuilds exactly the TUs that use it. Ninja moves the
+    // dependencies into its own log, the depfiles are only read once
     writeln("rule cc");
-    writeln("  command = $cc $cflags -c $in -o $out");
+    if (is_msvc(compiler)) {
+        writeln("  command = $cc /nologo /showIncludes $cflags /c $in /Fo$out");
+        writeln("  deps = msvc");
+    } else {
+        // through `qobs cc`, which restores objects from the object cache
+        std::string launcher;
+        for (auto& arg : m_compile_launcher)
+            launcher += escape_value(quote_arg(arg)) + ' ';
+        if (!launcher.empty())
+            launcher += "--in $in --out $out --depfile $out.d -- ";
+        writeln(fmt::format("  command = {}$cc -MD -MF $out.d $toolchain_flags "
+                            "$cflags -c $in -o $out",
+                            launcher));
+        writeln("  depfile = $out.d");
+        writeln("  deps = gcc");
+    }
     writeln("  description = CC $out");
 
+    writeln("rule ar");
+#ifdef QOBS_IS_WINDOWS
+    writeln("  command = cmd /c if exist $out del $out && $ar rcs $out $in");
+#else
+    // start from scratch, otherwise objects of deleted sources stay around
+    writeln("  command = rm -f $out && $ar rcs $out $in");
+#endif
+    writeln("  description = AR $out");
+
     writeln("rule link");
     writeln("  command = $cc $ldflags -o $out $in");
     writeln("  description = LINK $out");
 
+    // every dependency is its own static library with its own object
+    // directory, all in the same graph so that ninja can compile everything
+    // in parallel and only relink what changed
+    std::vector<std::string> archives;
+    for (auto& lib : libraries) {
+        if (lib.files.empty())
+            continue; // header-only
+        if (lib.prebuilt) {
+            // from the artifact cache, nothing to compile
+            writeln(fmt::format("\n# dependency `{}` (prebuilt)", lib.name));
+            archives.push_back(escape_path(*lib.prebuilt));
+            continue;
+        }
+
+        // every dependency goes into its own file, so that changing one
+        // doesn't rewrite the whole graph. Variables set in a `subninja` are
+        // scoped to it, so `cflags` only applies to the dependency
+        auto subninja = QOBS_FILES_DIR / "deps" / (lib.name + ".ninja");
+        writeln(fmt::format("\n# dependency `{}`", lib.name));
+        writeln(fmt::format("subninja {}", escape_path(subninja)));
+        auto parent = m_current;
+        m_current = m_files.size();
+        m_files.push_back(GeneratedFile{.path = subninja});
+
+        // e.g. `QobsFiles/deps/fmt.dir/`
+        auto lib_dir = QOBS_FILES_DIR / "deps" / (lib.name + ".dir");
+        writeln(fmt::format(
+            "# This file is automatically @generated by Qobs: DO NOT EDIT!\n"
+            "# dependency `{}`",
+            lib.name));
+        writeln(fmt::format("cflags = {}",
+                            escape_value(join_flags(
+                                lib.cflags, include_flags(lib.include_dirs)))));
+        auto objs = write_compile_edges(out(), lib.files, lib_dir, lib.root);
+
+        auto archive = escape_path(library_path(lib));
+        write(fmt::format("build {}: ar", archive));
+        append_paths(out(), objs);
+        writeln();
+        archives.push_back(std::move(archive));
+        m_current = parent;
+    }
+
     // obj_dir will be the directory where build files where go, e.g.
     // `QobsFiles/packagedir.dir`
     auto obj_dir = QOBS_FILES_DIR / (manifest.package().name() + ".dir");
 
-    // get object path, e.g.: src/main.cpp turns into
-    // QobsFiles/packagename.dir/src/main.cpp.obj
-    auto get_obj_path = [&](std::filesystem::path path) {
-        return escape_path(obj_dir / std::filesystem::relative(
-                                         path, manifest.package_root())) +
-               ".obj";
-    };
-
     // compile
     writeln("\n# compile source files");
-    for (auto& file : files) {
-        writeln(fmt::format("build {}: cc {}", get_obj_path(file.path()),
-                            escape_path(file.path())));
-    }
+    auto objs =
+        write_compile_edges(out(), files, obj_dir, manifest.package_root());
 
     // link
     writeln(fmt::format("\n# link the executable `{}`", exe_name));
     write(fmt::format("build {}: link", exe_name));
-    for (auto& file : files) {
+    append_paths(out(), objs);
+
+    // static libraries are searched in order, so dependents must come before
+    // their dependencies
+    for (auto it = archives.rbegin(); it != archives.rend(); ++it) {
         write(" ");
-        write(get_obj_path(file.path()));
+        write(*it);
     }
 
     // set variables for link
     writeln();
+
+    if (m_regeneration)
+        write_regeneration(*m_regeneration);
+}
+
+void NinjaGenerator::write_regeneration(const Regeneration& regeneration) {
+    // ninja checks whether its own manifest is out of date before building
+    // anything, and reloads it after running this edge. `restat` makes ninja
+    // notice when regenerating didn't change any file (they're only written
+    // if their contents change), so it doesn't keep regenerating
+    std::string command;
+    for (auto& arg : regeneration.command) {
+        if (!command.empty())
+            command += ' ';
+        command += quote_arg(arg);
+    }
+    writeln("\n# regenerate the build files when the manifest or sources change");
+    writeln("rule regenerate");
+    writeln(fmt::format("  command = {}", escape_value(command)));
+    writeln("  description = Regenerating build files");
+    writeln("  generator = 1");
+    writeln("  restat = 1");
+
+    write("build");
+    for (auto& file : m_files) {
+        write(" ");
+        write(escape_path(file.path));
+    }
+    write(": regenerate");
+    for (auto& input : regeneration.inputs) {
+        write(" ");
+        write(escape_path(input));
+    }
+    writeln();
+
+    // an input that's deleted (a source directory, a dependency's manifest,
+    // a cache entry) must regenerate the build files instead of failing with
+    // "missing and no known rule to make it"
+    std::unordered_set<std::string> phony;
+    for (auto& input : regeneration.inputs) {
+        auto path = escape_path(input);
+        if (phony.insert(path).second)
+            writeln(fmt::format("build {}: phony", path));
+    }
+}
+
+std::filesystem::path
+NinjaGenerator::library_path(const BuildLibrary& lib) const {
+    auto lib_dir = QOBS_FILES_DIR / "deps" / (lib.name + ".dir");
+#ifdef QOBS_IS_WINDOWS
+    return lib_dir / (lib.name + ".lib");
+#else
+    return lib_dir / ("lib" + lib.name + ".a");
+#endif
 }
 
 void NinjaGenerator::invoke(std::filesystem::path path) {
     auto cwd = path.parent_path();
     trace("invoking ninja in `{}`", cwd.string());
 
+    // remember where this build's entries of `.ninja_log` will start
+    auto log = cwd / ".ninja_log";
+    std::error_code ec;
+    m_log_size = std::filesystem::file_size(log, ec);
+    if (ec)
+        m_log_size = 0;
+    auto stamp = dir_stamp(log);
+    m_log_inode = stamp ? stamp->inode : 0;
+    m_invoked_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count();
+
     // TODO: make this use `utils::popen`
-    system(fmt::format("ninja -C \"{}\" -f \"{}\"", cwd.string(), path.string())
-               .c_str());
+    int result = system(
+        fmt::format("ninja -C \"{}\" -f \"{}\"", cwd.string(), path.string())
+            .c_str());
+    if (result != 0)
+        throw std::runtime_error(
+            fmt::format("ninja failed (exit status {})", result));
+}
+
+// Outputs passed to a single `ninja -t query`, to stay well below the limit
+// on the length of a command line.
+constexpr size_t QUERY_BATCH = 1000;
+
+// Fill in the `inputs` of `timings` from what `ninja -t query` says about
+// their edges. `indices` maps an output to its timing.
+static void
+query_inputs(std::vector<EdgeTiming>& timings,
+             const std::filesystem::path& build_dir,
+             const std::unordered_map<std::string, size_t>& indices) {
+    for (size_t begin = 0; begin < timings.size(); begin += QUERY_BATCH) {
+        std::vector<std::string> args = {"ninja", "-C", build_dir.string(),
+                                         "-t", "query"};
+        auto end = std::min(timings.size(), begin + QUERY_BATCH);
+        for (size_t i = begin; i < end; ++i)
+            args.push_back(timings[i].output.string());
+        auto [code, output] = utils::run_captured(args);
+        if (code != 0) {
+            debug("`ninja -t query` failed, the critical path won't know the "
+                  "dependencies: {}",
+                  output);
+            return;
+        }
+
+        // `<output>:`, then `  input: <rule>` followed by the inputs, indented
+        // and prefixed with `| ` (implicit) or `|| ` (order-only), then
+        // `  outputs:` and what the output is an input of
+        EdgeTiming* current = nullptr;
+        bool in_inputs = false;
+        std::istringstream in(output);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (!line.starts_with(' ')) {
+                in_inputs = false;
+                auto it = line.ends_with(':')
+                              ? indices.find(line.substr(0, line.size() - 1))
+                              : indices.end();
+                current = it != indices.end() ? &timings[it->second] : nullptr;
+            } else if (!line.starts_with("    ")) {
+                in_inputs = line.starts_with("  input:");
+            } else if (current && in_inputs) {
+                std::string_view input(line);
+                input.remove_prefix(4);
+                if (input.starts_with("|| "))
+                    input.remove_prefix(3);
+                else if (input.starts_with("| "))
+                    input.remove_prefix(2);
+                auto it = indices.find(std::string(input));
+                if (it != indices.end())
+                    current->inputs.push_back(it->second);
+            }
+        }
+    }
+}
+
+std::vector<EdgeTiming>
+NinjaGenerator::timings(const std::filesystem::path& build_dir) const {
+    auto log = build_dir / ".ninja_log";
+    std::ifstream file(log);
+    if (!file)
+        return {};
+
+    // ninja only appends to the log, unless it recompacted it (into a new
+    // file) at the start of the build. Then this build's edges are the ones
+    // whose output is newer than the build, which needs a log written by
+    // ninja 1.10 or later (mtimes in nanoseconds)
+    std::error_code ec;
+    auto size = std::filesystem::file_size(log, ec);
+    auto stamp = dir_stamp(log);
+    bool appended = !ec && size >= m_log_size && stamp &&
+                    stamp->inode == m_log_inode;
+    if (appended)
+        file.seekg(static_cast<std::streamoff>(m_log_size));
+    else
+        debug("`{}` was rewritten, filtering it by mtime", log.string());
+
+    // `start end mtime output hash`, tab-separated
+    std::vector<EdgeTiming> timings;
+    std::unordered_map<std::string, size_t> indices;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.starts_with('#'))
+            continue;
+        std::istringstream in(line);
+        EdgeTiming timing;
+        int64_t mtime = 0;
+        std::string output;
+        if (!(in >> timing.start_ms >> timing.end_ms >> mtime) ||
+            !std::getline(in.ignore(), output, '\t'))
+            continue;
+        if (!appended && mtime < m_invoked_ns)
+            continue;
+        timing.output = output;
+        // an output built twice (e.g. after regenerating) counts once
+        auto [it, inserted] = indices.emplace(output, timings.size());
+        if (inserted)
+            timings.push_back(std::move(timing));
+        else
+            timings[it->second] = std::move(timing);
+    }
+
+    query_inputs(timings, build_dir, indices);
+    return timings;
 }
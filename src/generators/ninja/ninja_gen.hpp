@@ -4,17 +4,46 @@
 class NinjaGenerator : public Generator {
 public:
     NinjaGenerator(){};
+    std::string_view name() const override {
+        return "ninja";
+    }
     void generate(const Manifest& manifest, const std::vector<BuildFile>& files,
+                  const std::vector<BuildLibrary>& libraries,
                   std::string_view exe_name,
                   std::string_view compiler) override;
     void invoke(std::filesystem::path path) override;
-    std::string& code() override {
-        return m_code;
+    // From what the last `invoke` appended to `.ninja_log`, with the inputs
+    // ninja reports for every edge.
+    std::vector<EdgeTiming>
+    timings(const std::filesystem::path& build_dir) const override;
+    std::filesystem::path
+    library_path(const BuildLibrary& lib) const override;
+    const std::vector<GeneratedFile>& files() const override {
+        return m_files;
     };
 
 private:
+    // The file being written.
+    inline std::string& out() {
+        return m_files[m_current].code;
+    }
     void write(std::string_view code);
     void writeln(std::string_view code = "");
 
-    std::string m_code;
+    // A `generator` edge that reruns qobs when the inputs change. Goes into
+    // `build.ninja` after everything else, since it lists all generated files.
+    void write_regeneration(const Regeneration& regeneration);
+
+    // `build.ninja` first, then a `subninja` for every dependency.
+    std::vector<GeneratedFile> m_files;
+
+    // Index of the file `write` appends to.
+    size_t m_current{0};
+
+    // `.ninja_log` right before the last `invoke`: its size and inode (ninja
+    // rewrites it when it recompacts it), and when ninja was started, in
+    // nanoseconds since the epoch.
+    uintmax_t m_log_size{0};
+    uint64_t m_log_inode{0};
+    int64_t m_invoked_ns{0};
 };
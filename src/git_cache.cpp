@@ -0,0 +1,224 @@
+#include "git_cache.hpp"
+#include "hash.hpp"
+#include "utils.hpp"
+#include <fstream>
+
+using namespace spdlog;
+
+static int sideband_progress(const char* str, int len, void* payload) {
+    auto bar = static_cast<MultiProgress::Bar*>(payload);
+    bar->message(std::string_view(str, static_cast<size_t>(len)));
+    return 0;
+}
+
+static int fetch_progress(const git_indexer_progress* stats, void* payload) {
+    auto bar = static_cast<MultiProgress::Bar*>(payload);
+    if (stats->total_objects == 0)
+        return 0;
+    auto progress = static_cast<double>(stats->received_objects) /
+                    static_cast<double>(stats->total_objects);
+    bar->update("fetching", progress);
+    return 0;
+}
+
+static void checkout_progress(const char* path, size_t cur, size_t tot,
+                              void* payload) {
+    auto bar = static_cast<MultiProgress::Bar*>(payload);
+    if (tot == 0)
+        return;
+    auto progress = static_cast<double>(cur) / static_cast<double>(tot);
+    bar->update("checkout", progress);
+}
+
+// `https://github.com/nlohmann/json.git` -> `json`
+static std::string repo_name(std::string_view url) {
+    auto pos = url.find_last_of("/:");
+    if (pos != std::string_view::npos)
+        url.remove_prefix(pos + 1);
+    if (url.ends_with(".git"))
+        url.remove_suffix(4);
+    return url.empty() ? "repo" : std::string(url);
+}
+
+GitMirror::GitMirror(std::string url) : m_url(std::move(url)) {
+    // `.../json` and `.../json.git` are the same remote
+    std::string_view key = m_url;
+    if (key.ends_with(".git"))
+        key.remove_suffix(4);
+
+    m_path = utils::cache_dir() / "git" /
+             fmt::format("{}-{}", repo_name(m_url),
+                         Sha256::hex(key).substr(0, 16));
+}
+
+GitPtr<git_repository> GitMirror::open_or_init() {
+    utils::git_init_once();
+    auto path_str = m_path.string();
+
+    git_repository* repo = nullptr;
+    if (std::filesystem::exists(m_path / "HEAD")) {
+        utils::check_lg2(git_repository_open_bare(&repo, path_str.c_str()),
+                         "couldn't open git mirror");
+    } else {
+        debug("creating git mirror for {} in `{}`", m_url, path_str);
+        std::filesystem::create_directories(m_path);
+        utils::check_lg2(git_repository_init(&repo, path_str.c_str(), 1),
+                         "couldn't create git mirror");
+    }
+    return GitPtr<git_repository>(repo);
+}
+
+void GitMirror::fetch(const std::vector<std::string>& refspecs, int depth,
+                      MultiProgress::Bar& bar) {
+    // other threads and qobs processes may be updating the same mirror
+    utils::FileLock lock(m_path.string() + ".lock");
+    auto repo = open_or_init();
+
+    git_remote* remote_ptr = nullptr;
+    if (git_remote_lookup(&remote_ptr, repo.get(), "origin") != 0) {
+        utils::check_lg2(git_remote_create_with_fetchspec(
+                             &remote_ptr, repo.get(), "origin", m_url.c_str(),
+                             "+refs/heads/*:refs/heads/*"),
+                         "couldn't add remote to git mirror");
+    }
+    GitPtr<git_remote> remote(remote_ptr);
+
+    git_fetch_options fetch_opts = GIT_FETCH_OPTIONS_INIT;
+    fetch_opts.callbacks.sideband_progress = sideband_progress;
+    fetch_opts.callbacks.transfer_progress = fetch_progress;
+    // TODO: fetch_opts.callbacks.credentials = cred_acquire_cb;
+    fetch_opts.callbacks.payload = &bar;
+    // only ever fetch what was asked for: no tag following, and no pruning
+    // of refs fetched earlier for other dependencies
+    fetch_opts.prune = GIT_FETCH_NO_PRUNE;
+    fetch_opts.download_tags = GIT_REMOTE_DOWNLOAD_TAGS_NONE;
+    fetch_opts.depth = depth > 0 ? depth : GIT_FETCH_DEPTH_UNSHALLOW;
+
+    std::vector<const char*> refspec_ptrs;
+    for (auto& refspec : refspecs)
+        refspec_ptrs.push_back(refspec.c_str());
+    git_strarray refspec_array{const_cast<char**>(refspec_ptrs.data()),
+                               refspec_ptrs.size()};
+
+    debug("fetching [{}] from {} into `{}` (depth {})",
+          fmt::join(refspecs, ", "), m_url, m_path.string(), depth);
+    bar.update("fetching", 0.0);
+    utils::check_lg2(
+        git_remote_fetch(remote.get(), &refspec_array, &fetch_opts, nullptr),
+        fmt::format("couldn't fetch {}", m_url));
+}
+
+git_oid GitMirror::resolve(const std::string& revspec) {
+    auto repo = open_or_init();
+
+    git_object* obj_ptr = nullptr;
+    utils::check_lg2(git_revparse_single(&obj_ptr, repo.get(), revspec.c_str()),
+                     fmt::format("couldn't find `{}` in {}", revspec, m_url));
+    GitPtr<git_object> obj(obj_ptr);
+
+    // tags may be annotated, peel them down to the commit
+    git_object* commit_ptr = nullptr;
+    utils::check_lg2(git_object_peel(&commit_ptr, obj.get(), GIT_OBJECT_COMMIT),
+                     fmt::format("`{}` is not a commit", revspec));
+    GitPtr<git_object> commit(commit_ptr);
+    return *git_object_id(commit.get());
+}
+
+std::optional<git_oid> GitMirror::try_resolve(const std::string& revspec) {
+    if (!std::filesystem::exists(m_path / "HEAD"))
+        return std::nullopt;
+    try {
+        return resolve(revspec);
+    } catch (const std::exception& err) {
+        trace("{}: {}", m_url, err.what());
+        return std::nullopt;
+    }
+}
+
+std::pair<std::string, std::string>
+GitMirror::tree_digest(const git_oid& commit_id) {
+    auto repo = open_or_init();
+
+    git_commit* commit_ptr = nullptr;
+    utils::check_lg2(git_commit_lookup(&commit_ptr, repo.get(), &commit_id),
+                     "couldn't look up commit");
+    GitPtr<git_commit> commit(commit_ptr);
+
+    git_tree* tree_ptr = nullptr;
+    utils::check_lg2(git_commit_tree(&tree_ptr, commit.get()),
+                     "couldn't look up commit tree");
+    GitPtr<git_tree> tree(tree_ptr);
+
+    // entries are walked in git's (sorted) order, so this is deterministic
+    Sha256 sha;
+    auto walk_cb = [](const char* root, const git_tree_entry* entry,
+                      void* payload) -> int {
+        if (git_tree_entry_type(entry) == GIT_OBJECT_TREE)
+            return 0;
+        auto sha = static_cast<Sha256*>(payload);
+        sha->update_field(fmt::format("{:o}", static_cast<unsigned>(
+                                                   git_tree_entry_filemode(entry))));
+        sha->update_field(fmt::format("{}{}", root, git_tree_entry_name(entry)));
+        sha->update_field(git_oid_tostr_s(git_tree_entry_id(entry)));
+        return 0;
+    };
+    utils::check_lg2(git_tree_walk(tree.get(), GIT_TREEWALK_PRE, walk_cb, &sha),
+                     "couldn't walk commit tree");
+
+    return {git_oid_tostr_s(git_commit_tree_id(commit.get())),
+            "sha256:" + sha.hex_digest()};
+}
+
+void GitMirror::checkout(const std::filesystem::path& dest,
+                         const git_oid& commit, MultiProgress::Bar& bar) {
+    utils::git_init_once();
+    auto dest_str = dest.string();
+    bool fresh = !std::filesystem::exists(dest / ".git");
+
+    git_repository* repo_ptr = nullptr;
+    if (fresh) {
+        std::filesystem::create_directories(dest);
+        utils::check_lg2(git_repository_init(&repo_ptr, dest_str.c_str(), 0),
+                         "couldn't initialize dependency repository");
+        git_remote* remote = nullptr;
+        if (git_remote_create(&remote, repo_ptr, "origin", m_url.c_str()) == 0)
+            git_remote_free(remote);
+        git_repository_free(repo_ptr);
+        repo_ptr = nullptr;
+    }
+
+    // borrow objects from the mirror instead of copying them. This has to be
+    // written before the repository's object database is loaded
+    auto alternates = (m_path / "objects").generic_string();
+    auto alternates_path = dest / ".git" / "objects" / "info" / "alternates";
+    std::filesystem::create_directories(alternates_path.parent_path());
+    {
+        std::ofstream file(alternates_path, std::ios::out | std::ios::trunc);
+        file << alternates << '\n';
+    }
+
+    utils::check_lg2(git_repository_open(&repo_ptr, dest_str.c_str()),
+                     "couldn't open dependency repository");
+    GitPtr<git_repository> repo(repo_ptr);
+
+    git_object* target_ptr = nullptr;
+    utils::check_lg2(git_object_lookup(&target_ptr, repo.get(), &commit,
+                                       GIT_OBJECT_COMMIT),
+                     "couldn't find commit to check out");
+    GitPtr<git_object> target(target_ptr);
+
+    git_checkout_options checkout_opts = GIT_CHECKOUT_OPTIONS_INIT;
+    // never overwrite local modifications in an existing checkout
+    checkout_opts.checkout_strategy =
+        fresh ? GIT_CHECKOUT_FORCE
+              : GIT_CHECKOUT_SAFE | GIT_CHECKOUT_RECREATE_MISSING;
+    checkout_opts.progress_cb = checkout_progress;
+    checkout_opts.progress_payload = &bar;
+
+    bar.update("checkout", 0.0);
+    utils::check_lg2(
+        git_checkout_tree(repo.get(), target.get(), &checkout_opts),
+        fmt::format("couldn't check out {}", git_oid_tostr_s(&commit)));
+    utils::check_lg2(git_repository_set_head_detached(repo.get(), &commit),
+                     "couldn't update HEAD");
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include "progress.hpp"
+#include <filesystem>
+#include <git2.h>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Frees libgit2 objects, use with `GitPtr`.
+struct GitDeleter {
+    void operator()(git_repository* p) const {
+        git_repository_free(p);
+    }
+    void operator()(git_remote* p) const {
+        git_remote_free(p);
+    }
+    void operator()(git_object* p) const {
+        git_object_free(p);
+    }
+    void operator()(git_commit* p) const {
+        git_commit_free(p);
+    }
+    void operator()(git_tree* p) const {
+        git_tree_free(p);
+    }
+};
+
+template <typename T> using GitPtr = std::unique_ptr<T, GitDeleter>;
+
+// A bare mirror of a git remote in the per-user cache
+// (`<cache dir>/git/<repo name>-<hash of url>`), shared by every project and
+// build directory on the machine. Fetches into the mirror are incremental,
+// and `_deps` checkouts borrow its objects through `objects/info/alternates`,
+// so checking out a dependency never copies or downloads objects again.
+// Dependencies pinned to a tag or commit only fetch that ref at depth 1, so
+// the mirror may be shallow.
+class GitMirror {
+public:
+    explicit GitMirror(std::string url);
+
+    inline const std::filesystem::path& path() const {
+        return m_path;
+    }
+
+    // Fetch `refspecs` from the remote into the mirror (creating it if
+    // needed). `depth` limits the history depth of what is fetched, 0 fetches
+    // the full history (and unshallows what was fetched shallowly before).
+    // Throws on failure.
+    void fetch(const std::vector<std::string>& refspecs, int depth,
+               MultiProgress::Bar& bar);
+
+    // Resolve a revspec (`HEAD`, a (short) commit hash, `refs/tags/v1.0`) to a
+    // commit id in the mirror. Throws if it doesn't exist.
+    git_oid resolve(const std::string& revspec);
+
+    // Like `resolve`, but returns nothing instead of throwing, e.g. when the
+    // mirror doesn't exist yet or doesn't have the commit.
+    std::optional<git_oid> try_resolve(const std::string& revspec);
+
+    // Tree id of `commit` and a SHA-256 digest (`sha256:<hex>`) of every path,
+    // mode and blob id in that tree, independent of the hash git uses.
+    std::pair<std::string, std::string> tree_digest(const git_oid& commit);
+
+    // Check out `commit` into the non-bare repository at `dest`, creating it
+    // if it doesn't exist. HEAD is detached at `commit`. Throws on failure.
+    void checkout(const std::filesystem::path& dest, const git_oid& commit,
+                  MultiProgress::Bar& bar);
+
+private:
+    GitPtr<git_repository> open_or_init();
+
+    std::string m_url;
+    std::filesystem::path m_path;
+};
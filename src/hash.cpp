@@ -0,0 +1,152 @@
+#include "hash.hpp"
+#include <cstring>
+#include <fmt/core.h>
+#include <fstream>
+#include <stdexcept>
+
+static constexpr std::array<uint32_t, 64> K{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+Sha256::Sha256()
+    : m_state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+              0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19} {}
+
+void Sha256::process_block(const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t(block[i * 4]) << 24) |
+               (uint32_t(block[i * 4 + 1]) << 16) |
+               (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 =
+            rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 =
+            rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    auto [a, b, c, d, e, f, g, h] = m_state;
+    for (int i = 0; i < 64; ++i) {
+        uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + K[i] + w[i];
+        uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+    m_state[4] += e;
+    m_state[5] += f;
+    m_state[6] += g;
+    m_state[7] += h;
+}
+
+Sha256& Sha256::update(const void* data, size_t size) {
+    auto bytes = static_cast<const uint8_t*>(data);
+    m_total_len += size;
+
+    // fill up a partially filled block first
+    if (m_buffer_len) {
+        auto n = std::min(size, m_buffer.size() - m_buffer_len);
+        std::memcpy(m_buffer.data() + m_buffer_len, bytes, n);
+        m_buffer_len += n;
+        bytes += n;
+        size -= n;
+        if (m_buffer_len < m_buffer.size())
+            return *this;
+        process_block(m_buffer.data());
+        m_buffer_len = 0;
+    }
+
+    // hash whole blocks straight from the input
+    while (size >= 64) {
+        process_block(bytes);
+        bytes += 64;
+        size -= 64;
+    }
+
+    std::memcpy(m_buffer.data(), bytes, size);
+    m_buffer_len = size;
+    return *this;
+}
+
+Sha256::Digest Sha256::finalize() {
+    uint64_t bit_len = m_total_len * 8;
+
+    // padding: 0x80, zeroes, then the 64-bit big endian message length
+    uint8_t pad[72] = {0x80};
+    size_t pad_len = (m_buffer_len < 56 ? 56 : 120) - m_buffer_len;
+    for (int i = 0; i < 8; ++i)
+        pad[pad_len + i] = static_cast<uint8_t>(bit_len >> (56 - i * 8));
+    update(pad, pad_len + 8);
+
+    Digest digest;
+    for (size_t i = 0; i < 8; ++i) {
+        digest[i * 4] = static_cast<uint8_t>(m_state[i] >> 24);
+        digest[i * 4 + 1] = static_cast<uint8_t>(m_state[i] >> 16);
+        digest[i * 4 + 2] = static_cast<uint8_t>(m_state[i] >> 8);
+        digest[i * 4 + 3] = static_cast<uint8_t>(m_state[i]);
+    }
+    return digest;
+}
+
+std::string Sha256::hex_digest() {
+    return to_hex(finalize());
+}
+
+std::string Sha256::to_hex(const Digest& digest) {
+    static constexpr char HEX[] = "0123456789abcdef";
+    std::string out(digest.size() * 2, '\0');
+    for (size_t i = 0; i < digest.size(); ++i) {
+        out[i * 2] = HEX[digest[i] >> 4];
+        out[i * 2 + 1] = HEX[digest[i] & 0xf];
+    }
+    return out;
+}
+
+std::string Sha256::hex(std::string_view data) {
+    return Sha256().update(data).hex_digest();
+}
+
+std::string Sha256::hex_file(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file)
+        throw std::runtime_error(
+            fmt::format("couldn't open `{}` for hashing", path.string()));
+
+    Sha256 sha;
+    char buf[64 * 1024];
+    while (file) {
+        file.read(buf, sizeof(buf));
+        sha.update(buf, static_cast<size_t>(file.gcount()));
+    }
+    return sha.hex_digest();
+}
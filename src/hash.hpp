@@ -0,0 +1,47 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+// Incremental SHA-256 (FIPS 180-4). Used for content addressing: cache keys,
+// lockfile digests and archive verification.
+class Sha256 {
+public:
+    using Digest = std::array<uint8_t, 32>;
+
+    Sha256();
+
+    Sha256& update(const void* data, size_t size);
+    inline Sha256& update(std::string_view data) {
+        return update(data.data(), data.size());
+    }
+
+    // Hash a string followed by a separator that can't occur in it, so
+    // that ("ab", "c") and ("a", "bc") don't hash to the same value.
+    inline Sha256& update_field(std::string_view data) {
+        update(data);
+        return update("\0", 1);
+    }
+
+    // Finish hashing. The object must not be updated after this.
+    Digest finalize();
+    std::string hex_digest();
+
+    static std::string to_hex(const Digest& digest);
+
+    // Convenience one-shot helpers.
+    static std::string hex(std::string_view data);
+
+    // Throws std::runtime_error if the file couldn't be read.
+    static std::string hex_file(const std::filesystem::path& path);
+
+private:
+    void process_block(const uint8_t* block);
+
+    std::array<uint32_t, 8> m_state;
+    std::array<uint8_t, 64> m_buffer;
+    size_t m_buffer_len{0};
+    uint64_t m_total_len{0};
+};
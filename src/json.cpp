@@ -0,0 +1,243 @@
+#include "json.hpp"
+#include <charconv>
+#include <cstdint>
+#include <fmt/core.h>
+#include <stdexcept>
+
+// Traces are nested a few levels deep, anything deeper is not worth a stack
+// overflow.
+constexpr size_t MAX_JSON_DEPTH = 256;
+
+const JsonValue* JsonValue::get(std::string_view key) const {
+    for (auto& [name, value] : object)
+        if (name == key)
+            return &value;
+    return nullptr;
+}
+
+namespace {
+
+class JsonParser {
+public:
+    JsonParser(std::string_view text) : m_text(text) {}
+
+    JsonValue parse_document() {
+        auto value = parse_value(0);
+        skip_whitespace();
+        if (m_pos != m_text.size())
+            fail("trailing characters");
+        return value;
+    }
+
+private:
+    [[noreturn]] void fail(std::string_view what) const {
+        throw std::runtime_error(
+            fmt::format("invalid JSON at offset {}: {}", m_pos, what));
+    }
+
+    void skip_whitespace() {
+        while (m_pos < m_text.size() &&
+               (m_text[m_pos] == ' ' || m_text[m_pos] == '\t' ||
+                m_text[m_pos] == '\n' || m_text[m_pos] == '\r'))
+            ++m_pos;
+    }
+
+    // Skip whitespace and `c`, returns whether it was there.
+    bool consume(char c) {
+        skip_whitespace();
+        if (m_pos < m_text.size() && m_text[m_pos] == c) {
+            ++m_pos;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if (!consume(c))
+            fail(fmt::format("expected `{}`", c));
+    }
+
+    bool consume_word(std::string_view word) {
+        if (!m_text.substr(m_pos).starts_with(word))
+            return false;
+        m_pos += word.size();
+        return true;
+    }
+
+    JsonValue parse_value(size_t depth) {
+        if (depth > MAX_JSON_DEPTH)
+            fail("too deeply nested");
+        skip_whitespace();
+        if (m_pos == m_text.size())
+            fail("unexpected end");
+
+        JsonValue value;
+        char c = m_text[m_pos];
+        if (c == '{') {
+            ++m_pos;
+            value.type = JsonValue::Type::object;
+            if (consume('}'))
+                return value;
+            do {
+                skip_whitespace();
+                auto key = parse_string();
+                expect(':');
+                value.object.emplace_back(std::move(key),
+                                          parse_value(depth + 1));
+            } while (consume(','));
+            expect('}');
+        } else if (c == '[') {
+            ++m_pos;
+            value.type = JsonValue::Type::array;
+            if (consume(']'))
+                return value;
+            do {
+                value.array.push_back(parse_value(depth + 1));
+            } while (consume(','));
+            expect(']');
+        } else if (c == '"') {
+            value.type = JsonValue::Type::string;
+            value.string = parse_string();
+        } else if (consume_word("true")) {
+            value.type = JsonValue::Type::boolean;
+            value.boolean = true;
+        } else if (consume_word("false")) {
+            value.type = JsonValue::Type::boolean;
+        } else if (consume_word("null")) {
+        } else {
+            value.type = JsonValue::Type::number;
+            auto begin = m_text.data() + m_pos;
+            auto [end, ec] =
+                std::from_chars(begin, m_text.data() + m_text.size(),
+                                value.number);
+            if (ec != std::errc() || end == begin)
+                fail("expected a value");
+            m_pos += end - begin;
+        }
+        return value;
+    }
+
+    uint32_t parse_hex4() {
+        if (m_text.size() - m_pos < 4)
+            fail("truncated escape");
+        uint32_t code = 0;
+        auto begin = m_text.data() + m_pos;
+        auto [end, ec] = std::from_chars(begin, begin + 4, code, 16);
+        if (ec != std::errc() || end != begin + 4)
+            fail("invalid escape");
+        m_pos += 4;
+        return code;
+    }
+
+    static void append_utf8(std::string& out, uint32_t code) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        } else if (code < 0x800) {
+            out += static_cast<char>(0xc0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        } else if (code < 0x10000) {
+            out += static_cast<char>(0xe0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        } else {
+            out += static_cast<char>(0xf0 | (code >> 18));
+            out += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        }
+    }
+
+    std::string parse_string() {
+        if (m_pos == m_text.size() || m_text[m_pos] != '"')
+            fail("expected a string");
+        ++m_pos;
+        std::string out;
+        for (;;) {
+            if (m_pos == m_text.size())
+                fail("unterminated string");
+            char c = m_text[m_pos++];
+            if (c == '"')
+                return out;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (m_pos == m_text.size())
+                fail("unterminated string");
+            switch (char escape = m_text[m_pos++]) {
+            case '"':
+            case '\\':
+            case '/':
+                out += escape;
+                break;
+            case 'b':
+                out += '\b';
+                break;
+            case 'f':
+                out += '\f';
+                break;
+            case 'n':
+                out += '\n';
+                break;
+            case 'r':
+                out += '\r';
+                break;
+            case 't':
+                out += '\t';
+                break;
+            case 'u': {
+                auto code = parse_hex4();
+                // a surrogate pair, e.g. for emoji in a path
+                if (code >= 0xd800 && code < 0xdc00 &&
+                    m_text.substr(m_pos).starts_with("\\u")) {
+                    m_pos += 2;
+                    auto low = parse_hex4();
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                }
+                append_utf8(out, code);
+                break;
+            }
+            default:
+                fail("invalid escape");
+            }
+        }
+    }
+
+    std::string_view m_text;
+    size_t m_pos{0};
+};
+
+} // namespace
+
+JsonValue parse_json(std::string_view text) {
+    return JsonParser(text).parse_document();
+}
+
+std::string json_string(std::string_view text) {
+    std::string out = "\"";
+    for (char c : text) {
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+                out += fmt::format("\\u{:04x}", static_cast<int>(c));
+            else
+                out += c;
+        }
+    }
+    return out + '"';
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Just enough JSON to read the traces of Clang's `-ftime-trace` and to write
+// reports: a parsed document is a tree of values, without any validation
+// beyond the syntax.
+struct JsonValue {
+    enum class Type { null, boolean, number, string, array, object };
+    Type type{Type::null};
+
+    bool boolean{false};
+    double number{0};
+    std::string string;
+    std::vector<JsonValue> array;
+    // In document order.
+    std::vector<std::pair<std::string, JsonValue>> object;
+
+    // Member `key` of an object, nullptr if there is none.
+    const JsonValue* get(std::string_view key) const;
+};
+
+// Throws std::runtime_error if `text` isn't valid JSON.
+JsonValue parse_json(std::string_view text);
+
+// `text` as a quoted JSON string.
+std::string json_string(std::string_view text);
@@ -0,0 +1,216 @@
+#include "loaded_package.hpp"
+#include "builder.hpp"
+#include "utils.hpp"
+#include <cstring>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+using namespace spdlog;
+
+#ifdef __linux__
+
+// Entries appearing or going away, in the directory or of the directory.
+constexpr uint32_t DIR_EVENTS = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+// Files being saved. Files are also often replaced by renaming a new one over
+// them, which is a `DIR_EVENTS` event.
+constexpr uint32_t WRITE_EVENTS = IN_CLOSE_WRITE;
+
+InputWatcher::InputWatcher() : m_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+    if (m_fd < 0)
+        throw std::runtime_error(fmt::format("couldn't initialize inotify: {}",
+                                             std::strerror(errno)));
+}
+
+InputWatcher::~InputWatcher() {
+    close(m_fd);
+}
+
+void InputWatcher::watch(const std::vector<std::filesystem::path>& inputs) {
+    // changes seen by the old watches (e.g. a source saved while building)
+    // happened after the last `take`, they stay pending
+    read_events();
+
+    std::unordered_map<std::string, Watch> dirs;
+    for (auto& input : inputs) {
+        std::error_code ec;
+        if (std::filesystem::is_directory(input, ec))
+            dirs[input.string()].scanned = true;
+        else
+            dirs[input.parent_path().string()].files.insert(
+                input.filename().string());
+    }
+    // the new watches are added before the old ones go away, so that no
+    // directory is unwatched in between. Watching a directory again returns
+    // the same descriptor
+    std::unordered_map<int, Watch> watches;
+    for (auto& [dir, watch] : dirs) {
+        auto wd = inotify_add_watch(m_fd, dir.c_str(),
+                                    DIR_EVENTS | WRITE_EVENTS | IN_ONLYDIR);
+        if (wd < 0) {
+            debug("couldn't watch `{}`: {}", dir, std::strerror(errno));
+            m_pending.files = true;
+            continue;
+        }
+        auto& existing = watches[wd];
+        existing.files.insert(watch.files.begin(), watch.files.end());
+        existing.scanned |= watch.scanned;
+    }
+    for (auto& [wd, _] : m_watches)
+        if (!watches.count(wd))
+            inotify_rm_watch(m_fd, wd);
+    m_watches = std::move(watches);
+    trace("watching {} director{}", m_watches.size(),
+          m_watches.size() == 1 ? "y" : "ies");
+}
+
+// Editor backups and swap files, e.g. `.main.cpp.swp` and `main.cpp~`.
+static bool is_scratch_file(std::string_view name) {
+    return name.starts_with('.') || name.ends_with('~');
+}
+
+bool InputWatcher::read_events() {
+    alignas(inotify_event) char buf[64 * 1024];
+    bool any = false;
+    for (;;) {
+        auto n = read(m_fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        any = true;
+        for (char* p = buf; p < buf + n;) {
+            auto event = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                m_pending.files = true;
+                continue;
+            }
+            auto it = m_watches.find(event->wd);
+            if (it == m_watches.end())
+                continue;
+            std::string name = event->len ? event->name : "";
+            if (it->second.files.count(name)) {
+                trace("`{}` changed", name);
+                m_pending.files = true;
+            } else if (!it->second.scanned) {
+                continue;
+            } else if (event->mask & DIR_EVENTS) {
+                trace("a directory changed: `{}`", name);
+                m_pending.dirs = true;
+            } else if (!is_scratch_file(name)) {
+                trace("`{}` was written", name);
+                m_pending.sources = true;
+            }
+        }
+    }
+    return any;
+}
+
+InputWatcher::Changes InputWatcher::take() {
+    read_events();
+    return std::exchange(m_pending, {});
+}
+
+void InputWatcher::wait(std::chrono::milliseconds quiet) {
+    pollfd pfd{.fd = m_fd, .events = POLLIN};
+    read_events();
+    while (!m_pending.any() && !m_pending.sources) {
+        poll(&pfd, 1, -1);
+        read_events();
+    }
+    while (poll(&pfd, 1, static_cast<int>(quiet.count())) > 0)
+        read_events();
+}
+
+#else
+
+InputWatcher::InputWatcher() {
+    throw std::runtime_error("watching files is only supported on Linux");
+}
+InputWatcher::~InputWatcher() {}
+void InputWatcher::watch(const std::vector<std::filesystem::path>&) {}
+InputWatcher::Changes InputWatcher::take() {
+    return {};
+}
+void InputWatcher::wait(std::chrono::milliseconds) {}
+
+#endif
+
+LoadedPackage::LoadedPackage(
+    PackageOptions options,
+    std::function<std::shared_ptr<Generator>()> make_generator)
+    : m_options(std::move(options)),
+      m_make_generator(std::move(make_generator)) {}
+
+std::filesystem::path LoadedPackage::build(bool invoke) {
+    auto& root = m_options.package_root;
+    auto& build_dir = m_options.build_dir;
+    auto& compiler = m_options.compiler;
+
+    auto changes = m_watcher.take();
+    if (changes.files)
+        m_manifest.reset();
+    if (m_stamp && !changes.any()) {
+        // nothing the build files were generated from changed: not even the
+        // stamp needs to be checked
+        debug("build files are up to date");
+        if (invoke)
+            m_gen->invoke(m_stamp->build_file);
+        return m_stamp->output;
+    }
+
+    // the scan index limits rescanning to the directories that changed, and
+    // build files that come out the same aren't rewritten
+    m_stamp.reset();
+    m_gen = m_make_generator();
+    auto stamp_path = root / build_dir / BUILD_STAMP_NAME;
+    std::optional<Builder> builder;
+    // before building, with what the last build files were generated from,
+    // so that nothing changed while building is missed. Again afterwards
+    // with the new inputs, even if the build failed, so that fixing it
+    // triggers the next one
+    auto watch_inputs = [&] {
+        std::vector<std::filesystem::path> inputs{root / MANIFEST_NAME, root};
+        if (builder) {
+            auto stamp_inputs = builder->stamp().inputs();
+            inputs.insert(inputs.end(), stamp_inputs.begin(),
+                          stamp_inputs.end());
+        } else if (auto stamp = BuildStamp::load(stamp_path)) {
+            auto stamp_inputs = stamp->inputs();
+            inputs.insert(inputs.end(), stamp_inputs.begin(),
+                          stamp_inputs.end());
+        }
+        m_watcher.watch(inputs);
+    };
+
+    watch_inputs();
+    std::optional<std::filesystem::path> output;
+    try {
+        output = Builder::build_if_unchanged(m_gen, root, build_dir, compiler,
+                                             invoke);
+        if (!output) {
+            if (!m_manifest) {
+                Manifest manifest{root};
+                manifest.parse_file((root / MANIFEST_NAME).string());
+                m_manifest = std::move(manifest);
+            }
+            builder.emplace(*m_manifest);
+            output = builder->build(m_gen, build_dir, compiler, invoke);
+        }
+    } catch (const std::exception&) {
+        watch_inputs();
+        throw;
+    }
+    watch_inputs();
+
+    // unreliable stamps aren't saved, those builds always check
+    if (auto stamp = BuildStamp::load(stamp_path)) {
+        if (Builder::build_if_unchanged(m_gen, root, build_dir, compiler,
+                                        false))
+            m_stamp = std::move(stamp);
+    }
+    return *output;
+}
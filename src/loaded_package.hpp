@@ -0,0 +1,112 @@
+#pragma once
+#include "build_stamp.hpp"
+#include "generators/generator.hpp"
+#include "manifest.hpp"
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// What to build.
+struct PackageOptions {
+    // Absolute.
+    std::filesystem::path package_root;
+    std::string build_dir;
+    // `-cc` and `-G`.
+    std::optional<std::string> compiler;
+    std::optional<std::string> generator;
+};
+
+// Watches the inputs of a build stamp (see `BuildStamp::inputs`) with inotify.
+// Events queue up in the kernel until they're asked for, so nothing runs
+// while idle. Linux only, throws elsewhere.
+class InputWatcher {
+public:
+    InputWatcher();
+    ~InputWatcher();
+
+    InputWatcher(const InputWatcher&) = delete;
+    InputWatcher& operator=(const InputWatcher&) = delete;
+
+    // What changed since the last call to `take`.
+    struct Changes {
+        // An input file, e.g. Qobs.toml.
+        bool files{false};
+        // The entries of a scanned directory.
+        bool dirs{false};
+        // The contents of something in a scanned directory, e.g. a source
+        // being saved. Doesn't affect the build files.
+        bool sources{false};
+
+        // Whether the build files may have to be regenerated.
+        inline bool any() const {
+            return files || dirs;
+        }
+    };
+
+    // Watch `inputs` instead of the previous inputs. Changes that weren't
+    // taken yet stay pending. If a directory can't be watched, the next
+    // `take` reports a change.
+    void watch(const std::vector<std::filesystem::path>& inputs);
+
+    // Read pending events, without blocking.
+    Changes take();
+
+    // Block until something changes, then until nothing changed for `quiet`,
+    // so that a burst of events (e.g. a `git checkout`) counts as one change.
+    // The changes stay pending for `take`.
+    void wait(std::chrono::milliseconds quiet);
+
+private:
+    struct Watch {
+        // Names of input files in the directory.
+        std::unordered_set<std::string> files;
+        // Whether the directory itself is an input.
+        bool scanned{false};
+    };
+
+    // Read pending events into `m_pending`, returns whether there were any.
+    bool read_events();
+
+    int m_fd{-1};
+    std::unordered_map<int, Watch> m_watches;
+    Changes m_pending;
+};
+
+// A package kept loaded between builds: the parsed manifest, the generator
+// (which holds the build graph of the native generator) and what the build
+// files were generated from, watched with an `InputWatcher`. A build only
+// regenerates the build files if one of their inputs changed, and only
+// parses the manifest again if it changed.
+class LoadedPackage {
+public:
+    LoadedPackage(PackageOptions options,
+                  std::function<std::shared_ptr<Generator>()> make_generator);
+
+    inline const PackageOptions& options() const {
+        return m_options;
+    }
+    inline InputWatcher& watcher() {
+        return m_watcher;
+    }
+
+    // Returns the path to the built executable/library. Only makes sure the
+    // build files are up to date if `invoke` is false. Throws if the build
+    // failed.
+    std::filesystem::path build(bool invoke = true);
+
+private:
+    PackageOptions m_options;
+    std::function<std::shared_ptr<Generator>()> m_make_generator;
+
+    InputWatcher m_watcher;
+    std::optional<Manifest> m_manifest;
+    std::shared_ptr<Generator> m_gen;
+    // Nothing if the build files must be checked before building.
+    std::optional<BuildStamp> m_stamp;
+};
@@ -0,0 +1,133 @@
+#include "lockfile.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <toml++/toml.hpp>
+
+// bump this if the format changes in an incompatible way
+constexpr int64_t LOCKFILE_VERSION = 1;
+
+void Lockfile::load(const std::filesystem::path& path) {
+    m_entries.clear();
+    if (!std::filesystem::exists(path))
+        return;
+
+    auto tbl = toml::parse_file(path.string());
+    auto version = tbl["version"].value_or(int64_t{0});
+    if (version != LOCKFILE_VERSION)
+        throw std::runtime_error(
+            fmt::format("unsupported lockfile version {} (expected {}), "
+                        "re-run `qobs update` to regenerate it",
+                        version, LOCKFILE_VERSION));
+
+    auto deps = tbl["dependency"];
+    if (!deps.is_array())
+        return;
+
+    for (auto& node : *deps.as_array()) {
+        if (!node.is_table())
+            continue;
+        auto& dep = *node.as_table();
+        LockedDependency locked{
+            .name = std::string(dep["name"].value_or("")),
+            .source = std::string(dep["source"].value_or("")),
+            .version = std::string(dep["version"].value_or("")),
+            .commit = std::string(dep["commit"].value_or("")),
+            .tree = std::string(dep["tree"].value_or("")),
+            .digest = std::string(dep["digest"].value_or("")),
+        };
+        if (!locked.name.empty())
+            set(std::move(locked));
+    }
+}
+
+// Quote a TOML basic string.
+static std::string quote(std::string_view str) {
+    std::string out = "\"";
+    for (char c : str) {
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+                out += fmt::format("\\u{:04x}", c);
+            else
+                out += c;
+        }
+    }
+    out += '"';
+    return out;
+}
+
+std::string Lockfile::to_string() const {
+    std::string out =
+        "# This file is automatically @generated by Qobs: DO NOT EDIT!\n"
+        "# Run `qobs update` to re-resolve dependencies.\n";
+    out += fmt::format("version = {}\n", LOCKFILE_VERSION);
+
+    auto write_field = [&](std::string_view key, const std::string& value) {
+        if (!value.empty())
+            out += fmt::format("{} = {}\n", key, quote(value));
+    };
+    for (auto& dep : m_entries) {
+        out += "\n[[dependency]]\n";
+        write_field("name", dep.name);
+        write_field("source", dep.source);
+        write_field("version", dep.version);
+        write_field("commit", dep.commit);
+        write_field("tree", dep.tree);
+        write_field("digest", dep.digest);
+    }
+    return out;
+}
+
+void Lockfile::save(const std::filesystem::path& path) const {
+    // don't bump the mtime (or annoy version control) if nothing changed
+    utils::write_if_changed(path, to_string());
+}
+
+const LockedDependency* Lockfile::find(std::string_view name) const {
+    auto it = std::lower_bound(
+        m_entries.begin(), m_entries.end(), name,
+        [](const LockedDependency& dep, std::string_view name) {
+            return dep.name < name;
+        });
+    if (it != m_entries.end() && it->name == name)
+        return &*it;
+    return nullptr;
+}
+
+void Lockfile::set(LockedDependency dep) {
+    auto it = std::lower_bound(
+        m_entries.begin(), m_entries.end(), dep.name,
+        [](const LockedDependency& dep, const std::string& name) {
+            return dep.name < name;
+        });
+    if (it != m_entries.end() && it->name == dep.name)
+        *it = std::move(dep);
+    else
+        m_entries.insert(it, std::move(dep));
+}
+
+void Lockfile::retain(const std::vector<std::string>& names) {
+    std::erase_if(m_entries, [&](const LockedDependency& dep) {
+        return std::find(names.begin(), names.end(), dep.name) == names.end();
+    });
+}
+
+bool Lockfile::remove(std::string_view name) {
+    return std::erase_if(m_entries, [&](const LockedDependency& dep) {
+               return dep.name == name;
+           }) != 0;
+}
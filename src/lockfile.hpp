@@ -0,0 +1,63 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <vector>
+
+constexpr auto& LOCKFILE_NAME = "Qobs.lock";
+
+// A dependency pinned in Qobs.lock.
+struct LockedDependency {
+    // `dep` in `dep = "gh:nlohmann/json"`
+    std::string name;
+
+    // Expanded URL of the dependency, see `Dependency::expanded()`.
+    std::string source;
+
+    // The version that was requested in Qobs.toml when this was locked (empty
+    // if the dependency was unversioned).
+    std::string version;
+
+    // Resolved commit and its tree id (git dependencies only).
+    std::string commit;
+    std::string tree;
+
+    // SHA-256 of the dependency contents.
+    std::string digest;
+};
+
+// Qobs.lock: records what every dependency resolved to, so that later builds
+// can check out exactly the same versions without asking the remotes.
+class Lockfile {
+public:
+    Lockfile() {}
+
+    // A missing file is an empty lockfile. Throws on parse errors.
+    void load(const std::filesystem::path& path);
+
+    // Write the lockfile to `path`. The file isn't touched if its contents
+    // wouldn't change.
+    void save(const std::filesystem::path& path) const;
+
+    // Returns nullptr if `name` isn't locked.
+    const LockedDependency* find(std::string_view name) const;
+
+    // Add or replace the entry with the same name.
+    void set(LockedDependency dep);
+
+    // Remove entries whose name isn't in `names`.
+    void retain(const std::vector<std::string>& names);
+
+    // Remove a single entry, returns whether it existed.
+    bool remove(std::string_view name);
+
+    inline const std::vector<LockedDependency>& entries() const {
+        return m_entries;
+    }
+
+    // Serialized TOML contents.
+    std::string to_string() const;
+
+private:
+    // Sorted by name, so that the file is stable.
+    std::vector<LockedDependency> m_entries;
+};
@@ -1,18 +1,27 @@
 #include "builder.hpp"
+#include "cache_limit.hpp"
+#include "cache_server.hpp"
+#include "cached_compile.hpp"
+#include "daemon.hpp"
 #include "manifest.hpp"
 #include "spdlog/spdlog.h"
+#include "thread_pool.hpp"
+#include "timings.hpp"
 #include "utils.hpp"
+#include "watch.hpp"
+#include "worker.hpp"
+#include <algorithm>
 #include <argparse/argparse.hpp>
 #include <filesystem>
 #include <fmt/core.h>
 #include <iostream>
 #include <optional>
 
+#include "generators/native/native_gen.hpp"
 #include "generators/ninja/ninja_gen.hpp"
 
 using namespace spdlog;
 
-constexpr auto& MANIFEST_NAME = "Qobs.toml";
 constexpr auto& DEFAULT_C = R"(#include <stdio.h>
 
 int main(void) {
@@ -70,25 +79,81 @@ find_and_parse_manifest(std::filesystem::path path) {
     return std::make_pair(manifest, *toml_path);
 }
 
-// returns path to the built executable/library
+// `ninja` or `native`. Without a name, ninja is used if it's installed
+std::shared_ptr<Generator> make_generator(std::optional<std::string> name) {
+    if (!name)
+        name = utils::find_program("ninja").empty() ? "native" : "ninja";
+    debug("using generator: {}", *name);
+    if (*name == "native")
+        return std::make_shared<NativeGenerator>();
+    return std::make_shared<NinjaGenerator>();
+}
+
+// returns path to the built executable/library. With `timings`, writes a
+// timing report of the build next to it
 std::optional<std::filesystem::path>
 begin_build(std::filesystem::path path, std::string_view build_dir,
-            std::optional<std::string> cc) {
+            std::optional<std::string> cc,
+            std::optional<std::string> generator, bool invoke = true,
+            bool timings = false) {
     debug("building package: {}", path.string());
 
+    // create a generator
+    auto gen = make_generator(generator);
+
+    auto since = std::filesystem::file_time_type::clock::now();
+    auto built = [&](std::filesystem::path exe_path) {
+        if (timings && invoke) {
+            auto dir = exe_path.parent_path();
+            try {
+                write_timing_report(gen->timings(dir), dir, since);
+            } catch (const std::exception& err) {
+                warn("couldn't write timing report: {}", err.what());
+            }
+        }
+        return exe_path;
+    };
+
+    // skip parsing and generating everything if nothing changed
+    if (auto toml_path = find_qobs_toml(std::filesystem::absolute(path))) {
+        // a daemon may have all of that in memory already, but only our
+        // generator knows the timings
+        std::optional<DaemonBuild> result;
+        if (!timings)
+            result = build_with_daemon(
+                PackageOptions{
+                    .package_root = toml_path->parent_path(),
+                    .build_dir = std::string(build_dir),
+                    .compiler = cc,
+                    .generator = generator,
+                },
+                invoke);
+        if (result) {
+            if (!result->ok)
+                return std::nullopt;
+            return result->output;
+        }
+
+        try {
+            if (auto exe_path = Builder::build_if_unchanged(
+                    gen, toml_path->parent_path(), build_dir, cc, invoke))
+                return built(*exe_path);
+        } catch (const std::exception& err) {
+            error("failed to build package: {}", err.what());
+            return std::nullopt;
+        }
+    }
+
     auto manifest_opt = find_and_parse_manifest(path);
     if (!manifest_opt)
         return std::nullopt;
     auto [manifest, _] = *manifest_opt;
 
-    // create a generator
-    auto gen = std::make_shared<NinjaGenerator>();
-
     // create builder, this will scan the package sources, download required
     // packages, and generate the project
     Builder builder(manifest);
     try {
-        return builder.build(gen, build_dir, cc);
+        return built(builder.build(gen, build_dir, cc, invoke));
     } catch (const std::exception& err) {
         error("failed to build package: {}", err.what());
         return std::nullopt;
@@ -229,6 +294,24 @@ void add_dependencies(std::filesystem::path path,
     }
 }
 
+bool update_dependencies(std::filesystem::path path,
+                         std::string_view build_dir,
+                         const std::vector<std::string>& names) {
+    auto manifest_opt = find_and_parse_manifest(path);
+    if (!manifest_opt)
+        return false; // error printed in find_and_parse_manifest
+    auto [manifest, _] = *manifest_opt;
+
+    Builder builder(manifest);
+    try {
+        builder.update(build_dir, names);
+    } catch (const std::exception& err) {
+        error("failed to update dependencies: {}", err.what());
+        return false;
+    }
+    return true;
+}
+
 void validate_build_dir(std::string& build_dir) {
     if (!utils::is_directory_valid(build_dir)) {
         warn("invalid build directory `{}`, defaulting to `build`", build_dir);
@@ -289,6 +372,19 @@ int main(int argc, char* argv[]) {
     build_command.add_argument("-b", "--build-dir")
         .default_value("build")
         .help("Build directory");
+    build_command.add_argument("-G", "--generator")
+        .choices("ninja", "native")
+        .help("Build with ninja or with qobs itself (default: ninja if "
+              "installed)");
+    build_command.add_argument("--generate-only")
+        .default_value(false)
+        .implicit_value(true)
+        .help("Only generate the build files, don't build");
+    build_command.add_argument("--timings")
+        .default_value(false)
+        .implicit_value(true)
+        .help("Write a report of where the build time went to "
+              "timings.html and timings.json in the build directory");
 
     // qobs run
     argparse::ArgumentParser run_command("run");
@@ -300,6 +396,10 @@ int main(int argc, char* argv[]) {
     run_command.add_argument("-b", "--build-dir")
         .default_value("build")
         .help("Build directory");
+    run_command.add_argument("-G", "--generator")
+        .choices("ninja", "native")
+        .help("Build with ninja or with qobs itself (default: ninja if "
+              "installed)");
     // FIXME: in the --help message for this, it is displayed like this:
     // run [--help] [--version] [-cc VAR] [--build-dir VAR] [-- VAR...] path
     //                                                      ^^^^^^^^^^^
@@ -321,14 +421,130 @@ int main(int argc, char* argv[]) {
         .nargs(argparse::nargs_pattern::at_least_one)
         .remaining();
 
+    // qobs update
+    argparse::ArgumentParser update_command("update");
+    update_command.add_description(
+        "Re-resolve dependencies and update the lockfile (Qobs.lock)");
+    update_command.add_argument("-p", "--path")
+        .help("Path to the package")
+        .default_value(current_path);
+    update_command.add_argument("-b", "--build-dir")
+        .default_value("build")
+        .help("Build directory");
+    update_command.add_argument("deps")
+        .help("Dependencies to update (all of them if none are given)")
+        .nargs(argparse::nargs_pattern::any)
+        .remaining();
+
+    // qobs cache-server
+    argparse::ArgumentParser cache_server_command("cache-server");
+    cache_server_command.add_description(
+        "Serve a build cache to other machines (see QOBS_REMOTE_CACHE)");
+    cache_server_command.add_argument("--host")
+        .default_value("127.0.0.1")
+        .help("Address to listen on");
+    cache_server_command.add_argument("-p", "--port")
+        .default_value(8080)
+        .scan<'i', int>()
+        .help("Port to listen on");
+    cache_server_command.add_argument("-d", "--dir")
+        .default_value((utils::cache_dir() / "server").string())
+        .help("Directory to store the cache in");
+    cache_server_command.add_argument("--max-size")
+        .help("Size to keep the directory under by removing the least "
+              "recently used entries, e.g. `50G` (default: "
+              "QOBS_CACHE_MAX_SIZE, unlimited if unset)");
+
+    // qobs daemon
+    argparse::ArgumentParser daemon_command("daemon");
+    daemon_command.add_description(
+        "Keep a package loaded in the background to speed up its builds");
+    daemon_command.add_argument("path")
+        .help("Path to the package")
+        .default_value(current_path);
+    daemon_command.add_argument("-cc").help(
+        "Override the default C/C++ compiler");
+    daemon_command.add_argument("-b", "--build-dir")
+        .default_value("build")
+        .help("Build directory");
+    daemon_command.add_argument("-G", "--generator")
+        .choices("ninja", "native")
+        .help("Build with ninja or with qobs itself (default: ninja if "
+              "installed)");
+
+    // qobs watch
+    argparse::ArgumentParser watch_command("watch");
+    watch_command.add_description(
+        "Rebuild a package whenever its sources or manifest change");
+    watch_command.add_argument("path")
+        .help("Path to the package")
+        .default_value(current_path);
+    watch_command.add_argument("-cc").help(
+        "Override the default C/C++ compiler");
+    watch_command.add_argument("-b", "--build-dir")
+        .default_value("build")
+        .help("Build directory");
+    watch_command.add_argument("-G", "--generator")
+        .choices("ninja", "native")
+        .help("Build with ninja or with qobs itself (default: ninja if "
+              "installed)");
+    watch_command.add_argument("--run")
+        .default_value(false)
+        .implicit_value(true)
+        .help("Restart the program after every successful build");
+    watch_command.add_argument("--")
+        .help("All arguments after this will be passed to the program")
+        .nargs(argparse::nargs_pattern::any);
+
+    // qobs worker
+    argparse::ArgumentParser worker_command("worker");
+    worker_command.add_description(
+        "Compile sources for other machines (see QOBS_WORKERS)");
+    worker_command.add_argument("--listen")
+        .default_value("127.0.0.1:3633")
+        .help("Address to listen on, `host:port` or `unix:<path>`");
+    worker_command.add_argument("-j", "--jobs")
+        .default_value(static_cast<int>(ThreadPool::hardware_threads()))
+        .scan<'i', int>()
+        .help("Number of sources to compile at once");
+
+    // qobs cc, run by ninja build files
+    argparse::ArgumentParser cc_command("cc");
+    cc_command.add_description("Compile a source through the object cache, "
+                               "the command follows after `--` (used by "
+                               "build.ninja)");
+    cc_command.add_argument("--in").required().help("Source file");
+    cc_command.add_argument("--out").required().help("Object file");
+    cc_command.add_argument("--depfile")
+        .required()
+        .help("Depfile the compile command writes");
+
     // add subparsers
-    program.add_subparser(new_command);   // qobs new
-    program.add_subparser(build_command); // qobs build
-    program.add_subparser(run_command);   // qobs run
-    program.add_subparser(add_command);   // qobs add
+    program.add_subparser(new_command);          // qobs new
+    program.add_subparser(build_command);        // qobs build
+    program.add_subparser(run_command);          // qobs run
+    program.add_subparser(add_command);          // qobs add
+    program.add_subparser(update_command);       // qobs update
+    program.add_subparser(cache_server_command); // qobs cache-server
+    program.add_subparser(worker_command);       // qobs worker
+    program.add_subparser(daemon_command);       // qobs daemon
+    program.add_subparser(watch_command);        // qobs watch
+    program.add_subparser(cc_command);           // qobs cc
+
+    // the compile command of `qobs cc` is full of flags, it's taken as is
+    // instead of letting argparse look at it
+    std::vector<std::string> args(argv, argv + argc);
+    std::vector<std::string> compile_command;
+    if (args.size() > 1 && args[1] == "cc") {
+        auto separator = std::find(args.begin(), args.end(), "--");
+        if (separator != args.end()) {
+            compile_command.assign(separator + 1, args.end());
+            args.erase(separator, args.end());
+        }
+    }
 
     try {
-        program.parse_args(argc, argv);
+        program.parse_args(args);
     } catch (const std::exception& err) {
         error(err.what());
         return 1;
@@ -349,10 +565,14 @@ int main(int argc, char* argv[]) {
         auto build_dir = build_command.get<std::string>("--build-dir");
         validate_build_dir(build_dir);
         auto cc = build_command.present<std::string>("-cc");
+        auto generator = build_command.present<std::string>("--generator");
+        auto invoke = !build_command.get<bool>("--generate-only");
+        auto timings = build_command.get<bool>("--timings");
 
         std::optional<std::filesystem::path> exe_path;
         try {
-            exe_path = begin_build(path, build_dir, cc);
+            exe_path =
+                begin_build(path, build_dir, cc, generator, invoke, timings);
         } catch (const std::exception& err) {
             error("failed to begin build: {}", err.what());
             return 1;
@@ -370,10 +590,11 @@ int main(int argc, char* argv[]) {
         auto build_dir = run_command.get<std::string>("--build-dir");
         validate_build_dir(build_dir);
         auto cc = build_command.present<std::string>("-cc");
+        auto generator = run_command.present<std::string>("--generator");
 
         std::optional<std::filesystem::path> exe_path;
         try {
-            exe_path = begin_build(path, build_dir, cc);
+            exe_path = begin_build(path, build_dir, cc, generator);
         } catch (const std::exception& err) {
             error("failed to begin build: {}", err.what());
             return 1;
@@ -409,6 +630,115 @@ int main(int argc, char* argv[]) {
             error("no dependencies provided. use `qobs add -h` for help");
             return 1;
         }
+    } else if (program.is_subcommand_used("update")) {
+        auto path = update_command.get<std::string>("--path");
+        auto build_dir = update_command.get<std::string>("--build-dir");
+        validate_build_dir(build_dir);
+        std::vector<std::string> names;
+        if (update_command.is_used("deps"))
+            names = update_command.get<std::vector<std::string>>("deps");
+        return update_dependencies(path, build_dir, names) ? 0 : 1;
+    } else if (program.is_subcommand_used("cache-server")) {
+        auto port = cache_server_command.get<int>("--port");
+        if (port <= 0 || port > 65535) {
+            error("invalid port {}", port);
+            return 1;
+        }
+        auto max_size = cache_max_size();
+        if (auto value = cache_server_command.present("--max-size")) {
+            max_size = parse_size(*value);
+            if (!max_size) {
+                error("invalid size `{}`", *value);
+                return 1;
+            }
+        }
+        try {
+            serve_cache(cache_server_command.get<std::string>("--dir"),
+                        cache_server_command.get<std::string>("--host"),
+                        static_cast<uint16_t>(port), max_size);
+        } catch (const std::exception& err) {
+            error("cache server failed: {}", err.what());
+            return 1;
+        }
+    } else if (program.is_subcommand_used("worker")) {
+        auto jobs = worker_command.get<int>("--jobs");
+        if (jobs <= 0) {
+            error("invalid number of jobs {}", jobs);
+            return 1;
+        }
+        try {
+            serve_worker(worker_command.get<std::string>("--listen"),
+                         static_cast<size_t>(jobs));
+        } catch (const std::exception& err) {
+            error("worker failed: {}", err.what());
+            return 1;
+        }
+    } else if (program.is_subcommand_used("daemon")) {
+        auto path = std::filesystem::absolute(
+            daemon_command.get<std::string>("path"));
+        auto build_dir = daemon_command.get<std::string>("--build-dir");
+        validate_build_dir(build_dir);
+        auto toml_path = find_qobs_toml(path);
+        if (!toml_path) {
+            error("{} not found in `{}` or any parent directory",
+                  MANIFEST_NAME, path.string());
+            return 1;
+        }
+        auto generator = daemon_command.present<std::string>("--generator");
+        try {
+            serve_daemon(
+                PackageOptions{
+                    .package_root = toml_path->parent_path(),
+                    .build_dir = build_dir,
+                    .compiler = daemon_command.present<std::string>("-cc"),
+                    .generator = generator,
+                },
+                [generator] { return make_generator(generator); });
+        } catch (const std::exception& err) {
+            error("daemon failed: {}", err.what());
+            return 1;
+        }
+    } else if (program.is_subcommand_used("watch")) {
+        auto path = std::filesystem::absolute(
+            watch_command.get<std::string>("path"));
+        auto build_dir = watch_command.get<std::string>("--build-dir");
+        validate_build_dir(build_dir);
+        auto toml_path = find_qobs_toml(path);
+        if (!toml_path) {
+            error("{} not found in `{}` or any parent directory",
+                  MANIFEST_NAME, path.string());
+            return 1;
+        }
+        std::optional<std::vector<std::string>> run_args;
+        if (watch_command.get<bool>("--run")) {
+            run_args.emplace();
+            if (watch_command.is_used("--"))
+                run_args = watch_command.get<std::vector<std::string>>("--");
+        }
+        auto generator = watch_command.present<std::string>("--generator");
+        try {
+            watch_package(
+                PackageOptions{
+                    .package_root = toml_path->parent_path(),
+                    .build_dir = build_dir,
+                    .compiler = watch_command.present<std::string>("-cc"),
+                    .generator = generator,
+                },
+                [generator] { return make_generator(generator); }, run_args);
+        } catch (const std::exception& err) {
+            error("watch failed: {}", err.what());
+            return 1;
+        }
+    } else if (program.is_subcommand_used("cc")) {
+        try {
+            return cached_compile(compile_command,
+                                  cc_command.get<std::string>("--in"),
+                                  cc_command.get<std::string>("--out"),
+                                  cc_command.get<std::string>("--depfile"));
+        } catch (const std::exception& err) {
+            error("failed to compile: {}", err.what());
+            return 1;
+        }
     }
 
     return 0;
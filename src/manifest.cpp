@@ -50,6 +50,26 @@ void Target::parse(toml::node_view<toml::node> target) {
             m_sources.push_back(source.as_string()->get());
         });
     }
+    if (target["exclude"].is_array()) {
+        m_exclude.clear();
+        target["exclude"].as_array()->for_each([this](size_t i, auto& pattern) {
+            if (warn_if_not_string_and_return_true(
+                    "exclude pattern", fmt::format("at index {}", i),
+                    pattern.type()))
+                return;
+            m_exclude.push_back(pattern.as_string()->get());
+        });
+    }
+    if (target["include_dirs"].is_array()) {
+        m_include_dirs.clear();
+        target["include_dirs"].as_array()->for_each([this](size_t i,
+                                                           auto& dir) {
+            if (warn_if_not_string_and_return_true(
+                    "include dir", fmt::format("at index {}", i), dir.type()))
+                return;
+            m_include_dirs.push_back(dir.as_string()->get());
+        });
+    }
     m_glob_recurse = target["glob_recurse"].value_or(false);
     m_cflags = target["cflags"].value_or("");
     m_ldflags = target["ldflags"].value_or("");
@@ -111,7 +131,7 @@ void Manifest::parse_file(std::string_view manifest_path) {
     auto deps = m_tbl["dependencies"];
     if (deps.is_table())
         m_dependencies.parse(*deps.as_table(), m_package_root);
-    else
+    else if (deps)
         warn("`dependencies` is of type `{}`, expected `table`",
              utils::toml_type_to_str(deps.type()));
 
@@ -175,6 +195,13 @@ void Manifest::save_to(std::filesystem::path path) {
         file << fmt_field("glob_recurse", m_target.glob_recurse()) << "\n";
     }
     file << "sources = " << fmt_vector(m_target.sources()) << "\n";
+    if (!m_target.exclude().empty()) {
+        file << "exclude = " << fmt_vector(m_target.exclude()) << "\n";
+    }
+    if (m_target.include_dirs() != std::vector<std::string>{"include"}) {
+        file << "include_dirs = " << fmt_vector(m_target.include_dirs())
+             << "\n";
+    }
     if (!m_target.cflags().empty()) {
         file << fmt_field("cflags", m_target.cflags()) << "\n";
     }
@@ -187,15 +214,23 @@ void Manifest::save_to(std::filesystem::path path) {
     file << "\n[dependencies]\n";
     for (auto& dep : m_dependencies.m_list) {
         switch (dep.type()) {
-        case DependencyType::git:
         case DependencyType::url:
+            if (!dep.sha256().empty()) {
+                toml::table tbl{{"url", dep.value()},
+                                {"sha256", dep.sha256()}};
+                file << fmt_field(dep.name(), tbl) << "\n";
+                break;
+            }
+            [[fallthrough]];
+        case DependencyType::git:
             file << fmt_field(dep.name(), dep.value()) << "\n";
             break;
-        case DependencyType::path:
+        case DependencyType::path: {
             toml::table tbl{{"path", dep.value()}};
             file << fmt_field(dep.name(), tbl) << "\n";
             break;
         }
+        }
     }
 
     file.close();
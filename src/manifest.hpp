@@ -3,6 +3,8 @@
 #include <filesystem>
 #include <toml++/toml.hpp>
 
+constexpr auto& MANIFEST_NAME = "Qobs.toml";
+
 // [package]
 class Package {
 public:
@@ -49,6 +51,12 @@ public:
     inline const std::string& ldflags() const {
         return m_ldflags;
     }
+    inline const std::vector<std::string>& exclude() const {
+        return m_exclude;
+    }
+    inline const std::vector<std::string>& include_dirs() const {
+        return m_include_dirs;
+    }
 
     // Prefer C++ compilers?
     bool m_cxx;
@@ -58,11 +66,18 @@ private:
     std::vector<std::string> m_sources{
         std::vector<std::string>{"src/*.cpp", "src/*.cc", "src/*.c"}};
 
+    // Globs for files (or whole directories) to leave out of `m_sources`.
+    std::vector<std::string> m_exclude;
+
     // Compiler flags.
     std::string m_cflags;
 
     // Linker flags.
     std::string m_ldflags;
+
+    // Public include directories, relative to the package root. Added to the
+    // include path of the package and of everything that depends on it.
+    std::vector<std::string> m_include_dirs{"include"};
 };
 
 class Dependencies {
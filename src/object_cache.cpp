@@ -0,0 +1,401 @@
+#include "object_cache.hpp"
+#include "cache_limit.hpp"
+#include "hash.hpp"
+#include "remote_cache.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <unordered_set>
+#include <zstd.h>
+
+using namespace spdlog;
+
+// bump when the way objects are built changes, so that old entries are never
+// picked up
+constexpr std::string_view OBJECT_FORMAT = "qobs-object-1";
+constexpr std::string_view MANIFEST_HEADER = "qobs-object-manifest 1";
+
+// Objects are stored compressed, remote blob names say so: the server checks
+// them against the digest of the decompressed object.
+const std::string REMOTE_OBJECT_PREFIX = "zstd-";
+
+// Whether `program` runs the command after it, e.g. `ccache gcc`.
+static bool is_launcher(const std::filesystem::path& program) {
+    constexpr std::string_view launchers[] = {"ccache", "sccache", "distcc",
+                                              "icecc", "buildcache"};
+    return std::find(std::begin(launchers), std::end(launchers),
+                     program.stem().string()) != std::end(launchers);
+}
+
+// Header states remembered per key, newest first.
+constexpr size_t MAX_MANIFEST_ENTRIES = 8;
+
+// A previous compilation of a key.
+struct ManifestEntry {
+    std::string object;
+    // Digest, path.
+    std::vector<std::pair<std::string, std::string>> deps;
+};
+
+static std::string read_file(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file)
+        throw std::runtime_error(
+            fmt::format("couldn't read `{}`", path.string()));
+    return std::string((std::istreambuf_iterator<char>(file)),
+                       std::istreambuf_iterator<char>());
+}
+
+static std::vector<ManifestEntry> parse_manifest(const std::string& text) {
+    std::istringstream file(text);
+    std::string line;
+    if (!std::getline(file, line) || line != MANIFEST_HEADER)
+        return {};
+
+    std::vector<ManifestEntry> entries;
+    while (std::getline(file, line)) {
+        std::istringstream in(line);
+        std::string kind;
+        in >> kind;
+        if (kind == "object") {
+            entries.emplace_back();
+            in >> entries.back().object;
+        } else if (kind == "dep" && !entries.empty()) {
+            std::string digest, dep;
+            in >> digest;
+            in.get(); // the space
+            std::getline(in, dep);
+            entries.back().deps.emplace_back(std::move(digest), std::move(dep));
+        } else {
+            return {};
+        }
+        if (in.fail())
+            return {};
+    }
+    return entries;
+}
+
+static std::vector<ManifestEntry>
+load_manifest(const std::filesystem::path& path) {
+    try {
+        return parse_manifest(read_file(path));
+    } catch (const std::exception&) {
+        return {};
+    }
+}
+
+static std::string format_manifest(const std::vector<ManifestEntry>& entries) {
+    std::string out(MANIFEST_HEADER);
+    out += '\n';
+    for (auto& entry : entries) {
+        out += "object " + entry.object + '\n';
+        for (auto& [dep_digest, dep] : entry.deps)
+            out += "dep " + dep_digest + ' ' + dep + '\n';
+    }
+    return out;
+}
+
+// Nothing if `compressed` isn't a complete zstd frame.
+static std::optional<std::string> decompress(const std::string& compressed) {
+    auto size =
+        ZSTD_getFrameContentSize(compressed.data(), compressed.size());
+    if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+        return std::nullopt;
+    std::string object(size, '\0');
+    auto ret = ZSTD_decompress(object.data(), object.size(), compressed.data(),
+                               compressed.size());
+    if (ZSTD_isError(ret) || ret != size)
+        return std::nullopt;
+    return object;
+}
+
+// Keys of objects stored by caches with `defer_uploads`, one per line.
+static std::filesystem::path deferred_uploads_path() {
+    return utils::cache_dir() / "object-uploads";
+}
+
+bool ObjectCache::enabled_by_env() {
+    auto value = std::getenv("QOBS_NO_OBJECT_CACHE");
+    return !value || !*value;
+}
+
+ObjectCache::ObjectCache(bool defer_uploads) : m_defer_uploads(defer_uploads) {
+    if (!enabled_by_env()) {
+        debug("object cache disabled by QOBS_NO_OBJECT_CACHE");
+        return;
+    }
+    m_dir = utils::cache_dir() / "objects";
+    m_remote = RemoteCache::from_env();
+}
+
+std::string ObjectCache::digest(const std::string& path) {
+    {
+        std::lock_guard lock(m_mutex);
+        auto it = m_digests.find(path);
+        if (it != m_digests.end())
+            return it->second;
+    }
+
+    // hashed outside of the lock, at worst two threads hash the same header
+    std::string result;
+    std::error_code ec;
+    if (std::filesystem::is_regular_file(path, ec)) {
+        try {
+            result = Sha256::hex_file(path);
+        } catch (const std::exception&) {
+        }
+    }
+    std::lock_guard lock(m_mutex);
+    m_digests.emplace(path, result);
+    return result;
+}
+
+std::string ObjectCache::toolchain(const std::vector<std::string>& command) {
+    auto compiler =
+        std::find_if(command.begin(), command.end(),
+                     [](const std::string& arg) { return !is_launcher(arg); });
+    if (compiler == command.end())
+        return "";
+
+    auto& name = *compiler;
+    {
+        std::lock_guard lock(m_mutex);
+        auto it = m_toolchains.find(name);
+        if (it != m_toolchains.end())
+            return it->second;
+    }
+
+    std::filesystem::path path(name);
+    std::error_code ec;
+    if (!path.has_parent_path() || !std::filesystem::is_regular_file(path, ec))
+        path = utils::find_program(name);
+
+    // a launcher can also pose as the compiler (`/usr/lib/ccache/gcc`), its
+    // stamp wouldn't change with the compiler
+    if (!path.empty() && is_launcher(std::filesystem::canonical(path, ec)))
+        path.clear();
+
+    std::string result;
+    if (!path.empty()) {
+        std::error_code size_ec, mtime_ec;
+        auto size = std::filesystem::file_size(path, size_ec);
+        auto mtime = std::filesystem::last_write_time(path, mtime_ec);
+        if (!size_ec && !mtime_ec) {
+            Sha256 sha;
+            sha.update_field(OBJECT_FORMAT)
+                .update_field(std::filesystem::absolute(path).string())
+                .update_field(std::to_string(size))
+                .update_field(
+                    std::to_string(mtime.time_since_epoch().count()));
+            result = sha.hex_digest();
+        }
+    }
+    if (result.empty())
+        debug("not caching objects of `{}`, couldn't identify it", name);
+
+    std::lock_guard lock(m_mutex);
+    m_toolchains.emplace(name, result);
+    return result;
+}
+
+std::string ObjectCache::key(const std::vector<std::string>& args,
+                             const std::vector<std::string>& command,
+                             const std::vector<std::filesystem::path>& inputs) {
+    if (!enabled())
+        return "";
+    auto tool = toolchain(command);
+    if (tool.empty())
+        return "";
+
+    Sha256 sha;
+    sha.update_field(tool);
+    for (auto& arg : args)
+        sha.update_field(arg);
+    // the path of the source ends up in the object too (`__FILE__`, debug
+    // info)
+    sha.update_field("inputs");
+    for (auto& input : inputs) {
+        auto path = input.string();
+        auto input_digest = digest(path);
+        if (input_digest.empty())
+            return "";
+        sha.update_field(path).update_field(input_digest);
+    }
+    return sha.hex_digest();
+}
+
+std::filesystem::path
+ObjectCache::manifest_path(const std::string& key) const {
+    return m_dir / key.substr(0, 2) / (key.substr(2) + ".manifest");
+}
+
+std::filesystem::path
+ObjectCache::object_path(const std::string& digest) const {
+    return m_dir / digest.substr(0, 2) / (digest.substr(2) + ".zst");
+}
+
+bool ObjectCache::is_current(const ManifestEntry& entry) {
+    for (auto& [dep_digest, dep] : entry.deps)
+        if (digest(dep) != dep_digest)
+            return false;
+    return true;
+}
+
+std::string ObjectCache::add_entry(const std::string& key,
+                                   ManifestEntry entry) {
+    // the new entry goes first, without older entries for the same headers
+    auto path = manifest_path(key);
+    auto entries = load_manifest(path);
+    std::erase_if(entries, [&](const ManifestEntry& old) {
+        return old.deps == entry.deps;
+    });
+    entries.insert(entries.begin(), std::move(entry));
+    if (entries.size() > MAX_MANIFEST_ENTRIES)
+        entries.resize(MAX_MANIFEST_ENTRIES);
+
+    auto text = format_manifest(entries);
+    utils::write_file_atomically(path, text);
+    return text;
+}
+
+std::optional<std::vector<std::string>>
+ObjectCache::restore(const std::string& key,
+                     const std::filesystem::path& output) {
+    auto restored = [&](const ManifestEntry& entry, const std::string& object) {
+        utils::write_file_atomically(output, object);
+        std::vector<std::string> deps;
+        for (auto& dep : entry.deps)
+            deps.push_back(dep.second);
+        return deps;
+    };
+
+    for (auto& entry : load_manifest(manifest_path(key))) {
+        if (!is_current(entry))
+            continue;
+        try {
+            auto blob = object_path(entry.object);
+            if (auto object = decompress(read_file(blob))) {
+                touch_cache_file(manifest_path(key));
+                touch_cache_file(blob);
+                return restored(entry, *object);
+            }
+        } catch (const std::exception& err) {
+            debug("couldn't restore `{}` from the object cache: {}",
+                  output.string(), err.what());
+        }
+    }
+
+    // another machine may have built it. Whatever is found there is kept
+    // locally too
+    if (!m_remote)
+        return std::nullopt;
+    auto record = m_remote->get_record("object-" + key);
+    if (!record)
+        return std::nullopt;
+    for (auto& entry : parse_manifest(*record)) {
+        if (!is_current(entry))
+            continue;
+        auto compressed = m_remote->get_blob(REMOTE_OBJECT_PREFIX +
+                                             entry.object);
+        if (!compressed)
+            continue;
+        auto object = decompress(*compressed);
+        if (!object || Sha256::hex(*object) != entry.object) {
+            debug("remote cache: corrupt object {}", entry.object);
+            continue;
+        }
+        try {
+            utils::write_file_atomically(object_path(entry.object),
+                                         *compressed);
+            add_entry(key, entry);
+            return restored(entry, *object);
+        } catch (const std::exception& err) {
+            debug("couldn't restore `{}` from the remote cache: {}",
+                  output.string(), err.what());
+        }
+    }
+    return std::nullopt;
+}
+
+void ObjectCache::store(const std::string& key,
+                        const std::filesystem::path& output,
+                        const std::vector<std::string>& deps) {
+    ManifestEntry entry;
+    for (auto& dep : deps) {
+        auto dep_digest = digest(dep);
+        if (dep_digest.empty())
+            return; // a header that's gone already can't be checked later
+        entry.deps.emplace_back(std::move(dep_digest), dep);
+    }
+
+    auto object = read_file(output);
+    entry.object = Sha256::hex(object);
+    auto blob = object_path(entry.object);
+    std::error_code ec;
+    if (!std::filesystem::exists(blob, ec)) {
+        std::string compressed(ZSTD_compressBound(object.size()), '\0');
+        auto size = ZSTD_compress(compressed.data(), compressed.size(),
+                                  object.data(), object.size(), 3);
+        if (ZSTD_isError(size))
+            throw std::runtime_error(fmt::format("couldn't compress `{}`: {}",
+                                                 output.string(),
+                                                 ZSTD_getErrorName(size)));
+        compressed.resize(size);
+        utils::write_file_atomically(blob, compressed);
+    }
+
+    auto object_digest = entry.object;
+    auto manifest = add_entry(key, std::move(entry));
+    if (m_remote && m_defer_uploads) {
+        // a single short line, appended atomically even with concurrent
+        // compiles
+        std::ofstream(deferred_uploads_path(), std::ios::out | std::ios::app)
+            << key + '\n' << std::flush;
+    } else if (m_remote) {
+        m_remote->put_blob(REMOTE_OBJECT_PREFIX + object_digest, blob);
+        m_remote->put_record("object-" + key, std::move(manifest));
+    }
+}
+
+void ObjectCache::upload_deferred() {
+    if (!m_remote)
+        return;
+
+    // take the queue, compiles that are still running start a new one
+    auto queue = deferred_uploads_path();
+    auto taken = queue;
+    taken += fmt::format(".{:x}", std::random_device{}());
+    std::error_code ec;
+    std::filesystem::rename(queue, taken, ec);
+    if (ec)
+        return; // nothing queued
+    std::unordered_set<std::string> keys;
+    {
+        std::ifstream in(taken);
+        std::string key;
+        while (std::getline(in, key))
+            if (key.size() > 2)
+                keys.insert(key);
+    }
+    std::filesystem::remove(taken, ec);
+
+    for (auto& key : keys) {
+        std::string manifest;
+        std::vector<ManifestEntry> entries;
+        try {
+            manifest = read_file(manifest_path(key));
+            entries = parse_manifest(manifest);
+        } catch (const std::exception&) {
+            continue; // trimmed meanwhile
+        }
+        for (auto& entry : entries)
+            if (std::filesystem::exists(object_path(entry.object), ec))
+                m_remote->put_blob(REMOTE_OBJECT_PREFIX + entry.object,
+                                   object_path(entry.object));
+        m_remote->put_record("object-" + key, std::move(manifest));
+    }
+    debug("remote cache: queued {} deferred object(s)", keys.size());
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct ManifestEntry;
+class RemoteCache;
+
+// Compiled objects in the per-user cache (`<cache dir>/objects`), shared by
+// every project and build directory on the machine, like ccache in its direct
+// mode.
+//
+// A compile command is keyed on the compiler binary, its arguments and the
+// contents of its source. Every key has a manifest listing, for each object
+// it produced before, the headers the source included and their digests: if
+// they all still match, the object is restored without running the compiler
+// (or even the preprocessor). Several header states are kept per key, so that
+// switching branches back and forth restores objects instead of recompiling.
+// Objects themselves are stored once per content, compressed with zstd.
+// With a `RemoteCache`, local misses are looked up there and new objects are
+// uploaded to it.
+//
+// Thread-safe. File digests are computed once per instance, so create one per
+// build: headers are assumed not to change while building.
+class ObjectCache {
+public:
+    // Disabled if `QOBS_NO_OBJECT_CACHE` is set. With `defer_uploads`, new
+    // objects aren't uploaded to the remote cache but queued for
+    // `upload_deferred`, for processes that compile a single source
+    // (`qobs cc`) and shouldn't wait for uploads when they exit.
+    explicit ObjectCache(bool defer_uploads = false);
+
+    // Whether `QOBS_NO_OBJECT_CACHE` isn't set.
+    static bool enabled_by_env();
+
+    inline bool enabled() const {
+        return !m_dir.empty();
+    }
+
+    // Key of a compile command. `args` may contain placeholders for paths
+    // that don't affect the object (like the output path), `command` is the
+    // command as it's actually run, whose compiler (behind a launcher like
+    // `ccache`) is stamped. Empty if the command can't be cached.
+    std::string key(const std::vector<std::string>& args,
+                    const std::vector<std::string>& command,
+                    const std::vector<std::filesystem::path>& inputs);
+
+    // Write the object for `key` to `output` and return the headers it was
+    // compiled with, if they didn't change since.
+    std::optional<std::vector<std::string>>
+    restore(const std::string& key, const std::filesystem::path& output);
+
+    // Remember the freshly built `output` and the headers it included. Entries
+    // appear atomically, so concurrent builds never see a half-written one.
+    // Throws on failure.
+    void store(const std::string& key, const std::filesystem::path& output,
+               const std::vector<std::string>& deps);
+
+    // Upload what caches with `defer_uploads` queued, in the background like
+    // `store` does. Never throws.
+    void upload_deferred();
+
+private:
+    // Digest of a file's contents, empty if it can't be read.
+    std::string digest(const std::string& path);
+
+    // Identifies the compiler of `command` by the path, size and mtime of
+    // its binary (not by running it), skipping launchers like `ccache` that
+    // run the compiler after them. Empty if it can't be found.
+    std::string toolchain(const std::vector<std::string>& command);
+
+    // Whether none of the headers of `entry` changed.
+    bool is_current(const ManifestEntry& entry);
+
+    // Put `entry` first in the manifest of `key`, returns the new manifest.
+    std::string add_entry(const std::string& key, ManifestEntry entry);
+
+    std::filesystem::path manifest_path(const std::string& key) const;
+    std::filesystem::path object_path(const std::string& digest) const;
+
+    std::filesystem::path m_dir;
+    std::shared_ptr<RemoteCache> m_remote;
+    bool m_defer_uploads{false};
+
+    std::mutex m_mutex;
+    std::unordered_map<std::string, std::string> m_digests;
+    std::unordered_map<std::string, std::string> m_toolchains;
+};
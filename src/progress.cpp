@@ -0,0 +1,129 @@
+#include "progress.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fmt/core.h>
+
+// minimum time between two redraws of the active block
+constexpr auto REDRAW_INTERVAL = std::chrono::milliseconds(66);
+constexpr size_t BAR_WIDTH = 40;
+constexpr size_t MAX_MESSAGE_WIDTH = 40;
+
+MultiProgress::MultiProgress() {
+    m_is_tty = utils::is_stdout_tty();
+#ifdef QOBS_IS_WINDOWS
+    // see https://github.com/p-ranav/indicators/issues/131
+    if (m_is_tty)
+        utils::ensure_virtual_terminal_processing();
+#endif
+}
+
+MultiProgress::Bar MultiProgress::add_bar(std::string label) {
+    std::lock_guard lock(m_mutex);
+    m_label_width = std::max(m_label_width, label.size());
+    m_bars.push_back(BarState{.label = std::move(label)});
+    return Bar(*this, m_bars.size() - 1);
+}
+
+void MultiProgress::update(size_t index, std::string_view stage,
+                           double progress) {
+    std::lock_guard lock(m_mutex);
+    auto& bar = m_bars[index];
+    progress = std::clamp(progress, 0.0, 1.0);
+
+    // only force a redraw when something visibly changed
+    bool stage_changed = bar.stage != stage;
+    if (!stage_changed &&
+        static_cast<int>(bar.progress * 100.0) ==
+            static_cast<int>(progress * 100.0))
+        return;
+
+    bar.stage = stage;
+    bar.progress = progress;
+    redraw(stage_changed);
+}
+
+void MultiProgress::message(size_t index, std::string_view message) {
+    std::lock_guard lock(m_mutex);
+    auto& bar = m_bars[index];
+
+    // keep only the last line of the message, remotes like to send `\r`
+    while (!message.empty() &&
+           (message.back() == '\n' || message.back() == '\r'))
+        message.remove_suffix(1);
+    auto pos = message.find_last_of("\r\n");
+    if (pos != std::string_view::npos)
+        message = message.substr(pos + 1);
+    if (message.empty())
+        return;
+
+    bar.message = message.substr(0, MAX_MESSAGE_WIDTH);
+    redraw(false);
+}
+
+void MultiProgress::finish(size_t index, std::string_view status) {
+    std::lock_guard lock(m_mutex);
+    auto& bar = m_bars[index];
+    bar.finished = true;
+    bar.stage = status;
+    bar.progress = 1.0;
+    redraw(true);
+}
+
+void MultiProgress::done() {
+    std::lock_guard lock(m_mutex);
+    redraw(true);
+}
+
+std::string MultiProgress::format_bar(const BarState& bar) const {
+    if (bar.finished)
+        return fmt::format("  {:>{}} {}", bar.label, m_label_width, bar.stage);
+
+    auto filled = static_cast<size_t>(bar.progress * BAR_WIDTH);
+    return fmt::format("  {:>{}} {:<9} [{}{}] {:>3}% {}", bar.label,
+                       m_label_width, bar.stage, std::string(filled, '='),
+                       std::string(BAR_WIDTH - filled, ' '),
+                       static_cast<int>(bar.progress * 100.0), bar.message);
+}
+
+void MultiProgress::redraw(bool force) {
+    auto now = std::chrono::steady_clock::now();
+    if (!force && now - m_last_draw < REDRAW_INTERVAL)
+        return;
+    m_last_draw = now;
+
+    std::string out;
+    if (m_is_tty) {
+        // move the cursor to the start of the active block
+        if (m_drawn_lines)
+            out += fmt::format("\x1b[{}F", m_drawn_lines);
+    }
+
+    // finished bars are printed once, above the active block
+    for (auto& bar : m_bars) {
+        if (!bar.finished || bar.printed)
+            continue;
+        bar.printed = true;
+        if (m_is_tty)
+            out += "\x1b[2K";
+        out += format_bar(bar);
+        out += '\n';
+    }
+
+    m_drawn_lines = 0;
+    if (m_is_tty) {
+        for (auto& bar : m_bars) {
+            if (bar.finished || bar.stage.empty())
+                continue;
+            out += "\x1b[2K";
+            out += format_bar(bar);
+            out += '\n';
+            ++m_drawn_lines;
+        }
+        // clear leftovers from a previously taller block
+        out += "\x1b[J";
+    }
+
+    std::fwrite(out.data(), 1, out.size(), stdout);
+    std::fflush(stdout);
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Thread-safe display for several concurrent progressbars (e.g. parallel git
+// transfers). Active bars are redrawn in place as a block at the bottom of the
+// terminal; finished bars are printed once above that block and never touched
+// again. Redraws are throttled so that many tiny updates (libgit2 reports
+// every received object) don't hog the terminal, which matters a lot for
+// Windows cmd. When stdout isn't a terminal, only the final lines are printed.
+class MultiProgress {
+public:
+    class Bar {
+    public:
+        Bar(MultiProgress& progress, size_t index)
+            : m_progress(&progress), m_index(index) {}
+
+        // `stage` is the short text before the bar, e.g. `fetching`.
+        // `progress` is in the range [0; 1].
+        void update(std::string_view stage, double progress) {
+            m_progress->update(m_index, stage, progress);
+        }
+
+        // Text displayed after the bar (e.g. `remote:` messages).
+        void message(std::string_view message) {
+            m_progress->message(m_index, message);
+        }
+
+        // Mark the bar as completed, it will be printed as `label: status`.
+        void finish(std::string_view status) {
+            m_progress->finish(m_index, status);
+        }
+
+    private:
+        MultiProgress* m_progress;
+        size_t m_index;
+    };
+
+    MultiProgress();
+
+    // Add a new bar, `label` is usually the dependency name.
+    Bar add_bar(std::string label);
+
+    // Print anything still pending. Call after all bars have finished.
+    void done();
+
+private:
+    struct BarState {
+        std::string label;
+        std::string stage;
+        std::string message;
+        double progress{0.0};
+        bool finished{false};
+        bool printed{false};
+    };
+
+    void update(size_t index, std::string_view stage, double progress);
+    void message(size_t index, std::string_view message);
+    void finish(size_t index, std::string_view status);
+
+    // Must be called with `m_mutex` held.
+    void redraw(bool force);
+    std::string format_bar(const BarState& bar) const;
+
+    std::mutex m_mutex;
+    std::vector<BarState> m_bars;
+    bool m_is_tty;
+    size_t m_label_width{0};
+
+    // Number of lines occupied by the active block from the last redraw.
+    size_t m_drawn_lines{0};
+    std::chrono::steady_clock::time_point m_last_draw{};
+};
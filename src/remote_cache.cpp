@@ -0,0 +1,227 @@
+#include "remote_cache.hpp"
+#include "hash.hpp"
+#include "utils.hpp"
+#include <fstream>
+#include <sstream>
+#include <subprocess.h>
+#include <unordered_set>
+
+using namespace spdlog;
+
+// curl exits with this for HTTP errors (with `--fail`), e.g. 404. Anything
+// else means the server couldn't be talked to at all.
+constexpr int CURL_HTTP_ERROR = 22;
+
+std::filesystem::path RemoteCache::down_marker(std::string_view url) {
+    while (!url.empty() && url.back() == '/')
+        url.remove_suffix(1);
+    return utils::cache_dir() /
+           fmt::format("remote-down-{}", Sha256::hex(url).substr(0, 16));
+}
+
+std::shared_ptr<RemoteCache> RemoteCache::from_env() {
+    auto url = std::getenv("QOBS_REMOTE_CACHE");
+    if (!url || !*url)
+        return nullptr;
+    std::error_code ec;
+    auto down = std::filesystem::last_write_time(down_marker(url), ec);
+    if (!ec &&
+        std::filesystem::file_time_type::clock::now() - down < DOWN_RETRY) {
+        debug("remote cache `{}` was unavailable recently, not using it", url);
+        return nullptr;
+    }
+    return std::make_shared<RemoteCache>(url);
+}
+
+RemoteCache::RemoteCache(std::string url) : m_url(std::move(url)) {
+    while (!m_url.empty() && m_url.back() == '/')
+        m_url.pop_back();
+    m_uploader = std::thread([this] { upload_loop(); });
+}
+
+RemoteCache::~RemoteCache() {
+    {
+        std::unique_lock lock(m_mutex);
+        m_stop = true;
+        m_cv.notify_all();
+        // the build is done, a slow server doesn't get to hold it up
+        if (!m_cv.wait_for(lock, FLUSH_TIMEOUT,
+                           [this] { return m_finished; })) {
+            debug("remote cache: uploads didn't finish within {}s, dropping "
+                  "them",
+                  FLUSH_TIMEOUT.count());
+            m_abandoned = true;
+            m_uploads.clear();
+            for (auto process : m_processes)
+                subprocess_terminate(process);
+        }
+    }
+    m_uploader.join();
+}
+
+std::optional<std::string>
+RemoteCache::request(std::vector<std::string> args, std::string_view input) {
+    if (m_down || m_abandoned)
+        return std::nullopt;
+
+    // short timeouts: a cache that is slower than compiling is no cache
+    std::vector<std::string> command{"curl",   "--fail",    "--silent",
+                                     "--show-error",        "--connect-timeout",
+                                     "2",      "--max-time", "60"};
+    command.insert(command.end(), args.begin(), args.end());
+    std::vector<const char*> argv;
+    for (auto& arg : command)
+        argv.push_back(arg.c_str());
+    argv.push_back(nullptr);
+
+    subprocess_s process;
+    if (subprocess_create(argv.data(),
+                          subprocess_option_inherit_environment |
+                              subprocess_option_search_user_path |
+                              subprocess_option_no_window,
+                          &process) != 0) {
+        warn("remote cache disabled: couldn't spawn curl");
+        m_down = true;
+        return std::nullopt;
+    }
+
+    // the input is small (a record or a list of digests) and curl reads all
+    // of it before responding, so this can't deadlock
+    auto stdin_file = subprocess_stdin(&process);
+    if (!input.empty())
+        std::fwrite(input.data(), 1, input.size(), stdin_file);
+    std::fclose(stdin_file);
+    process.stdin_file = nullptr;
+
+    // only now, killing curl while writing to it would raise SIGPIPE
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_abandoned)
+            subprocess_terminate(&process);
+        m_processes.push_back(&process);
+    }
+
+    std::string output;
+    char buf[16 * 1024];
+    auto stdout_file = subprocess_stdout(&process);
+    while (auto n = std::fread(buf, 1, sizeof(buf), stdout_file))
+        output.append(buf, n);
+
+    {
+        std::lock_guard lock(m_mutex);
+        std::erase(m_processes, &process);
+    }
+    int code = -1;
+    subprocess_join(&process, &code);
+    std::string err;
+    auto stderr_file = subprocess_stderr(&process);
+    while (auto n = std::fread(buf, 1, sizeof(buf), stderr_file))
+        err.append(buf, n);
+    subprocess_destroy(&process);
+    utils::trim_in_place(err);
+
+    if (code == 0)
+        return output;
+    if (m_abandoned)
+        return std::nullopt; // killed
+    if (code != CURL_HTTP_ERROR && !m_down.exchange(true)) {
+        warn("remote cache `{}` is unavailable, continuing without it: {}",
+             m_url, err);
+        std::error_code ec;
+        std::filesystem::create_directories(utils::cache_dir(), ec);
+        std::ofstream(down_marker(m_url), std::ios::out | std::ios::trunc);
+    }
+    return std::nullopt;
+}
+
+std::optional<std::string> RemoteCache::get(const std::string& path) {
+    auto body = request({m_url + path});
+    trace("remote cache: GET {} {}", path, body ? "hit" : "miss");
+    return body;
+}
+
+std::optional<std::string> RemoteCache::get_blob(const std::string& digest) {
+    return get("/cas/" + digest);
+}
+
+std::optional<std::string> RemoteCache::get_record(const std::string& key) {
+    return get("/ac/" + key);
+}
+
+void RemoteCache::put_blob(const std::string& digest,
+                           std::filesystem::path path) {
+    {
+        std::lock_guard lock(m_mutex);
+        m_uploads.push_back(Upload{.name = digest, .path = std::move(path)});
+    }
+    m_cv.notify_all();
+}
+
+void RemoteCache::put_record(const std::string& key, std::string contents) {
+    {
+        std::lock_guard lock(m_mutex);
+        m_uploads.push_back(Upload{.name = key, .contents = std::move(contents)});
+    }
+    m_cv.notify_all();
+}
+
+void RemoteCache::upload_loop() {
+    for (;;) {
+        std::deque<Upload> batch;
+        {
+            std::unique_lock lock(m_mutex);
+            m_cv.wait(lock, [this] { return m_stop || !m_uploads.empty(); });
+            if (m_uploads.empty()) {
+                // stopping, and nothing left to do
+                m_finished = true;
+                m_cv.notify_all();
+                return;
+            }
+            // everything that was queued while the last batch was uploading
+            batch.swap(m_uploads);
+        }
+        if (!m_down && !m_abandoned)
+            upload_batch(std::move(batch));
+    }
+}
+
+void RemoteCache::upload_batch(std::deque<Upload> batch) {
+    std::string digests;
+    for (auto& upload : batch)
+        if (!upload.path.empty())
+            digests += upload.name + '\n';
+
+    std::unordered_set<std::string> present;
+    if (!digests.empty()) {
+        auto response = request(
+            {"--data-binary", "@-", "-H", "Content-Type: text/plain",
+             m_url + "/cas/exists"},
+            digests);
+        if (!response)
+            return;
+        std::istringstream in(*response);
+        std::string line;
+        while (std::getline(in, line))
+            present.insert(line);
+    }
+
+    size_t blobs = 0, records = 0;
+    for (auto& upload : batch) {
+        if (upload.path.empty()) {
+            request({"--request", "PUT", "--data-binary", "@-",
+                     m_url + "/ac/" + upload.name},
+                    upload.contents);
+            ++records;
+        } else if (!present.count(upload.name) &&
+                   std::filesystem::exists(upload.path)) {
+            request({"--upload-file", upload.path.string(),
+                     m_url + "/cas/" + upload.name});
+            present.insert(upload.name); // queued twice in the same batch
+            ++blobs;
+        }
+        if (m_down || m_abandoned)
+            return;
+    }
+    debug("remote cache: uploaded {} blob(s) and {} record(s)", blobs,
+          records);
+}
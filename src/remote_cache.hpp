@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct subprocess_s;
+
+// Client for a cache shared between machines (e.g. a CI fleet), set with
+// `QOBS_REMOTE_CACHE=http://host:port`. See `qobs cache-server` for a
+// reference server. The protocol is plain HTTP:
+//
+// - `GET`/`PUT /cas/<digest>`: immutable blobs, named by a digest of their
+//   contents (checked by the server on upload and by the client after
+//   downloading). `zstd-<digest>` blobs are compressed, the digest is of
+//   what they decompress to.
+// - `GET`/`PUT /ac/<key>`: small records pointing at blobs, e.g. the object
+//   cache manifest of a compile command.
+// - `POST /cas/exists`: a body of digests, one per line. Responds with the
+//   ones the server has.
+//
+// Uploads happen in the background and are batched: every batch starts with
+// a single existence check, so blobs the server already has aren't sent
+// again. They are best effort: whatever isn't uploaded within
+// `FLUSH_TIMEOUT` of the build finishing is dropped. The remote cache is
+// strictly optional: once it can't be reached, it is ignored for the rest of
+// the build instead of failing it, and by every other process for
+// `DOWN_RETRY` (e.g. the compiles of a ninja build, see `qobs cc`).
+class RemoteCache {
+public:
+    // Nothing if `QOBS_REMOTE_CACHE` isn't set, or if it couldn't be reached
+    // within the last `DOWN_RETRY`.
+    static std::shared_ptr<RemoteCache> from_env();
+
+    // How long a cache that couldn't be reached is left alone.
+    static constexpr std::chrono::minutes DOWN_RETRY{1};
+
+    explicit RemoteCache(std::string url);
+
+    // A build doesn't wait longer than this for its uploads.
+    static constexpr std::chrono::seconds FLUSH_TIMEOUT{3};
+
+    // Waits up to `FLUSH_TIMEOUT` for pending uploads, then drops the rest.
+    ~RemoteCache();
+
+    RemoteCache(const RemoteCache&) = delete;
+    RemoteCache& operator=(const RemoteCache&) = delete;
+
+    // Nothing if it's missing or the cache can't be reached.
+    std::optional<std::string> get_blob(const std::string& digest);
+    std::optional<std::string> get_record(const std::string& key);
+
+    // Queue uploads. Records are uploaded after every blob queued before
+    // them, so that they never point at a missing blob.
+    void put_blob(const std::string& digest, std::filesystem::path path);
+    void put_record(const std::string& key, std::string contents);
+
+private:
+    struct Upload {
+        // A record if `path` is empty.
+        std::string name;
+        std::filesystem::path path;
+        std::string contents;
+    };
+
+    // Run `curl` with `args` after the common ones, feeding it `input`.
+    // Returns the response body, or nothing on HTTP errors. Marks the cache
+    // as down if it can't be reached.
+    std::optional<std::string> request(std::vector<std::string> args,
+                                       std::string_view input = {});
+    std::optional<std::string> get(const std::string& path);
+
+    // Marks a cache that can't be reached for all processes, its mtime is
+    // when that was noticed.
+    static std::filesystem::path down_marker(std::string_view url);
+
+    void upload_loop();
+    void upload_batch(std::deque<Upload> batch);
+
+    std::string m_url;
+    std::atomic<bool> m_down{false};
+    // set once uploads were dropped, stops everything still in flight
+    std::atomic<bool> m_abandoned{false};
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Upload> m_uploads;
+    bool m_stop{false};
+    bool m_finished{false};
+    // running curl processes, killed when uploads are dropped
+    std::vector<subprocess_s*> m_processes;
+    std::thread m_uploader;
+};
@@ -0,0 +1,387 @@
+#include "socket.hpp"
+#include <cstring>
+#include <mutex>
+
+#ifdef QOBS_IS_WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+constexpr std::string_view UNIX_PREFIX = "unix:";
+
+// Length prefixes and field counts of messages, little endian.
+using MessageSize = uint64_t;
+
+static void init_sockets() {
+#ifdef QOBS_IS_WINDOWS
+    static std::once_flag wsa_once;
+    std::call_once(wsa_once, [] {
+        WSADATA data;
+        WSAStartup(MAKEWORD(2, 2), &data);
+    });
+#endif
+}
+
+static void close_handle(Socket::Handle handle) {
+#ifdef QOBS_IS_WINDOWS
+    closesocket(handle);
+#else
+    close(handle);
+#endif
+}
+
+static std::string last_error() {
+#ifdef QOBS_IS_WINDOWS
+    return fmt::format("error {}", WSAGetLastError());
+#else
+    return std::strerror(errno);
+#endif
+}
+
+Socket::~Socket() {
+    if (valid())
+        close_handle(m_handle);
+}
+
+Socket::Socket(Socket&& other) noexcept
+    : m_handle(std::exchange(other.m_handle, INVALID)) {}
+
+Socket& Socket::operator=(Socket&& other) noexcept {
+    if (this != &other) {
+        if (valid())
+            close_handle(m_handle);
+        m_handle = std::exchange(other.m_handle, INVALID);
+    }
+    return *this;
+}
+
+#ifndef QOBS_IS_WINDOWS
+static sockaddr_un unix_address(std::string_view path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error(
+            fmt::format("invalid Unix socket path `{}`", path));
+    std::memcpy(addr.sun_path, path.data(), path.size());
+    return addr;
+}
+#endif
+
+// `host:port` or `[host]:port`. Throws if it can't be resolved.
+static addrinfo* resolve(const std::string& address, bool passive) {
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0 ||
+        colon + 1 == address.size())
+        throw std::runtime_error(fmt::format(
+            "invalid address `{}`, expected `host:port` or `unix:<path>`",
+            address));
+    auto host = address.substr(0, colon);
+    auto port = address.substr(colon + 1);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo* addrs = nullptr;
+    if (int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs))
+        throw std::runtime_error(fmt::format("couldn't resolve `{}`: {}",
+                                             address, gai_strerror(err)));
+    return addrs;
+}
+
+static void set_nonblocking(Socket::Handle handle, bool nonblocking) {
+#ifdef QOBS_IS_WINDOWS
+    u_long mode = nonblocking ? 1 : 0;
+    ioctlsocket(handle, FIONBIO, &mode);
+#else
+    auto flags = fcntl(handle, F_GETFL, 0);
+    fcntl(handle, F_SETFL,
+          nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+#endif
+}
+
+// Connect with a timeout: start a non-blocking connect and wait for it to
+// become writable.
+static bool connect_handle(Socket::Handle handle, const sockaddr* addr,
+                           size_t addr_len,
+                           std::chrono::milliseconds timeout) {
+    set_nonblocking(handle, true);
+    if (::connect(handle, addr, static_cast<int>(addr_len)) != 0) {
+#ifdef QOBS_IS_WINDOWS
+        if (WSAGetLastError() != WSAEWOULDBLOCK)
+            return false;
+        WSAPOLLFD pfd{.fd = handle, .events = POLLOUT};
+        if (WSAPoll(&pfd, 1, static_cast<int>(timeout.count())) != 1)
+            return false;
+#else
+        if (errno != EINPROGRESS)
+            return false;
+        pollfd pfd{.fd = handle, .events = POLLOUT};
+        if (poll(&pfd, 1, static_cast<int>(timeout.count())) != 1)
+            return false;
+#endif
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(handle, SOL_SOCKET, SO_ERROR,
+                       reinterpret_cast<char*>(&err), &len) != 0 ||
+            err != 0)
+            return false;
+    }
+    set_nonblocking(handle, false);
+    return true;
+}
+
+Socket Socket::listen_on(const std::string& address) {
+    init_sockets();
+    if (address.starts_with(UNIX_PREFIX)) {
+#ifdef QOBS_IS_WINDOWS
+        throw std::runtime_error("Unix sockets aren't supported on Windows");
+#else
+        auto path = address.substr(UNIX_PREFIX.size());
+        auto addr = unix_address(path);
+        Socket sock(socket(AF_UNIX, SOCK_STREAM, 0));
+        if (!sock.valid())
+            throw std::runtime_error(
+                fmt::format("couldn't create socket: {}", last_error()));
+        // left behind by a previous run that didn't exit cleanly
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+        if (bind(sock.m_handle, reinterpret_cast<const sockaddr*>(&addr),
+                 sizeof(addr)) != 0 ||
+            ::listen(sock.m_handle, SOMAXCONN) != 0)
+            throw std::runtime_error(fmt::format("couldn't listen on `{}`: {}",
+                                                 address, last_error()));
+        return sock;
+#endif
+    }
+
+    auto addrs = resolve(address, true);
+    Socket sock;
+    for (auto addr = addrs; addr; addr = addr->ai_next) {
+        sock = Socket(static_cast<Handle>(
+            socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)));
+        if (!sock.valid())
+            continue;
+        int yes = 1;
+        setsockopt(sock.m_handle, SOL_SOCKET, SO_REUSEADDR,
+                   reinterpret_cast<const char*>(&yes), sizeof(yes));
+        if (bind(sock.m_handle, addr->ai_addr,
+                 static_cast<int>(addr->ai_addrlen)) == 0 &&
+            ::listen(sock.m_handle, SOMAXCONN) == 0)
+            break;
+        sock = Socket();
+    }
+    freeaddrinfo(addrs);
+    if (!sock.valid())
+        throw std::runtime_error(
+            fmt::format("couldn't listen on `{}`", address));
+    return sock;
+}
+
+Socket Socket::connect_to(const std::string& address,
+                          std::chrono::milliseconds timeout) {
+    init_sockets();
+    if (address.starts_with(UNIX_PREFIX)) {
+#ifdef QOBS_IS_WINDOWS
+        throw std::runtime_error("Unix sockets aren't supported on Windows");
+#else
+        auto addr = unix_address(address.substr(UNIX_PREFIX.size()));
+        Socket sock(socket(AF_UNIX, SOCK_STREAM, 0));
+        if (!sock.valid() ||
+            !connect_handle(sock.m_handle,
+                            reinterpret_cast<const sockaddr*>(&addr),
+                            sizeof(addr), timeout))
+            throw std::runtime_error(fmt::format(
+                "couldn't connect to `{}`: {}", address, last_error()));
+        return sock;
+#endif
+    }
+
+    auto addrs = resolve(address, false);
+    Socket sock;
+    for (auto addr = addrs; addr; addr = addr->ai_next) {
+        sock = Socket(static_cast<Handle>(
+            socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)));
+        if (sock.valid() && connect_handle(sock.m_handle, addr->ai_addr,
+                                           addr->ai_addrlen, timeout))
+            break;
+        sock = Socket();
+    }
+    freeaddrinfo(addrs);
+    if (!sock.valid())
+        throw std::runtime_error(
+            fmt::format("couldn't connect to `{}`", address));
+    return sock;
+}
+
+Socket Socket::accept() {
+    Socket sock(static_cast<Handle>(::accept(m_handle, nullptr, nullptr)));
+#ifdef SO_NOSIGPIPE
+    if (sock.valid()) {
+        int yes = 1;
+        setsockopt(sock.m_handle, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+    }
+#endif
+    return sock;
+}
+
+void Socket::set_timeout(std::chrono::milliseconds timeout) {
+#ifdef QOBS_IS_WINDOWS
+    DWORD value = static_cast<DWORD>(timeout.count());
+#else
+    timeval value{.tv_sec = static_cast<time_t>(timeout.count() / 1000),
+                  .tv_usec =
+                      static_cast<suseconds_t>(timeout.count() % 1000 * 1000)};
+#endif
+    setsockopt(m_handle, SOL_SOCKET, SO_RCVTIMEO,
+               reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool Socket::send_all(std::string_view data) {
+#ifdef MSG_NOSIGNAL
+    constexpr int flags = MSG_NOSIGNAL;
+#else
+    constexpr int flags = 0;
+#endif
+    while (!data.empty()) {
+        auto n =
+            send(m_handle, data.data(), static_cast<int>(data.size()), flags);
+        if (n <= 0)
+            return false;
+        data.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+size_t Socket::recv_some(char* buf, size_t size) {
+    auto n = recv(m_handle, buf, static_cast<int>(size), 0);
+    return n > 0 ? static_cast<size_t>(n) : 0;
+}
+
+bool Socket::recv_exact(char* buf, size_t size) {
+    while (size) {
+        auto n = recv_some(buf, size);
+        if (!n)
+            return false;
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void append_size(std::string& out, MessageSize size) {
+    for (int i = 0; i < 8; ++i)
+        out += static_cast<char>((size >> (i * 8)) & 0xff);
+}
+
+static MessageSize parse_size(const char* data) {
+    MessageSize size = 0;
+    for (int i = 0; i < 8; ++i)
+        size |= MessageSize(static_cast<unsigned char>(data[i])) << (i * 8);
+    return size;
+}
+
+bool Socket::send_message(const std::vector<std::string_view>& fields) {
+    // the sizes go first, so that a message is two sends
+    std::string head;
+    append_size(head, fields.size());
+    for (auto field : fields)
+        append_size(head, field.size());
+    if (!send_all(head))
+        return false;
+    for (auto field : fields)
+        if (!send_all(field))
+            return false;
+    return true;
+}
+
+std::optional<std::vector<std::string>>
+Socket::recv_message(size_t max_size) {
+    char buf[8];
+    if (!recv_exact(buf, sizeof(buf)))
+        return std::nullopt;
+    auto count = parse_size(buf);
+    if (count > max_size / sizeof(buf))
+        return std::nullopt;
+
+    std::vector<MessageSize> sizes;
+    MessageSize total = 0;
+    for (MessageSize i = 0; i < count; ++i) {
+        if (!recv_exact(buf, sizeof(buf)))
+            return std::nullopt;
+        sizes.push_back(parse_size(buf));
+        total += sizes.back();
+        if (sizes.back() > max_size || total > max_size)
+            return std::nullopt;
+    }
+
+    std::vector<std::string> fields;
+    fields.reserve(sizes.size());
+    for (auto size : sizes) {
+        std::string field(static_cast<size_t>(size), '\0');
+        if (!recv_exact(field.data(), field.size()))
+            return std::nullopt;
+        fields.push_back(std::move(field));
+    }
+    return fields;
+}
+
+#ifndef QOBS_IS_WINDOWS
+bool Socket::send_fds(const std::vector<int>& fds) {
+    char byte = 0;
+    iovec iov{.iov_base = &byte, .iov_len = 1};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    return sendmsg(m_handle, &msg, 0) == 1;
+}
+
+std::optional<std::vector<int>> Socket::recv_fds(size_t count) {
+    char byte;
+    iovec iov{.iov_base = &byte, .iov_len = 1};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * count));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    if (recvmsg(m_handle, &msg, 0) != 1)
+        return std::nullopt;
+
+    std::vector<int> fds;
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        auto n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        auto first = fds.size();
+        fds.resize(first + n);
+        std::memcpy(fds.data() + first, CMSG_DATA(cmsg), n * sizeof(int));
+    }
+    if (fds.size() < count || (msg.msg_flags & MSG_CTRUNC)) {
+        for (auto fd : fds)
+            close(fd);
+        return std::nullopt;
+    }
+    return fds;
+}
+#endif
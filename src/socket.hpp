@@ -0,0 +1,75 @@
+#pragma once
+#include "utils.hpp"
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A stream socket, closed when destroyed. Addresses are `host:port` for TCP
+// (`[::1]:port` for IPv6 literals) or `unix:<path>` for a Unix domain socket.
+class Socket {
+public:
+#ifdef QOBS_IS_WINDOWS
+    using Handle = std::uintptr_t; // SOCKET
+#else
+    using Handle = int;
+#endif
+    static constexpr Handle INVALID = static_cast<Handle>(-1);
+
+    Socket() = default;
+    explicit Socket(Handle handle) : m_handle(handle) {}
+    ~Socket();
+
+    Socket(Socket&& other) noexcept;
+    Socket& operator=(Socket&& other) noexcept;
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+
+    // Listen on `address`, replacing a stale Unix socket file. Throws.
+    static Socket listen_on(const std::string& address);
+
+    // Connect to `address`, giving up after `timeout`. Throws.
+    static Socket connect_to(const std::string& address,
+                             std::chrono::milliseconds timeout);
+
+    inline bool valid() const {
+        return m_handle != INVALID;
+    }
+
+    // Next connection of a listening socket, invalid on failure.
+    Socket accept();
+
+    // Make receiving fail after waiting `timeout` for data.
+    void set_timeout(std::chrono::milliseconds timeout);
+
+    // Whether everything was sent. A peer going away isn't fatal (no SIGPIPE).
+    bool send_all(std::string_view data);
+
+    // Up to `size` bytes, 0 if the connection was closed or broke.
+    size_t recv_some(char* buf, size_t size);
+
+    bool recv_exact(char* buf, size_t size);
+
+    // A message is a list of byte strings, each prefixed with its length. Used
+    // by protocols that don't need to be spoken by other tools.
+    bool send_message(const std::vector<std::string_view>& fields);
+
+    // Nothing if the connection broke or the message is bigger than
+    // `max_size` in total.
+    std::optional<std::vector<std::string>> recv_message(size_t max_size);
+
+#ifndef QOBS_IS_WINDOWS
+    // Pass open file descriptors to the peer of a Unix socket, along with a
+    // single byte.
+    bool send_fds(const std::vector<int>& fds);
+
+    // Nothing if the connection broke or fewer than `count` descriptors
+    // arrived.
+    std::optional<std::vector<int>> recv_fds(size_t count);
+#endif
+
+private:
+    Handle m_handle{INVALID};
+};
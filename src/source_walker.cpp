@@ -0,0 +1,696 @@
+#include "source_walker.hpp"
+#include "hash.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <glob/glob.h>
+#include <mutex>
+#include <spdlog/spdlog.h>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace spdlog;
+
+// Directories that never contain sources of the package being scanned.
+constexpr std::string_view ALWAYS_PRUNED[] = {".git", "_deps"};
+
+// bump when the scan index format or what goes into it changes
+constexpr std::string_view SCAN_INDEX_MAGIC = "qobs-scan-1";
+
+// Directories changed less than this long before a walk aren't put into the
+// index: another change within the same mtime tick wouldn't be noticed.
+constexpr int64_t RACY_STAMP_NS = 2'000'000'000;
+
+static bool is_hidden(std::string_view name) {
+    return !name.empty() && name.front() == '.';
+}
+
+// Match a `[...]` class starting at `pattern[i]` (just after the `[`) against
+// `c`. Sets `i` to just after the closing `]`. Returns nullopt if the class is
+// unterminated, in which case the `[` is a literal.
+static std::optional<bool> match_class(std::string_view pattern, size_t& i,
+                                       char c) {
+    size_t j = i;
+    bool negate = j < pattern.size() && pattern[j] == '!';
+    if (negate)
+        ++j;
+    bool matched = false;
+    bool first = true;
+    for (; j < pattern.size(); ++j) {
+        if (pattern[j] == ']' && !first) {
+            i = j + 1;
+            return matched != negate;
+        }
+        first = false;
+        if (j + 2 < pattern.size() && pattern[j + 1] == '-' &&
+            pattern[j + 2] != ']') {
+            if (pattern[j] <= c && c <= pattern[j + 2])
+                matched = true;
+            j += 2;
+        } else if (pattern[j] == c) {
+            matched = true;
+        }
+    }
+    return std::nullopt;
+}
+
+// fnmatch without path separators: `*` backtracks to the last star only, so
+// this is linear in practice.
+static bool match_wildcard(std::string_view pattern, std::string_view name) {
+    size_t p = 0, n = 0;
+    size_t star_p = std::string_view::npos, star_n = 0;
+    while (n < name.size()) {
+        if (p < pattern.size()) {
+            char c = pattern[p];
+            if (c == '*') {
+                star_p = ++p;
+                star_n = n;
+                continue;
+            }
+            if (c == '?') {
+                ++p;
+                ++n;
+                continue;
+            }
+            if (c == '[') {
+                size_t i = p + 1;
+                auto matched = match_class(pattern, i, name[n]);
+                if (matched && *matched) {
+                    p = i;
+                    ++n;
+                    continue;
+                }
+                if (!matched && name[n] == '[') {
+                    ++p;
+                    ++n;
+                    continue;
+                }
+            } else if (c == name[n]) {
+                ++p;
+                ++n;
+                continue;
+            }
+        }
+        if (star_p == std::string_view::npos)
+            return false;
+        p = star_p;
+        n = ++star_n;
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+        ++p;
+    return p == pattern.size();
+}
+
+GlobPattern::GlobPattern(std::string_view pattern, bool recursive) {
+    std::filesystem::path path(pattern);
+    m_escapes_root = path.has_root_path();
+
+    size_t start = 0;
+    while (start <= pattern.size()) {
+        auto end = pattern.find_first_of("/\\", start);
+        if (end == std::string_view::npos)
+            end = pattern.size();
+        auto text = pattern.substr(start, end - start);
+        start = end + 1;
+
+        if (text.empty() || text == ".")
+            continue;
+        if (text == "..")
+            m_escapes_root = true;
+
+        Segment::Kind kind = Segment::Kind::literal;
+        if (text == "**" && recursive)
+            kind = Segment::Kind::recursive;
+        else if (text.find_first_of("*?[") != std::string_view::npos)
+            kind = Segment::Kind::wildcard;
+
+        // consecutive `**` are the same as one
+        if (kind == Segment::Kind::recursive && !m_segments.empty() &&
+            m_segments.back().kind == Segment::Kind::recursive)
+            continue;
+        m_segments.push_back(Segment{kind, std::string(text)});
+    }
+}
+
+bool GlobPattern::Segment::matches(std::string_view name) const {
+    switch (kind) {
+    case Kind::literal:
+        return name == text;
+    case Kind::wildcard:
+        if (is_hidden(name) && !is_hidden(text))
+            return false;
+        return match_wildcard(text, name);
+    case Kind::recursive:
+        return !is_hidden(name);
+    }
+    return false;
+}
+
+bool GlobPattern::matches_from(const std::vector<std::string_view>& path,
+                               size_t i, size_t j, size_t end) const {
+    if (j == end)
+        return i == path.size();
+    auto& segment = m_segments[j];
+    if (segment.kind == Segment::Kind::recursive) {
+        // zero directories, or one more
+        if (matches_from(path, i, j + 1, end))
+            return true;
+        return i < path.size() && segment.matches(path[i]) &&
+               matches_from(path, i + 1, j, end);
+    }
+    return i < path.size() && segment.matches(path[i]) &&
+           matches_from(path, i + 1, j + 1, end);
+}
+
+bool GlobPattern::matches(const std::vector<std::string_view>& path) const {
+    return matches_from(path, 0, 0, m_segments.size());
+}
+
+bool GlobPattern::matches_everything_in(
+    const std::vector<std::string_view>& path) const {
+    if (matches(path))
+        return true;
+    return !m_segments.empty() &&
+           m_segments.back().kind == Segment::Kind::recursive &&
+           matches_from(path, 0, 0, m_segments.size() - 1);
+}
+
+SourceWalker::SourceWalker(const std::vector<std::string>& sources,
+                           const std::vector<std::string>& exclude,
+                           bool recursive)
+    : m_recursive(recursive) {
+    for (auto& source : sources) {
+        GlobPattern pattern(source, recursive);
+        if (pattern.escapes_root())
+            m_fallback.push_back(source);
+        else if (!pattern.segments().empty())
+            m_sources.push_back(std::move(pattern));
+    }
+    // excludes are always recursive, `**/test/**` should work either way
+    for (auto& pattern : exclude)
+        m_exclude.emplace_back(pattern, true);
+
+    Sha256 sha;
+    sha.update_field(SCAN_INDEX_MAGIC).update_field(recursive ? "1" : "0");
+    for (auto& source : sources)
+        sha.update_field(source);
+    sha.update_field("exclude");
+    for (auto& pattern : exclude)
+        sha.update_field(pattern);
+    m_key = sha.hex_digest();
+}
+
+void SourceWalker::cache_in(std::filesystem::path path) {
+    m_cache_path = std::move(path);
+}
+
+void SourceWalker::prune(std::filesystem::path dir) {
+    m_pruned.push_back(std::filesystem::absolute(dir).lexically_normal());
+}
+
+void SourceWalker::close(std::vector<State>& states) const {
+    for (size_t i = 0; i < states.size(); ++i) {
+        auto [p, j] = states[i];
+        auto& segments = m_sources[p].segments();
+        if (j + 1 < segments.size() &&
+            segments[j].kind == GlobPattern::Segment::Kind::recursive) {
+            State next{p, j + 1};
+            if (std::find(states.begin(), states.end(), next) == states.end())
+                states.push_back(next);
+        }
+    }
+}
+
+bool SourceWalker::is_excluded(const std::vector<std::string_view>& rel) const {
+    for (auto& pattern : m_exclude)
+        if (pattern.matches(rel))
+            return true;
+    return false;
+}
+
+bool SourceWalker::is_pruned(const std::vector<std::string_view>& rel,
+                             const std::vector<PrunedPath>& pruned) const {
+    auto& name = rel.back();
+    for (auto always : ALWAYS_PRUNED)
+        if (name == always)
+            return true;
+    for (auto& pattern : m_exclude)
+        if (pattern.matches_everything_in(rel))
+            return true;
+    for (auto& path : pruned)
+        if (std::equal(path.begin(), path.end(), rel.begin(), rel.end()))
+            return true;
+    return false;
+}
+
+#ifdef __linux__
+// Read the entries of `dir` with raw `getdents64`, which fills a large buffer
+// per syscall and already knows the type of (almost) every entry, so nothing
+// needs to be `stat`ed. Only symlinks and filesystems that don't report types
+// need a `statx`.
+std::vector<DirEntry> list_directory(const std::filesystem::path& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error(fmt::format("couldn't open `{}`: {}",
+                                             dir.string(), strerror(errno)));
+
+    std::vector<DirEntry> entries;
+    alignas(8) char buf[64 * 1024];
+    for (;;) {
+        auto n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            auto err = errno;
+            close(fd);
+            throw std::runtime_error(fmt::format(
+                "couldn't list `{}`: {}", dir.string(), strerror(err)));
+        }
+        if (n == 0)
+            break;
+
+        for (long offset = 0; offset < n;) {
+            // struct linux_dirent64, not exposed by glibc
+            auto record = buf + offset;
+            unsigned short reclen;
+            std::memcpy(&reclen, record + 16, sizeof(reclen));
+            auto type = static_cast<unsigned char>(record[18]);
+            std::string_view name(record + 19);
+            offset += reclen;
+            if (name == "." || name == "..")
+                continue;
+
+            DirEntry entry{.name = std::string(name)};
+            if (type == DT_DIR) {
+                entry.is_dir = true;
+            } else if (type == DT_REG) {
+                entry.is_file = true;
+            } else {
+                // symlink or unknown type: look at what it points to
+                entry.is_symlink = type == DT_LNK;
+                struct statx stx;
+                if (statx(fd, entry.name.c_str(), AT_STATX_DONT_SYNC,
+                          STATX_TYPE | STATX_MODE, &stx) == 0) {
+                    entry.is_dir = S_ISDIR(stx.stx_mode);
+                    entry.is_file = S_ISREG(stx.stx_mode);
+                }
+                if (type == DT_UNKNOWN &&
+                    statx(fd, entry.name.c_str(),
+                          AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE,
+                          &stx) == 0)
+                    entry.is_symlink = S_ISLNK(stx.stx_mode);
+            }
+            entries.push_back(std::move(entry));
+        }
+    }
+    close(fd);
+    return entries;
+}
+#else
+std::vector<DirEntry> list_directory(const std::filesystem::path& dir) {
+    std::vector<DirEntry> entries;
+    std::error_code ec;
+    for (std::filesystem::directory_iterator it(dir, ec), end; !ec && it != end;
+         it.increment(ec)) {
+        std::error_code type_ec;
+        entries.push_back(DirEntry{
+            .name = it->path().filename().string(),
+            .is_dir = it->is_directory(type_ec),
+            .is_file = it->is_regular_file(type_ec),
+            .is_symlink = it->is_symlink(type_ec),
+        });
+    }
+    if (ec)
+        throw std::runtime_error(fmt::format("couldn't list `{}`: {}",
+                                             dir.string(), ec.message()));
+    return entries;
+}
+#endif
+
+#ifdef __linux__
+std::optional<DirStamp> dir_stamp(const std::filesystem::path& dir) {
+    struct statx stx;
+    if (statx(AT_FDCWD, dir.c_str(), AT_STATX_DONT_SYNC,
+              STATX_MTIME | STATX_INO, &stx) != 0)
+        return std::nullopt;
+    return DirStamp{
+        .mtime = static_cast<int64_t>(stx.stx_mtime.tv_sec) * 1'000'000'000 +
+                 stx.stx_mtime.tv_nsec,
+        .inode = stx.stx_ino,
+    };
+}
+
+static int64_t stamp_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+#else
+std::optional<DirStamp> dir_stamp(const std::filesystem::path& dir) {
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(dir, ec);
+    if (ec)
+        return std::nullopt;
+    return DirStamp{
+        .mtime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     time.time_since_epoch())
+                     .count(),
+    };
+}
+
+static int64_t stamp_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::filesystem::file_time_type::clock::now()
+                   .time_since_epoch())
+        .count();
+}
+#endif
+
+bool is_racy(const DirStamp& stamp) {
+    return stamp.mtime >= stamp_now() - RACY_STAMP_NS;
+}
+
+namespace {
+
+struct CachedDir {
+    DirStamp stamp;
+
+    // Only the entries that matched something.
+    std::vector<DirEntry> entries;
+};
+
+// Directory (relative to the root, `/`-separated) -> what it had in it.
+using ScanIndex = std::unordered_map<std::string, CachedDir>;
+
+enum EntryFlags : uint8_t {
+    ENTRY_DIR = 1,
+    ENTRY_FILE = 2,
+    ENTRY_SYMLINK = 4,
+};
+
+// Returns an empty index if the file is missing, corrupt or for other
+// patterns.
+ScanIndex load_index(const std::filesystem::path& path, std::string_view key) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file)
+        return {};
+
+    auto read_u64 = [&] {
+        uint64_t value = 0;
+        file.read(reinterpret_cast<char*>(&value), sizeof(value));
+        return value;
+    };
+    auto read_str = [&] {
+        auto size = read_u64();
+        std::string str;
+        if (!file || size > 64 * 1024) {
+            file.setstate(std::ios::failbit);
+            return str;
+        }
+        str.resize(size);
+        file.read(str.data(), static_cast<std::streamsize>(size));
+        return str;
+    };
+
+    if (read_str() != SCAN_INDEX_MAGIC || read_str() != key)
+        return {};
+    ScanIndex index;
+    auto dirs = read_u64();
+    for (uint64_t i = 0; i < dirs && file; ++i) {
+        auto rel = read_str();
+        CachedDir dir;
+        dir.stamp.mtime = static_cast<int64_t>(read_u64());
+        dir.stamp.inode = read_u64();
+        auto entries = read_u64();
+        for (uint64_t j = 0; j < entries && file; ++j) {
+            char flags = 0;
+            file.read(&flags, 1);
+            dir.entries.push_back(DirEntry{
+                .name = read_str(),
+                .is_dir = (flags & ENTRY_DIR) != 0,
+                .is_file = (flags & ENTRY_FILE) != 0,
+                .is_symlink = (flags & ENTRY_SYMLINK) != 0,
+            });
+        }
+        index.emplace(std::move(rel), std::move(dir));
+    }
+    if (!file) {
+        debug("ignoring corrupt scan index `{}`", path.string());
+        return {};
+    }
+    return index;
+}
+
+void save_index(const std::filesystem::path& path, std::string_view key,
+                const ScanIndex& index) {
+    // write next to it and rename, so that an interrupted build never leaves
+    // a truncated index behind
+    auto tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::out | std::ios::binary |
+                                    std::ios::trunc);
+        auto write_u64 = [&](uint64_t value) {
+            file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        };
+        auto write_str = [&](std::string_view str) {
+            write_u64(str.size());
+            file.write(str.data(), static_cast<std::streamsize>(str.size()));
+        };
+
+        write_str(SCAN_INDEX_MAGIC);
+        write_str(key);
+        write_u64(index.size());
+        for (auto& [rel, dir] : index) {
+            write_str(rel);
+            write_u64(static_cast<uint64_t>(dir.stamp.mtime));
+            write_u64(dir.stamp.inode);
+            write_u64(dir.entries.size());
+            for (auto& entry : dir.entries) {
+                char flags = (entry.is_dir ? ENTRY_DIR : 0) |
+                             (entry.is_file ? ENTRY_FILE : 0) |
+                             (entry.is_symlink ? ENTRY_SYMLINK : 0);
+                file.write(&flags, 1);
+                write_str(entry.name);
+            }
+        }
+        if (!file)
+            throw std::runtime_error(
+                fmt::format("couldn't write `{}`", tmp.string()));
+    }
+    std::filesystem::rename(tmp, path);
+}
+
+} // namespace
+
+// State shared by the jobs of one `SourceWalker::walk`.
+struct SourceWalker::Walk {
+    explicit Walk(std::vector<PrunedPath> pruned) : pruned(std::move(pruned)) {}
+
+    std::vector<PrunedPath> pruned;
+
+    // Whether to use (and fill) the scan index.
+    bool cache{false};
+    // Whether to collect `walked`.
+    bool stamps{false};
+    ScanIndex old_index;
+    int64_t racy_after{0};
+
+    std::mutex mutex;
+    std::vector<std::filesystem::path> out;
+    ScanIndex index;
+    std::vector<WalkedDir> walked;
+    std::atomic<size_t> listed{0};
+    std::atomic<size_t> reused{0};
+
+    // destroyed (joined) first, jobs use everything above
+    ThreadPool pool;
+};
+
+void SourceWalker::walk_dir(Walk& walk, const std::filesystem::path& dir,
+                            const std::vector<std::string>& rel,
+                            const std::vector<State>& states) const {
+    // reuse the entries from the last walk if the directory didn't change
+    std::string key;
+    std::optional<DirStamp> stamp;
+    const std::vector<DirEntry>* cached = nullptr;
+    if (walk.cache || walk.stamps)
+        stamp = dir_stamp(dir);
+    if (walk.cache) {
+        key = fmt::format("{}", fmt::join(rel, "/"));
+        auto it = walk.old_index.find(key);
+        if (stamp && it != walk.old_index.end() &&
+            it->second.stamp == *stamp) {
+            cached = &it->second.entries;
+            ++walk.reused;
+        }
+    }
+
+    // list the directory once for all patterns
+    std::vector<DirEntry> listed;
+    if (!cached) {
+        try {
+            listed = list_directory(dir);
+        } catch (const std::exception& err) {
+            debug("{}", err.what());
+            return;
+        }
+        ++walk.listed;
+    }
+    auto& entries = cached ? *cached : listed;
+
+    std::vector<std::string_view> rel_view(rel.begin(), rel.end());
+    std::vector<std::filesystem::path> found;
+    std::vector<DirEntry> relevant;
+    std::vector<State> child_states;
+    for (auto& entry : entries) {
+        child_states.clear();
+        bool matched = false;
+        for (auto [p, j] : states) {
+            auto& segments = m_sources[p].segments();
+            auto& segment = segments[j];
+            bool last = j + 1 == segments.size();
+            if (!segment.matches(entry.name))
+                continue;
+
+            if (segment.kind == GlobPattern::Segment::Kind::recursive) {
+                // don't follow symlinks into directories for `**`, they may
+                // well form a loop
+                if (entry.is_dir && !entry.is_symlink)
+                    child_states.push_back({p, j});
+                if (last && entry.is_file)
+                    matched = true;
+            } else if (last) {
+                matched |= entry.is_file;
+            } else if (entry.is_dir) {
+                child_states.push_back({p, j + 1});
+            }
+        }
+        if (!matched && child_states.empty())
+            continue;
+        if (walk.cache)
+            relevant.push_back(entry);
+
+        rel_view.push_back(entry.name);
+        auto path = dir / entry.name;
+        if (matched && !is_excluded(rel_view)) {
+            trace("found source file: {}", path.string());
+            found.push_back(path);
+        }
+        if (!child_states.empty() && !is_pruned(rel_view, walk.pruned)) {
+            std::sort(child_states.begin(), child_states.end());
+            child_states.erase(
+                std::unique(child_states.begin(), child_states.end()),
+                child_states.end());
+            close(child_states);
+
+            // every subdirectory is its own job, so that wide trees are
+            // listed by all workers at once
+            auto child_rel = rel;
+            child_rel.push_back(entry.name);
+            walk.pool.submit([this, &walk, path = std::move(path),
+                              child_rel = std::move(child_rel),
+                              child_states = child_states] {
+                walk_dir(walk, path, child_rel, child_states);
+            });
+        }
+        rel_view.pop_back();
+    }
+
+    bool index = walk.cache && stamp && stamp->mtime < walk.racy_after;
+    if (found.empty() && !index && !walk.stamps)
+        return;
+    std::lock_guard lock(walk.mutex);
+    if (walk.stamps)
+        walk.walked.push_back(WalkedDir{dir, stamp.value_or(DirStamp{})});
+    walk.out.insert(walk.out.end(), std::make_move_iterator(found.begin()),
+                    std::make_move_iterator(found.end()));
+    if (index)
+        walk.index.emplace(std::move(key),
+                           CachedDir{*stamp, std::move(relevant)});
+}
+
+std::vector<std::filesystem::path>
+SourceWalker::walk(const std::filesystem::path& root,
+                   std::vector<WalkedDir>* walked) const {
+    std::vector<std::filesystem::path> out;
+
+    std::vector<State> states;
+    for (size_t p = 0; p < m_sources.size(); ++p)
+        states.push_back({p, 0});
+    close(states);
+    if (!states.empty()) {
+        // compare pruned directories by their path relative to the root
+        // instead of resolving every directory that is walked
+        auto abs_root = std::filesystem::absolute(root).lexically_normal();
+        std::vector<PrunedPath> pruned;
+        for (auto& dir : m_pruned) {
+            auto rel = dir.lexically_relative(abs_root);
+            if (rel.empty() || *rel.begin() == "..")
+                continue;
+            auto& segments = pruned.emplace_back();
+            for (auto& part : rel)
+                if (!part.empty() && part != ".")
+                    segments.push_back(part.string());
+        }
+
+        Walk walk(std::move(pruned));
+        std::string key;
+        if (!m_cache_path.empty()) {
+            // pruned directories change what is walked too
+            Sha256 sha;
+            sha.update_field(m_key);
+            for (auto& dir : walk.pruned)
+                sha.update_field(fmt::format("{}", fmt::join(dir, "/")));
+            key = sha.hex_digest();
+
+            walk.cache = true;
+            walk.old_index = load_index(m_cache_path, key);
+            walk.racy_after = stamp_now() - RACY_STAMP_NS;
+        }
+
+        walk.stamps = walked != nullptr;
+        walk_dir(walk, root, {}, states);
+        walk.pool.wait();
+        if (walked)
+            walked->insert(walked->end(), walk.walked.begin(),
+                           walk.walked.end());
+
+        if (walk.cache) {
+            debug("listed {} director{}, {} unchanged", walk.listed.load(),
+                  walk.listed == 1 ? "y" : "ies", walk.reused.load());
+            if (walk.listed || walk.index.size() != walk.old_index.size()) {
+                try {
+                    save_index(m_cache_path, key, walk.index);
+                } catch (const std::exception& err) {
+                    warn("couldn't save scan index: {}", err.what());
+                }
+            }
+        }
+        out = std::move(walk.out);
+    }
+
+    // patterns pointing outside of the root are globbed on their own
+    for (auto& query : m_fallback) {
+        auto path = std::filesystem::path(query);
+        auto full = path.is_absolute() ? path : root / path;
+        trace("globbing query outside of the package: {}", full.string());
+        auto paths = m_recursive ? glob::rglob(full.string())
+                                 : glob::glob(full.string());
+        out.insert(out.end(), paths.begin(), paths.end());
+    }
+
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+}
@@ -0,0 +1,165 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A glob pattern (`src/**/*.cpp`), split into path segments. Supports `*`,
+// `?`, `[abc]`, `[a-z]`, `[!abc]` and, if recursive, `**` for any number of
+// directories. Like p-ranav/glob, wildcards don't match hidden names (starting
+// with a dot) unless the segment starts with a dot too.
+class GlobPattern {
+public:
+    GlobPattern(std::string_view pattern, bool recursive);
+
+    struct Segment {
+        enum class Kind {
+            // matches exactly `text`
+            literal,
+            // `*.cpp`, `test_?.c`
+            wildcard,
+            // `**`
+            recursive,
+        } kind;
+        std::string text;
+
+        bool matches(std::string_view name) const;
+    };
+
+    inline const std::vector<Segment>& segments() const {
+        return m_segments;
+    }
+
+    // Absolute patterns and patterns with `..` point outside of the root and
+    // can't be matched while walking it.
+    inline bool escapes_root() const {
+        return m_escapes_root;
+    }
+
+    // Whether the path (split into segments, relative to the root) matches.
+    bool matches(const std::vector<std::string_view>& path) const;
+
+    // Whether everything inside the directory at `path` matches, e.g. `build`
+    // or `build/**` for `build`.
+    bool matches_everything_in(const std::vector<std::string_view>& path) const;
+
+private:
+    // Whether `path[i..]` matches `m_segments[j..end]`.
+    bool matches_from(const std::vector<std::string_view>& path, size_t i,
+                      size_t j, size_t end) const;
+
+    std::vector<Segment> m_segments;
+    bool m_escapes_root{false};
+};
+
+struct DirEntry {
+    std::string name;
+
+    // Of what the entry points to, for symlinks.
+    bool is_dir{false};
+    bool is_file{false};
+
+    bool is_symlink{false};
+};
+
+// Entries of `dir` (without `.` and `..`), in no particular order. Throws if
+// the directory can't be read.
+std::vector<DirEntry> list_directory(const std::filesystem::path& dir);
+
+// When a directory last changed: adding, removing or renaming an entry
+// updates its mtime. The inode catches directories that were replaced.
+struct DirStamp {
+    // Nanoseconds since the epoch.
+    int64_t mtime{0};
+    uint64_t inode{0};
+
+    bool operator==(const DirStamp&) const = default;
+};
+
+// Nothing if `dir` can't be `stat`ed.
+std::optional<DirStamp> dir_stamp(const std::filesystem::path& dir);
+
+// Whether `stamp` is so recent that another change within the same mtime tick
+// could go unnoticed. Such stamps shouldn't be relied on later.
+bool is_racy(const DirStamp& stamp);
+
+// A directory a walk looked into, and its stamp at that time.
+struct WalkedDir {
+    std::filesystem::path path;
+    DirStamp stamp;
+};
+
+// Finds the files matching any of a set of source patterns (and none of the
+// exclude patterns) in a single walk of the directory tree. The patterns are
+// matched segment by segment as the walk goes down (like an NFA), so every
+// directory is listed at most once no matter how many patterns there are, and
+// directories no pattern can match anything in are never entered at all.
+// Subdirectories are listed in parallel.
+class SourceWalker {
+public:
+    SourceWalker(const std::vector<std::string>& sources,
+                 const std::vector<std::string>& exclude, bool recursive);
+
+    // Never enter `dir`, e.g. the build directory. `.git` and `_deps`
+    // directories are always skipped.
+    void prune(std::filesystem::path dir);
+
+    // Keep an index of every walked directory's stamp and relevant entries in
+    // the file at `path`. The next walk reuses the entries of directories
+    // whose stamp didn't change instead of listing them again, so walking an
+    // unchanged tree takes one `stat` per directory. The index is thrown away
+    // if the patterns change.
+    void cache_in(std::filesystem::path path);
+
+    // Matching files in `root`, sorted and without duplicates. If `walked` is
+    // given, every directory that was looked into is added to it: the result
+    // can only change if one of their stamps does.
+    std::vector<std::filesystem::path>
+    walk(const std::filesystem::path& root,
+         std::vector<WalkedDir>* walked = nullptr) const;
+
+    // Whether `walked` covers every pattern. Patterns outside of the root are
+    // globbed without keeping track of the directories.
+    inline bool tracks_everything() const {
+        return m_fallback.empty();
+    }
+
+private:
+    // Pattern index, segment index.
+    using State = std::pair<size_t, size_t>;
+
+    // A pruned directory, as segments relative to the walked root.
+    using PrunedPath = std::vector<std::string>;
+
+    struct Walk;
+
+    // Match the entries of `dir` (at `rel` relative to the root) against
+    // `states`, and submit a job for every subdirectory that may contain
+    // matches.
+    void walk_dir(Walk& walk, const std::filesystem::path& dir,
+                  const std::vector<std::string>& rel,
+                  const std::vector<State>& states) const;
+
+    // Add the states `**` can skip to (it also matches zero directories).
+    void close(std::vector<State>& states) const;
+
+    bool is_excluded(const std::vector<std::string_view>& rel) const;
+    bool is_pruned(const std::vector<std::string_view>& rel,
+                   const std::vector<PrunedPath>& pruned) const;
+
+    std::vector<GlobPattern> m_sources;
+    std::vector<GlobPattern> m_exclude;
+
+    // Sources outside of the root, see `GlobPattern::escapes_root()`.
+    std::vector<std::string> m_fallback;
+
+    // Absolute.
+    std::vector<std::filesystem::path> m_pruned;
+    bool m_recursive;
+
+    // Hash of the patterns, see `cache_in`.
+    std::string m_key;
+    std::filesystem::path m_cache_path;
+};
@@ -0,0 +1,310 @@
+#include "stream.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cstring>
+#include <subprocess.h>
+#include <zlib.h>
+#include <zstd.h>
+
+using namespace spdlog;
+
+void ByteStream::read_exact(char* buf, size_t size) {
+    while (size) {
+        auto n = read(buf, size);
+        if (n == 0)
+            throw std::runtime_error("unexpected end of data");
+        buf += n;
+        size -= n;
+    }
+}
+
+void ByteStream::skip(uint64_t size) {
+    char buf[16 * 1024];
+    while (size) {
+        auto n = read(buf, static_cast<size_t>(
+                               std::min<uint64_t>(size, sizeof(buf))));
+        if (n == 0)
+            throw std::runtime_error("unexpected end of data");
+        size -= n;
+    }
+}
+
+void ByteStream::drain() {
+    char buf[64 * 1024];
+    while (read(buf, sizeof(buf)))
+        ;
+}
+
+FileStream::FileStream(const std::filesystem::path& path)
+    : m_file(path, std::ios::in | std::ios::binary) {
+    if (!m_file)
+        throw std::runtime_error(
+            fmt::format("couldn't open `{}`", path.string()));
+}
+
+size_t FileStream::read(char* buf, size_t size) {
+    m_file.read(buf, static_cast<std::streamsize>(size));
+    if (m_file.bad())
+        throw std::runtime_error("couldn't read file");
+    return static_cast<size_t>(m_file.gcount());
+}
+
+size_t MemoryStream::read(char* buf, size_t size) {
+    size = std::min(size, m_data.size());
+    std::copy_n(m_data.data(), size, buf);
+    m_data.remove_prefix(size);
+    return size;
+}
+
+struct ProcessStream::Process {
+    subprocess_s process;
+};
+
+ProcessStream::ProcessStream(std::vector<std::string> args)
+    : m_process(std::make_unique<Process>()), m_name(args.at(0)) {
+    std::vector<const char*> argv;
+    for (auto& arg : args)
+        argv.push_back(arg.c_str());
+    argv.push_back(nullptr);
+
+    int result = subprocess_create(
+        argv.data(),
+        subprocess_option_enable_async | subprocess_option_no_window |
+            subprocess_option_inherit_environment |
+            subprocess_option_search_user_path,
+        &m_process->process);
+    if (result != 0)
+        throw std::runtime_error(
+            fmt::format("failed to spawn `{}` (code {})", m_name, result));
+}
+
+ProcessStream::~ProcessStream() {
+    if (!m_finished) {
+        subprocess_terminate(&m_process->process);
+        subprocess_join(&m_process->process, nullptr);
+    }
+    subprocess_destroy(&m_process->process);
+}
+
+size_t ProcessStream::read(char* buf, size_t size) {
+    if (m_finished)
+        return 0;
+
+    auto n = subprocess_read_stdout(&m_process->process, buf,
+                                    static_cast<unsigned>(size));
+    if (n)
+        return n;
+
+    // stdout was closed, the process has exited
+    m_finished = true;
+    int code = 0;
+    if (subprocess_join(&m_process->process, &code) != 0)
+        throw std::runtime_error(
+            fmt::format("failed to join on `{}`", m_name));
+    if (code != 0) {
+        char err[1024];
+        auto len = subprocess_read_stderr(&m_process->process, err,
+                                          sizeof(err) - 1);
+        std::string message(err, len);
+        utils::trim_in_place(message);
+        throw std::runtime_error(fmt::format("`{}` exited with code {}: {}",
+                                             m_name, code, message));
+    }
+    return 0;
+}
+
+size_t HashingStream::read(char* buf, size_t size) {
+    auto n = m_inner.read(buf, size);
+    m_sha.update(buf, n);
+    return n;
+}
+
+BufferedStream::BufferedStream(ByteStream& inner, size_t capacity)
+    : m_inner(inner), m_buffer(capacity) {}
+
+bool BufferedStream::fill() {
+    // move unconsumed bytes to the front to make room
+    if (m_pos) {
+        std::memmove(m_buffer.data(), m_buffer.data() + m_pos, m_end - m_pos);
+        m_end -= m_pos;
+        m_pos = 0;
+    }
+    if (m_end == m_buffer.size())
+        return true; // full already
+    auto n = m_inner.read(m_buffer.data() + m_end, m_buffer.size() - m_end);
+    m_end += n;
+    return n != 0;
+}
+
+size_t BufferedStream::peek(size_t size) {
+    while (available() < size && fill())
+        ;
+    return available();
+}
+
+size_t BufferedStream::read(char* buf, size_t size) {
+    if (!available()) {
+        // large reads bypass the buffer
+        if (size >= m_buffer.size())
+            return m_inner.read(buf, size);
+        if (!fill())
+            return 0;
+    }
+    auto n = std::min(size, available());
+    std::memcpy(buf, data(), n);
+    consume(n);
+    return n;
+}
+
+struct InflateStream::State {
+    z_stream z{};
+};
+
+InflateStream::InflateStream(BufferedStream& inner, Format format)
+    : m_state(std::make_unique<State>()), m_inner(inner), m_format(format) {
+    // always inflate raw deflate data, gzip headers are parsed by hand (the
+    // zlib bundled with libgit2 is built without gzip support)
+    if (inflateInit2(&m_state->z, -MAX_WBITS) != Z_OK)
+        throw std::runtime_error("couldn't initialize zlib");
+    if (m_format == Format::gzip)
+        read_gzip_header();
+}
+
+InflateStream::~InflateStream() {
+    inflateEnd(&m_state->z);
+}
+
+void InflateStream::read_gzip_header() {
+    // see RFC 1952
+    constexpr uint8_t FHCRC = 2, FEXTRA = 4, FNAME = 8, FCOMMENT = 16;
+    unsigned char header[10];
+    m_inner.read_exact(reinterpret_cast<char*>(header), sizeof(header));
+    if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 8)
+        throw std::runtime_error("not a gzip stream");
+
+    auto flags = header[3];
+    if (flags & FEXTRA) {
+        unsigned char len[2];
+        m_inner.read_exact(reinterpret_cast<char*>(len), 2);
+        m_inner.skip(len[0] | (len[1] << 8));
+    }
+    auto skip_string = [&] {
+        char c;
+        do {
+            m_inner.read_exact(&c, 1);
+        } while (c != '\0');
+    };
+    if (flags & FNAME)
+        skip_string();
+    if (flags & FCOMMENT)
+        skip_string();
+    if (flags & FHCRC)
+        m_inner.skip(2);
+}
+
+bool InflateStream::next_gzip_member() {
+    // CRC32 and size of the member we just finished
+    m_inner.skip(8);
+
+    // concatenated gzip members form a single stream
+    if (m_inner.peek(2) < 2 ||
+        static_cast<unsigned char>(m_inner.data()[0]) != 0x1f ||
+        static_cast<unsigned char>(m_inner.data()[1]) != 0x8b)
+        return false;
+    inflateReset(&m_state->z);
+    read_gzip_header();
+    return true;
+}
+
+size_t InflateStream::read(char* buf, size_t size) {
+    auto& z = m_state->z;
+    while (!m_finished) {
+        if (!m_inner.available() && !m_inner.fill())
+            throw std::runtime_error("unexpected end of compressed data");
+
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(m_inner.data()));
+        z.avail_in = static_cast<uInt>(m_inner.available());
+        z.next_out = reinterpret_cast<Bytef*>(buf);
+        z.avail_out = static_cast<uInt>(size);
+
+        auto ret = inflate(&z, Z_NO_FLUSH);
+        m_inner.consume(m_inner.available() - z.avail_in);
+        auto produced = size - z.avail_out;
+
+        if (ret == Z_STREAM_END) {
+            if (m_format != Format::gzip || !next_gzip_member())
+                m_finished = true;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            throw std::runtime_error(fmt::format(
+                "corrupt deflate data: {}", z.msg ? z.msg : "unknown error"));
+        }
+
+        if (produced)
+            return produced;
+    }
+    return 0;
+}
+
+struct ZstdStream::State {
+    ZSTD_DStream* stream{nullptr};
+
+    // whether the last frame was fully decoded
+    bool frame_done{true};
+};
+
+ZstdStream::ZstdStream(BufferedStream& inner)
+    : m_state(std::make_unique<State>()), m_inner(inner) {
+    m_state->stream = ZSTD_createDStream();
+    if (!m_state->stream)
+        throw std::runtime_error("couldn't initialize zstd");
+    ZSTD_initDStream(m_state->stream);
+}
+
+ZstdStream::~ZstdStream() {
+    ZSTD_freeDStream(m_state->stream);
+}
+
+size_t ZstdStream::read(char* buf, size_t size) {
+    while (!m_finished) {
+        if (!m_inner.available() && !m_inner.fill()) {
+            if (!m_state->frame_done)
+                throw std::runtime_error("unexpected end of zstd data");
+            m_finished = true;
+            break;
+        }
+
+        ZSTD_inBuffer in{m_inner.data(), m_inner.available(), 0};
+        ZSTD_outBuffer out{buf, size, 0};
+        auto ret = ZSTD_decompressStream(m_state->stream, &out, &in);
+        if (ZSTD_isError(ret))
+            throw std::runtime_error(fmt::format("corrupt zstd data: {}",
+                                                 ZSTD_getErrorName(ret)));
+        m_inner.consume(in.pos);
+        m_state->frame_done = ret == 0;
+
+        if (out.pos)
+            return out.pos;
+    }
+    return 0;
+}
+
+std::unique_ptr<ByteStream> open_url(const std::string& url) {
+    constexpr std::string_view FILE_SCHEME = "file://";
+    if (url.starts_with(FILE_SCHEME)) {
+        auto path = url.substr(FILE_SCHEME.size());
+#ifdef QOBS_IS_WINDOWS
+        // file:///C:/path -> C:/path
+        if (path.size() > 2 && path[0] == '/' && path[2] == ':')
+            path.erase(0, 1);
+#endif
+        return std::make_unique<FileStream>(path);
+    }
+    if (url.find("://") == std::string::npos)
+        return std::make_unique<FileStream>(url);
+
+    // curl ships with every OS we care about (including Windows 10+), and
+    // handles TLS, proxies and redirects for us
+    debug("downloading {} with curl", url);
+    return std::make_unique<ProcessStream>(std::vector<std::string>{
+        "curl", "--fail", "--silent", "--show-error", "--location", url});
+}
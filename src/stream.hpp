@@ -0,0 +1,152 @@
+#pragma once
+#include "hash.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A source of bytes that is read in chunks, so that arbitrarily large
+// downloads and archives can be processed in constant memory.
+class ByteStream {
+public:
+    virtual ~ByteStream() = default;
+
+    // Read up to `size` bytes into `buf`. Returns 0 only at the end of the
+    // stream. Throws on errors.
+    virtual size_t read(char* buf, size_t size) = 0;
+
+    // Read exactly `size` bytes, throws if the stream ends early.
+    void read_exact(char* buf, size_t size);
+
+    // Discard `size` bytes, throws if the stream ends early.
+    void skip(uint64_t size);
+
+    // Read and discard everything that's left.
+    void drain();
+};
+
+// Reads a local file.
+class FileStream : public ByteStream {
+public:
+    explicit FileStream(const std::filesystem::path& path);
+    size_t read(char* buf, size_t size) override;
+
+private:
+    std::ifstream m_file;
+};
+
+// Reads a buffer in memory, which must outlive the stream.
+class MemoryStream : public ByteStream {
+public:
+    explicit MemoryStream(std::string_view data) : m_data(data) {}
+    size_t read(char* buf, size_t size) override;
+
+private:
+    std::string_view m_data;
+};
+
+// Reads the stdout of a process, e.g. `curl`. Throws at the end of the stream
+// if the process exited with a non-zero code.
+class ProcessStream : public ByteStream {
+public:
+    explicit ProcessStream(std::vector<std::string> args);
+    ~ProcessStream() override;
+    size_t read(char* buf, size_t size) override;
+
+private:
+    struct Process;
+    std::unique_ptr<Process> m_process;
+    std::string m_name;
+    bool m_finished{false};
+};
+
+// Passes everything through while hashing it.
+class HashingStream : public ByteStream {
+public:
+    explicit HashingStream(ByteStream& inner) : m_inner(inner) {}
+    size_t read(char* buf, size_t size) override;
+
+    // Finish hashing, call after the whole stream has been read.
+    inline std::string hex_digest() {
+        return m_sha.hex_digest();
+    }
+
+private:
+    ByteStream& m_inner;
+    Sha256 m_sha;
+};
+
+// Buffers another stream. Decoders use the buffer directly, so that they only
+// consume the bytes they actually need, and others (e.g. the next zip entry)
+// can continue right after them.
+class BufferedStream : public ByteStream {
+public:
+    explicit BufferedStream(ByteStream& inner, size_t capacity = 64 * 1024);
+    size_t read(char* buf, size_t size) override;
+
+    // Buffered, not yet consumed bytes.
+    inline const char* data() const {
+        return m_buffer.data() + m_pos;
+    }
+    inline size_t available() const {
+        return m_end - m_pos;
+    }
+    inline void consume(size_t size) {
+        m_pos += size;
+    }
+
+    // Read more from the inner stream (keeping what's unconsumed). Returns
+    // false if the inner stream has ended.
+    bool fill();
+
+    // Make sure at least `size` bytes are buffered, if the stream has that
+    // many. Returns the number of available bytes.
+    size_t peek(size_t size);
+
+private:
+    ByteStream& m_inner;
+    std::vector<char> m_buffer;
+    size_t m_pos{0};
+    size_t m_end{0};
+};
+
+// Decompresses raw deflate (zip entries) or gzip (.tar.gz) data. Stops at
+// the end of the compressed data, leaving the rest of `inner` unconsumed.
+class InflateStream : public ByteStream {
+public:
+    enum class Format { raw, gzip };
+    InflateStream(BufferedStream& inner, Format format);
+    ~InflateStream() override;
+    size_t read(char* buf, size_t size) override;
+
+private:
+    void read_gzip_header();
+    bool next_gzip_member();
+
+    struct State;
+    std::unique_ptr<State> m_state;
+    BufferedStream& m_inner;
+    Format m_format;
+    bool m_finished{false};
+};
+
+// Decompresses zstd (.tar.zst) data.
+class ZstdStream : public ByteStream {
+public:
+    explicit ZstdStream(BufferedStream& inner);
+    ~ZstdStream() override;
+    size_t read(char* buf, size_t size) override;
+
+private:
+    struct State;
+    std::unique_ptr<State> m_state;
+    BufferedStream& m_inner;
+    bool m_finished{false};
+};
+
+// Open `url` for reading. `file://` URLs and plain paths are read directly,
+// anything else is downloaded through `curl` and streamed from its stdout.
+std::unique_ptr<ByteStream> open_url(const std::string& url);
@@ -0,0 +1,73 @@
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0)
+        threads = hardware_threads();
+    m_workers.reserve(threads);
+    for (size_t i = 0; i < threads; ++i)
+        m_workers.emplace_back([this] { worker_loop(); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::unique_lock lock(m_mutex);
+        m_idle_cv.wait(lock, [this] { return m_jobs.empty() && !m_active; });
+        m_stop = true;
+    }
+    m_job_cv.notify_all();
+    for (auto& worker : m_workers)
+        worker.join();
+}
+
+void ThreadPool::submit(std::function<void()> job) {
+    {
+        std::lock_guard lock(m_mutex);
+        m_jobs.push_back(std::move(job));
+    }
+    m_job_cv.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock lock(m_mutex);
+    m_idle_cv.wait(lock, [this] { return m_jobs.empty() && !m_active; });
+    if (m_error) {
+        auto error = m_error;
+        m_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+size_t ThreadPool::hardware_threads() {
+    auto n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+void ThreadPool::worker_loop() {
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock lock(m_mutex);
+            m_job_cv.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+            if (m_stop && m_jobs.empty())
+                return;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            ++m_active;
+        }
+
+        try {
+            job();
+        } catch (...) {
+            std::lock_guard lock(m_mutex);
+            if (!m_error)
+                m_error = std::current_exception();
+        }
+
+        {
+            std::lock_guard lock(m_mutex);
+            --m_active;
+            if (m_jobs.empty() && !m_active)
+                m_idle_cv.notify_all();
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads. Jobs run in FIFO order and are allowed to
+// submit more jobs to the same pool (e.g. to fan out over a graph).
+class ThreadPool {
+public:
+    // `threads` == 0 will use the number of hardware threads.
+    explicit ThreadPool(size_t threads = 0);
+
+    // Waits for all queued jobs to finish and joins the workers.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(std::function<void()> job);
+
+    // Block until the queue is empty and every worker is idle. If a job threw,
+    // the first exception is rethrown here (after all other jobs finished).
+    void wait();
+
+    inline size_t size() const {
+        return m_workers.size();
+    }
+
+    // Number of hardware threads, never 0.
+    static size_t hardware_threads();
+
+private:
+    void worker_loop();
+
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable m_job_cv;
+    std::condition_variable m_idle_cv;
+    size_t m_active{0};
+    bool m_stop{false};
+    std::exception_ptr m_error;
+};
@@ -0,0 +1,537 @@
+#include "timings.hpp"
+#include "json.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <numeric>
+#include <unordered_map>
+
+using namespace spdlog;
+
+// Rows in every table of the report.
+constexpr size_t REPORT_ROWS = 30;
+// Columns of the parallelism chart.
+constexpr size_t PARALLELISM_BUCKETS = 100;
+// Size of the timeline, in pixels.
+constexpr int TIMELINE_WIDTH = 1000;
+constexpr int LANE_HEIGHT = 14;
+
+enum class EdgeKind { compile, archive, link, other };
+
+// Guessed from the output, so that it works for `.ninja_log` too.
+static EdgeKind edge_kind(const std::filesystem::path& output) {
+    auto ext = output.extension().string();
+    if (ext == ".o" || ext == ".obj")
+        return EdgeKind::compile;
+    if (ext == ".a" || ext == ".lib")
+        return EdgeKind::archive;
+    if (ext.empty() || ext == ".exe" || ext == ".so" || ext == ".dll" ||
+        ext == ".dylib")
+        return EdgeKind::link;
+    return EdgeKind::other; // e.g. regenerating `build.ninja`
+}
+
+static std::string_view kind_name(EdgeKind kind) {
+    switch (kind) {
+    case EdgeKind::compile:
+        return "compile";
+    case EdgeKind::archive:
+        return "archive";
+    case EdgeKind::link:
+        return "link";
+    default:
+        return "other";
+    }
+}
+
+static std::string_view kind_color(EdgeKind kind) {
+    switch (kind) {
+    case EdgeKind::compile:
+        return "#4e79a7";
+    case EdgeKind::archive:
+        return "#f28e2b";
+    case EdgeKind::link:
+        return "#e15759";
+    default:
+        return "#bab0ac";
+    }
+}
+
+static int64_t duration(const EdgeTiming& edge) {
+    return edge.end_ms - edge.start_ms;
+}
+
+static std::string format_ms(double ms) {
+    return ms < 1000 ? fmt::format("{:.0f}ms", ms)
+                     : fmt::format("{:.2f}s", ms / 1000);
+}
+
+// Time spent on something, summed over all translation units.
+struct TraceTotal {
+    double ms{0};
+    // Translation units it took time in.
+    size_t units{0};
+};
+
+// What the `-ftime-trace` traces of a build add up to. Times are inclusive:
+// a header includes the headers it includes, an instantiation the ones it
+// caused, like in the traces themselves.
+struct TraceSummary {
+    std::unordered_map<std::string, TraceTotal> headers;
+    std::unordered_map<std::string, TraceTotal> templates;
+
+    // Per compile edge with a trace.
+    struct Unit {
+        // Parsing and instantiating templates.
+        double frontend_ms{0};
+        // Optimizing and generating code.
+        double backend_ms{0};
+    };
+    std::unordered_map<size_t, Unit> units;
+};
+
+// Add the trace of one translation unit to `summary`. Throws if it can't be
+// read.
+static void add_trace(TraceSummary& summary, std::mutex& mutex, size_t index,
+                      const std::filesystem::path& path) {
+    std::string text;
+    {
+        std::ifstream file(path, std::ios::in | std::ios::binary);
+        if (!file)
+            throw std::runtime_error("couldn't open it");
+        text.assign(std::istreambuf_iterator<char>(file),
+                    std::istreambuf_iterator<char>());
+    }
+    auto trace = parse_json(text);
+    auto events = trace.get("traceEvents");
+    if (!events)
+        throw std::runtime_error("no `traceEvents`");
+
+    std::unordered_map<std::string, double> headers, templates;
+    TraceSummary::Unit unit;
+    for (auto& event : events->array) {
+        auto phase = event.get("ph");
+        auto name = event.get("name");
+        auto dur = event.get("dur");
+        if (!phase || phase->string != "X" || !name || !dur)
+            continue;
+        auto ms = dur->number / 1000;
+        auto args = event.get("args");
+        auto detail = args ? args->get("detail") : nullptr;
+        if (name->string == "Frontend") {
+            unit.frontend_ms += ms;
+        } else if (name->string == "Backend") {
+            unit.backend_ms += ms;
+        } else if (!detail) {
+        } else if (name->string == "Source") {
+            headers[detail->string] += ms;
+        } else if (name->string.starts_with("Instantiate")) {
+            templates[detail->string] += ms;
+        }
+    }
+
+    std::lock_guard lock(mutex);
+    for (auto& [header, ms] : headers) {
+        auto& total = summary.headers[header];
+        total.ms += ms;
+        ++total.units;
+    }
+    for (auto& [name, ms] : templates) {
+        auto& total = summary.templates[name];
+        total.ms += ms;
+        ++total.units;
+    }
+    summary.units[index] = unit;
+}
+
+// Traces Clang wrote next to the objects built since `since`: `-o a.cpp.o`
+// writes `a.cpp.json`.
+static TraceSummary read_traces(const std::vector<EdgeTiming>& edges,
+                                const std::filesystem::path& build_dir,
+                                std::filesystem::file_time_type since) {
+    TraceSummary summary;
+    std::mutex mutex;
+    ThreadPool pool;
+    for (size_t i = 0; i < edges.size(); ++i) {
+        if (edge_kind(edges[i].output) != EdgeKind::compile)
+            continue;
+        auto path = edges[i].output.is_absolute()
+                        ? edges[i].output
+                        : build_dir / edges[i].output;
+        path.replace_extension(".json");
+        std::error_code ec;
+        auto mtime = std::filesystem::last_write_time(path, ec);
+        if (ec || mtime < since)
+            continue;
+        pool.submit([&, i, path] {
+            // a broken trace only leaves a gap in the report
+            try {
+                add_trace(summary, mutex, i, path);
+            } catch (const std::exception& err) {
+                warn("couldn't read `{}`: {}", path.string(), err.what());
+            }
+        });
+    }
+    pool.wait();
+    return summary;
+}
+
+// The chain of dependent edges that took the longest in total: however many
+// cores there were, the build couldn't have been faster than this. Inputs
+// that were up to date took no time in this build and aren't part of it.
+static std::vector<size_t> critical_path(const std::vector<EdgeTiming>& edges) {
+    // the longest chain ending with each edge, and the input it goes through
+    constexpr int64_t unvisited = -1, visiting = -2;
+    std::vector<int64_t> longest(edges.size(), unvisited);
+    std::vector<size_t> through(edges.size(), SIZE_MAX);
+    std::function<int64_t(size_t)> visit = [&](size_t index) -> int64_t {
+        if (longest[index] != unvisited)
+            return longest[index];
+        longest[index] = visiting;
+        int64_t before = 0;
+        for (auto input : edges[index].inputs) {
+            // a cycle, which the generators never produce
+            if (input >= edges.size() || longest[input] == visiting)
+                continue;
+            auto length = visit(input);
+            if (length > before || through[index] == SIZE_MAX) {
+                before = length;
+                through[index] = input;
+            }
+        }
+        return longest[index] = before + duration(edges[index]);
+    };
+
+    size_t last = 0;
+    for (size_t i = 0; i < edges.size(); ++i)
+        if (visit(i) > visit(last))
+            last = i;
+
+    std::vector<size_t> path;
+    for (auto index = last; index != SIZE_MAX; index = through[index])
+        path.push_back(index);
+    std::reverse(path.begin(), path.end());
+    return path;
+}
+
+// Average number of edges running at once in each of `PARALLELISM_BUCKETS`
+// slices of the build.
+static std::vector<double> parallelism(const std::vector<EdgeTiming>& edges,
+                                       int64_t wall_ms, double bucket_ms) {
+    std::vector<double> buckets(PARALLELISM_BUCKETS);
+    if (wall_ms <= 0)
+        return buckets;
+    for (auto& edge : edges) {
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            auto begin = i * bucket_ms, end = begin + bucket_ms;
+            auto overlap = std::min<double>(end, edge.end_ms) -
+                           std::max<double>(begin, edge.start_ms);
+            if (overlap > 0)
+                buckets[i] += overlap / bucket_ms;
+        }
+    }
+    return buckets;
+}
+
+// Row `lane` of the timeline for every edge, so that edges in a lane never
+// overlap.
+static std::vector<size_t> assign_lanes(const std::vector<EdgeTiming>& edges,
+                                        size_t& lanes) {
+    std::vector<size_t> order(edges.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return edges[a].start_ms < edges[b].start_ms;
+    });
+    std::vector<size_t> result(edges.size());
+    std::vector<int64_t> lane_ends;
+    for (auto index : order) {
+        size_t lane = 0;
+        while (lane < lane_ends.size() &&
+               lane_ends[lane] > edges[index].start_ms)
+            ++lane;
+        if (lane == lane_ends.size())
+            lane_ends.push_back(0);
+        lane_ends[lane] = edges[index].end_ms;
+        result[index] = lane;
+    }
+    lanes = lane_ends.size();
+    return result;
+}
+
+static std::string html_escape(std::string_view text) {
+    std::string out;
+    for (char c : text) {
+        switch (c) {
+        case '&':
+            out += "&amp;";
+            break;
+        case '<':
+            out += "&lt;";
+            break;
+        case '>':
+            out += "&gt;";
+            break;
+        case '"':
+            out += "&quot;";
+            break;
+        default:
+            out += c;
+        }
+    }
+    return out;
+}
+
+// The `REPORT_ROWS` most expensive entries of a trace total.
+static std::vector<std::pair<std::string, TraceTotal>>
+top_totals(const std::unordered_map<std::string, TraceTotal>& totals) {
+    std::vector<std::pair<std::string, TraceTotal>> result(totals.begin(),
+                                                           totals.end());
+    std::sort(result.begin(), result.end(), [](auto& a, auto& b) {
+        return a.second.ms > b.second.ms;
+    });
+    if (result.size() > REPORT_ROWS)
+        result.resize(REPORT_ROWS);
+    return result;
+}
+
+void write_timing_report(const std::vector<EdgeTiming>& edges,
+                         const std::filesystem::path& build_dir,
+                         std::filesystem::file_time_type since) {
+    if (edges.empty()) {
+        info("nothing was built, no timing report written");
+        return;
+    }
+
+    int64_t wall_ms = 0, busy_ms = 0;
+    for (auto& edge : edges) {
+        wall_ms = std::max(wall_ms, edge.end_ms);
+        busy_ms += duration(edge);
+    }
+    auto average = wall_ms > 0 ? static_cast<double>(busy_ms) / wall_ms : 0.0;
+    auto bucket_ms = static_cast<double>(wall_ms) / PARALLELISM_BUCKETS;
+    auto buckets = parallelism(edges, wall_ms, bucket_ms);
+    auto threads = ThreadPool::hardware_threads();
+
+    auto path = critical_path(edges);
+    std::vector<bool> on_path(edges.size());
+    int64_t path_ms = 0;
+    for (auto index : path) {
+        on_path[index] = true;
+        path_ms += duration(edges[index]);
+    }
+
+    auto traces = read_traces(edges, build_dir, since);
+
+    std::vector<size_t> units, links;
+    for (size_t i = 0; i < edges.size(); ++i) {
+        auto kind = edge_kind(edges[i].output);
+        if (kind == EdgeKind::compile)
+            units.push_back(i);
+        else if (kind == EdgeKind::link || kind == EdgeKind::archive)
+            links.push_back(i);
+    }
+    auto slowest_first = [&](size_t a, size_t b) {
+        return duration(edges[a]) > duration(edges[b]);
+    };
+    std::stable_sort(units.begin(), units.end(), slowest_first);
+    std::stable_sort(links.begin(), links.end(), slowest_first);
+    if (units.size() > REPORT_ROWS)
+        units.resize(REPORT_ROWS);
+    int64_t link_ms = 0;
+    for (auto index : links)
+        link_ms += duration(edges[index]);
+    auto headers = top_totals(traces.headers);
+    auto templates = top_totals(traces.templates);
+
+    // timings.json
+    std::string json = "{\n";
+    fmt::format_to(std::back_inserter(json),
+                   "  \"wall_ms\": {},\n  \"threads\": {},\n"
+                   "  \"average_parallelism\": {:.2f},\n"
+                   "  \"critical_path_ms\": {},\n  \"link_ms\": {},\n",
+                   wall_ms, threads, average, path_ms, link_ms);
+    json += "  \"edges\": [";
+    for (size_t i = 0; i < edges.size(); ++i) {
+        fmt::format_to(std::back_inserter(json),
+                       "{}\n    {{\"output\": {}, \"kind\": \"{}\", "
+                       "\"start_ms\": {}, \"end_ms\": {}",
+                       i ? "," : "", json_string(edges[i].output.string()),
+                       kind_name(edge_kind(edges[i].output)),
+                       edges[i].start_ms, edges[i].end_ms);
+        auto unit = traces.units.find(i);
+        if (unit != traces.units.end())
+            fmt::format_to(std::back_inserter(json),
+                           ", \"frontend_ms\": {:.1f}, \"backend_ms\": {:.1f}",
+                           unit->second.frontend_ms, unit->second.backend_ms);
+        json += "}";
+    }
+    json += "\n  ],\n  \"critical_path\": [";
+    for (size_t i = 0; i < path.size(); ++i)
+        fmt::format_to(std::back_inserter(json), "{}{}", i ? ", " : "",
+                       path[i]);
+    fmt::format_to(std::back_inserter(json),
+                   "],\n  \"parallelism\": {{\"bucket_ms\": {:.1f}, "
+                   "\"values\": [",
+                   bucket_ms);
+    for (size_t i = 0; i < buckets.size(); ++i)
+        fmt::format_to(std::back_inserter(json), "{}{:.2f}", i ? ", " : "",
+                       buckets[i]);
+    json += "]}";
+    for (auto [name, totals] : {std::pair{"headers", &headers},
+                                std::pair{"templates", &templates}}) {
+        fmt::format_to(std::back_inserter(json), ",\n  \"{}\": [", name);
+        for (size_t i = 0; i < totals->size(); ++i) {
+            auto& [what, total] = (*totals)[i];
+            fmt::format_to(std::back_inserter(json),
+                           "{}\n    {{\"name\": {}, \"ms\": {:.1f}, "
+                           "\"units\": {}}}",
+                           i ? "," : "", json_string(what), total.ms,
+                           total.units);
+        }
+        json += "\n  ]";
+    }
+    json += "\n}\n";
+
+    // timings.html, self-contained
+    std::string html;
+    auto out = std::back_inserter(html);
+    fmt::format_to(
+        out,
+        "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\">"
+        "<title>Build timings</title>\n<style>\n"
+        "body {{ font-family: sans-serif; margin: 2em; }}\n"
+        "table {{ border-collapse: collapse; margin-bottom: 2em; }}\n"
+        "td, th {{ padding: 2px 10px; text-align: left; }}\n"
+        "td.num {{ text-align: right; font-variant-numeric: tabular-nums; }}\n"
+        "tr:nth-child(even) {{ background: #f2f2f2; }}\n"
+        "svg {{ display: block; margin-bottom: 2em; }}\n"
+        "</style></head><body>\n<h1>Build timings</h1>\n<table>\n"
+        "<tr><td>Wall time</td><td class=\"num\">{}</td></tr>\n"
+        "<tr><td>Critical path</td><td class=\"num\">{} ({} edges)</td></tr>\n"
+        "<tr><td>Edges run</td><td class=\"num\">{}</td></tr>\n"
+        "<tr><td>Average parallelism</td><td class=\"num\">{:.1f} "
+        "({} hardware threads)</td></tr>\n"
+        "<tr><td>Linking and archiving</td><td class=\"num\">{}</td></tr>\n"
+        "</table>\n",
+        format_ms(wall_ms), format_ms(path_ms), path.size(), edges.size(),
+        average, threads, format_ms(link_ms));
+
+    // every edge in a lane, critical path outlined
+    size_t lanes = 0;
+    auto lane_of = assign_lanes(edges, lanes);
+    auto scale = wall_ms > 0 ? static_cast<double>(TIMELINE_WIDTH) / wall_ms
+                             : 0.0;
+    fmt::format_to(out,
+                   "<h2>Timeline</h2>\n<svg width=\"{}\" height=\"{}\">\n",
+                   TIMELINE_WIDTH, lanes * LANE_HEIGHT);
+    for (size_t i = 0; i < edges.size(); ++i) {
+        auto kind = edge_kind(edges[i].output);
+        fmt::format_to(
+            out,
+            "<rect x=\"{:.1f}\" y=\"{}\" width=\"{:.1f}\" height=\"{}\" "
+            "fill=\"{}\"{}><title>{} ({})</title></rect>\n",
+            edges[i].start_ms * scale, lane_of[i] * LANE_HEIGHT,
+            std::max(duration(edges[i]) * scale, 1.0), LANE_HEIGHT - 2,
+            kind_color(kind),
+            on_path[i] ? " stroke=\"black\" stroke-width=\"1.5\"" : "",
+            html_escape(edges[i].output.string()),
+            format_ms(duration(edges[i])));
+    }
+    html += "</svg>\n";
+
+    // parallelism, with a line at the number of hardware threads
+    constexpr int chart_height = 120;
+    auto peak = std::max<double>(
+        threads, *std::max_element(buckets.begin(), buckets.end()));
+    auto bar_width = static_cast<double>(TIMELINE_WIDTH) / buckets.size();
+    fmt::format_to(out,
+                   "<h2>Parallelism</h2>\n<svg width=\"{}\" height=\"{}\">\n",
+                   TIMELINE_WIDTH, chart_height);
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        auto height = buckets[i] / peak * chart_height;
+        fmt::format_to(out,
+                       "<rect x=\"{:.1f}\" y=\"{:.1f}\" width=\"{:.1f}\" "
+                       "height=\"{:.1f}\" fill=\"#76b7b2\"><title>{}: {:.1f} "
+                       "at once</title></rect>\n",
+                       i * bar_width, chart_height - height, bar_width,
+                       height, format_ms(i * bucket_ms), buckets[i]);
+    }
+    auto threads_y = chart_height - threads / peak * chart_height;
+    fmt::format_to(out,
+                   "<line x1=\"0\" x2=\"{}\" y1=\"{:.1f}\" y2=\"{:.1f}\" "
+                   "stroke=\"black\" stroke-dasharray=\"4\"/>\n</svg>\n",
+                   TIMELINE_WIDTH, threads_y, threads_y);
+
+    html += "<h2>Critical path</h2>\n<table>\n"
+            "<tr><th>Start</th><th>Duration</th><th>Output</th></tr>\n";
+    for (auto index : path)
+        fmt::format_to(out,
+                       "<tr><td class=\"num\">{}</td><td class=\"num\">{}</td>"
+                       "<td>{}</td></tr>\n",
+                       format_ms(edges[index].start_ms),
+                       format_ms(duration(edges[index])),
+                       html_escape(edges[index].output.string()));
+    html += "</table>\n";
+
+    html += "<h2>Slowest translation units</h2>\n<table>\n"
+            "<tr><th>Duration</th><th>Front end</th><th>Back end</th>"
+            "<th>Object</th></tr>\n";
+    for (auto index : units) {
+        auto unit = traces.units.find(index);
+        auto has_trace = unit != traces.units.end();
+        fmt::format_to(
+            out,
+            "<tr><td class=\"num\">{}</td><td class=\"num\">{}</td>"
+            "<td class=\"num\">{}</td><td>{}</td></tr>\n",
+            format_ms(duration(edges[index])),
+            has_trace ? format_ms(unit->second.frontend_ms) : "",
+            has_trace ? format_ms(unit->second.backend_ms) : "",
+            html_escape(edges[index].output.string()));
+    }
+    html += "</table>\n";
+
+    html += "<h2>Linking and archiving</h2>\n<table>\n"
+            "<tr><th>Duration</th><th>Output</th></tr>\n";
+    for (auto index : links)
+        fmt::format_to(out,
+                       "<tr><td class=\"num\">{}</td><td>{}</td></tr>\n",
+                       format_ms(duration(edges[index])),
+                       html_escape(edges[index].output.string()));
+    html += "</table>\n";
+
+    if (traces.units.empty()) {
+        html += "<p>Compile with Clang's <code>-ftime-trace</code> (e.g. "
+                "<code>cflags = \"-ftime-trace\"</code> in Qobs.toml) to see "
+                "the most expensive headers and templates.</p>\n";
+    } else {
+        for (auto [title, totals] :
+             {std::pair{"Most expensive headers", &headers},
+              std::pair{"Most expensive template instantiations",
+                        &templates}}) {
+            fmt::format_to(out,
+                           "<h2>{}</h2>\n<table>\n<tr><th>Total</th>"
+                           "<th>Units</th><th>Name</th></tr>\n",
+                           title);
+            for (auto& [what, total] : *totals)
+                fmt::format_to(out,
+                               "<tr><td class=\"num\">{}</td>"
+                               "<td class=\"num\">{}</td><td>{}</td></tr>\n",
+                               format_ms(total.ms), total.units,
+                               html_escape(what));
+            html += "</table>\n";
+        }
+    }
+    html += "</body></html>\n";
+
+    utils::write_file_atomically(build_dir / "timings.json", json);
+    utils::write_file_atomically(build_dir / "timings.html", html);
+    info("build took {}, critical path {} ({} edges), {:.1f} edges at once "
+         "on average",
+         format_ms(wall_ms), format_ms(path_ms), path.size(), average);
+    info("wrote timing report to `{}`",
+         (build_dir / "timings.html").string());
+}
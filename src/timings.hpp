@@ -0,0 +1,15 @@
+#pragma once
+#include "generators/generator.hpp"
+#include <filesystem>
+#include <vector>
+
+// `qobs build --timings`: write `timings.html` and `timings.json` to
+// `build_dir` from the edges of a build (see `Generator::timings`). They show
+// the critical path, how many edges ran at once over time, the slowest
+// translation units and the link times. Objects compiled with Clang's
+// `-ftime-trace` since `since` add the headers and template instantiations
+// that took the longest, summed over all translation units. Throws if the
+// report can't be written.
+void write_timing_report(const std::vector<EdgeTiming>& edges,
+                         const std::filesystem::path& build_dir,
+                         std::filesystem::file_time_type since);
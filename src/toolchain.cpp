@@ -0,0 +1,300 @@
+#include "toolchain.hpp"
+#include "hash.hpp"
+#include "source_walker.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+#include <fstream>
+#include <sstream>
+
+using namespace spdlog;
+
+// bump this if the format or what is probed changes
+constexpr std::string_view TOOLCHAIN_HEADER = "qobs-toolchain 2";
+
+// TODO: add Zig's `zig cc`
+#ifdef QOBS_IS_WINDOWS
+const std::vector<std::string> COMMON_C_COMPILERS = {
+    "cl.exe", "clang.exe", "gcc.exe", "icx.exe", "icc.exe", "tcc.exe"};
+const std::vector<std::string> COMMON_CXX_COMPILERS = {
+    "cl.exe",   "clang++.exe", "g++.exe",  "clang.exe", "gcc.exe",
+    "icpx.exe", "icx.exe",     "icpc.exe", "icc.exe"};
+constexpr char PATH_SEPARATOR = ';';
+constexpr auto& NULL_DEVICE = "NUL";
+#else
+const std::vector<std::string> COMMON_C_COMPILERS = {"clang", "gcc", "icx",
+                                                     "icc", "tcc"};
+const std::vector<std::string> COMMON_CXX_COMPILERS = {
+    "clang++", "g++", "clang", "gcc", "icpx", "icx", "icpc", "icc"};
+constexpr char PATH_SEPARATOR = ':';
+constexpr auto& NULL_DEVICE = "/dev/null";
+#endif
+
+static std::vector<std::filesystem::path> path_dirs() {
+    std::vector<std::filesystem::path> result;
+    const char* path = std::getenv("PATH");
+    std::string_view dirs(path ? path : "");
+    while (!dirs.empty()) {
+        auto end = dirs.find(PATH_SEPARATOR);
+        auto dir = dirs.substr(0, end);
+        dirs.remove_prefix(end == std::string_view::npos ? dirs.size()
+                                                         : end + 1);
+        if (!dir.empty())
+            result.emplace_back(dir);
+    }
+    return result;
+}
+
+// Name of the cache entry for the current PATH. A compiler appearing in (or
+// going away from) a directory in PATH changes the directory's stamp. Nothing
+// if a directory changed too recently for its stamp to be relied on.
+static std::optional<std::string> cache_key(bool need_cxx) {
+    Sha256 sha;
+    sha.update_field(TOOLCHAIN_HEADER).update_field(need_cxx ? "c++" : "c");
+    for (auto& dir : path_dirs()) {
+        auto stamp = dir_stamp(dir);
+        if (stamp && is_racy(*stamp))
+            return std::nullopt;
+        sha.update_field(dir.string())
+            .update_field(stamp ? fmt::format("{} {}", stamp->mtime,
+                                              stamp->inode)
+                                : "-");
+    }
+    return sha.hex_digest().substr(0, 32);
+}
+
+static void save_toolchain(const std::filesystem::path& path,
+                           const Toolchain& toolchain) {
+    auto binary = dir_stamp(toolchain.path);
+    if (!binary || is_racy(*binary))
+        return;
+
+    std::ostringstream out;
+    out << TOOLCHAIN_HEADER << '\n';
+    out << "binary " << binary->mtime << ' ' << binary->inode << '\n';
+    out << "compiler " << toolchain.compiler << '\n';
+    out << "path " << toolchain.path.string() << '\n';
+    out << "version " << toolchain.version << '\n';
+    out << "target " << toolchain.target << '\n';
+    for (auto& flag : toolchain.flags)
+        out << "flag " << flag << '\n';
+    utils::write_file_atomically(path, out.str());
+}
+
+// Nothing if there is no (valid) entry at `path`, or if the compiler binary
+// changed since it was written.
+static std::optional<Toolchain> load_toolchain(
+    const std::filesystem::path& path) {
+    std::ifstream file(path);
+    std::string line;
+    if (!file || !std::getline(file, line) || line != TOOLCHAIN_HEADER)
+        return std::nullopt;
+
+    // the rest of the line, after what was already read from it
+    auto rest = [](std::istringstream& in) {
+        std::string str;
+        in.get(); // the space
+        std::getline(in, str);
+        return str;
+    };
+
+    Toolchain toolchain;
+    std::optional<DirStamp> binary;
+    while (std::getline(file, line)) {
+        std::istringstream in(line);
+        std::string kind;
+        in >> kind;
+        if (kind == "binary") {
+            binary.emplace();
+            in >> binary->mtime >> binary->inode;
+        } else if (kind == "compiler") {
+            toolchain.compiler = rest(in);
+        } else if (kind == "path") {
+            toolchain.path = rest(in);
+        } else if (kind == "version") {
+            toolchain.version = rest(in);
+        } else if (kind == "target") {
+            toolchain.target = rest(in);
+        } else if (kind == "flag") {
+            toolchain.flags.push_back(rest(in));
+        } else {
+            return std::nullopt;
+        }
+        if (in.fail())
+            return std::nullopt;
+    }
+    if (!binary || toolchain.compiler.empty() || toolchain.path.empty())
+        return std::nullopt;
+    if (dir_stamp(toolchain.path) != binary) {
+        debug("`{}` changed since it was probed", toolchain.path.string());
+        return std::nullopt;
+    }
+    return toolchain;
+}
+
+// Fill in what the toolchain run with `command` reports about itself besides
+// its version, all of it at once.
+static void probe_details(Toolchain& toolchain,
+                          const std::vector<std::string>& command) {
+    auto with = [&](std::initializer_list<std::string> args) {
+        auto result = command;
+        result.insert(result.end(), args);
+        return result;
+    };
+    std::vector<char> supported(std::size(PROBED_FLAGS));
+    {
+        ThreadPool pool(1 + supported.size());
+        pool.submit([&] {
+            auto [code, output] = utils::run_captured(with({"-dumpmachine"}));
+            if (code == 0) {
+                utils::trim_in_place(output);
+                toolchain.target = output;
+            }
+        });
+        for (size_t i = 0; i < supported.size(); ++i) {
+            pool.submit([&, i] {
+                // unused or unknown flags are only a warning for some
+                // compilers
+                auto [code, _] = utils::run_captured(
+                    with({"-Werror", PROBED_FLAGS[i], "-fsyntax-only", "-x",
+                          "c", NULL_DEVICE}));
+                supported[i] = code == 0;
+            });
+        }
+        pool.wait();
+    }
+    for (size_t i = 0; i < supported.size(); ++i)
+        if (supported[i])
+            toolchain.flags.push_back(PROBED_FLAGS[i]);
+}
+
+// First line of `--version` of the toolchain run with `command`, nothing if
+// it doesn't run.
+static std::optional<std::string>
+probe_version(const std::vector<std::string>& command) {
+    auto args = command;
+    args.push_back("--version");
+    auto [code, output] = utils::run_captured(args);
+    if (code != 0) {
+        debug("compiler(?) `{}` exited with code {}", command.back(), code);
+        return std::nullopt;
+    }
+    auto version = output.substr(0, output.find('\n'));
+    utils::trim_in_place(version);
+    return version;
+}
+
+// `cl.exe` -> `cl`, `find_program` adds the extension itself.
+static std::string program_name(const std::string& compiler) {
+#ifdef QOBS_IS_WINDOWS
+    return std::filesystem::path(compiler).replace_extension().string();
+#else
+    return compiler;
+#endif
+}
+
+std::optional<Toolchain> find_toolchain(bool need_cxx) {
+    auto key = cache_key(need_cxx);
+    auto cache_path = utils::cache_dir() / "toolchains" / key.value_or("");
+    if (key) {
+        if (auto toolchain = load_toolchain(cache_path)) {
+            debug("using compiler: {} ({})", toolchain->compiler,
+                  toolchain->version);
+            return toolchain;
+        }
+    }
+
+    // only compilers that are in PATH are worth spawning
+    std::vector<Toolchain> candidates;
+    for (auto& name : need_cxx ? COMMON_CXX_COMPILERS : COMMON_C_COMPILERS) {
+        auto path = utils::find_program(program_name(name));
+        if (path.empty()) {
+            trace("`{}` is not in PATH", name);
+            continue;
+        }
+        candidates.push_back(Toolchain{.compiler = name, .path = path});
+    }
+    if (candidates.empty())
+        return std::nullopt;
+
+    // try them all at once, the first working one wins
+    std::vector<char> works(candidates.size());
+    {
+        ThreadPool pool(candidates.size());
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            pool.submit([&, i] {
+                auto& candidate = candidates[i];
+                trace("trying compiler: {}", candidate.path.string());
+                auto version = probe_version({candidate.path.string()});
+                if (!version)
+                    return;
+                candidate.version = std::move(*version);
+                works[i] = true;
+            });
+        }
+        pool.wait();
+    }
+    size_t i = 0;
+    while (i < candidates.size() && !works[i])
+        ++i;
+    if (i == candidates.size())
+        return std::nullopt;
+
+    auto toolchain = std::move(candidates[i]);
+    debug("found working compiler: {} ({})", toolchain.compiler,
+          toolchain.version);
+    probe_details(toolchain, {toolchain.path.string()});
+    trace("target: {}, flags: {}", toolchain.target,
+          fmt::join(toolchain.flags, " "));
+
+    if (key) {
+        try {
+            save_toolchain(cache_path, toolchain);
+        } catch (const std::exception& err) {
+            debug("couldn't cache toolchain: {}", err.what());
+        }
+    }
+    return toolchain;
+}
+
+std::optional<Toolchain> probe_toolchain(std::string_view compiler) {
+    std::vector<std::string> command;
+    std::istringstream words{std::string(compiler)};
+    for (std::string word; words >> word;)
+        command.push_back(std::move(word));
+    if (command.empty())
+        return std::nullopt;
+
+    // the last word is the compiler itself, anything before it a wrapper
+    std::filesystem::path path = command.back();
+    if (!path.has_parent_path())
+        path = utils::find_program(program_name(command.back()));
+    if (path.empty())
+        return std::nullopt;
+
+    Sha256 sha;
+    sha.update_field(TOOLCHAIN_HEADER)
+        .update_field("probe")
+        .update_field(compiler)
+        .update_field(path.string());
+    auto cache_path =
+        utils::cache_dir() / "toolchains" / sha.hex_digest().substr(0, 32);
+    if (auto toolchain = load_toolchain(cache_path))
+        return toolchain;
+
+    auto version = probe_version(command);
+    if (!version)
+        return std::nullopt;
+    Toolchain toolchain{.compiler = std::string(compiler),
+                        .path = path,
+                        .version = std::move(*version)};
+    probe_details(toolchain, command);
+    trace("probed `{}`: {}, target: {}, flags: {}", compiler,
+          toolchain.version, toolchain.target,
+          fmt::join(toolchain.flags, " "));
+    try {
+        save_toolchain(cache_path, toolchain);
+    } catch (const std::exception& err) {
+        debug("couldn't cache toolchain: {}", err.what());
+    }
+    return toolchain;
+}
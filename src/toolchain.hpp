@@ -0,0 +1,49 @@
+#pragma once
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A C/C++ compiler and what it reported about itself.
+struct Toolchain {
+    // As it's run, e.g. `g++` or `ccache gcc`.
+    std::string compiler;
+    // The compiler binary (not a wrapper like ccache).
+    std::filesystem::path path;
+    // First line of `--version`.
+    std::string version;
+    // `-dumpmachine`, e.g. `x86_64-linux-gnu`. Empty if it can't tell.
+    std::string target;
+    // The flags of `PROBED_FLAGS` it accepts.
+    std::vector<std::string> flags;
+
+    inline bool supports(std::string_view flag) const {
+        for (auto& supported : flags)
+            if (supported == flag)
+                return true;
+        return false;
+    }
+};
+
+// Colored diagnostics even though the output is captured, for compilers that
+// support it.
+constexpr auto& COLOR_DIAGNOSTICS_FLAG = "-fdiagnostics-color=always";
+
+// Flags that only some compilers accept, probed once per toolchain.
+constexpr const char* PROBED_FLAGS[] = {
+    COLOR_DIAGNOSTICS_FLAG,
+};
+
+// Find a working C (or C++, with `need_cxx`) compiler in PATH. Every
+// well-known compiler that is in PATH is probed at once and the first working
+// one in order of preference wins. The result is cached in
+// `<cache dir>/toolchains`, keyed on PATH and the stamps of its directories,
+// and reused as long as the compiler binary is the same, so that later calls
+// don't run anything. Nothing if no compiler works.
+std::optional<Toolchain> find_toolchain(bool need_cxx);
+
+// The toolchain of `compiler`, as it's run (e.g. from `CC` or `-cc`, possibly
+// with a wrapper like `ccache gcc`). Cached like `find_toolchain`, keyed on
+// the command and the compiler binary. Nothing if it doesn't run.
+std::optional<Toolchain> probe_toolchain(std::string_view compiler);
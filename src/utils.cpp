@@ -4,12 +4,23 @@
 
 #ifdef QOBS_IS_WINDOWS
 #define WIN32_LEAN_AND_MEAN
+#include <io.h>
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
 #endif
 
+#include <cstring>
 #include <filesystem>
+#include <fstream>
 #include <git2.h>
 #include <iostream>
+#include <random>
 #include <subprocess.h>
 
 using namespace spdlog;
@@ -88,53 +99,72 @@ int popen(std::initializer_list<std::string> args) {
     return process_return;
 }
 
-// TODO: add Zig's `zig cc`
-#ifdef QOBS_IS_WINDOWS
-const std::vector<std::string> COMMON_C_COMPILERS = {
-    "cl.exe", "clang.exe", "gcc.exe", "icx.exe", "icc.exe", "tcc.exe"};
-const std::vector<std::string> COMMON_CXX_COMPILERS = {
-    "cl.exe",   "clang++.exe", "g++.exe",  "clang.exe", "gcc.exe",
-    "icpx.exe", "icx.exe",     "icpc.exe", "icc.exe"};
-#else
-const std::vector<std::string> COMMON_C_COMPILERS = {"clang", "gcc", "icx",
-                                                     "icc", "tcc"};
-const std::vector<std::string> COMMON_CXX_COMPILERS = {
-    "clang++", "g++", "clang", "gcc", "icpx", "icx", "icpc", "icc"};
-#endif
+std::pair<int, std::string> run_captured(const std::vector<std::string>& args) {
+    std::vector<const char*> argv;
+    for (auto& arg : args)
+        argv.push_back(arg.c_str());
+    argv.push_back(nullptr);
 
-std::string find_compiler(bool need_cxx) {
+    subprocess_s process;
+    int result = subprocess_create(
+        argv.data(),
+        subprocess_option_combined_stdout_stderr |
+            subprocess_option_inherit_environment |
+            subprocess_option_search_user_path | subprocess_option_no_window,
+        &process);
+    if (result != 0)
+        return {-1, fmt::format("failed to spawn `{}` (code {})\n", args.at(0),
+                                result)};
+
+    // read everything before joining, the process blocks once the pipe is
+    // full
+    std::string output;
+    char buf[4096];
+    auto stdout_file = subprocess_stdout(&process);
+    while (auto n = std::fread(buf, 1, sizeof(buf), stdout_file))
+        output.append(buf, n);
+
+    int code = 0;
+    if (subprocess_join(&process, &code) != 0)
+        code = -1;
+    subprocess_destroy(&process);
+    return {code, output};
+}
+
+std::pair<std::string, std::optional<Toolchain>> find_compiler(bool need_cxx) {
     // check CC/CXX envvars
     const char* cc = std::getenv("CC");
-    const char* cxx = std::getenv("CC");
+    const char* cxx = std::getenv("CXX");
 
     if (cc && cxx)
-        return need_cxx ? cxx : cc;
+        return {need_cxx ? cxx : cc, std::nullopt};
     else if (cc)
-        return cc;
+        return {cc, std::nullopt};
     else if (cxx)
-        return cxx;
-    else {
-        // CC/CXX envvar not set, search in PATH
-        for (const auto& compiler :
-             need_cxx ? COMMON_CXX_COMPILERS : COMMON_C_COMPILERS) {
-            trace("trying compiler: {}", compiler);
-            int result;
-            try {
-                result = popen({compiler, "--version"});
-            } catch (const std::exception& e) {
-                // this is not critical, we'll just try the next compiler
-                trace("failed to spawn `{}`: {}", compiler, e.what());
-                continue;
-            }
-            if (result == 0) {
-                debug("found working compiler: {}", compiler);
-                return compiler;
-            } else {
-                debug("compiler(?) `{}` exited with code {}", compiler, result);
-            }
+        return {cxx, std::nullopt};
+
+    // CC/CXX envvar not set, search in PATH
+    auto toolchain = find_toolchain(need_cxx);
+    if (!toolchain)
+        return {"", std::nullopt};
+    auto compiler = toolchain->compiler;
+    return {std::move(compiler), std::move(toolchain)};
+}
+
+std::string find_archiver(std::string_view compiler) {
+    if (const char* ar = std::getenv("AR"); ar && *ar)
+        return ar;
+
+    // `/usr/bin/aarch64-linux-gnu-gcc-12` -> `aarch64-linux-gnu-`
+    auto name = std::filesystem::path(compiler).filename().string();
+    for (std::string_view suffix : {"-gcc", "-g++", "-cc", "-c++", "-clang"}) {
+        auto pos = name.rfind(suffix);
+        if (pos != std::string::npos && pos != 0) {
+            auto dir = std::filesystem::path(compiler).parent_path();
+            return (dir / (name.substr(0, pos) + "-ar")).string();
         }
     }
-    return "";
+    return "ar";
 }
 
 template <typename... Args>
@@ -188,6 +218,70 @@ void ensure_virtual_terminal_processing() {
 }
 #endif
 
+bool is_stdout_tty() {
+#ifdef QOBS_IS_WINDOWS
+    return _isatty(_fileno(stdout));
+#else
+    return isatty(fileno(stdout));
+#endif
+}
+
+std::filesystem::path current_exe() {
+#if defined(QOBS_IS_WINDOWS)
+    std::wstring buf(MAX_PATH, L'\0');
+    for (;;) {
+        auto len = GetModuleFileNameW(nullptr, buf.data(),
+                                      static_cast<DWORD>(buf.size()));
+        if (len == 0)
+            return {};
+        if (len < buf.size())
+            return std::filesystem::path(buf.substr(0, len));
+        buf.resize(buf.size() * 2);
+    }
+#elif defined(__APPLE__)
+    uint32_t size = 0;
+    _NSGetExecutablePath(nullptr, &size);
+    std::string buf(size, '\0');
+    if (_NSGetExecutablePath(buf.data(), &size) != 0)
+        return {};
+    std::error_code ec;
+    auto path = std::filesystem::canonical(buf.c_str(), ec);
+    return ec ? std::filesystem::path{} : path;
+#else
+    std::error_code ec;
+    auto path = std::filesystem::read_symlink("/proc/self/exe", ec);
+    return ec ? std::filesystem::path{} : path;
+#endif
+}
+
+std::filesystem::path find_program(std::string_view name) {
+    const char* path = std::getenv("PATH");
+    if (!path)
+        return {};
+#ifdef QOBS_IS_WINDOWS
+    constexpr char separator = ';';
+    auto file_name = std::string(name) + ".exe";
+#else
+    constexpr char separator = ':';
+    auto file_name = std::string(name);
+#endif
+
+    std::string_view dirs(path);
+    while (!dirs.empty()) {
+        auto end = dirs.find(separator);
+        auto dir = dirs.substr(0, end);
+        dirs.remove_prefix(end == std::string_view::npos ? dirs.size()
+                                                         : end + 1);
+        if (dir.empty())
+            continue;
+        auto candidate = std::filesystem::path(dir) / file_name;
+        std::error_code ec;
+        if (std::filesystem::is_regular_file(candidate, ec))
+            return candidate;
+    }
+    return {};
+}
+
 void check_lg2(int error, std::string_view message) {
     const git_error* lg2error;
     const char *msg = "", *spacer = "";
@@ -205,6 +299,128 @@ void check_lg2(int error, std::string_view message) {
         fmt::format("{} [{}]{}{}", message, error, spacer, msg));
 }
 
+bool write_if_changed(const std::filesystem::path& path,
+                      std::string_view contents) {
+    std::error_code ec;
+    auto size = std::filesystem::file_size(path, ec);
+    if (!ec && size == contents.size()) {
+        std::ifstream existing(path, std::ios::in | std::ios::binary);
+        std::string buf(64 * 1024, '\0');
+        size_t offset = 0;
+        while (existing && offset < contents.size()) {
+            existing.read(buf.data(), static_cast<std::streamsize>(buf.size()));
+            auto n = static_cast<size_t>(existing.gcount());
+            if (contents.substr(offset, n) != std::string_view(buf.data(), n))
+                break;
+            offset += n;
+        }
+        if (offset == contents.size())
+            return false;
+    }
+
+    if (path.has_parent_path())
+        std::filesystem::create_directories(path.parent_path());
+    auto tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::out | std::ios::trunc |
+                                    std::ios::binary);
+        file.write(contents.data(),
+                   static_cast<std::streamsize>(contents.size()));
+        if (!file)
+            throw std::runtime_error(
+                fmt::format("couldn't write `{}`", tmp.string()));
+    }
+    std::filesystem::rename(tmp, path);
+    return true;
+}
+
+void write_file_atomically(const std::filesystem::path& path,
+                           std::string_view contents) {
+    if (path.has_parent_path())
+        std::filesystem::create_directories(path.parent_path());
+    auto tmp = path.parent_path() / fmt::format(".{}.{:x}.tmp",
+                                                path.filename().string(),
+                                                std::random_device{}());
+    try {
+        {
+            std::ofstream file(tmp, std::ios::out | std::ios::trunc |
+                                        std::ios::binary);
+            file.write(contents.data(),
+                       static_cast<std::streamsize>(contents.size()));
+            if (!file)
+                throw std::runtime_error(
+                    fmt::format("couldn't write `{}`", tmp.string()));
+        }
+        std::filesystem::rename(tmp, path);
+    } catch (...) {
+        std::error_code ec;
+        std::filesystem::remove(tmp, ec);
+        throw;
+    }
+}
+
+std::filesystem::path cache_dir() {
+    if (auto dir = std::getenv("QOBS_CACHE_DIR"); dir && *dir)
+        return dir;
+#ifdef QOBS_IS_WINDOWS
+    if (auto dir = std::getenv("LOCALAPPDATA"); dir && *dir)
+        return std::filesystem::path(dir) / "qobs" / "cache";
+#else
+    if (auto dir = std::getenv("XDG_CACHE_HOME"); dir && *dir)
+        return std::filesystem::path(dir) / "qobs";
+    if (auto home = std::getenv("HOME"); home && *home)
+        return std::filesystem::path(home) / ".cache" / "qobs";
+#endif
+    // nowhere better to put it
+    return std::filesystem::temp_directory_path() / "qobs-cache";
+}
+
+FileLock::FileLock(const std::filesystem::path& path) {
+    std::filesystem::create_directories(path.parent_path());
+#ifdef QOBS_IS_WINDOWS
+    m_handle = CreateFileW(path.wstring().c_str(), GENERIC_READ | GENERIC_WRITE,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                           OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_handle == INVALID_HANDLE_VALUE)
+        throw std::runtime_error(
+            fmt::format("couldn't open lock file `{}`", path.string()));
+    OVERLAPPED overlapped{};
+    if (!LockFileEx(m_handle, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD,
+                    &overlapped)) {
+        CloseHandle(m_handle);
+        throw std::runtime_error(
+            fmt::format("couldn't lock `{}`", path.string()));
+    }
+#else
+    m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+        throw std::runtime_error(fmt::format(
+            "couldn't open lock file `{}`: {}", path.string(), strerror(errno)));
+    int result;
+    do {
+        result = flock(m_fd, LOCK_EX);
+    } while (result != 0 && errno == EINTR);
+    if (result != 0) {
+        auto err = errno;
+        close(m_fd);
+        throw std::runtime_error(fmt::format("couldn't lock `{}`: {}",
+                                             path.string(), strerror(err)));
+    }
+#endif
+}
+
+FileLock::~FileLock() {
+#ifdef QOBS_IS_WINDOWS
+    OVERLAPPED overlapped{};
+    UnlockFileEx(m_handle, 0, MAXDWORD, MAXDWORD, &overlapped);
+    CloseHandle(m_handle);
+#else
+    flock(m_fd, LOCK_UN);
+    close(m_fd);
+#endif
+}
+
 void init_git_repo(const std::string& path) {
     git_init_once();
 
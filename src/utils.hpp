@@ -1,8 +1,12 @@
 #pragma once
+#include "toolchain.hpp"
+#include <filesystem>
 #include <initializer_list>
 #include <spdlog/spdlog.h>
 #include <string>
 #include <toml++/toml.hpp>
+#include <utility>
+#include <vector>
 
 #if defined(WIN32) || defined(_WIN32) ||                                       \
     defined(__WIN32) && !defined(__CYGWIN__)
@@ -28,8 +32,19 @@ std::string toml_type_to_str(toml::node_type type);
 // Throws std::runtime_error if subprocess failed to create or join.
 int popen(std::initializer_list<std::string> args);
 
-// Will return an empty string if no compiler is found.
-std::string find_compiler(bool need_cxx);
+// Run `args`, returning the exit code and everything it printed (stdout and
+// stderr combined). The exit code is -1 if it couldn't be spawned, with the
+// reason as output.
+std::pair<int, std::string> run_captured(const std::vector<std::string>& args);
+
+// `CC`/`CXX` if set, otherwise a compiler found in PATH (see
+// `find_toolchain`) along with its toolchain, which was probed finding it.
+// The compiler is an empty string if no compiler is found.
+std::pair<std::string, std::optional<Toolchain>> find_compiler(bool need_cxx);
+
+// Static library archiver matching `compiler`: `$AR` if set, `<triple>-ar`
+// for cross compilers like `x86_64-w64-mingw32-gcc`, otherwise `ar`.
+std::string find_archiver(std::string_view compiler);
 
 template <typename... Args>
 std::string ask(fmt::format_string<Args...> fmt, Args&&... args);
@@ -46,6 +61,59 @@ void maybe_shutdown_git();
 void ensure_virtual_terminal_processing();
 #endif
 
+// Whether stdout is attached to a terminal (and not redirected to a file/pipe).
+bool is_stdout_tty();
+
 void init_git_repo(const std::string& path);
 
+// Absolute path of the running qobs executable, empty if it can't be found.
+std::filesystem::path current_exe();
+
+// Full path of the executable `name` in PATH, empty if it isn't there.
+std::filesystem::path find_program(std::string_view name);
+
+// Throws std::runtime_error with `message` and libgit2's last error if
+// `error` is non-zero.
+void check_lg2(int error, std::string_view message);
+
+// Write `contents` to `path` (creating parent directories), unless the file
+// already has exactly these contents: an unchanged file keeps its mtime, so
+// tools watching it (e.g. ninja for its manifest) don't see a change. The new
+// contents are written next to it and renamed over it, so readers never see
+// a half-written file. Returns whether the file was written. Throws on
+// failure.
+bool write_if_changed(const std::filesystem::path& path,
+                      std::string_view contents);
+
+// Write `contents` to a uniquely named file next to `path` and rename it over
+// `path` (creating parent directories). Unlike `write_if_changed`, several
+// processes may write the same path at the same time, e.g. in a shared cache:
+// the last rename wins and readers never see a half-written file. Throws on
+// failure.
+void write_file_atomically(const std::filesystem::path& path,
+                           std::string_view contents);
+
+// Per-user cache directory shared by all projects, e.g. `~/.cache/qobs`.
+// Can be overridden with the `QOBS_CACHE_DIR` environment variable.
+std::filesystem::path cache_dir();
+
+// Exclusive advisory lock on a file, held for the lifetime of the object.
+// Works across processes (and across threads, since every instance opens its
+// own handle). Blocks until the lock is acquired. Throws on failure.
+class FileLock {
+public:
+    explicit FileLock(const std::filesystem::path& path);
+    ~FileLock();
+
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+private:
+#ifdef QOBS_IS_WINDOWS
+    void* m_handle;
+#else
+    int m_fd;
+#endif
+};
+
 } // namespace utils
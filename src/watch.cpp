@@ -0,0 +1,123 @@
+#include "watch.hpp"
+#include "utils.hpp"
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+#include <csignal>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+#endif
+
+using namespace spdlog;
+
+// A burst of events (saving several files, switching branches) is only over
+// once nothing changed for this long.
+constexpr std::chrono::milliseconds QUIET_PERIOD{150};
+
+#ifdef __linux__
+
+// Time a program gets to exit after SIGTERM before it's killed.
+constexpr std::chrono::seconds STOP_TIMEOUT{2};
+
+// The program of `qobs watch --run`, sharing our terminal.
+class Program {
+public:
+    ~Program() {
+        stop();
+    }
+
+    // Throws if it can't be started.
+    void start(const std::filesystem::path& path,
+               const std::vector<std::string>& args);
+
+    // Stop it if it's still running.
+    void stop();
+
+private:
+    pid_t m_pid{-1};
+    std::thread m_reaper;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_exited{false};
+    bool m_stopping{false};
+};
+
+void Program::start(const std::filesystem::path& path,
+                    const std::vector<std::string>& args) {
+    auto program = path.string();
+    std::vector<char*> argv{program.data()};
+    for (auto& arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    if (int err = posix_spawn(&m_pid, program.c_str(), nullptr, nullptr,
+                              argv.data(), environ))
+        throw std::runtime_error(fmt::format("couldn't run `{}`: {}", program,
+                                             std::strerror(err)));
+    m_exited = m_stopping = false;
+    m_reaper = std::thread([this, pid = m_pid] {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        std::lock_guard lock(m_mutex);
+        m_exited = true;
+        m_cv.notify_all();
+        if (m_stopping)
+            return;
+        if (WIFEXITED(status))
+            info("program exited with code {}", WEXITSTATUS(status));
+        else if (WIFSIGNALED(status))
+            warn("program was killed by signal {}", WTERMSIG(status));
+    });
+}
+
+void Program::stop() {
+    if (m_pid < 0)
+        return;
+    {
+        std::unique_lock lock(m_mutex);
+        m_stopping = true;
+        if (!m_exited) {
+            kill(m_pid, SIGTERM);
+            if (!m_cv.wait_for(lock, STOP_TIMEOUT, [this] { return m_exited; }))
+                kill(m_pid, SIGKILL);
+        }
+    }
+    m_reaper.join();
+    m_pid = -1;
+}
+
+void watch_package(const PackageOptions& options,
+                   std::function<std::shared_ptr<Generator>()> make_generator,
+                   std::optional<std::vector<std::string>> run_args) {
+    LoadedPackage package(options, std::move(make_generator));
+    Program program;
+    for (;;) {
+        try {
+            auto output = package.build();
+            if (run_args) {
+                program.stop();
+                program.start(output, *run_args);
+            }
+        } catch (const std::exception& err) {
+            error("failed to build package: {}", err.what());
+        }
+
+        info("waiting for changes...");
+        package.watcher().wait(QUIET_PERIOD);
+    }
+}
+
+#else
+
+void watch_package(const PackageOptions&,
+                   std::function<std::shared_ptr<Generator>()>,
+                   std::optional<std::vector<std::string>>) {
+    throw std::runtime_error("watching files is only supported on Linux");
+}
+
+#endif
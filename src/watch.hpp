@@ -0,0 +1,13 @@
+#pragma once
+#include "loaded_package.hpp"
+#include <optional>
+#include <string>
+#include <vector>
+
+// `qobs watch`: build the package, then build it again whenever one of its
+// sources or anything its build files were generated from changes. With
+// `run_args`, the built program is (re)started with them after every
+// successful build. Linux only. Blocks forever, throws if it can't watch.
+void watch_package(const PackageOptions& options,
+                   std::function<std::shared_ptr<Generator>()> make_generator,
+                   std::optional<std::vector<std::string>> run_args);
@@ -0,0 +1,141 @@
+#include "worker.hpp"
+#include "compile_farm.hpp"
+#include "socket.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <semaphore>
+
+using namespace spdlog;
+
+// `-x` of a preprocessed source in `language`, nothing if it's unknown.
+static std::optional<std::string_view>
+preprocessed_language(std::string_view language) {
+    if (language == "c")
+        return "cpp-output";
+    if (language == "c++")
+        return "c++-cpp-output";
+    return std::nullopt;
+}
+
+// `compiler`, looked up by name only: a client can't make the worker run an
+// arbitrary file. Empty if it isn't in PATH.
+static std::filesystem::path find_compiler(const std::string& compiler) {
+    auto name = std::filesystem::path(compiler).filename().string();
+    return name.empty() ? std::filesystem::path()
+                        : utils::find_program(name);
+}
+
+// Answer an `info` request, returning the fields of the response.
+static std::vector<std::string> info(const std::vector<std::string>& request,
+                                     size_t jobs) {
+    // version, "info", compilers...
+    std::vector<std::string> response{"ok", std::to_string(jobs)};
+    for (size_t i = 2; i < request.size(); ++i) {
+        auto compiler = find_compiler(request[i]);
+        response.push_back(compiler.empty() ? ""
+                                            : compiler_identity(compiler));
+    }
+    return response;
+}
+
+// Compile a request, returning the fields of the response.
+static std::vector<std::string>
+compile(const std::vector<std::string>& request) {
+    // version, "compile", compiler, language, source, args...
+    auto x = preprocessed_language(request.at(3));
+    if (!x)
+        return {"error", fmt::format("unknown language `{}`", request[3])};
+    for (size_t i = 5; i < request.size(); ++i)
+        if (!is_remote_safe_arg(request[i]))
+            return {"error", fmt::format("refusing `{}`", request[i])};
+    auto compiler = find_compiler(request[2]);
+    if (compiler.empty())
+        return {"error", fmt::format("compiler `{}` not found", request[2])};
+
+    auto dir = std::filesystem::temp_directory_path() /
+               fmt::format("qobs-worker-{:x}", std::random_device{}());
+    std::filesystem::create_directories(dir);
+    struct Cleanup {
+        std::filesystem::path dir;
+        ~Cleanup() {
+            std::error_code ec;
+            std::filesystem::remove_all(dir, ec);
+        }
+    } cleanup{dir};
+
+    auto source = dir / (request[3] == "c" ? "tu.i" : "tu.ii");
+    auto object = dir / "tu.o";
+    utils::write_file_atomically(source, request[4]);
+
+    std::vector<std::string> args{compiler.string()};
+    args.insert(args.end(), request.begin() + 5, request.end());
+    args.insert(args.end(), {"-x", std::string(*x), "-c", source.string(),
+                             "-o", object.string()});
+    auto [code, output] = utils::run_captured(args);
+
+    std::string contents;
+    if (code == 0) {
+        std::ifstream file(object, std::ios::in | std::ios::binary);
+        if (!file)
+            return {"error", "the compiler didn't produce an object"};
+        contents.assign(std::istreambuf_iterator<char>(file),
+                        std::istreambuf_iterator<char>());
+    }
+    return {"ok", std::to_string(code), std::move(output),
+            std::move(contents)};
+}
+
+static void serve_connection(Socket sock, std::counting_semaphore<>& slots,
+                             size_t jobs) {
+    // don't let a stuck client hold a connection forever
+    sock.set_timeout(std::chrono::seconds(30));
+    auto request = sock.recv_message(MAX_WORKER_MESSAGE_SIZE);
+    if (!request)
+        return;
+
+    std::vector<std::string> response;
+    if (request->size() < 2 || request->front() != WORKER_PROTOCOL) {
+        response = {"error", fmt::format("unsupported protocol, expected `{}`",
+                                         WORKER_PROTOCOL)};
+    } else if (request->at(1) == "info") {
+        response = info(*request, jobs);
+    } else if (request->at(1) == "compile" && request->size() >= 5) {
+        slots.acquire();
+        try {
+            response = compile(*request);
+        } catch (const std::exception& err) {
+            response = {"error", err.what()};
+        }
+        slots.release();
+        debug("compiled {} bytes of {}: {}", request->at(4).size(),
+              request->at(3), response.front());
+    } else {
+        response = {"error", "invalid request"};
+    }
+
+    std::vector<std::string_view> fields(response.begin(), response.end());
+    sock.send_message(fields);
+}
+
+void serve_worker(const std::string& address, size_t jobs) {
+    auto listener = Socket::listen_on(address);
+    info("compiling up to {} source(s) at once on `{}`", jobs, address);
+
+    // more connections than compile slots, so that sources are received and
+    // objects sent while others compile
+    std::counting_semaphore<> slots(static_cast<std::ptrdiff_t>(jobs));
+    ThreadPool pool(jobs * 2);
+    for (;;) {
+        auto sock = listener.accept();
+        if (!sock.valid())
+            continue;
+        // `std::function` needs a copyable job
+        auto shared = std::make_shared<Socket>(std::move(sock));
+        pool.submit([shared, &slots, jobs] {
+            serve_connection(std::move(*shared), slots, jobs);
+        });
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// `qobs worker`: compiles preprocessed sources for `CompileFarm` clients on
+// `address` (`host:port` or `unix:<path>`), running up to `jobs` compilers at
+// once. Compilers are looked up by name in PATH, clients only use those that
+// are the same as theirs. Options that could make a compiler run other code
+// or touch other files are refused (see `is_remote_safe_arg`), but there's no
+// authentication: only listen on loopback or a trusted network. Blocks
+// forever, throws if it can't listen.
+void serve_worker(const std::string& address, size_t jobs);